@@ -4,10 +4,12 @@
 #include "spdk/stdinc.h"
 
 #define DEFAULT_STRIPE_SIZE_KB 1024
+#define SPDK_UBI_MAX_IMAGE_OVERLAYS 8
 
 typedef void (*spdk_delete_ubi_complete)(void *cb_arg, int bdeverrno);
 
 struct spdk_bdev;
+struct spdk_histogram_data;
 struct spdk_uuid;
 
 /*
@@ -16,11 +18,124 @@ struct spdk_uuid;
 struct spdk_ubi_bdev_opts {
     const char *name;
     const char *image_path;
+    /*
+     * Bdev to read the image from instead of image_path. Exactly one of them
+     * must be given. The bdev is claimed read-only, so it can be shared.
+     */
+    const char *image_bdev_name;
+    /*
+     * Block of image_bdev where the image starts. image_bdev may be the base
+     * bdev itself, with the image stored after the data area. Stripes are
+     * then fetched with copy commands if the base bdev supports them.
+     */
+    uint64_t image_offset_blocks;
+    /*
+     * Sparse raw or qcow2 files layered over image_path, from the bottom
+     * up. Each range of the image is read from the topmost layer which has
+     * data for it.
+     */
+    const char *image_overlays[SPDK_UBI_MAX_IMAGE_OVERLAYS];
+    uint32_t image_overlay_count;
     const char *base_bdev_name;
+    const char *metadata_bdev_name;
     uint32_t stripe_size_kb;
     bool no_sync;
     bool copy_on_read;
     bool directio;
+    uint32_t checkpoint_interval_ms;
+    uint32_t checkpoint_dirty_stripes;
+    bool uring_sqpoll;
+    /* CPU to pin the SQ polling thread to if uring_sqpoll is set, or -1. */
+    int32_t uring_sqpoll_cpu;
+    bool uring_iopoll;
+};
+
+/*
+ * I/O counters. Each I/O channel keeps its own, and counters of destroyed
+ * channels are added to their bdev's.
+ */
+struct spdk_ubi_io_stats {
+    uint64_t blocks_read;
+    uint64_t blocks_written;
+
+    /* Stripe fetches started. */
+    uint64_t stripe_fetches;
+
+    /* Bytes read from the image file, by stripe fetches and by reads. */
+    uint64_t image_bytes_read;
+
+    /* Bytes written to the base bdev by stripe fetches. */
+    uint64_t fetch_bytes_written;
+
+    /* Reads and writes which had to wait for their stripe to be fetched. */
+    uint64_t ios_blocked_on_fetch;
+
+    /* Stripe fetches and image reads served by the stripe cache. */
+    uint64_t stripe_cache_hits;
+};
+
+/*
+ * Statistics of a ubi bdev, aggregated over its I/O channels.
+ */
+struct spdk_ubi_bdev_stats {
+    /* Stripes covering the image, and how many of them were fetched. */
+    uint64_t image_stripes;
+    uint64_t stripes_fetched;
+    uint64_t stripes_flushed;
+
+    struct spdk_ubi_io_stats io;
+
+    /* Current state of I/O channels. */
+    uint32_t channels;
+    uint64_t queued_ios;
+    uint64_t queued_stripe_fetches;
+    uint64_t active_stripe_fetches;
+    uint64_t active_reads;
+};
+
+typedef void (*spdk_ubi_get_stats_complete)(void *cb_arg,
+                                            const struct spdk_ubi_bdev_stats *stats,
+                                            int status);
+
+/*
+ * Phases of I/O whose latency is tracked in histograms.
+ */
+enum spdk_ubi_latency_phase {
+    /* Time spent in a channel's I/O queue, e.g. waiting for a stripe fetch. */
+    SPDK_UBI_LATENCY_QUEUE = 0,
+    /* Reads of unfetched blocks from the image file. */
+    SPDK_UBI_LATENCY_IMAGE_READ,
+    /* Reads, writes and data flushes sent to the base bdev. */
+    SPDK_UBI_LATENCY_BASE_IO,
+    /* End-to-end latency of reads, writes and flushes. */
+    SPDK_UBI_LATENCY_READ,
+    SPDK_UBI_LATENCY_WRITE,
+    SPDK_UBI_LATENCY_FLUSH,
+    /* Stripe fetches reading the image file, and writing to the base bdev. */
+    SPDK_UBI_LATENCY_FETCH_READ,
+    SPDK_UBI_LATENCY_FETCH_WRITE,
+    SPDK_UBI_LATENCY_PHASES
+};
+
+typedef void (*spdk_ubi_enable_histograms_complete)(void *cb_arg, int status);
+
+/*
+ * "histograms" is an array of SPDK_UBI_LATENCY_PHASES histograms in ticks,
+ * valid during the call only.
+ */
+typedef void (*spdk_ubi_get_histograms_complete)(
+    void *cb_arg, struct spdk_histogram_data *const *histograms, int status);
+
+/*
+ * Latency and bandwidth cap added to all image reads, to benchmark against
+ * image storage slower than a local file. Like SPDK's delay bdev, about 1% of
+ * reads take p99_latency_us, and others avg_latency_us. All zeros disables it.
+ */
+struct spdk_ubi_image_delay_opts {
+    uint64_t avg_latency_us;
+    uint64_t p99_latency_us;
+    /* Image read bandwidth of all bdevs in MB/s, or 0 for no cap. */
+    uint64_t max_mbytes_per_sec;
 };
 
 struct ubi_create_context {
@@ -32,6 +147,9 @@ struct ubi_create_context {
 
     /* temporary channel used to read metadata */
     struct spdk_io_channel *base_ch;
+
+    /* temporary buffer used to read the metadata header */
+    void *header_buf;
 };
 
 /*
@@ -40,5 +158,14 @@ struct ubi_create_context {
 void bdev_ubi_create(const struct spdk_ubi_bdev_opts *opts,
                      struct ubi_create_context *context);
 void bdev_ubi_delete(const char *bdev_name, spdk_delete_ubi_complete cb_fn, void *cb_arg);
+void bdev_ubi_get_stats(const char *bdev_name, spdk_ubi_get_stats_complete cb_fn,
+                        void *cb_arg);
+void bdev_ubi_enable_histograms(const char *bdev_name, bool enable,
+                                spdk_ubi_enable_histograms_complete cb_fn, void *cb_arg);
+void bdev_ubi_get_histograms(const char *bdev_name, bool reset,
+                             spdk_ubi_get_histograms_complete cb_fn, void *cb_arg);
+const char *bdev_ubi_latency_phase_name(enum spdk_ubi_latency_phase phase);
+void bdev_ubi_set_image_delay(const struct spdk_ubi_image_delay_opts *opts);
+void bdev_ubi_set_stripe_cache(uint64_t size_mb);
 
 #endif /* BDEV_UBI_H */
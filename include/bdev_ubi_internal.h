@@ -4,28 +4,55 @@
 #include "spdk/bdev.h"
 #include "spdk/bdev_module.h"
 #include "spdk/env.h"
+#include "spdk/histogram_data.h"
 #include "spdk/json.h"
 #include "spdk/stdinc.h"
 #include "spdk/string.h"
 #include "spdk/thread.h"
+#include "spdk/trace.h"
 
 #include "bdev_ubi.h"
 
 #include <liburing.h>
 
-#define UBI_METADATA_SIZE 8388608
+/*
+ * Metadata is read and written in units of pages. Only pages modified since
+ * the last commit are copied to the snapshot and written.
+ */
+#define UBI_METADATA_PAGE_SIZE 4096
+
+/*
+ * Metadata v0.1 always has room for UBI_V0_1_MAX_STRIPES stripe headers and
+ * takes UBI_V0_1_METADATA_SIZE bytes.
+ */
+#define UBI_V0_1_METADATA_SIZE 8388608
+#define UBI_V0_1_MAX_STRIPES (2 * 1024 * 1024)
 
-// support images upto 2TB = 2^40 (assuming 1MB stripe size)
-#define UBI_MAX_STRIPES (2 * 1024 * 1024)
+/*
+ * Since v0.2 the stripe header table is sized to the image. Support images
+ * upto 16TB = 2^44 with 1MB stripes, and upto 1PB with 64MB stripes.
+ */
+#define UBI_MAX_STRIPES (16 * 1024 * 1024)
 #define UBI_STRIPE_SIZE_MIN 64
-#define UBI_STRIPE_SIZE_MAX 1024
+#define UBI_STRIPE_SIZE_MAX 65536
+
+/*
+ * Bounds used when picking stripe size automatically for a new disk. See
+ * ubi_auto_stripe_size_kb().
+ */
+#define UBI_AUTO_STRIPE_SIZE_MIN 256
+#define UBI_AUTO_MIN_STRIPES 1024
+#define UBI_AUTO_MAX_STRIPES (256 * 1024)
+
+/* Data starts at a multiple of this when metadata is stored on base bdev. */
+#define UBI_DATA_ALIGNMENT (1024 * 1024)
 
 #define UBI_PATH_LEN 1024
 
 #define UBI_MAGIC "BDEV_UBI"
 #define UBI_MAGIC_SIZE 9
 #define UBI_VERSION_MAJOR 0
-#define UBI_VERSION_MINOR 1
+#define UBI_VERSION_MINOR 2
 
 #define UBI_MAX_ACTIVE_STRIPE_FETCHES 8
 #define UBI_MAX_CONCURRENT_READS 24
@@ -34,25 +61,91 @@
 #define UBI_URING_QUEUE_SIZE 32
 
 /*
- * On-disk metadata for a ubi bdev.
+ * Size of the io_uring shared by channels of all ubi bdevs on a thread, and
+ * of its registered file table, i.e. how many channels on a thread can use
+ * a registered image file.
  */
-struct ubi_metadata {
+#define UBI_SHARED_URING_QUEUE_SIZE 512
+#define UBI_SHARED_URING_MAX_FILES 1024
+
+/*
+ * In interrupt mode, how often a channel rechecks I/O waiting for a stripe
+ * which is being fetched by another channel. Such fetches don't wake us up.
+ */
+#define UBI_INTERRUPT_RETRY_US 100
+
+#define UBI_CHECKPOINT_POLL_PERIOD_US 10000
+
+/*
+ * Latency histograms have 2^UBI_HISTOGRAM_BUCKET_SHIFT buckets per power of
+ * 2, i.e. about 6% precision, which keeps each at 8KB.
+ */
+#define UBI_HISTOGRAM_BUCKET_SHIFT 4
+
+/*
+ * Tracepoints, see bdev_ubi_trace.c. Group, owner and object types are picked
+ * from the ranges SPDK's own modules don't use. I/O objects are identified by
+ * their spdk_bdev_io, and stripe fetch objects by their stripe index.
+ */
+#define TRACE_GROUP_UBI 0xF
+#define OWNER_UBI 0xF0
+#define OBJECT_UBI_IO 0xF0
+#define OBJECT_UBI_STRIPE_FETCH 0xF1
+
+#define TRACE_UBI_IO_SUBMIT SPDK_TPOINT_ID(TRACE_GROUP_UBI, 0x0)
+#define TRACE_UBI_IO_DEQUEUE SPDK_TPOINT_ID(TRACE_GROUP_UBI, 0x1)
+#define TRACE_UBI_IO_IMAGE_READ_DONE SPDK_TPOINT_ID(TRACE_GROUP_UBI, 0x2)
+#define TRACE_UBI_IO_COMPLETE SPDK_TPOINT_ID(TRACE_GROUP_UBI, 0x3)
+#define TRACE_UBI_FLUSH_COMMIT SPDK_TPOINT_ID(TRACE_GROUP_UBI, 0x4)
+#define TRACE_UBI_FLUSH_DATA SPDK_TPOINT_ID(TRACE_GROUP_UBI, 0x5)
+#define TRACE_UBI_FETCH_ENQUEUE SPDK_TPOINT_ID(TRACE_GROUP_UBI, 0x6)
+#define TRACE_UBI_FETCH_START SPDK_TPOINT_ID(TRACE_GROUP_UBI, 0x7)
+#define TRACE_UBI_FETCH_READ_DONE SPDK_TPOINT_ID(TRACE_GROUP_UBI, 0x8)
+#define TRACE_UBI_FETCH_WRITE_DONE SPDK_TPOINT_ID(TRACE_GROUP_UBI, 0x9)
+
+/*
+ * On-disk metadata header for a ubi bdev. The header is followed by 2-byte
+ * stripe headers, one per stripe. Currently stripe_headers[i] will be either 0
+ * or 1, but reserve 16 more bits per stripe for future extension.
+ */
+struct ubi_metadata_header {
     uint8_t magic[UBI_MAGIC_SIZE];
 
     /* Parsed as little-endian 16-bit integers. */
     uint8_t versionMajor[2];
     uint8_t versionMinor[2];
 
-    uint8_t stripe_size_kb;
+    /*
+     * Stripe size in KB, truncated to 8 bits. Stripe headers of v0.1
+     * metadata start right after this.
+     */
+    uint8_t stripe_size_kb_v0_1;
 
     /*
-     * Currently stripe_headers[i] will be either 0 or 1, but reserve 16 more
-     * bits per stripe for future extension.
+     * Since v0.2. Parsed as little-endian 32-bit integers. Stripe headers
+     * start right after these.
      */
-    uint8_t stripe_headers[UBI_MAX_STRIPES][2];
+    uint8_t stripe_size_kb[4];
+    uint8_t stripe_count[4];
+};
+
+#define UBI_V0_1_HEADER_SIZE offsetof(struct ubi_metadata_header, stripe_size_kb)
+#define UBI_HEADER_SIZE sizeof(struct ubi_metadata_header)
+
+/*
+ * A request to persist metadata, e.g. by a flush. cb is called in "thread"
+ * once a metadata commit which started after the request has finished.
+ */
+typedef void (*ubi_metadata_commit_cb)(void *cb_arg, bool success);
+
+struct ubi_metadata_commit_waiter {
+    struct ubi_bdev *ubi_bdev;
+    struct spdk_thread *thread;
+    ubi_metadata_commit_cb cb;
+    void *cb_arg;
+    bool success;
 
-    /* Unused space reserved for future extension. */
-    uint8_t padding[UBI_METADATA_SIZE - UBI_MAGIC_SIZE - UBI_MAX_STRIPES * 2 - 5];
+    TAILQ_ENTRY(ubi_metadata_commit_waiter) link;
 };
 
 /*
@@ -63,6 +156,109 @@ struct ubi_base_bdev_info {
     struct spdk_bdev_desc *desc;
 };
 
+/*
+ * What a layer of the image has for a range: nothing, so the layers below
+ * show through, zeros, or data stored in its file.
+ */
+enum ubi_range_kind { UBI_RANGE_ABSENT, UBI_RANGE_ZERO, UBI_RANGE_DATA };
+
+/*
+ * Cluster index of a qcow2 image. See bdev_ubi_qcow2.c.
+ */
+struct ubi_qcow2 {
+    /* Virtual size of the image. */
+    uint64_t size;
+    uint32_t cluster_bits;
+    uint64_t cluster_count;
+
+    /*
+     * Host offset of each cluster, 0 if it's unallocated, or 1 if it's a
+     * zero cluster.
+     */
+    uint64_t *cluster_offsets;
+};
+
+/*
+ * A range of a sparse raw overlay which has data.
+ */
+struct ubi_layer_extent {
+    uint64_t start;
+    uint64_t end;
+};
+
+/*
+ * An overlay of the image, see bdev_ubi_layer.c. qcow2 overlays are indexed
+ * by their clusters, and sparse raw overlays by their extents with data.
+ */
+struct ubi_image_layer {
+    char path[UBI_PATH_LEN];
+    struct ubi_qcow2 *qcow2;
+    struct ubi_layer_extent *extents;
+    uint32_t extent_count;
+};
+
+/* Layers ubi_image_map resolves ranges to, besides overlays 0, 1, ... */
+#define UBI_IMAGE_LAYER_BASE -1
+#define UBI_IMAGE_LAYER_ZERO -2
+
+/*
+ * Frame index of an image in the zstd seekable format. See bdev_ubi_zstd.c.
+ */
+struct ubi_zstd {
+    /* Decompressed size of the image. */
+    uint64_t size;
+
+    /* Decompressed size of each frame, except the last which may be smaller. */
+    uint32_t frame_size;
+    uint32_t frame_count;
+
+    /* Offset of each frame in the image file, followed by the seek table's. */
+    uint64_t *frame_offsets;
+
+    /* Compressed size of the largest stripe. */
+    uint64_t max_stripe_bytes;
+};
+
+/*
+ * Identity of an image file in the stripe cache. See bdev_ubi_cache.c.
+ */
+struct ubi_cache_file_id {
+    dev_t dev;
+    ino_t ino;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+};
+
+/*
+ * Identity of the contents of an image's stripes. Compared with memcmp.
+ * file_count is 0 if the image's stripes can't be cached.
+ */
+struct ubi_cache_image_key {
+    uint32_t stripe_size;
+    uint32_t file_count;
+    struct ubi_cache_file_id files[1 + SPDK_UBI_MAX_IMAGE_OVERLAYS];
+};
+
+/*
+ * A stripe in the stripe cache shared by all ubi bdevs. See bdev_ubi_cache.c.
+ */
+struct ubi_cache_entry {
+    uint32_t image_id;
+    uint32_t stripe_idx;
+    uint8_t *buf;
+    uint32_t len;
+
+    /* Users copying from buf. The entry isn't evicted while there are any. */
+    uint32_t refs;
+
+    /* Set when the entry is used, and cleared when the clock hand passes it. */
+    bool referenced;
+
+    LIST_ENTRY(ubi_cache_entry) bucket_link;
+    TAILQ_ENTRY(ubi_cache_entry) clock_link;
+};
+
 /*
  * Runtime status of a stripe.
  */
@@ -83,7 +279,48 @@ struct ubi_bdev {
 
     struct ubi_base_bdev_info base_bdev_info;
 
+    /*
+     * Bdev where metadata is stored. Points to base_bdev_info, unless a
+     * separate metadata bdev was given. In that case it points to
+     * metadata_bdev_info, and all of base bdev is used for data.
+     */
+    struct ubi_base_bdev_info *metadata_info;
+    struct ubi_base_bdev_info metadata_bdev_info;
+
+    /*
+     * Image is read either from the file at image_path using io_uring, or if
+     * image_bdev_info.desc is set, from that bdev. image_path is empty then.
+     */
     char image_path[UBI_PATH_LEN];
+    struct ubi_base_bdev_info image_bdev_info;
+
+    /*
+     * Index of the image file if it's a qcow2 or a zstd seekable image. Both
+     * are NULL for raw images.
+     */
+    struct ubi_qcow2 *qcow2;
+    struct ubi_zstd *zstd;
+
+    /* Overlays of the image file, from the bottom up. */
+    struct ubi_image_layer overlays[SPDK_UBI_MAX_IMAGE_OVERLAYS];
+    uint32_t overlay_count;
+
+    /*
+     * Key of the image in the stripe cache, taken when the image and overlays
+     * are loaded, and its id, or 0 if it isn't cached. The id is registered
+     * once stripe size is known, at the end of creation.
+     */
+    struct ubi_cache_image_key cache_key;
+    uint32_t cache_image_id;
+    uint64_t image_offset_blocks;
+
+    /*
+     * Is the image stored on base bdev? image_bdev_info shares base bdev's
+     * desc then, and base bdev's data area ends at image_offset_blocks. If
+     * base bdev supports copy, stripes are fetched without host buffers.
+     */
+    bool image_on_base;
+    bool image_copy_offload;
     uint32_t stripe_size_kb;
     uint32_t stripe_block_count;
     uint32_t stripe_shift;
@@ -93,13 +330,85 @@ struct ubi_bdev {
     bool no_sync;
     bool copy_on_read;
     bool directio;
+    uint32_t checkpoint_interval_ms;
+    uint32_t checkpoint_dirty_stripes;
+    bool uring_sqpoll;
+    int32_t uring_sqpoll_cpu;
+    bool uring_iopoll;
 
-    enum stripe_status stripe_status[UBI_MAX_STRIPES];
+    /*
+     * In-memory copy of on-disk metadata. It's metadata_size bytes, and
+     * consists of a header followed by stripe_count stripe headers.
+     */
+    struct ubi_metadata_header *metadata;
+    uint8_t (*stripe_headers)[2];
+    uint64_t metadata_size;
+    uint32_t metadata_pages;
+    uint32_t stripe_count;
 
-    struct ubi_metadata metadata;
+    enum stripe_status *stripe_status;
     uint64_t stripes_fetched;
     uint64_t stripes_flushed;
 
+    /*
+     * Stripe fetches waiting in channel queues, and in progress. Updated
+     * atomically, once per fetch, so they can be reported from any thread.
+     */
+    uint64_t stripe_fetches_queued;
+    uint64_t stripe_fetches_active;
+
+    /* Sum of I/O counters of destroyed channels. Updated atomically. */
+    struct spdk_ubi_io_stats closed_channel_stats;
+
+    /*
+     * Latency histograms, see bdev_ubi_histogram.c. While enabled, channels
+     * keep their own, and merge them into closed_channel_histograms when
+     * they're destroyed. histograms_lock protects closed_channel_histograms.
+     */
+    bool histograms_enabled;
+    pthread_mutex_t histograms_lock;
+    struct spdk_histogram_data *closed_channel_histograms[SPDK_UBI_LATENCY_PHASES];
+
+    /*
+     * Channels of the bdev, so a channel which is destroyed can kick the
+     * others waiting for its stripe fetches. Protected by channels_lock.
+     */
+    TAILQ_HEAD(, ubi_io_channel) channels;
+    pthread_mutex_t channels_lock;
+
+    /*
+     * Bitmap of pages of "metadata" modified since they were last copied to
+     * metadata_snapshot. Updated atomically from any thread.
+     */
+    uint64_t *metadata_dirty_pages;
+
+    /*
+     * Ticks when a metadata page first became dirty since the last commit
+     * started, or 0. checkpoint_interval_ms is measured from this. Set
+     * atomically from any thread.
+     */
+    uint64_t first_dirty_tsc;
+
+    /*
+     * Metadata writer state. These are only accessed from "thread".
+     *
+     * Metadata is always written from metadata_snapshot, which is only
+     * modified when a commit starts. So it stays stable while it is being
+     * written, even though channels keep updating "metadata".
+     */
+    uint8_t *metadata_snapshot;
+    struct spdk_io_channel *metadata_base_ch;
+    struct spdk_io_channel *metadata_ch;
+    struct spdk_poller *checkpoint_poller;
+    bool commit_in_progress;
+    uint32_t commit_first_page;
+    uint32_t commit_end_page;
+    uint64_t commit_stripes_fetched;
+    TAILQ_HEAD(, ubi_metadata_commit_waiter) commit_waiters;
+    TAILQ_HEAD(, ubi_metadata_commit_waiter) pending_commit_waiters;
+    bool metadata_writer_stopping;
+    void (*metadata_writer_stopped_cb)(struct ubi_bdev *ubi_bdev);
+
     /*
      * Thread where ubi_bdev was initialized. It's essential to close the base
      * bdev in the same thread in which it was opened.
@@ -114,6 +423,21 @@ enum ubi_io_type { UBI_BDEV_IO, UBI_STRIPE_FETCH };
 
 struct ubi_io_op {
     enum ubi_io_type type;
+
+    /*
+     * With image delay, result of the image read, when it's due to complete,
+     * and its entry in the ring's list of delayed completions.
+     */
+    int res;
+    uint64_t complete_tsc;
+    TAILQ_ENTRY(ubi_io_op) delay_link;
+
+    /*
+     * Set when the channel of the op is destroyed while the op is in the
+     * ring. Its completion then only releases it. See
+     * ubi_image_ring_cancel_channel.
+     */
+    bool canceled;
 };
 
 /*
@@ -128,7 +452,14 @@ struct ubi_bdev_io {
     uint64_t block_offset;
     uint64_t block_count;
 
-    uint64_t stripes_fetched;
+    /*
+     * Ticks when the I/O was submitted, and when its current phase started.
+     * Only set while histograms are enabled.
+     */
+    uint64_t submit_tsc;
+    uint64_t phase_tsc;
+
+    struct ubi_metadata_commit_waiter commit_waiter;
 };
 
 /*
@@ -143,11 +474,98 @@ struct stripe_fetch {
     /* Which stripe are we fetching? */
     uint32_t stripe_idx;
 
-    /* Where will the data be stored at? */
-    uint8_t buf[1024 * UBI_STRIPE_SIZE_MAX + 8192];
-    uint8_t *buf_aligned;
+    /*
+     * Where will the data be stored at? Allocated on first use, since
+     * stripes can be large.
+     */
+    uint8_t *buf;
 
     struct ubi_bdev *ubi_bdev;
+    struct ubi_io_channel *ch;
+
+    /* Ticks when the current phase started, if histograms are enabled. */
+    uint64_t phase_tsc;
+
+    /*
+     * A qcow2 stripe, or a stripe of an image with overlays, is read one
+     * run which is contiguous in one of the files at a time. read_offset
+     * is where in the stripe the run being read starts, and read_len is its
+     * length.
+     *
+     * Frames of a zstd stripe are read into zbuf, at read_offset so the read
+     * is aligned, and read_len is their compressed size.
+     */
+    uint32_t read_offset;
+    uint32_t read_len;
+    uint8_t *zbuf;
+};
+
+/*
+ * An io_uring used for reading image files, together with its registered
+ * file table. See bdev_ubi_uring.c.
+ */
+struct ubi_image_ring {
+    struct io_uring ring;
+
+    /*
+     * Number of SQEs prepared but not submitted yet. They're submitted
+     * together by ubi_image_ring_submit.
+     */
+    uint32_t pending_sqes;
+
+    /*
+     * Number of submitted SQEs whose CQEs haven't been seen yet. Only
+     * maintained for IOPOLL rings without an SQ polling thread, whose
+     * completions are only found when we ask the kernel to poll for them.
+     */
+    uint32_t inflight_sqes;
+    bool reap;
+
+    /*
+     * Registered file table, with -1 for free slots. "files" is NULL if
+     * registering files failed.
+     */
+    int *files;
+    uint32_t max_files;
+
+    /*
+     * In interrupt mode, eventfd registered with the ring, which is signaled
+     * on completions. It's also signaled when SQEs are prepared, so they get
+     * submitted. -1 otherwise.
+     */
+    int efd;
+    bool efd_signaled;
+
+    /* Image reads which completed, but are delayed, sorted by complete_tsc. */
+    TAILQ_HEAD(ubi_io_op_list, ubi_io_op) delayed;
+
+    /*
+     * In interrupt mode, a timeout request in the ring wakes it through efd
+     * when the earliest delayed read is due. timeout_tsc is the deadline of
+     * the last one armed, or 0 if it has fired.
+     */
+    struct __kernel_timespec timeout_ts;
+    uint64_t timeout_tsc;
+
+    /*
+     * State of the random numbers picking which delayed reads get the p99
+     * latency. Each ring has its own, since rand() isn't thread safe.
+     */
+    uint64_t delay_rand_state;
+};
+
+/*
+ * Per thread state shared by all ubi bdevs. It's the context of an I/O
+ * channel of a module-wide io_device, so it's created when the first ubi
+ * channel on a thread is created, and destroyed after the last one.
+ */
+struct ubi_thread_ctx {
+    struct ubi_image_ring image_ring;
+
+    /* Either a poller, or in interrupt mode an eventfd and its interrupt. */
+    struct spdk_poller *poller;
+    int efd;
+    struct spdk_interrupt *intr;
 };
 
 /*
@@ -155,12 +573,28 @@ struct stripe_fetch {
  */
 struct ubi_io_channel {
     struct ubi_bdev *ubi_bdev;
+    TAILQ_ENTRY(ubi_io_channel) link;
     struct spdk_poller *poller;
+
+    /*
+     * In interrupt mode, the channel is processed when "efd" is signaled by
+     * ubi_kick_channel, instead of by "poller". While it waits for stripes
+     * fetched by other channels, retry_poller is resumed to recheck them.
+     */
+    int efd;
+    struct spdk_interrupt *intr;
+    bool efd_signaled;
+    struct spdk_poller *retry_poller;
+    bool retry_poller_active;
     struct spdk_io_channel *base_channel;
 
-    uint64_t blocks_read;
-    uint64_t blocks_written;
-    uint64_t stripes_fetched;
+    /* Channel of the image bdev if there's one. No ring is used then. */
+    struct spdk_io_channel *image_channel;
+
+    struct spdk_ubi_io_stats stats;
+
+    /* Latency histograms, or NULLs if they're not enabled. */
+    struct spdk_histogram_data *histograms[SPDK_UBI_LATENCY_PHASES];
 
     uint64_t active_reads;
 
@@ -179,8 +613,42 @@ struct ubi_io_channel {
 
     /* io_uring stuff */
     int image_file_fd;
-    struct io_uring image_file_ring;
-    int has_reads;
+
+    /* Overlays are read with their plain fds, which aren't registered. */
+    int overlay_fds[SPDK_UBI_MAX_IMAGE_OVERLAYS];
+
+    /*
+     * Ring used for reading the image file. Channels share their thread's
+     * ring, whose channel is thread_ctx_ch. Channels of bdevs which need
+     * ring flags (uring_sqpoll, uring_iopoll) have a ring of their own, which
+     * is private_ring, and is polled by the channel's poller.
+     */
+    struct ubi_image_ring *image_ring;
+    struct spdk_io_channel *thread_ctx_ch;
+    struct ubi_image_ring *private_ring;
+
+    /*
+     * If the image file is registered with image_ring, SQEs refer to it by
+     * its slot in the file table and have IOSQE_FIXED_FILE set. Otherwise
+     * they use image_file_fd. ubi_prep_image_sqe sets these on an SQE.
+     */
+    int image_file_slot;
+    int image_file_sqe_fd;
+    unsigned image_file_sqe_flags;
+
+    /*
+     * Are stripe fetch buffers registered with image_ring? If so,
+     * stripe_fetches[i].buf is fixed buffer i. Only done for private rings,
+     * since the buffer table is ring-wide.
+     */
+    bool fetch_bufs_registered;
+
+    /* Number of ops of the channel submitted to image_ring and not reaped yet. */
+    uint32_t image_ops_inflight;
+
+    /* zstd decompression context, created on first zstd stripe fetch. */
+    void *zstd_dctx;
+
     int wait_cycles;
 
     /* queue pointer */
@@ -189,15 +657,29 @@ struct ubi_io_channel {
 
 /* bdev_ubi.c */
 void ubi_write_config_json(struct spdk_bdev *bdev, struct spdk_json_write_ctx *w);
+int ubi_dump_info_json(void *ctx, struct spdk_json_write_ctx *w);
+struct ubi_bdev *ubi_bdev_get_by_name(const char *bdev_name);
 
 /* bdev_ubi_flush.c */
 void ubi_submit_flush_request(struct ubi_bdev_io *ubi_io);
 
+/* bdev_ubi_metadata.c */
+typedef void (*ubi_metadata_writer_stopped_cb)(struct ubi_bdev *ubi_bdev);
+int ubi_start_metadata_writer(struct ubi_bdev *ubi_bdev);
+void ubi_stop_metadata_writer(struct ubi_bdev *ubi_bdev,
+                              ubi_metadata_writer_stopped_cb cb);
+void ubi_request_metadata_commit(struct ubi_bdev *ubi_bdev,
+                                 struct ubi_metadata_commit_waiter *waiter,
+                                 ubi_metadata_commit_cb cb, void *cb_arg);
+void ubi_mark_metadata_dirty(struct ubi_bdev *ubi_bdev, const void *addr);
+
 /* bdev_ubi_stripe.c */
 void ubi_start_fetch_stripe(struct ubi_io_channel *base_ch,
                             struct stripe_fetch *stripe_fetch);
 int ubi_complete_fetch_stripe(struct ubi_io_channel *ch,
                               struct stripe_fetch *stripe_fetch, int res);
+void ubi_cancel_stripe_fetch(struct stripe_fetch *stripe_fetch);
+void ubi_cancel_queued_stripe_fetches(struct ubi_io_channel *ch);
 void enqueue_stripe(struct ubi_io_channel *ch, int stripe_idx);
 int dequeue_stripe(struct ubi_io_channel *ch);
 bool stripe_queue_empty(struct ubi_io_channel *ch);
@@ -208,6 +690,83 @@ void ubi_set_stripe_status(struct ubi_bdev *ubi_bdev, int index,
 /* bdev_ubi_io_channel.c */
 int ubi_create_channel_cb(void *io_device, void *ctx_buf);
 void ubi_destroy_channel_cb(void *io_device, void *ctx_buf);
+void ubi_prep_image_sqe(struct ubi_io_channel *ch, struct io_uring_sqe *sqe);
+uint64_t ubi_image_bdev_read_size(struct ubi_bdev *ubi_bdev, uint64_t offset,
+                                  uint64_t nbytes);
+int ubi_alloc_fetch_bufs(struct ubi_io_channel *ch);
+int ubi_complete_read_from_image(struct ubi_io_channel *ch, struct ubi_bdev_io *ubi_io,
+                                 int res);
+void ubi_complete_io(struct ubi_bdev_io *ubi_io, bool success);
+void ubi_kick_channel(struct ubi_io_channel *ch);
+
+/* bdev_ubi_histogram.c */
+void ubi_histograms_open_channel(struct ubi_io_channel *ch);
+void ubi_histograms_close_channel(struct ubi_io_channel *ch);
+void ubi_free_closed_channel_histograms(struct ubi_bdev *ubi_bdev);
+uint64_t ubi_histogram_start(struct ubi_io_channel *ch);
+void ubi_histogram_tally(struct ubi_io_channel *ch, enum spdk_ubi_latency_phase phase,
+                         uint64_t start_tsc);
+
+/* bdev_ubi_stats.c */
+void ubi_stats_close_channel(struct ubi_io_channel *ch);
+
+/* bdev_ubi_qcow2.c */
+int ubi_qcow2_load(const char *path, bool allow_backing_file, struct ubi_qcow2 **out);
+void ubi_qcow2_free(struct ubi_qcow2 *qcow2);
+uint64_t ubi_qcow2_map(const struct ubi_qcow2 *qcow2, uint64_t offset, uint64_t *len);
+enum ubi_range_kind ubi_qcow2_map_range(const struct ubi_qcow2 *qcow2, uint64_t offset,
+                                        uint64_t *len, uint64_t *host);
+
+/* bdev_ubi_layer.c */
+int ubi_image_layer_load(const char *path, struct ubi_image_layer *layer);
+void ubi_image_layer_free(struct ubi_image_layer *layer);
+int ubi_image_map(const struct ubi_bdev *ubi_bdev, uint64_t offset, uint64_t *len,
+                  uint64_t *host);
+
+/* bdev_ubi_zstd.c */
+int ubi_zstd_load(const char *path, struct ubi_zstd **out);
+void ubi_zstd_free(struct ubi_zstd *zstd);
+void ubi_zstd_set_stripe_size(struct ubi_zstd *zstd, uint32_t stripe_size);
+void ubi_zstd_stripe_range(const struct ubi_zstd *zstd, uint32_t stripe_idx,
+                           uint32_t stripe_size, uint64_t *offset, uint64_t *len);
+int ubi_zstd_decompress_stripe(const struct ubi_zstd *zstd, void **dctx,
+                               uint32_t stripe_idx, uint32_t stripe_size,
+                               const uint8_t *src, uint8_t *dst);
+void ubi_zstd_free_dctx(void *dctx);
+
+/* bdev_ubi_cache.c */
+uint64_t ubi_stripe_cache_size_mb(void);
+void ubi_stripe_cache_finish(void);
+void ubi_stripe_cache_init_key(const struct ubi_bdev *ubi_bdev,
+                               struct ubi_cache_image_key *key);
+uint32_t ubi_stripe_cache_image_id(struct ubi_cache_image_key *key, uint32_t stripe_size);
+struct ubi_cache_entry *ubi_stripe_cache_get(uint32_t image_id, uint32_t stripe_idx);
+void ubi_stripe_cache_put(struct ubi_cache_entry *entry);
+void ubi_stripe_cache_insert(uint32_t image_id, uint32_t stripe_idx, const uint8_t *buf,
+                             uint32_t len);
+
+/* bdev_ubi_uring.c */
+void ubi_uring_initialize(void);
+void ubi_uring_finish(void);
+struct spdk_io_channel *ubi_get_thread_ctx_channel(void);
+int ubi_image_ring_init(struct ubi_image_ring *image_ring, uint32_t entries,
+                        uint32_t flags, int sq_thread_cpu, uint32_t max_files);
+void ubi_image_ring_exit(struct ubi_image_ring *image_ring);
+bool ubi_image_ring_probe(struct ubi_image_ring *image_ring, int fd, uint32_t nbytes,
+                          uint32_t alignment);
+int ubi_image_ring_add_file(struct ubi_image_ring *image_ring, int fd);
+void ubi_image_ring_remove_file(struct ubi_image_ring *image_ring, int slot);
+int ubi_image_ring_register_buffers(struct ubi_image_ring *image_ring,
+                                    const struct iovec *iovs, unsigned n);
+struct io_uring_sqe *ubi_image_ring_get_sqe(struct ubi_image_ring *image_ring);
+void ubi_image_sqe_set_op(struct io_uring_sqe *sqe, struct ubi_io_op *op);
+int ubi_image_ring_submit(struct ubi_image_ring *image_ring);
+int ubi_image_ring_complete(struct ubi_image_ring *image_ring);
+void ubi_image_ring_cancel_channel(struct ubi_image_ring *image_ring,
+                                   struct ubi_io_channel *ch);
+int ubi_image_ring_set_eventfd(struct ubi_image_ring *image_ring, int efd);
+void ubi_signal_eventfd(int efd, bool *signaled);
+void ubi_drain_eventfd(int efd, bool *signaled);
 
 /* macros */
 #define UBI_ERRLOG(ubi_bdev, format, ...)                                                \
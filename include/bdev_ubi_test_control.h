@@ -11,6 +11,9 @@ void ubi_fail_calloc_ubi_bdev(bool fail);
 extern void ubi_io_channel_fail_register_poller(bool fail);
 extern void ubi_io_channel_fail_create_base_ch(bool fail);
 extern void ubi_io_channel_fail_image_file_open(bool fail);
-extern void ubi_io_channel_fail_uring_queue_init(bool fail);
+
+/* bdev_ubi_uring.c */
+extern void ubi_uring_fail_queue_init(bool fail);
+extern void ubi_uring_fail_register(bool fail);
 
 #endif /* BDEV_UBI_TEST_CONTROL_H */
@@ -0,0 +1,23 @@
+BENCH_DIR := $(SRC_DIR)/bench
+BENCH_BIN_DIR = $(BIN_DIR)/bench
+
+# bdevperf isn't installed as a library, so it's built from the SPDK source
+# tree together with bdev_ubi, which makes ubi bdevs available to it.
+BDEVPERF_SRC ?= $(SPDK_PATH)/../examples/bdev/bdevperf/bdevperf.c
+
+ifneq ($(MAKECMDGOALS),format)
+# bdevperf's job config files are parsed by spdk_conf, which other apps don't use.
+SPDK_CONF_LIB := $(shell PKG_CONFIG_PATH="$(PKG_CONFIG_PATH)" pkg-config --libs spdk_conf)
+endif
+
+# Extra arguments for run_bench.py, e.g. BENCH_ARGS="--time 30 --base null".
+BENCH_ARGS ?=
+
+$(BENCH_BIN_DIR)/bdevperf_ubi: $(BDEVPERF_SRC) $(LIB_OBJS)
+	$(info Building $@ ...)
+	@mkdir -p $(@D)
+	@$(CC) $(CFLAGS) $< $(LIB_OBJS) -o $@ $(LDFLAGS) -Wl,-Bstatic $(SPDK_CONF_LIB) -Wl,-Bdynamic
+
+bench: $(BENCH_BIN_DIR)/bdevperf_ubi
+	sudo python3 $(BENCH_DIR)/run_bench.py --bdevperf $< --work-dir $(BENCH_BIN_DIR) \
+		--output $(BENCH_BIN_DIR)/results.json $(BENCH_ARGS)
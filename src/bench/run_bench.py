@@ -0,0 +1,404 @@
+#!/usr/bin/env python3
+"""
+Runs bdevperf workloads against ubi bdevs and records their results.
+
+Each scenario starts a fresh bdevperf process, so its ubi bdev starts with
+nothing fetched from the image. Cold scenarios measure the first run of their
+workload. Warm scenarios run it once to fetch stripes and measure the second
+run. Results are written as JSON, and can be compared against a baseline
+results file to catch regressions.
+"""
+
+import argparse
+import json
+import os
+import random
+import re
+import socket
+import subprocess
+import sys
+import time
+
+MB = 1024 * 1024
+IMAGE_BLOCK_SIZE = 4096
+
+# Synthetic image contents. Stripe fetches and image reads don't depend on
+# data today, but formats and compression will.
+IMAGE_KINDS = ["random", "zero_heavy", "sparse", "compressible"]
+
+# Each scenario is a list of bdevperf jobs, which run concurrently on the ubi
+# bdev, and whether its workload is measured after a warm-up run.
+SCENARIOS = {
+    "cold_seq_read": {
+        "images": IMAGE_KINDS,
+        "jobs": [{"rw": "read", "bs": 128 * 1024, "iodepth": 32}],
+    },
+    "cold_rand_read_4k": {
+        "images": IMAGE_KINDS,
+        "jobs": [{"rw": "randread", "bs": 4096, "iodepth": 32}],
+    },
+    "cold_rand_write_4k": {
+        "images": ["random"],
+        "jobs": [{"rw": "randwrite", "bs": 4096, "iodepth": 32}],
+    },
+    "warm_rand_rw_4k": {
+        "images": ["random"],
+        "warm": True,
+        "copy_on_read": True,
+        "jobs": [{"rw": "randrw", "bs": 4096, "iodepth": 32, "rwmixread": 50}],
+    },
+    "flush_heavy": {
+        "images": ["random"],
+        "jobs": [
+            {"rw": "randwrite", "bs": 4096, "iodepth": 16},
+            {"rw": "flush", "bs": 4096, "iodepth": 4},
+        ],
+    },
+    "mixed": {
+        "images": ["random"],
+        "jobs": [
+            {"rw": "randrw", "bs": 4096, "iodepth": 16, "rwmixread": 70},
+            {"rw": "read", "bs": 64 * 1024, "iodepth": 4},
+        ],
+    },
+}
+
+
+def generate_image(path, kind, size, seed):
+    """Writes a synthetic image, which is the same for the same seed."""
+    rng = random.Random(f"{seed}-{kind}")
+    zero_block = bytes(IMAGE_BLOCK_SIZE)
+    patterns = [rng.randbytes(rng.randint(8, 64)) for _ in range(16)]
+
+    with open(path + ".tmp", "wb") as f:
+        if kind == "sparse":
+            # Mostly holes, with about 1% of blocks allocated.
+            f.truncate(size)
+            for offset in range(0, size, IMAGE_BLOCK_SIZE):
+                if rng.random() < 0.01:
+                    f.seek(offset)
+                    f.write(rng.randbytes(IMAGE_BLOCK_SIZE))
+        else:
+            for _ in range(size // IMAGE_BLOCK_SIZE):
+                if kind == "random":
+                    block = rng.randbytes(IMAGE_BLOCK_SIZE)
+                elif kind == "zero_heavy":
+                    # Allocated zeros, unlike holes of the sparse image.
+                    if rng.random() < 0.9:
+                        block = zero_block
+                    else:
+                        block = rng.randbytes(IMAGE_BLOCK_SIZE)
+                else:
+                    pattern = rng.choice(patterns)
+                    repeats = IMAGE_BLOCK_SIZE // len(pattern) + 1
+                    block = (pattern * repeats)[:IMAGE_BLOCK_SIZE]
+                f.write(block)
+    os.rename(path + ".tmp", path)
+
+
+def bdevperf_config(args, image_path, copy_on_read):
+    if args.base == "malloc":
+        base = {
+            "method": "bdev_malloc_create",
+            "params": {
+                "name": "base0",
+                "block_size": 512,
+                "num_blocks": args.base_size_mb * MB // 512,
+            },
+        }
+    else:
+        base = {
+            "method": "bdev_null_create",
+            "params": {
+                "name": "base0",
+                "block_size": 512,
+                "num_blocks": args.base_size_mb * MB // 512,
+            },
+        }
+
+    config = [base]
+    base_name = "base0"
+    if args.base_latency_us:
+        avg, p99 = args.base_latency_us
+        config.append({
+            "method": "bdev_delay_create",
+            "params": {
+                "base_bdev_name": base_name,
+                "name": "delay0",
+                "avg_read_latency": avg,
+                "p99_read_latency": p99,
+                "avg_write_latency": avg,
+                "p99_write_latency": p99,
+            },
+        })
+        base_name = "delay0"
+
+    if args.base_mbps:
+        config.append({
+            "method": "bdev_set_qos_limit",
+            "params": {"name": base_name, "rw_mbytes_per_sec": args.base_mbps},
+        })
+
+    if args.image_latency_us or args.image_mbps:
+        avg, p99 = args.image_latency_us or (0, 0)
+        config.append({
+            "method": "bdev_ubi_set_image_delay",
+            "params": {
+                "avg_latency_us": avg,
+                "p99_latency_us": p99,
+                "max_mbytes_per_sec": args.image_mbps,
+            },
+        })
+
+    ubi = {
+        "method": "bdev_ubi_create",
+        "params": {
+            "name": "ubi0",
+            "base_bdev": base_name,
+            "image_path": os.path.abspath(image_path),
+            "stripe_size_kb": args.stripe_size_kb,
+            "copy_on_read": copy_on_read,
+            "directio": False,
+            "no_sync": False,
+        },
+    }
+
+    return {
+        "subsystems": [
+            {
+                "subsystem": "bdev",
+                "config": config + [ubi, {"method": "bdev_wait_for_examine"}],
+            }
+        ]
+    }
+
+
+def latency_arg(value):
+    """Parses "AVG[,P99]" latencies in us. P99 defaults to AVG."""
+    parts = [int(part) for part in value.split(",")]
+    if len(parts) not in (1, 2) or min(parts) < 0:
+        raise argparse.ArgumentTypeError(f"invalid latency: {value}")
+    return (parts[0], parts[-1])
+
+
+def bdevperf_job_file(jobs):
+    lines = ["[global]", "filename=ubi0", "cpumask=0x1", ""]
+    for i, job in enumerate(jobs):
+        lines.append(f"[job{i}]")
+        lines.extend(f"{key}={value}" for key, value in job.items())
+        lines.append("")
+    return "\n".join(lines)
+
+
+def rpc_call(proc, sock_path, method, timeout):
+    """Calls a JSON-RPC method of bdevperf, and returns its result."""
+    deadline = time.monotonic() + timeout
+    while True:
+        try:
+            sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+            sock.connect(sock_path)
+            break
+        except (FileNotFoundError, ConnectionRefusedError):
+            sock.close()
+            if proc.poll() is not None:
+                raise RuntimeError(f"bdevperf exited with {proc.returncode}")
+            if time.monotonic() > deadline:
+                raise TimeoutError(f"bdevperf didn't listen on {sock_path}")
+            time.sleep(0.1)
+
+    with sock:
+        sock.settimeout(timeout)
+        request = {"jsonrpc": "2.0", "method": method, "id": 1}
+        sock.sendall(json.dumps(request).encode())
+        decoder = json.JSONDecoder()
+        buf = ""
+        while True:
+            data = sock.recv(4096)
+            if not data:
+                raise ConnectionError(f"bdevperf closed the socket during {method}")
+            buf += data.decode()
+            try:
+                response, _ = decoder.raw_decode(buf)
+                break
+            except json.JSONDecodeError:
+                continue
+
+    if "error" in response:
+        raise RuntimeError(f"{method} failed: {response['error']}")
+    return response.get("result")
+
+
+RESULTS_HEADER_RE = re.compile(r"Device Information")
+TOTAL_RE = re.compile(r"^\s*Total\s*:(.*)$")
+LATENCY_HEADER_RE = re.compile(r"^\s*Latency summary\s*(.*?):?\s*$")
+PERCENTILE_RE = re.compile(r"^\s*([\d.]+)%\s*:\s*([\d.]+)us")
+REPORTED_PERCENTILES = {"p50": 50.0, "p90": 90.0, "p99": 99.0, "p99_9": 99.9,
+                        "p99_99": 99.99}
+
+
+def parse_bdevperf_output(output):
+    """
+    Parses results of the last test run in bdevperf output. The Total line
+    has IOPS and MiB/s first, and average, min and max latency in us last.
+    Latency summaries of jobs follow it.
+    """
+    lines = output.splitlines()
+    headers = [i for i, line in enumerate(lines) if RESULTS_HEADER_RE.search(line)]
+    if not headers:
+        raise ValueError("bdevperf output has no results")
+
+    result = {"latency_us": {}}
+    summary = None
+    for line in lines[headers[-1]:]:
+        match = TOTAL_RE.match(line)
+        if match:
+            numbers = [float(n) for n in match.group(1).split()]
+            result["iops"] = numbers[0]
+            result["bandwidth_mib_s"] = numbers[1]
+            result["latency_avg_us"] = numbers[-3]
+            result["latency_min_us"] = numbers[-2]
+            result["latency_max_us"] = numbers[-1]
+            continue
+
+        match = LATENCY_HEADER_RE.match(line)
+        if match:
+            summary = {}
+            # Jobs on the same bdev have the same summary header.
+            name = match.group(1).strip("[] ") or "job"
+            if name in result["latency_us"]:
+                name += f"_{len(result['latency_us'])}"
+            result["latency_us"][name] = summary
+            continue
+
+        match = PERCENTILE_RE.match(line)
+        if match and summary is not None:
+            percent, latency = float(match.group(1)), float(match.group(2))
+            for key, cutoff in REPORTED_PERCENTILES.items():
+                if abs(percent - cutoff) < 1e-6:
+                    summary[key] = latency
+
+    if "iops" not in result:
+        raise ValueError("bdevperf output has no results")
+    return result
+
+
+def run_scenario(args, name, scenario, image_kind):
+    run_name = f"{name}-{image_kind}-{args.base}"
+    prefix = os.path.join(args.work_dir, run_name)
+    image_path = os.path.join(args.work_dir, f"image_{image_kind}.raw")
+    config_path = prefix + ".json"
+    job_path = prefix + ".job"
+    log_path = prefix + ".log"
+    sock_path = f"/var/tmp/ubi_bench_{os.getpid()}.sock"
+    if os.path.exists(sock_path):
+        os.unlink(sock_path)
+
+    with open(config_path, "w") as f:
+        json.dump(bdevperf_config(args, image_path,
+                                  scenario.get("copy_on_read", False)), f, indent=2)
+    with open(job_path, "w") as f:
+        f.write(bdevperf_job_file(scenario["jobs"]))
+
+    cmd = [args.bdevperf, "-m", "0x1", "-r", sock_path, "--json", config_path,
+           "-j", job_path, "-t", str(args.time), "-l", "-z"]
+    timeout = args.time * 4 + 60
+    with open(log_path, "w") as log:
+        proc = subprocess.Popen(cmd, stdout=log, stderr=subprocess.STDOUT)
+        try:
+            rpc_call(proc, sock_path, "framework_wait_init", timeout)
+            if scenario.get("warm", False):
+                rpc_call(proc, sock_path, "perform_tests", timeout)
+            rpc_call(proc, sock_path, "perform_tests", timeout)
+        finally:
+            # bdevperf's output is buffered until it exits.
+            proc.terminate()
+            proc.wait()
+
+    with open(log_path) as f:
+        result = parse_bdevperf_output(f.read())
+
+    result.update({"scenario": name, "image": image_kind, "base": args.base,
+                   "warm": scenario.get("warm", False), "jobs": scenario["jobs"]})
+    return run_name, result
+
+
+def compare_with_baseline(results, baseline_path, max_regression):
+    """Returns names of runs whose IOPS dropped more than max_regression %."""
+    with open(baseline_path) as f:
+        baseline = json.load(f)["runs"]
+
+    regressions = []
+    for run_name, result in results.items():
+        if run_name not in baseline:
+            continue
+        old_iops = baseline[run_name]["iops"]
+        if old_iops > 0 and result["iops"] < old_iops * (1 - max_regression / 100):
+            print(f"{run_name}: IOPS dropped from {old_iops:.0f} to "
+                  f"{result['iops']:.0f}", file=sys.stderr)
+            regressions.append(run_name)
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawTextHelpFormatter)
+    parser.add_argument("--bdevperf", required=True, help="bdevperf with bdev_ubi")
+    parser.add_argument("--work-dir", default="bin/bench",
+                        help="directory for images, configs and logs")
+    parser.add_argument("--output", required=True, help="results file to write")
+    parser.add_argument("--base", choices=["malloc", "null"], default="malloc",
+                        help="base bdev type")
+    parser.add_argument("--time", type=int, default=10,
+                        help="seconds each measured run takes")
+    parser.add_argument("--image-size-mb", type=int, default=128)
+    parser.add_argument("--base-size-mb", type=int, default=256)
+    parser.add_argument("--stripe-size-kb", type=int, default=1024)
+    parser.add_argument("--seed", type=int, default=0, help="seed of image contents")
+    parser.add_argument("--base-latency-us", type=latency_arg,
+                        help="AVG[,P99] latency of base bdev I/O, through a delay bdev")
+    parser.add_argument("--base-mbps", type=int, default=0,
+                        help="bandwidth cap of base bdev I/O in MB/s")
+    parser.add_argument("--image-latency-us", type=latency_arg,
+                        help="AVG[,P99] latency of image reads")
+    parser.add_argument("--image-mbps", type=int, default=0,
+                        help="bandwidth cap of image reads in MB/s")
+    parser.add_argument("--scenario", action="append", choices=SCENARIOS.keys(),
+                        help="scenarios to run, all by default")
+    parser.add_argument("--baseline", help="results file to compare IOPS against")
+    parser.add_argument("--max-regression", type=float, default=10.0,
+                        help="IOPS drop in percent that fails the comparison")
+    args = parser.parse_args()
+
+    os.makedirs(args.work_dir, exist_ok=True)
+    for kind in IMAGE_KINDS:
+        path = os.path.join(args.work_dir, f"image_{kind}.raw")
+        if not os.path.exists(path) or os.path.getsize(path) != args.image_size_mb * MB:
+            print(f"Generating {path} ...")
+            generate_image(path, kind, args.image_size_mb * MB, args.seed)
+
+    results = {}
+    for name in args.scenario or SCENARIOS.keys():
+        scenario = SCENARIOS[name]
+        for image_kind in scenario["images"]:
+            run_name, result = run_scenario(args, name, scenario, image_kind)
+            print(f"{run_name}: {result['iops']:.0f} IOPS, "
+                  f"{result['bandwidth_mib_s']:.2f} MiB/s, "
+                  f"{result['latency_avg_us']:.2f} us average latency")
+            results[run_name] = result
+
+    with open(args.output, "w") as f:
+        json.dump({"time": args.time, "image_size_mb": args.image_size_mb,
+                   "stripe_size_kb": args.stripe_size_kb, "seed": args.seed,
+                   "base_latency_us": args.base_latency_us,
+                   "base_mbps": args.base_mbps,
+                   "image_latency_us": args.image_latency_us,
+                   "image_mbps": args.image_mbps,
+                   "runs": results}, f, indent=2)
+
+    if args.baseline and compare_with_baseline(results, args.baseline,
+                                               args.max_regression):
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
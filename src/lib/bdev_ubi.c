@@ -15,31 +15,54 @@
  */
 static int ubi_initialize(void);
 static void ubi_finish(void);
+static int ubi_config_json(struct spdk_json_write_ctx *w);
 static int ubi_get_ctx_size(void);
 static int ubi_destruct(void *ctx);
-static void ubi_close_base_bdev(void *ctx);
+static void ubi_destruct_on_bdev_thread(void *ctx);
+static void ubi_finish_destruct(struct ubi_bdev *ubi_bdev);
 static int ubi_init_layout_params(struct ubi_bdev *ubi_bdev);
+static int ubi_validate_stripe_size(struct ubi_bdev *ubi_bdev, uint32_t stripe_size_kb);
+static uint32_t ubi_auto_stripe_size_kb(struct ubi_bdev *ubi_bdev);
+static int ubi_get_v0_1_stripe_size(struct ubi_bdev *ubi_bdev, uint8_t stored,
+                                    uint32_t *stripe_size_kb);
+static int ubi_set_stripe_size(struct ubi_bdev *ubi_bdev, uint32_t stripe_size_kb);
 static void ubi_start_read_metadata(struct ubi_bdev *ubi_bdev,
                                     struct ubi_create_context *context);
+static void ubi_finish_read_metadata_header(struct spdk_bdev_io *bdev_io, bool success,
+                                            void *cb_arg);
 static void ubi_finish_read_metadata(struct spdk_bdev_io *bdev_io, bool success,
                                      void *cb_arg);
+static uint64_t ubi_count_fetched_stripes(struct ubi_bdev *ubi_bdev,
+                                          uint64_t stripe_count);
 static bool ubi_new_disk(const uint8_t *magic);
+static int ubi_alloc_metadata(struct ubi_bdev *ubi_bdev, uint16_t versionMinor,
+                              uint32_t stripe_count);
 static void ubi_init_metadata(struct ubi_bdev *ubi_bdev);
+static int ubi_init_data_layout(struct ubi_bdev *ubi_bdev);
+static void ubi_free_bdev(struct ubi_bdev *ubi_bdev);
 static void ubi_finish_create(int status, struct ubi_create_context *context);
 static void ubi_submit_request(struct spdk_io_channel *ch, struct spdk_bdev_io *bdev_io);
+static bool ubi_image_read_needs_fetch(struct ubi_bdev *ubi_bdev,
+                                       struct spdk_bdev_io *bdev_io);
 static bool ubi_io_type_supported(void *ctx, enum spdk_bdev_io_type io_type);
 static struct spdk_io_channel *ubi_get_io_channel(void *ctx);
 static int configure_base_bdev(const char *name, bool write,
                                struct ubi_base_bdev_info *base_info);
+static int configure_image_bdev(struct ubi_bdev *ubi_bdev, const char *name);
+static void ubi_handle_image_bdev_event(enum spdk_bdev_event_type type,
+                                        struct spdk_bdev *bdev, void *event_ctx);
+static void ubi_close_base_bdevs(struct ubi_bdev *ubi_bdev);
 static void ubi_handle_base_bdev_event(enum spdk_bdev_event_type type,
                                        struct spdk_bdev *bdev, void *event_ctx);
 static bool ubi_bdev_find_by_base_bdev(struct spdk_bdev *base_bdev,
                                        struct ubi_bdev **_ubi_bdev,
                                        struct ubi_base_bdev_info **_base_info);
 static void ubi_handle_base_bdev_remove_event(struct spdk_bdev *base_bdev);
-static void ubi_set_version(struct ubi_metadata *metadata, uint16_t major,
+static void store_littleendian_int(uint32_t n, uint8_t *mem);
+static uint32_t load_littleendian_int(uint8_t *mem);
+static void ubi_set_version(struct ubi_metadata_header *header, uint16_t major,
                             uint16_t minor);
-static void ubi_get_version(struct ubi_metadata *metadata, uint16_t *major,
+static void ubi_get_version(struct ubi_metadata_header *header, uint16_t *major,
                             uint16_t *minor);
 
 /*
@@ -55,6 +78,7 @@ static struct spdk_bdev_module ubi_if = {
     .name = "ubi",
     .module_init = ubi_initialize,
     .module_fini = ubi_finish,
+    .config_json = ubi_config_json,
     .async_fini = false,
     .async_init = false,
     .get_ctx_size = ubi_get_ctx_size,
@@ -71,6 +95,7 @@ static const struct spdk_bdev_fn_table ubi_fn_table = {
     .io_type_supported = ubi_io_type_supported,
     .get_io_channel = ubi_get_io_channel,
     .write_config_json = ubi_write_config_json,
+    .dump_info_json = ubi_dump_info_json,
 };
 
 static TAILQ_HEAD(, ubi_bdev) g_ubi_bdev_head = TAILQ_HEAD_INITIALIZER(g_ubi_bdev_head);
@@ -78,12 +103,37 @@ static TAILQ_HEAD(, ubi_bdev) g_ubi_bdev_head = TAILQ_HEAD_INITIALIZER(g_ubi_bde
 /*
  * ubi_initialize is called when the module is initialized.
  */
-static int ubi_initialize(void) { return 0; }
+static int ubi_initialize(void) {
+    ubi_uring_initialize();
+    return 0;
+}
 
 /*
  * ubi_finish is called when the module is finished.
  */
-static void ubi_finish(void) {}
+static void ubi_finish(void) {
+    ubi_uring_finish();
+    ubi_stripe_cache_finish();
+}
+
+/*
+ * ubi_config_json writes out module-wide config, i.e. the stripe cache size
+ * if it was set.
+ */
+static int ubi_config_json(struct spdk_json_write_ctx *w) {
+    uint64_t size_mb = ubi_stripe_cache_size_mb();
+    if (size_mb == 0) {
+        return 0;
+    }
+
+    spdk_json_write_object_begin(w);
+    spdk_json_write_named_string(w, "method", "bdev_ubi_set_stripe_cache");
+    spdk_json_write_named_object_begin(w, "params");
+    spdk_json_write_named_uint64(w, "size_mb", size_mb);
+    spdk_json_write_object_end(w);
+    spdk_json_write_object_end(w);
+    return 0;
+}
 
 /*
  * ubi_get_ctx_size returns the size of I/O cotnext.
@@ -109,8 +159,7 @@ void bdev_ubi_create(const struct spdk_ubi_bdev_opts *opts,
 
     /*
      * By using calloc() we initialize the memory region to all 0, which also
-     * ensures that metadata, strip_status, and metadata_dirty are all 0
-     * initially.
+     * ensures that pointers to memory allocated later are NULL initially.
      */
     ubi_bdev = g_fail_calloc_ubi_bdev ? NULL : calloc(1, sizeof(struct ubi_bdev));
     if (!ubi_bdev) {
@@ -124,6 +173,9 @@ void bdev_ubi_create(const struct spdk_ubi_bdev_opts *opts,
      * clean it up (on failure) in ubi_finish_create().
      */
     context->ubi_bdev = ubi_bdev;
+    pthread_mutex_init(&ubi_bdev->histograms_lock, NULL);
+    TAILQ_INIT(&ubi_bdev->channels);
+    pthread_mutex_init(&ubi_bdev->channels_lock, NULL);
 
     ubi_bdev->bdev.name = opts->name ? strdup(opts->name) : NULL;
     if (!ubi_bdev->bdev.name) {
@@ -132,6 +184,27 @@ void bdev_ubi_create(const struct spdk_ubi_bdev_opts *opts,
         return;
     }
 
+    if ((opts->image_path == NULL) == (opts->image_bdev_name == NULL)) {
+        UBI_ERRLOG(ubi_bdev, "exactly one of image_path and image_bdev is required\n");
+        ubi_finish_create(-EINVAL, context);
+        return;
+    }
+
+    if (opts->image_offset_blocks != 0 && opts->image_bdev_name == NULL) {
+        UBI_ERRLOG(ubi_bdev, "image_offset_blocks requires image_bdev\n");
+        ubi_finish_create(-EINVAL, context);
+        return;
+    }
+
+    if (opts->image_overlay_count > SPDK_UBI_MAX_IMAGE_OVERLAYS ||
+        (opts->image_overlay_count > 0 && opts->image_path == NULL)) {
+        UBI_ERRLOG(ubi_bdev, "image_path and at most %d image_overlays are required "
+                             "for overlays\n",
+                   SPDK_UBI_MAX_IMAGE_OVERLAYS);
+        ubi_finish_create(-EINVAL, context);
+        return;
+    }
+
     /* Save the thread where the base device is opened. */
     ubi_bdev->thread = spdk_get_thread();
 
@@ -142,12 +215,47 @@ void bdev_ubi_create(const struct spdk_ubi_bdev_opts *opts,
         return;
     }
 
+    ubi_bdev->metadata_info = &ubi_bdev->base_bdev_info;
+    if (opts->metadata_bdev_name) {
+        rc = configure_base_bdev(opts->metadata_bdev_name, true,
+                                 &ubi_bdev->metadata_bdev_info);
+        if (rc) {
+            UBI_ERRLOG(ubi_bdev, "could not get metadata bdev\n");
+            ubi_finish_create(rc, context);
+            return;
+        }
+        ubi_bdev->metadata_info = &ubi_bdev->metadata_bdev_info;
+    }
+
+    if (opts->image_bdev_name) {
+        ubi_bdev->image_offset_blocks = opts->image_offset_blocks;
+        rc = configure_image_bdev(ubi_bdev, opts->image_bdev_name);
+        if (rc) {
+            UBI_ERRLOG(ubi_bdev, "could not get image bdev\n");
+            ubi_finish_create(rc, context);
+            return;
+        }
+    } else {
+        strncpy(ubi_bdev->image_path, opts->image_path, UBI_PATH_LEN);
+        ubi_bdev->image_path[UBI_PATH_LEN - 1] = 0;
+    }
+
+    for (uint32_t i = 0; i < opts->image_overlay_count; i++) {
+        ubi_bdev->overlay_count++;
+        rc = ubi_image_layer_load(opts->image_overlays[i], &ubi_bdev->overlays[i]);
+        if (rc) {
+            UBI_ERRLOG(ubi_bdev, "could not load image overlay %s\n",
+                       opts->image_overlays[i]);
+            ubi_finish_create(rc, context);
+            return;
+        }
+    }
+
     /*
      * Initialize variables that determine the layout of both metadata and
-     * actual data on base bdev.
-     *
-     * TODO: if this is not a new disk, we should read stripe_size_kb from
-     * metadata.
+     * actual data on base bdev. stripe_size_kb is only what the caller asked
+     * for. 0 means to use the one in metadata, or to pick one for a new disk.
+     * It's finalized once metadata has been read.
      */
     ubi_bdev->stripe_size_kb = opts->stripe_size_kb;
     ubi_bdev->no_sync = opts->no_sync;
@@ -155,8 +263,28 @@ void bdev_ubi_create(const struct spdk_ubi_bdev_opts *opts,
     ubi_bdev->copy_on_read = opts->copy_on_read;
     ubi_bdev->directio = opts->directio;
 
-    strncpy(ubi_bdev->image_path, opts->image_path, UBI_PATH_LEN);
-    ubi_bdev->image_path[UBI_PATH_LEN - 1] = 0;
+    ubi_bdev->checkpoint_interval_ms = opts->checkpoint_interval_ms;
+    ubi_bdev->checkpoint_dirty_stripes = opts->checkpoint_dirty_stripes;
+
+    ubi_bdev->uring_sqpoll = opts->uring_sqpoll;
+    ubi_bdev->uring_sqpoll_cpu = opts->uring_sqpoll_cpu;
+    ubi_bdev->uring_iopoll = opts->uring_iopoll;
+    if (ubi_bdev->uring_iopoll && !ubi_bdev->directio) {
+        SPDK_WARNLOG("[%s] uring_iopoll requires directio, ignoring it\n",
+                     ubi_bdev->bdev.name);
+        ubi_bdev->uring_iopoll = false;
+    }
+
+    /* Image bdevs are read through the bdev layer, which has no use for rings. */
+    if (ubi_bdev->image_bdev_info.desc &&
+        (ubi_bdev->uring_sqpoll || ubi_bdev->uring_iopoll)) {
+        SPDK_WARNLOG("[%s] uring options don't apply to image bdevs, ignoring them\n",
+                     ubi_bdev->bdev.name);
+        ubi_bdev->uring_sqpoll = false;
+        ubi_bdev->uring_iopoll = false;
+    }
+
+    ubi_bdev->alignment_bytes = 4096;
 
     rc = ubi_init_layout_params(ubi_bdev);
     if (rc) {
@@ -165,10 +293,12 @@ void bdev_ubi_create(const struct spdk_ubi_bdev_opts *opts,
         return;
     }
 
-    /* Copy some properties from the underlying base bdev. */
+    /*
+     * Copy some properties from the underlying base bdev. blockcnt depends on
+     * metadata size, so it's set once metadata has been read.
+     */
     struct spdk_bdev *base_bdev = ubi_bdev->base_bdev_info.bdev;
     ubi_bdev->bdev.blocklen = base_bdev->blocklen;
-    ubi_bdev->bdev.blockcnt = base_bdev->blockcnt - ubi_bdev->data_offset_blocks;
     ubi_bdev->bdev.write_cache = base_bdev->write_cache;
 
     ubi_bdev->bdev.product_name = "Ubi disk";
@@ -176,10 +306,8 @@ void bdev_ubi_create(const struct spdk_ubi_bdev_opts *opts,
     ubi_bdev->bdev.fn_table = &ubi_fn_table;
     ubi_bdev->bdev.module = &ubi_if;
 
-    ubi_bdev->bdev.optimal_io_boundary = ubi_bdev->stripe_block_count;
     ubi_bdev->bdev.split_on_optimal_io_boundary = true;
 
-    ubi_bdev->alignment_bytes = 4096;
     ubi_bdev->bdev.required_alignment = spdk_u32log2(ubi_bdev->alignment_bytes);
 
     spdk_io_device_register(ubi_bdev, ubi_create_channel_cb, ubi_destroy_channel_cb,
@@ -191,78 +319,225 @@ void bdev_ubi_create(const struct spdk_ubi_bdev_opts *opts,
 }
 
 /*
- * ubi_start_read_metadata initiates reading metadata from base bdev and
- * returns. This doesn't block. Instead ubi_finish_read_metadata is called when
- * reading is done.
+ * ubi_start_read_metadata initiates reading metadata from metadata bdev and
+ * returns. This doesn't block.
+ *
+ * Metadata size depends on its version and on the number of stripes, so
+ * reading is done in two steps. First the page containing the header is read,
+ * and ubi_finish_read_metadata_header is called. It then reads the whole
+ * metadata, after which ubi_finish_read_metadata is called.
  */
 static void ubi_start_read_metadata(struct ubi_bdev *ubi_bdev,
                                     struct ubi_create_context *context) {
-    struct spdk_bdev_desc *base_desc = ubi_bdev->base_bdev_info.desc;
+    struct spdk_bdev_desc *metadata_desc = ubi_bdev->metadata_info->desc;
     context->base_ch = g_fail_create_channel_for_metadata_read
                            ? NULL
-                           : spdk_bdev_get_io_channel(base_desc);
+                           : spdk_bdev_get_io_channel(metadata_desc);
     if (context->base_ch == NULL) {
-        UBI_ERRLOG(ubi_bdev, "could not get io channel for base bdev\n");
+        UBI_ERRLOG(ubi_bdev, "could not get io channel for metadata bdev\n");
+        ubi_finish_create(-ENOMEM, context);
+        return;
+    }
+
+    context->header_buf =
+        spdk_dma_zmalloc(UBI_METADATA_PAGE_SIZE, ubi_bdev->alignment_bytes, NULL);
+    if (context->header_buf == NULL) {
+        UBI_ERRLOG(ubi_bdev, "could not allocate metadata header buffer\n");
         ubi_finish_create(-ENOMEM, context);
         return;
     }
+
     int offset = 0;
-    int block_cnt = UBI_METADATA_SIZE / ubi_bdev->bdev.blocklen;
-    int ret = spdk_bdev_read_blocks(base_desc, context->base_ch, &ubi_bdev->metadata,
-                                    offset, block_cnt, ubi_finish_read_metadata, context);
+    int block_cnt = UBI_METADATA_PAGE_SIZE / ubi_bdev->metadata_info->bdev->blocklen;
+    int ret = spdk_bdev_read_blocks(metadata_desc, context->base_ch, context->header_buf,
+                                    offset, block_cnt, ubi_finish_read_metadata_header,
+                                    context);
     if (ret) {
         ubi_finish_create(ret, context);
     }
 }
 
 /*
- * ubi_finish_read_metadata is called when reading metadata from base bdev
- * finishes.
+ * ubi_finish_read_metadata_header is called when reading the first page of
+ * metadata finishes. For a new disk this initializes metadata, otherwise it
+ * initiates reading the whole metadata.
  */
-static void ubi_finish_read_metadata(struct spdk_bdev_io *bdev_io, bool success,
-                                     void *cb_arg) {
+static void ubi_finish_read_metadata_header(struct spdk_bdev_io *bdev_io, bool success,
+                                            void *cb_arg) {
     struct ubi_create_context *context = cb_arg;
+    struct ubi_bdev *ubi_bdev = context->ubi_bdev;
     spdk_bdev_free_io(bdev_io);
-    spdk_put_io_channel(context->base_ch);
 
     if (!success) {
         ubi_finish_create(-EIO, context);
         return;
     }
 
-    struct ubi_metadata *metadata = &context->ubi_bdev->metadata;
-    if (ubi_new_disk(metadata->magic)) {
-        ubi_init_metadata(context->ubi_bdev);
-        ubi_finish_create(0, context);
+    struct ubi_metadata_header *header = context->header_buf;
+    if (ubi_new_disk(header->magic)) {
+        uint32_t stripe_size_kb = ubi_bdev->stripe_size_kb;
+        if (stripe_size_kb == 0) {
+            stripe_size_kb = ubi_auto_stripe_size_kb(ubi_bdev);
+            SPDK_NOTICELOG("[%s] using stripe size %u KB\n", ubi_bdev->bdev.name,
+                           stripe_size_kb);
+        }
+
+        int rc = ubi_set_stripe_size(ubi_bdev, stripe_size_kb);
+        if (rc) {
+            ubi_finish_create(rc, context);
+            return;
+        }
+
+        uint64_t stripe_count = spdk_divide_round_up(ubi_bdev->image_block_count,
+                                                     ubi_bdev->stripe_block_count);
+        if (stripe_count > UBI_MAX_STRIPES) {
+            UBI_ERRLOG(ubi_bdev, "image has too many stripes (%lu), max is %d\n",
+                       stripe_count, UBI_MAX_STRIPES);
+            ubi_finish_create(-EINVAL, context);
+            return;
+        }
+
+        rc = ubi_alloc_metadata(ubi_bdev, UBI_VERSION_MINOR, stripe_count);
+        if (rc == 0) {
+            ubi_init_metadata(ubi_bdev);
+            rc = ubi_init_data_layout(ubi_bdev);
+        }
+        ubi_finish_create(rc, context);
         return;
-    } else if (memcmp(UBI_MAGIC, metadata->magic, UBI_MAGIC_SIZE)) {
-        UBI_ERRLOG(context->ubi_bdev, "Invalid magic.\n");
+    } else if (memcmp(UBI_MAGIC, header->magic, UBI_MAGIC_SIZE)) {
+        UBI_ERRLOG(ubi_bdev, "Invalid magic.\n");
         ubi_finish_create(-EINVAL, context);
         return;
     }
 
     uint16_t versionMajor, versionMinor;
-    ubi_get_version(metadata, &versionMajor, &versionMinor);
-    if (versionMajor != UBI_VERSION_MAJOR || versionMinor != UBI_VERSION_MINOR) {
-        UBI_ERRLOG(context->ubi_bdev, "Unsupported metadata version: %d.%d", versionMajor,
+    ubi_get_version(header, &versionMajor, &versionMinor);
+    if (versionMajor != UBI_VERSION_MAJOR || versionMinor < 1 ||
+        versionMinor > UBI_VERSION_MINOR) {
+        UBI_ERRLOG(ubi_bdev, "Unsupported metadata version: %d.%d", versionMajor,
                    versionMinor);
         ubi_finish_create(-EINVAL, context);
         return;
     }
 
-    for (int i = 0; i < UBI_MAX_STRIPES; i++) {
-        bool fetched = metadata->stripe_headers[i][0];
-        context->ubi_bdev->stripe_status[i] =
-            fetched ? STRIPE_FETCHED : STRIPE_NOT_FETCHED;
-        if (fetched) {
-            context->ubi_bdev->stripes_fetched++;
-            context->ubi_bdev->stripes_flushed++;
+    /*
+     * Layout of an existing disk always comes from metadata. A stripe size
+     * given by the caller must match it.
+     */
+    int rc = 0;
+    uint32_t stripe_size_kb;
+    uint32_t stripe_count = UBI_V0_1_MAX_STRIPES;
+    if (versionMinor >= 2) {
+        stripe_count = load_littleendian_int(header->stripe_count);
+        if (stripe_count > UBI_MAX_STRIPES) {
+            UBI_ERRLOG(ubi_bdev, "Invalid stripe count in metadata: %u\n", stripe_count);
+            ubi_finish_create(-EINVAL, context);
+            return;
+        }
+
+        stripe_size_kb = load_littleendian_int(header->stripe_size_kb);
+        if (ubi_bdev->stripe_size_kb != 0 && ubi_bdev->stripe_size_kb != stripe_size_kb) {
+            UBI_ERRLOG(ubi_bdev,
+                       "stripe_size_kb (%u) doesn't match stripe size in metadata (%u)\n",
+                       ubi_bdev->stripe_size_kb, stripe_size_kb);
+            rc = -EINVAL;
         }
+    } else {
+        rc = ubi_get_v0_1_stripe_size(ubi_bdev, header->stripe_size_kb_v0_1,
+                                      &stripe_size_kb);
+    }
+
+    if (rc == 0) {
+        rc = ubi_set_stripe_size(ubi_bdev, stripe_size_kb);
+    }
+
+    if (rc == 0) {
+        rc = ubi_alloc_metadata(ubi_bdev, versionMinor, stripe_count);
+    }
+
+    if (rc) {
+        ubi_finish_create(rc, context);
+        return;
+    }
+
+    /*
+     * Reading past the end of a too small metadata bdev fails to submit. Once
+     * metadata is read, ubi_init_data_layout checks the metadata bdev size.
+     */
+    struct spdk_bdev *metadata_bdev = ubi_bdev->metadata_info->bdev;
+    int offset = 0;
+    int block_cnt = ubi_bdev->metadata_size / metadata_bdev->blocklen;
+    int ret = spdk_bdev_read_blocks(ubi_bdev->metadata_info->desc, context->base_ch,
+                                    ubi_bdev->metadata, offset, block_cnt,
+                                    ubi_finish_read_metadata, context);
+    if (ret) {
+        ubi_finish_create(ret, context);
+    }
+}
+
+/*
+ * ubi_finish_read_metadata is called when reading the whole metadata from
+ * metadata bdev finishes.
+ */
+static void ubi_finish_read_metadata(struct spdk_bdev_io *bdev_io, bool success,
+                                     void *cb_arg) {
+    struct ubi_create_context *context = cb_arg;
+    struct ubi_bdev *ubi_bdev = context->ubi_bdev;
+    spdk_bdev_free_io(bdev_io);
+
+    if (!success) {
+        ubi_finish_create(-EIO, context);
+        return;
     }
 
+    int rc = ubi_init_data_layout(ubi_bdev);
+    if (rc) {
+        ubi_finish_create(rc, context);
+        return;
+    }
+
+    /*
+     * stripe_status isn't initialized here. ubi_get_stripe_status falls back
+     * to stripe headers for stripes it hasn't seen change, so we only need to
+     * count fetched stripes, and only image stripes can have been fetched.
+     */
+    uint64_t image_stripes =
+        spdk_divide_round_up(ubi_bdev->image_block_count, ubi_bdev->stripe_block_count);
+    ubi_bdev->stripes_fetched = ubi_count_fetched_stripes(ubi_bdev, image_stripes);
+    ubi_bdev->stripes_flushed = ubi_bdev->stripes_fetched;
+
     ubi_finish_create(0, context);
 }
 
+/*
+ * ubi_count_fetched_stripes counts fetched stripes among the first
+ * "stripe_count" stripes. Most of the stripe table is usually zero, so it's
+ * scanned a word (4 stripe headers) at a time, and only non-zero words are
+ * looked into.
+ */
+static uint64_t ubi_count_fetched_stripes(struct ubi_bdev *ubi_bdev,
+                                          uint64_t stripe_count) {
+    const uint64_t headers_per_word =
+        sizeof(uint64_t) / sizeof(ubi_bdev->stripe_headers[0]);
+    uint64_t count = 0;
+    uint64_t i = 0;
+
+    for (; i + headers_per_word <= stripe_count; i += headers_per_word) {
+        uint64_t word;
+        memcpy(&word, ubi_bdev->stripe_headers[i], sizeof(word));
+        if (word == 0)
+            continue;
+
+        for (uint64_t j = i; j < i + headers_per_word; j++)
+            count += ubi_bdev->stripe_headers[j][0] != 0;
+    }
+
+    for (; i < stripe_count; i++)
+        count += ubi_bdev->stripe_headers[i][0] != 0;
+
+    return count;
+}
+
 static bool ubi_new_disk(const uint8_t *magic) {
     /*
      * Assume a new disk if metadata has been zeroed out.
@@ -273,10 +548,98 @@ static bool ubi_new_disk(const uint8_t *magic) {
     return true;
 }
 
+/*
+ * ubi_alloc_metadata allocates in-memory metadata and per stripe state for
+ * metadata of the given minor version with "stripe_count" stripes.
+ */
+static int ubi_alloc_metadata(struct ubi_bdev *ubi_bdev, uint16_t versionMinor,
+                              uint32_t stripe_count) {
+    uint64_t header_size = UBI_HEADER_SIZE;
+    ubi_bdev->metadata_size = SPDK_ALIGN_CEIL(header_size + 2ULL * stripe_count,
+                                              (uint64_t)UBI_METADATA_PAGE_SIZE);
+    if (versionMinor == 1) {
+        header_size = UBI_V0_1_HEADER_SIZE;
+        ubi_bdev->metadata_size = UBI_V0_1_METADATA_SIZE;
+    }
+
+    ubi_bdev->stripe_count = stripe_count;
+    ubi_bdev->metadata_pages = ubi_bdev->metadata_size / UBI_METADATA_PAGE_SIZE;
+
+    ubi_bdev->metadata =
+        spdk_dma_zmalloc(ubi_bdev->metadata_size, ubi_bdev->alignment_bytes, NULL);
+    ubi_bdev->stripe_status =
+        calloc(spdk_max(stripe_count, 1), sizeof(enum stripe_status));
+    ubi_bdev->metadata_dirty_pages =
+        calloc(spdk_divide_round_up(ubi_bdev->metadata_pages, 64), sizeof(uint64_t));
+    if (!ubi_bdev->metadata || !ubi_bdev->stripe_status ||
+        !ubi_bdev->metadata_dirty_pages) {
+        UBI_ERRLOG(ubi_bdev, "could not allocate metadata for %u stripes\n",
+                   stripe_count);
+        return -ENOMEM;
+    }
+
+    ubi_bdev->stripe_headers =
+        (uint8_t(*)[2])((uint8_t *)ubi_bdev->metadata + header_size);
+    return 0;
+}
+
 static void ubi_init_metadata(struct ubi_bdev *ubi_bdev) {
-    memcpy(ubi_bdev->metadata.magic, UBI_MAGIC, UBI_MAGIC_SIZE);
-    ubi_set_version(&ubi_bdev->metadata, UBI_VERSION_MAJOR, UBI_VERSION_MINOR);
-    ubi_bdev->metadata.stripe_size_kb = ubi_bdev->stripe_size_kb;
+    struct ubi_metadata_header *header = ubi_bdev->metadata;
+    memcpy(header->magic, UBI_MAGIC, UBI_MAGIC_SIZE);
+    ubi_set_version(header, UBI_VERSION_MAJOR, UBI_VERSION_MINOR);
+    store_littleendian_int(ubi_bdev->stripe_size_kb, header->stripe_size_kb);
+    store_littleendian_int(ubi_bdev->stripe_count, header->stripe_count);
+    ubi_mark_metadata_dirty(ubi_bdev, header);
+}
+
+/*
+ * ubi_init_data_layout initializes variables related to where block data is
+ * layed out on base bdev. This depends on metadata, so it's called after
+ * metadata has been read or initialized.
+ */
+static int ubi_init_data_layout(struct ubi_bdev *ubi_bdev) {
+    struct spdk_bdev *base_bdev = ubi_bdev->base_bdev_info.bdev;
+    uint32_t blocklen = base_bdev->blocklen;
+
+    uint64_t image_stripes =
+        spdk_divide_round_up(ubi_bdev->image_block_count, ubi_bdev->stripe_block_count);
+    if (image_stripes > ubi_bdev->stripe_count) {
+        UBI_ERRLOG(ubi_bdev, "image has more stripes (%lu) than metadata (%u)\n",
+                   image_stripes, ubi_bdev->stripe_count);
+        return -EINVAL;
+    }
+
+    struct spdk_bdev *metadata_bdev = ubi_bdev->metadata_info->bdev;
+    if (ubi_bdev->metadata_size > metadata_bdev->blockcnt * metadata_bdev->blocklen) {
+        UBI_ERRLOG(ubi_bdev, "metadata block device is smaller than metadata size\n");
+        return -EINVAL;
+    }
+
+    uint64_t data_offset = 0;
+    if (ubi_bdev->metadata_info == &ubi_bdev->base_bdev_info) {
+        data_offset =
+            SPDK_ALIGN_CEIL(ubi_bdev->metadata_size, (uint64_t)UBI_DATA_ALIGNMENT);
+        if (data_offset % blocklen) {
+            UBI_ERRLOG(ubi_bdev,
+                       "data offset (%lu) must be a multiple of blocklen (%d)\n",
+                       data_offset, blocklen);
+            return -EINVAL;
+        }
+    }
+
+    /* If the image is stored on base bdev, data must end where it starts. */
+    uint64_t data_end_blocks =
+        ubi_bdev->image_on_base ? ubi_bdev->image_offset_blocks : base_bdev->blockcnt;
+
+    uint64_t image_size = ubi_bdev->image_block_count * blocklen;
+    if (data_end_blocks * blocklen < image_size + data_offset) {
+        UBI_ERRLOG(ubi_bdev, "base block device is smaller than image + metadata size\n");
+        return -EINVAL;
+    }
+
+    ubi_bdev->data_offset_blocks = data_offset / blocklen;
+    ubi_bdev->bdev.blockcnt = data_end_blocks - ubi_bdev->data_offset_blocks;
+    return 0;
 }
 
 /*
@@ -286,27 +649,40 @@ static void ubi_init_metadata(struct ubi_bdev *ubi_bdev) {
 static void ubi_finish_create(int status, struct ubi_create_context *context) {
     struct ubi_bdev *ubi_bdev = context->ubi_bdev;
 
+    if (context->base_ch) {
+        spdk_put_io_channel(context->base_ch);
+        context->base_ch = NULL;
+    }
+    spdk_dma_free(context->header_buf);
+
+    if (status == 0) {
+        uint32_t stripe_size = ubi_bdev->stripe_size_kb * 1024;
+        ubi_bdev->cache_image_id =
+            ubi_stripe_cache_image_id(&ubi_bdev->cache_key, stripe_size);
+        status = ubi_start_metadata_writer(ubi_bdev);
+        if (status != 0) {
+            UBI_ERRLOG(ubi_bdev, "could not start metadata writer\n");
+        }
+    }
+
     if (status == 0) {
         status = spdk_bdev_register(&ubi_bdev->bdev);
         if (status != 0) {
             UBI_ERRLOG(ubi_bdev, "could not register ubi_bdev\n");
+            ubi_stop_metadata_writer(ubi_bdev, NULL);
         } else {
             TAILQ_INSERT_TAIL(&g_ubi_bdev_head, ubi_bdev, tailq);
         }
     }
 
     if (status != 0 && ubi_bdev) {
-        if (ubi_bdev->base_bdev_info.desc) {
-            spdk_bdev_module_release_bdev(ubi_bdev->base_bdev_info.bdev);
-            spdk_bdev_close(ubi_bdev->base_bdev_info.desc);
-        }
+        ubi_close_base_bdevs(ubi_bdev);
 
         if (context->registered_io_device) {
             spdk_io_device_unregister(ubi_bdev, NULL);
         }
 
-        free(ubi_bdev->bdev.name);
-        free(ubi_bdev);
+        ubi_free_bdev(ubi_bdev);
     }
 
     context->done_fn(context->done_arg, &ubi_bdev->bdev, status);
@@ -314,40 +690,122 @@ static void ubi_finish_create(int status, struct ubi_create_context *context) {
 }
 
 /*
- * ubi_init_layout_params initializes variables related to layout of metadata
- * and block data are layed out on base bdev.
+ * ubi_init_layout_params initializes variables related to the stripe layout
+ * of the image. See ubi_init_data_layout for where block data is layed out on
+ * base bdev.
  */
 static int ubi_init_layout_params(struct ubi_bdev *ubi_bdev) {
-    // ensure base image exists, and get its size
-    struct stat statBuffer;
-    int statResult = stat(ubi_bdev->image_path, &statBuffer);
-    if (statResult < 0) {
-        UBI_ERRLOG(ubi_bdev, "getting stats for %s failed: %s\n", ubi_bdev->image_path,
-                   strerror(errno));
-        return -EINVAL;
+    uint64_t image_size;
+    struct spdk_bdev *image_bdev = ubi_bdev->image_bdev_info.bdev;
+    if (image_bdev) {
+        if (ubi_bdev->image_offset_blocks >= image_bdev->blockcnt) {
+            UBI_ERRLOG(ubi_bdev, "image offset is beyond the end of image bdev\n");
+            return -EINVAL;
+        }
+        image_size =
+            (image_bdev->blockcnt - ubi_bdev->image_offset_blocks) * image_bdev->blocklen;
+    } else {
+        // ensure base image exists, and get its size
+        struct stat statBuffer;
+        int statResult = stat(ubi_bdev->image_path, &statBuffer);
+        if (statResult < 0) {
+            UBI_ERRLOG(ubi_bdev, "getting stats for %s failed: %s\n",
+                       ubi_bdev->image_path, strerror(errno));
+            return -EINVAL;
+        }
+
+        int rc = ubi_qcow2_load(ubi_bdev->image_path, false, &ubi_bdev->qcow2);
+        if (rc) {
+            UBI_ERRLOG(ubi_bdev, "could not load qcow2 image %s\n", ubi_bdev->image_path);
+            return rc;
+        }
+
+        if (ubi_bdev->qcow2 == NULL) {
+            rc = ubi_zstd_load(ubi_bdev->image_path, &ubi_bdev->zstd);
+            if (rc) {
+                UBI_ERRLOG(ubi_bdev, "could not load zstd image %s\n",
+                           ubi_bdev->image_path);
+                return rc;
+            }
+        }
+
+        if (ubi_bdev->zstd && ubi_bdev->overlay_count > 0) {
+            UBI_ERRLOG(ubi_bdev, "zstd images can't have overlays\n");
+            return -ENOTSUP;
+        }
+
+        ubi_stripe_cache_init_key(ubi_bdev, &ubi_bdev->cache_key);
+
+        if (ubi_bdev->qcow2) {
+            image_size = ubi_bdev->qcow2->size;
+        } else if (ubi_bdev->zstd) {
+            image_size = ubi_bdev->zstd->size;
+        } else {
+            image_size = statBuffer.st_size;
+        }
     }
 
     uint32_t blocklen = ubi_bdev->base_bdev_info.bdev->blocklen;
     uint64_t blockcnt = ubi_bdev->base_bdev_info.bdev->blockcnt;
+    uint32_t metadata_blocklen = ubi_bdev->metadata_info->bdev->blocklen;
+    uint64_t metadata_blockcnt = ubi_bdev->metadata_info->bdev->blockcnt;
 
-    if (blockcnt * blocklen < (uint64_t)statBuffer.st_size + UBI_METADATA_SIZE) {
-        UBI_ERRLOG(ubi_bdev, "base block device is smaller than image + metadata size\n");
+    /* Reads of image bdevs must be aligned to their blocks. */
+    if (image_bdev && blocklen % image_bdev->blocklen != 0) {
+        UBI_ERRLOG(ubi_bdev, "image bdev block size %u doesn't divide block size %u\n",
+                   image_bdev->blocklen, blocklen);
         return -EINVAL;
     }
 
-    if (ubi_bdev->stripe_size_kb < UBI_STRIPE_SIZE_MIN ||
-        ubi_bdev->stripe_size_kb > UBI_STRIPE_SIZE_MAX) {
+    /*
+     * Metadata size is only known once it has been read, so this only checks
+     * the minimum sizes here. ubi_init_data_layout checks the rest.
+     */
+    if (blockcnt * blocklen < image_size) {
+        UBI_ERRLOG(ubi_bdev, "base block device is smaller than image size\n");
+        return -EINVAL;
+    }
+
+    if (metadata_blockcnt * metadata_blocklen < UBI_METADATA_PAGE_SIZE) {
+        UBI_ERRLOG(ubi_bdev, "metadata block device is smaller than a metadata page\n");
+        return -EINVAL;
+    }
+
+    /* Fail early for invalid input. Stripe size is set once metadata is read. */
+    if (ubi_bdev->stripe_size_kb != 0) {
+        int rc = ubi_validate_stripe_size(ubi_bdev, ubi_bdev->stripe_size_kb);
+        if (rc) {
+            return rc;
+        }
+    }
+
+    if (UBI_METADATA_PAGE_SIZE % metadata_blocklen) {
+        UBI_ERRLOG(ubi_bdev,
+                   "metadata page size (%d) must be a multiple of blocklen (%d)\n",
+                   UBI_METADATA_PAGE_SIZE, metadata_blocklen);
+        return -EINVAL;
+    }
+
+    ubi_bdev->image_block_count = (image_size + blocklen - 1) / blocklen;
+
+    return 0;
+}
+
+static int ubi_validate_stripe_size(struct ubi_bdev *ubi_bdev, uint32_t stripe_size_kb) {
+    uint32_t blocklen = ubi_bdev->base_bdev_info.bdev->blocklen;
+
+    if (stripe_size_kb < UBI_STRIPE_SIZE_MIN || stripe_size_kb > UBI_STRIPE_SIZE_MAX) {
         UBI_ERRLOG(ubi_bdev, "stripe_size_kb must be between %d and %d (inclusive)\n",
                    UBI_STRIPE_SIZE_MIN, UBI_STRIPE_SIZE_MAX);
         return -EINVAL;
     }
 
-    if (ubi_bdev->stripe_size_kb & (ubi_bdev->stripe_size_kb - 1)) {
+    if (stripe_size_kb & (stripe_size_kb - 1)) {
         UBI_ERRLOG(ubi_bdev, "stripe_size_kb must be a power of 2\n");
         return -EINVAL;
     }
 
-    uint32_t stripSizeBytes = ubi_bdev->stripe_size_kb * 1024;
+    uint32_t stripSizeBytes = stripe_size_kb * 1024;
     if (stripSizeBytes < blocklen) {
         UBI_ERRLOG(ubi_bdev,
                    "stripe size (%u bytes) can't be less than base bdev's "
@@ -356,23 +814,106 @@ static int ubi_init_layout_params(struct ubi_bdev *ubi_bdev) {
         return -EINVAL;
     }
 
-    if (UBI_METADATA_SIZE % blocklen) {
-        UBI_ERRLOG(ubi_bdev, "metadata size (%d) must be a multiple of blocklen (%d)\n",
-                   UBI_METADATA_SIZE, blocklen);
+    /* Each stripe of a zstd image is decompressed from whole frames. */
+    if (ubi_bdev->zstd && stripSizeBytes % ubi_bdev->zstd->frame_size != 0) {
+        UBI_ERRLOG(ubi_bdev,
+                   "stripe size (%u bytes) must be a multiple of zstd frame size "
+                   "(%u bytes)\n",
+                   stripSizeBytes, ubi_bdev->zstd->frame_size);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/*
+ * ubi_auto_stripe_size_kb picks a stripe size for a new disk. Smaller stripes
+ * make the first access to a stripe faster, while larger stripes need less
+ * metadata. So this starts at DEFAULT_STRIPE_SIZE_KB, goes down to
+ * UBI_AUTO_STRIPE_SIZE_MIN for small images, and goes up for large images to
+ * keep metadata within UBI_AUTO_MAX_STRIPES stripe headers.
+ *
+ * Stripe size is also kept at least as large as base bdev's optimal I/O
+ * boundary and write unit, so that stripe writes aren't split by base bdev.
+ */
+static uint32_t ubi_auto_stripe_size_kb(struct ubi_bdev *ubi_bdev) {
+    struct spdk_bdev *base_bdev = ubi_bdev->base_bdev_info.bdev;
+    uint64_t image_size = ubi_bdev->image_block_count * base_bdev->blocklen;
+    uint32_t stripe_size_kb = DEFAULT_STRIPE_SIZE_KB;
+
+    while (stripe_size_kb > UBI_AUTO_STRIPE_SIZE_MIN &&
+           image_size / (stripe_size_kb * 1024ULL) < UBI_AUTO_MIN_STRIPES) {
+        stripe_size_kb /= 2;
+    }
+
+    while (stripe_size_kb < UBI_STRIPE_SIZE_MAX &&
+           spdk_divide_round_up(image_size, stripe_size_kb * 1024ULL) >
+               UBI_AUTO_MAX_STRIPES) {
+        stripe_size_kb *= 2;
+    }
+
+    uint64_t boundary_blocks = spdk_max(spdk_bdev_get_optimal_io_boundary(base_bdev),
+                                        spdk_bdev_get_write_unit_size(base_bdev));
+    uint64_t min_bytes = spdk_max(boundary_blocks, 1) * base_bdev->blocklen;
+    if (ubi_bdev->zstd) {
+        min_bytes = spdk_max(min_bytes, ubi_bdev->zstd->frame_size);
+    }
+    while (stripe_size_kb < UBI_STRIPE_SIZE_MAX && stripe_size_kb * 1024ULL < min_bytes) {
+        stripe_size_kb *= 2;
+    }
+
+    return stripe_size_kb;
+}
+
+/*
+ * Metadata v0.1 only stores the low 8 bits of stripe_size_kb, so stripe sizes
+ * of 256, 512 and 1024 can't be told apart. The caller has to provide
+ * stripe_size_kb to open such disks.
+ */
+static int ubi_get_v0_1_stripe_size(struct ubi_bdev *ubi_bdev, uint8_t stored,
+                                    uint32_t *stripe_size_kb) {
+    uint32_t requested = ubi_bdev->stripe_size_kb;
+
+    if (requested == 0 && stored == 0) {
+        UBI_ERRLOG(ubi_bdev, "stripe_size_kb is required to open v0.1 metadata with "
+                             "stripes larger than 128 KB\n");
+        return -EINVAL;
+    }
+
+    if (requested != 0 && ((requested & 0xff) != stored || requested > 1024)) {
+        UBI_ERRLOG(ubi_bdev, "stripe_size_kb (%u) doesn't match v0.1 metadata (%u)\n",
+                   requested, stored);
         return -EINVAL;
     }
 
-    uint32_t r = (stripSizeBytes + blocklen - 1) / blocklen;
+    *stripe_size_kb = requested ? requested : stored;
+    return 0;
+}
+
+/*
+ * ubi_set_stripe_size sets the stripe size and variables derived from it.
+ */
+static int ubi_set_stripe_size(struct ubi_bdev *ubi_bdev, uint32_t stripe_size_kb) {
+    int rc = ubi_validate_stripe_size(ubi_bdev, stripe_size_kb);
+    if (rc) {
+        return rc;
+    }
+
+    uint32_t blocklen = ubi_bdev->base_bdev_info.bdev->blocklen;
+    uint32_t r = (stripe_size_kb * 1024 + blocklen - 1) / blocklen;
     int log2_r = 0;
     while (r > 1) {
         r /= 2;
         log2_r++;
     }
 
+    ubi_bdev->stripe_size_kb = stripe_size_kb;
     ubi_bdev->stripe_block_count = (1 << log2_r);
     ubi_bdev->stripe_shift = log2_r;
-    ubi_bdev->data_offset_blocks = UBI_METADATA_SIZE / blocklen;
-    ubi_bdev->image_block_count = (statBuffer.st_size + blocklen - 1) / blocklen;
+    ubi_bdev->bdev.optimal_io_boundary = ubi_bdev->stripe_block_count;
+    if (ubi_bdev->zstd) {
+        ubi_zstd_set_stripe_size(ubi_bdev->zstd, stripe_size_kb * 1024);
+    }
 
     return 0;
 }
@@ -389,47 +930,123 @@ void bdev_ubi_delete(const char *bdev_name, spdk_delete_ubi_complete cb_fn,
     }
 }
 
+/*
+ * ubi_bdev_get_by_name returns the ubi_bdev with the given name, or NULL if
+ * there's no such bdev or it isn't a ubi bdev.
+ */
+struct ubi_bdev *ubi_bdev_get_by_name(const char *bdev_name) {
+    struct spdk_bdev *bdev = spdk_bdev_get_by_name(bdev_name);
+    if (bdev == NULL || bdev->module != &ubi_if) {
+        return NULL;
+    }
+
+    return bdev->ctxt;
+}
+
 /* Callback for unregistering the IO device. */
 static void _device_unregister_cb(void *io_device) {
     struct ubi_bdev *ubi_bdev = io_device;
 
     /* Done with this ubi_bdev. */
+    ubi_free_bdev(ubi_bdev);
+}
+
+/*
+ * ubi_free_bdev frees memory owned by the given ubi_bdev, and the ubi_bdev
+ * itself.
+ */
+static void ubi_free_bdev(struct ubi_bdev *ubi_bdev) {
+    spdk_dma_free(ubi_bdev->metadata);
+    free(ubi_bdev->stripe_status);
+    free(ubi_bdev->metadata_dirty_pages);
+    ubi_qcow2_free(ubi_bdev->qcow2);
+    ubi_zstd_free(ubi_bdev->zstd);
+    for (uint32_t i = 0; i < ubi_bdev->overlay_count; i++) {
+        ubi_image_layer_free(&ubi_bdev->overlays[i]);
+    }
+    ubi_free_closed_channel_histograms(ubi_bdev);
+    pthread_mutex_destroy(&ubi_bdev->histograms_lock);
+    pthread_mutex_destroy(&ubi_bdev->channels_lock);
     free(ubi_bdev->bdev.name);
     free(ubi_bdev);
 }
 
 /*
  * ubi_destruct. Given a pointer to a ubi_bdev, destruct it.
+ *
+ * Destruction is asynchronous, since an in-progress metadata commit needs
+ * to finish before the base bdev can be closed. ubi_finish_destruct() reports
+ * completion to the bdev layer.
  */
 static int ubi_destruct(void *ctx) {
     struct ubi_bdev *ubi_bdev = ctx;
 
     TAILQ_REMOVE(&g_ubi_bdev_head, ubi_bdev, tailq);
 
-    /* Unclaim the underlying bdev. */
-    spdk_bdev_module_release_bdev(ubi_bdev->base_bdev_info.bdev);
-
-    /* Close the underlying bdev in the same thread it was opened. */
+    /*
+     * Stop the metadata writer and close the base bdev in the thread it was
+     * opened.
+     */
     if (ubi_bdev->thread && ubi_bdev->thread != spdk_get_thread()) {
-        spdk_thread_send_msg(ubi_bdev->thread, ubi_close_base_bdev,
-                             ubi_bdev->base_bdev_info.desc);
+        spdk_thread_send_msg(ubi_bdev->thread, ubi_destruct_on_bdev_thread, ubi_bdev);
     } else {
-        ubi_close_base_bdev(ubi_bdev->base_bdev_info.desc);
+        ubi_destruct_on_bdev_thread(ubi_bdev);
     }
 
+    return 1;
+}
+
+static void ubi_destruct_on_bdev_thread(void *ctx) {
+    struct ubi_bdev *ubi_bdev = ctx;
+
+    ubi_stop_metadata_writer(ubi_bdev, ubi_finish_destruct);
+}
+
+/*
+ * ubi_finish_destruct is called once there are no more metadata I/O in flight
+ * for the given ubi_bdev.
+ */
+static void ubi_finish_destruct(struct ubi_bdev *ubi_bdev) {
+    /* Unclaim and close the underlying bdevs. */
+    ubi_close_base_bdevs(ubi_bdev);
+
+    spdk_bdev_destruct_done(&ubi_bdev->bdev, 0);
+
     /* Unregister the io_device. */
     spdk_io_device_unregister(ubi_bdev, _device_unregister_cb);
-
-    return 0;
 }
 
 /*
- * ubi_close_base_bdev closes bdev given as context.
+ * ubi_write_image_source_json writes out where the image is read from.
  */
-static void ubi_close_base_bdev(void *ctx) {
-    struct spdk_bdev_desc *desc = ctx;
+static void ubi_write_image_source_json(struct ubi_bdev *ubi_bdev,
+                                        struct spdk_json_write_ctx *w) {
+    if (ubi_bdev->image_bdev_info.bdev) {
+        spdk_json_write_named_string(w, "image_bdev",
+                                     ubi_bdev->image_bdev_info.bdev->name);
+        if (ubi_bdev->image_offset_blocks != 0) {
+            spdk_json_write_named_uint64(w, "image_offset_blocks",
+                                         ubi_bdev->image_offset_blocks);
+        }
+    } else {
+        spdk_json_write_named_string(w, "image_path", ubi_bdev->image_path);
+    }
 
-    spdk_bdev_close(desc);
+    if (ubi_bdev->overlay_count > 0) {
+        spdk_json_write_named_array_begin(w, "image_overlays");
+        for (uint32_t i = 0; i < ubi_bdev->overlay_count; i++) {
+            spdk_json_write_string(w, ubi_bdev->overlays[i].path);
+        }
+        spdk_json_write_array_end(w);
+    }
+}
+
+static const char *ubi_image_format(struct ubi_bdev *ubi_bdev) {
+    if (ubi_bdev->qcow2) {
+        return "qcow2";
+    }
+
+    return ubi_bdev->zstd ? "zstd" : "raw";
 }
 
 /*
@@ -446,16 +1063,105 @@ void ubi_write_config_json(struct spdk_bdev *bdev, struct spdk_json_write_ctx *w
     spdk_json_write_named_object_begin(w, "params");
     spdk_json_write_named_string(w, "name", bdev->name);
     spdk_json_write_named_string(w, "base_bdev", ubi_bdev->base_bdev_info.bdev->name);
-    spdk_json_write_named_string(w, "image_path", ubi_bdev->image_path);
+    if (ubi_bdev->metadata_info != &ubi_bdev->base_bdev_info) {
+        spdk_json_write_named_string(w, "metadata_bdev",
+                                     ubi_bdev->metadata_info->bdev->name);
+    }
+    ubi_write_image_source_json(ubi_bdev, w);
     spdk_json_write_named_uint32(w, "stripe_size_kb", ubi_bdev->stripe_size_kb);
     spdk_json_write_named_bool(w, "copy_on_read", ubi_bdev->copy_on_read);
     spdk_json_write_named_bool(w, "directio", ubi_bdev->directio);
     spdk_json_write_named_bool(w, "no_sync", ubi_bdev->no_sync);
+    spdk_json_write_named_uint32(w, "checkpoint_interval_ms",
+                                 ubi_bdev->checkpoint_interval_ms);
+    spdk_json_write_named_uint32(w, "checkpoint_dirty_stripes",
+                                 ubi_bdev->checkpoint_dirty_stripes);
+    spdk_json_write_named_bool(w, "uring_sqpoll", ubi_bdev->uring_sqpoll);
+    if (ubi_bdev->uring_sqpoll) {
+        spdk_json_write_named_int32(w, "uring_sqpoll_cpu", ubi_bdev->uring_sqpoll_cpu);
+    }
+    spdk_json_write_named_bool(w, "uring_iopoll", ubi_bdev->uring_iopoll);
     spdk_json_write_object_end(w);
 
     spdk_json_write_object_end(w);
 }
 
+/*
+ * ubi_dump_info_json writes out runtime state of the given bdev, which is
+ * shown by bdev_get_bdevs. It's called synchronously from any thread, so it
+ * only reports state which is either constant or updated atomically.
+ */
+int ubi_dump_info_json(void *ctx, struct spdk_json_write_ctx *w) {
+    struct ubi_bdev *ubi_bdev = ctx;
+
+    uint64_t image_stripes =
+        spdk_divide_round_up(ubi_bdev->image_block_count, ubi_bdev->stripe_block_count);
+    uint64_t fetched = __atomic_load_n(&ubi_bdev->stripes_fetched, __ATOMIC_ACQUIRE);
+    uint64_t flushed = __atomic_load_n(&ubi_bdev->stripes_flushed, __ATOMIC_ACQUIRE);
+    double hydration_percent = 100.0;
+    if (image_stripes > 0) {
+        hydration_percent = 100.0 * fetched / image_stripes;
+    }
+
+    uint16_t version_major, version_minor;
+    ubi_get_version(ubi_bdev->metadata, &version_major, &version_minor);
+
+    spdk_json_write_named_object_begin(w, "ubi");
+    spdk_json_write_named_string(w, "base_bdev", ubi_bdev->base_bdev_info.bdev->name);
+    ubi_write_image_source_json(ubi_bdev, w);
+    spdk_json_write_named_string(w, "image_format", ubi_image_format(ubi_bdev));
+    spdk_json_write_named_uint64(w, "image_size",
+                                 ubi_bdev->image_block_count * ubi_bdev->bdev.blocklen);
+    spdk_json_write_named_bool(w, "image_copy_offload", ubi_bdev->image_copy_offload);
+    spdk_json_write_named_uint32(w, "stripe_size_kb", ubi_bdev->stripe_size_kb);
+    spdk_json_write_named_uint64(w, "image_stripes", image_stripes);
+
+    spdk_json_write_named_object_begin(w, "hydration");
+    spdk_json_write_named_uint64(w, "stripes_fetched", fetched);
+    spdk_json_write_named_uint64(w, "stripes_flushed", flushed);
+    spdk_json_write_named_double(w, "percent", hydration_percent);
+    /*
+     * Once complete, the image file isn't read anymore. Once also persisted,
+     * that survives a crash.
+     */
+    spdk_json_write_named_bool(w, "complete", fetched >= image_stripes);
+    spdk_json_write_named_bool(w, "persisted", flushed >= image_stripes);
+    spdk_json_write_named_uint64(
+        w, "stripe_fetches_queued",
+        __atomic_load_n(&ubi_bdev->stripe_fetches_queued, __ATOMIC_RELAXED));
+    spdk_json_write_named_uint64(
+        w, "stripe_fetches_active",
+        __atomic_load_n(&ubi_bdev->stripe_fetches_active, __ATOMIC_RELAXED));
+    spdk_json_write_object_end(w);
+
+    spdk_json_write_named_object_begin(w, "modes");
+    spdk_json_write_named_bool(w, "copy_on_read", ubi_bdev->copy_on_read);
+    spdk_json_write_named_bool(w, "directio", ubi_bdev->directio);
+    spdk_json_write_named_bool(w, "no_sync", ubi_bdev->no_sync);
+    spdk_json_write_named_bool(w, "uring_sqpoll", ubi_bdev->uring_sqpoll);
+    spdk_json_write_named_bool(w, "uring_iopoll", ubi_bdev->uring_iopoll);
+    spdk_json_write_named_bool(w, "interrupt_mode", spdk_interrupt_mode_is_enabled());
+    spdk_json_write_named_bool(w, "histograms", ubi_bdev->histograms_enabled);
+    spdk_json_write_object_end(w);
+
+    spdk_json_write_named_object_begin(w, "metadata");
+    spdk_json_write_named_string_fmt(w, "version", "%u.%u", version_major,
+                                     version_minor);
+    spdk_json_write_named_string(w, "bdev", ubi_bdev->metadata_info->bdev->name);
+    spdk_json_write_named_bool(w, "on_base_bdev",
+                               ubi_bdev->metadata_info == &ubi_bdev->base_bdev_info);
+    /* Metadata is always at the start of its bdev. */
+    spdk_json_write_named_uint64(w, "offset", 0);
+    spdk_json_write_named_uint64(w, "size", ubi_bdev->metadata_size);
+    spdk_json_write_named_uint64(w, "data_offset",
+                                 (uint64_t)ubi_bdev->data_offset_blocks *
+                                     ubi_bdev->bdev.blocklen);
+    spdk_json_write_object_end(w);
+
+    spdk_json_write_object_end(w);
+    return 0;
+}
+
 /*
  * ubi_io_type_supported determines which I/O operations are supported.
  */
@@ -494,6 +1200,33 @@ static bool ubi_io_type_supported(void *ctx, enum spdk_bdev_io_type io_type) {
     }
 }
 
+/*
+ * ubi_image_read_needs_fetch returns whether a read of the image can't be
+ * served with a single image read, because it's compressed, it has overlays,
+ * or its qcow2 clusters aren't contiguous in the image file. Its stripe is
+ * fetched then, as with copy_on_read.
+ */
+static bool ubi_image_read_needs_fetch(struct ubi_bdev *ubi_bdev,
+                                       struct spdk_bdev_io *bdev_io) {
+    if (bdev_io->u.bdev.offset_blocks >= ubi_bdev->image_block_count) {
+        return false;
+    }
+
+    if (ubi_bdev->zstd || ubi_bdev->overlay_count > 0) {
+        return true;
+    }
+
+    if (ubi_bdev->qcow2 == NULL) {
+        return false;
+    }
+
+    uint64_t offset = bdev_io->u.bdev.offset_blocks * ubi_bdev->bdev.blocklen;
+    uint64_t nbytes = bdev_io->u.bdev.num_blocks * ubi_bdev->bdev.blocklen;
+    uint64_t len = nbytes;
+    ubi_qcow2_map(ubi_bdev->qcow2, offset, &len);
+    return len < nbytes;
+}
+
 /*
  * ubi_submit_request is called when an I/O request arrives. It will enqueue
  * an stripe fetch if necessary, and then enqueue the I/O request so it is
@@ -505,7 +1238,8 @@ static void ubi_submit_request(struct spdk_io_channel *_ch,
     struct ubi_bdev *ubi_bdev = bdev_io->bdev->ctxt;
 
     if (bdev_io->type == SPDK_BDEV_IO_TYPE_WRITE ||
-        (bdev_io->type == SPDK_BDEV_IO_TYPE_READ && ubi_bdev->copy_on_read)) {
+        (bdev_io->type == SPDK_BDEV_IO_TYPE_READ &&
+         (ubi_bdev->copy_on_read || ubi_image_read_needs_fetch(ubi_bdev, bdev_io)))) {
 
         uint64_t start_block = bdev_io->u.bdev.offset_blocks;
         uint64_t num_blocks = bdev_io->u.bdev.num_blocks;
@@ -527,10 +1261,30 @@ static void ubi_submit_request(struct spdk_io_channel *_ch,
             ubi_get_stripe_status(ubi_bdev, start_stripe) == STRIPE_NOT_FETCHED) {
             enqueue_stripe(ch, start_stripe);
             ubi_set_stripe_status(ubi_bdev, start_stripe, STRIPE_INFLIGHT);
+            __atomic_fetch_add(&ubi_bdev->stripe_fetches_queued, 1, __ATOMIC_RELAXED);
+            spdk_trace_record(TRACE_UBI_FETCH_ENQUEUE, 0, 0, start_stripe,
+                              (uint64_t)(uintptr_t)bdev_io);
         }
     }
 
+    uint64_t start_block = bdev_io->u.bdev.offset_blocks;
+    uint64_t stripe = start_block >> ubi_bdev->stripe_shift;
+    spdk_trace_record(TRACE_UBI_IO_SUBMIT, 0, 0, (uintptr_t)bdev_io,
+                      (uint64_t)bdev_io->type, start_block, bdev_io->u.bdev.num_blocks,
+                      stripe);
+
+    /* I/O within a stripe being fetched waits in the queue until it's done. */
+    if (bdev_io->type != SPDK_BDEV_IO_TYPE_FLUSH &&
+        start_block < ubi_bdev->image_block_count &&
+        ubi_get_stripe_status(ubi_bdev, stripe) == STRIPE_INFLIGHT) {
+        ch->stats.ios_blocked_on_fetch++;
+    }
+
+    struct ubi_bdev_io *ubi_io = (struct ubi_bdev_io *)bdev_io->driver_ctx;
+    ubi_io->submit_tsc = ubi_histogram_start(ch);
+
     TAILQ_INSERT_TAIL(&ch->io, bdev_io, module_link);
+    ubi_kick_channel(ch);
 }
 
 /*
@@ -577,6 +1331,71 @@ static int configure_base_bdev(const char *name, bool write,
     return 0;
 }
 
+/*
+ * configure_image_bdev opens the image bdev read-only. Its claim allows any
+ * number of readers and no writers, so several ubi bdevs can share an image,
+ * while the image can't change under them.
+ */
+static int configure_image_bdev(struct ubi_bdev *ubi_bdev, const char *name) {
+    struct spdk_bdev_desc *desc;
+    int rc;
+
+    assert(spdk_get_thread() == spdk_thread_get_app_thread());
+
+    /* Base bdev is already claimed for writing, so its desc is reused. */
+    if (spdk_bdev_get_by_name(name) == ubi_bdev->base_bdev_info.bdev) {
+        ubi_bdev->image_bdev_info = ubi_bdev->base_bdev_info;
+        ubi_bdev->image_on_base = true;
+        ubi_bdev->image_copy_offload = spdk_bdev_io_type_supported(
+            ubi_bdev->base_bdev_info.bdev, SPDK_BDEV_IO_TYPE_COPY);
+        return 0;
+    }
+
+    rc = spdk_bdev_open_ext(name, false, ubi_handle_image_bdev_event, ubi_bdev, &desc);
+    if (rc != 0) {
+        if (rc != -ENODEV) {
+            SPDK_ERRLOG("Unable to create desc on bdev '%s'\n", name);
+        }
+        return rc;
+    }
+
+    rc = spdk_bdev_module_claim_bdev_desc(desc, SPDK_BDEV_CLAIM_READ_MANY_WRITE_NONE,
+                                          NULL, &ubi_if);
+    if (rc != 0) {
+        SPDK_ERRLOG("Unable to claim bdev '%s' for reading\n", name);
+        spdk_bdev_close(desc);
+        return rc;
+    }
+
+    ubi_bdev->image_bdev_info.bdev = spdk_bdev_desc_get_bdev(desc);
+    ubi_bdev->image_bdev_info.desc = desc;
+
+    return 0;
+}
+
+/*
+ * ubi_close_base_bdevs unclaims and closes the base bdev and, if there are
+ * ones, the separate metadata bdev and the image bdev.
+ */
+static void ubi_close_base_bdevs(struct ubi_bdev *ubi_bdev) {
+    struct ubi_base_bdev_info *infos[] = {&ubi_bdev->base_bdev_info,
+                                          &ubi_bdev->metadata_bdev_info};
+
+    for (size_t i = 0; i < SPDK_COUNTOF(infos); i++) {
+        if (infos[i]->desc) {
+            spdk_bdev_module_release_bdev(infos[i]->bdev);
+            spdk_bdev_close(infos[i]->desc);
+            infos[i]->desc = NULL;
+        }
+    }
+
+    /* The image bdev's claim belongs to its desc, so closing it releases it. */
+    if (ubi_bdev->image_bdev_info.desc && !ubi_bdev->image_on_base) {
+        spdk_bdev_close(ubi_bdev->image_bdev_info.desc);
+        ubi_bdev->image_bdev_info.desc = NULL;
+    }
+}
+
 /*
  * ubi_handle_base_bdev_remove_event is callback which is called when of base
  * bdevs trigger an event, e.g. when they're removed or resized.
@@ -593,6 +1412,25 @@ static void ubi_handle_base_bdev_event(enum spdk_bdev_event_type type,
     }
 }
 
+/*
+ * ubi_handle_image_bdev_event is called when the image bdev triggers an event.
+ * The image may be shared, so each ubi bdev gets the event through its own
+ * desc, with itself as event_ctx.
+ */
+static void ubi_handle_image_bdev_event(enum spdk_bdev_event_type type,
+                                        struct spdk_bdev *bdev, void *event_ctx) {
+    struct ubi_bdev *ubi_bdev = event_ctx;
+
+    switch (type) {
+    case SPDK_BDEV_EVENT_REMOVE:
+        spdk_bdev_unregister(&ubi_bdev->bdev, NULL, NULL);
+        break;
+    default:
+        SPDK_NOTICELOG("Unsupported bdev event: type %d\n", type);
+        break;
+    }
+}
+
 /*
  * ubi_handle_base_bdev_remove_event is called if a base bdev is removed.
  */
@@ -609,7 +1447,8 @@ static void ubi_handle_base_bdev_remove_event(struct spdk_bdev *base_bdev) {
 }
 
 /*
- * ubi_bdev_find_by_base_bdev finds the bdev which owns the given base bdev.
+ * ubi_bdev_find_by_base_bdev finds the bdev which owns the given base bdev or
+ * metadata bdev.
  */
 static bool ubi_bdev_find_by_base_bdev(struct spdk_bdev *base_bdev,
                                        struct ubi_bdev **_ubi_bdev,
@@ -622,6 +1461,12 @@ static bool ubi_bdev_find_by_base_bdev(struct spdk_bdev *base_bdev,
             *_base_info = &ubi_bdev->base_bdev_info;
             return true;
         }
+
+        if (ubi_bdev->metadata_bdev_info.bdev == base_bdev) {
+            *_ubi_bdev = ubi_bdev;
+            *_base_info = &ubi_bdev->metadata_bdev_info;
+            return true;
+        }
     }
 
     return false;
@@ -637,16 +1482,30 @@ static uint16_t load_littleendian_shortint(uint8_t *mem) {
     return result;
 }
 
-static void ubi_set_version(struct ubi_metadata *metadata, uint16_t major,
+static void store_littleendian_int(uint32_t n, uint8_t *mem) {
+    for (int i = 0; i < 4; i++) {
+        mem[i] = (n >> (8 * i)) & 0xff;
+    }
+}
+
+static uint32_t load_littleendian_int(uint8_t *mem) {
+    uint32_t result = 0;
+    for (int i = 0; i < 4; i++) {
+        result |= ((uint32_t)mem[i]) << (8 * i);
+    }
+    return result;
+}
+
+static void ubi_set_version(struct ubi_metadata_header *header, uint16_t major,
                             uint16_t minor) {
-    store_littleendian_shortint(major, metadata->versionMajor);
-    store_littleendian_shortint(minor, metadata->versionMinor);
+    store_littleendian_shortint(major, header->versionMajor);
+    store_littleendian_shortint(minor, header->versionMinor);
 }
 
-static void ubi_get_version(struct ubi_metadata *metadata, uint16_t *major,
+static void ubi_get_version(struct ubi_metadata_header *header, uint16_t *major,
                             uint16_t *minor) {
-    *major = load_littleendian_shortint(metadata->versionMajor);
-    *minor = load_littleendian_shortint(metadata->versionMinor);
+    *major = load_littleendian_shortint(header->versionMajor);
+    *minor = load_littleendian_shortint(header->versionMinor);
 }
 
 /*
@@ -0,0 +1,309 @@
+#include "bdev_ubi_internal.h"
+
+#include "spdk/log.h"
+#include "spdk/util.h"
+
+/*
+ * The stripe cache keeps recently fetched image stripes in hugepage memory,
+ * shared by all ubi bdevs of the process. When many bdevs are created from
+ * the same image, e.g. VMs booting together, each stripe is read from the
+ * image file by the first bdev which fetches it, and copied from the cache by
+ * the others. It's disabled until bdev_ubi_set_stripe_cache sets its size.
+ *
+ * Stripes are cached as they're written to base bdev, i.e. after qcow2
+ * clusters and overlays are resolved and zstd frames are decompressed, so
+ * they're keyed by the identity of all files of the image and stripe size.
+ * A file is identified by its device, inode, size and modification time, so
+ * replacing or modifying an image makes its cached stripes unreachable, and
+ * they're evicted eventually. Images read from a bdev aren't cached.
+ *
+ * Entries are evicted with the CLOCK algorithm. Entries which are being
+ * copied from are pinned by their reference count. The cache is accessed from
+ * all reactor threads, under g_stripe_cache_lock, which is only held for
+ * lookups and list updates, not while copying stripes.
+ */
+
+#define UBI_STRIPE_CACHE_BUCKET_BITS 12
+#define UBI_STRIPE_CACHE_BUCKETS (1 << UBI_STRIPE_CACHE_BUCKET_BITS)
+
+struct ubi_cache_image {
+    struct ubi_cache_image_key key;
+    uint32_t id;
+    TAILQ_ENTRY(ubi_cache_image) link;
+};
+
+/*
+ * Static function forward declarations
+ */
+static int ubi_stripe_cache_stat_file(const char *path, struct ubi_cache_file_id *id);
+static uint32_t ubi_stripe_cache_bucket(uint32_t image_id, uint32_t stripe_idx);
+static struct ubi_cache_entry *ubi_stripe_cache_lookup(uint32_t image_id,
+                                                       uint32_t stripe_idx);
+static bool ubi_stripe_cache_make_room(uint64_t len);
+static void ubi_stripe_cache_remove(struct ubi_cache_entry *entry);
+static void ubi_stripe_cache_free_entry(struct ubi_cache_entry *entry);
+
+/*
+ * Capacity is read without the lock, so lookups are cheap while the cache is
+ * disabled. Everything else is protected by g_stripe_cache_lock. Image ids
+ * start at 1, since 0 means an image isn't cached.
+ */
+static pthread_mutex_t g_stripe_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t g_stripe_cache_capacity;
+static uint64_t g_stripe_cache_used;
+static uint64_t g_stripe_cache_entries;
+static uint32_t g_stripe_cache_next_image_id = 1;
+static TAILQ_HEAD(, ubi_cache_image)
+    g_stripe_cache_images = TAILQ_HEAD_INITIALIZER(g_stripe_cache_images);
+static TAILQ_HEAD(, ubi_cache_entry)
+    g_stripe_cache_clock = TAILQ_HEAD_INITIALIZER(g_stripe_cache_clock);
+static LIST_HEAD(, ubi_cache_entry) g_stripe_cache_buckets[UBI_STRIPE_CACHE_BUCKETS];
+
+/*
+ * bdev_ubi_set_stripe_cache sets the size of the stripe cache, or disables
+ * it if size_mb is 0. Entries beyond the new size are evicted.
+ */
+void bdev_ubi_set_stripe_cache(uint64_t size_mb) {
+    pthread_mutex_lock(&g_stripe_cache_lock);
+    __atomic_store_n(&g_stripe_cache_capacity, size_mb * 1024 * 1024, __ATOMIC_RELAXED);
+    ubi_stripe_cache_make_room(0);
+    pthread_mutex_unlock(&g_stripe_cache_lock);
+}
+
+uint64_t ubi_stripe_cache_size_mb(void) {
+    return __atomic_load_n(&g_stripe_cache_capacity, __ATOMIC_RELAXED) / (1024 * 1024);
+}
+
+/*
+ * ubi_stripe_cache_finish frees all entries when the module is finished, at
+ * which point no channels are left to reference them.
+ */
+void ubi_stripe_cache_finish(void) {
+    pthread_mutex_lock(&g_stripe_cache_lock);
+    __atomic_store_n(&g_stripe_cache_capacity, 0, __ATOMIC_RELAXED);
+    ubi_stripe_cache_make_room(0);
+
+    struct ubi_cache_image *image;
+    while ((image = TAILQ_FIRST(&g_stripe_cache_images)) != NULL) {
+        TAILQ_REMOVE(&g_stripe_cache_images, image, link);
+        free(image);
+    }
+    pthread_mutex_unlock(&g_stripe_cache_lock);
+}
+
+/*
+ * ubi_stripe_cache_init_key stats the image files of a bdev into "key", once
+ * they're loaded. Stat'ing them isn't done on every lookup, since stat() may
+ * block. key->file_count is left 0 if the bdev's stripes can't be cached.
+ */
+void ubi_stripe_cache_init_key(const struct ubi_bdev *ubi_bdev,
+                               struct ubi_cache_image_key *key) {
+    memset(key, 0, sizeof(*key));
+    if (ubi_bdev->image_path[0] == '\0') {
+        return;
+    }
+
+    if (ubi_stripe_cache_stat_file(ubi_bdev->image_path, &key->files[0]) != 0) {
+        return;
+    }
+    for (uint32_t i = 0; i < ubi_bdev->overlay_count; i++) {
+        const char *path = ubi_bdev->overlays[i].path;
+        if (ubi_stripe_cache_stat_file(path, &key->files[1 + i]) != 0) {
+            return;
+        }
+    }
+
+    key->file_count = 1 + ubi_bdev->overlay_count;
+}
+
+/*
+ * ubi_stripe_cache_image_id returns the id stripes of an image are cached
+ * with, given its key and stripe size. Bdevs whose image files and stripe
+ * size are the same share it. Returns 0 if the stripes can't be cached.
+ */
+uint32_t ubi_stripe_cache_image_id(struct ubi_cache_image_key *key,
+                                   uint32_t stripe_size) {
+    if (key->file_count == 0) {
+        return 0;
+    }
+
+    key->stripe_size = stripe_size;
+
+    uint32_t id = 0;
+    pthread_mutex_lock(&g_stripe_cache_lock);
+    struct ubi_cache_image *image;
+    TAILQ_FOREACH(image, &g_stripe_cache_images, link) {
+        if (memcmp(&image->key, key, sizeof(*key)) == 0) {
+            id = image->id;
+            break;
+        }
+    }
+
+    if (id == 0 && (image = calloc(1, sizeof(*image))) != NULL) {
+        image->key = *key;
+        image->id = id = g_stripe_cache_next_image_id++;
+        TAILQ_INSERT_TAIL(&g_stripe_cache_images, image, link);
+    }
+    pthread_mutex_unlock(&g_stripe_cache_lock);
+
+    return id;
+}
+
+static int ubi_stripe_cache_stat_file(const char *path, struct ubi_cache_file_id *id) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return -errno;
+    }
+
+    id->dev = st.st_dev;
+    id->ino = st.st_ino;
+    id->size = st.st_size;
+    id->mtime_sec = st.st_mtim.tv_sec;
+    id->mtime_nsec = st.st_mtim.tv_nsec;
+    return 0;
+}
+
+/*
+ * ubi_stripe_cache_get returns the cached copy of a stripe, or NULL if it
+ * isn't cached. The entry stays valid until it's released with
+ * ubi_stripe_cache_put.
+ */
+struct ubi_cache_entry *ubi_stripe_cache_get(uint32_t image_id, uint32_t stripe_idx) {
+    if (image_id == 0 ||
+        __atomic_load_n(&g_stripe_cache_capacity, __ATOMIC_RELAXED) == 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_stripe_cache_lock);
+    struct ubi_cache_entry *entry = ubi_stripe_cache_lookup(image_id, stripe_idx);
+    if (entry != NULL) {
+        entry->refs++;
+        entry->referenced = true;
+    }
+    pthread_mutex_unlock(&g_stripe_cache_lock);
+
+    return entry;
+}
+
+void ubi_stripe_cache_put(struct ubi_cache_entry *entry) {
+    pthread_mutex_lock(&g_stripe_cache_lock);
+    entry->refs--;
+
+    /* The cache may have been shrunk while this was pinned. */
+    if (g_stripe_cache_used > g_stripe_cache_capacity) {
+        ubi_stripe_cache_make_room(0);
+    }
+    pthread_mutex_unlock(&g_stripe_cache_lock);
+}
+
+/*
+ * ubi_stripe_cache_insert adds a copy of a stripe which was read from the
+ * image to the cache, evicting other entries to make room for it. The copy is
+ * made before taking the lock, and dropped if another bdev cached the stripe
+ * meanwhile.
+ */
+void ubi_stripe_cache_insert(uint32_t image_id, uint32_t stripe_idx, const uint8_t *buf,
+                             uint32_t len) {
+    if (image_id == 0 ||
+        len > __atomic_load_n(&g_stripe_cache_capacity, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    struct ubi_cache_entry *entry = calloc(1, sizeof(*entry));
+    if (entry == NULL) {
+        return;
+    }
+
+    entry->buf = spdk_dma_malloc(len, 0, NULL);
+    if (entry->buf == NULL) {
+        free(entry);
+        return;
+    }
+
+    memcpy(entry->buf, buf, len);
+    entry->image_id = image_id;
+    entry->stripe_idx = stripe_idx;
+    entry->len = len;
+
+    pthread_mutex_lock(&g_stripe_cache_lock);
+    bool inserted = false;
+    if (ubi_stripe_cache_lookup(image_id, stripe_idx) == NULL &&
+        ubi_stripe_cache_make_room(len)) {
+        uint32_t bucket = ubi_stripe_cache_bucket(image_id, stripe_idx);
+        LIST_INSERT_HEAD(&g_stripe_cache_buckets[bucket], entry, bucket_link);
+        TAILQ_INSERT_TAIL(&g_stripe_cache_clock, entry, clock_link);
+        g_stripe_cache_used += len;
+        g_stripe_cache_entries++;
+        inserted = true;
+    }
+    pthread_mutex_unlock(&g_stripe_cache_lock);
+
+    if (!inserted) {
+        ubi_stripe_cache_free_entry(entry);
+    }
+}
+
+static uint32_t ubi_stripe_cache_bucket(uint32_t image_id, uint32_t stripe_idx) {
+    uint64_t key = (uint64_t)image_id << 32 | stripe_idx;
+    return (key * 0x9E3779B97F4A7C15ULL) >> (64 - UBI_STRIPE_CACHE_BUCKET_BITS);
+}
+
+static struct ubi_cache_entry *ubi_stripe_cache_lookup(uint32_t image_id,
+                                                       uint32_t stripe_idx) {
+    uint32_t bucket = ubi_stripe_cache_bucket(image_id, stripe_idx);
+    struct ubi_cache_entry *entry;
+    LIST_FOREACH(entry, &g_stripe_cache_buckets[bucket], bucket_link) {
+        if (entry->image_id == image_id && entry->stripe_idx == stripe_idx) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * ubi_stripe_cache_make_room evicts entries until len more bytes fit in the
+ * cache. The clock hand is the head of g_stripe_cache_clock. Entries which
+ * were used since the hand last passed them, or which are pinned, get
+ * another round. Returns false if there isn't enough to evict, e.g. because
+ * entries are pinned.
+ */
+static bool ubi_stripe_cache_make_room(uint64_t len) {
+    uint64_t capacity = g_stripe_cache_capacity;
+    if (len > capacity) {
+        return false;
+    }
+
+    uint64_t budget = 2 * g_stripe_cache_entries;
+    while (g_stripe_cache_used + len > capacity) {
+        struct ubi_cache_entry *entry = TAILQ_FIRST(&g_stripe_cache_clock);
+        if (entry == NULL || budget == 0) {
+            return false;
+        }
+
+        budget--;
+        TAILQ_REMOVE(&g_stripe_cache_clock, entry, clock_link);
+        if (entry->refs > 0 || entry->referenced) {
+            entry->referenced = false;
+            TAILQ_INSERT_TAIL(&g_stripe_cache_clock, entry, clock_link);
+            continue;
+        }
+
+        ubi_stripe_cache_remove(entry);
+    }
+
+    return true;
+}
+
+/* ubi_stripe_cache_remove frees an entry which was removed from the clock. */
+static void ubi_stripe_cache_remove(struct ubi_cache_entry *entry) {
+    LIST_REMOVE(entry, bucket_link);
+    g_stripe_cache_used -= entry->len;
+    g_stripe_cache_entries--;
+    ubi_stripe_cache_free_entry(entry);
+}
+
+static void ubi_stripe_cache_free_entry(struct ubi_cache_entry *entry) {
+    spdk_dma_free(entry->buf);
+    free(entry);
+}
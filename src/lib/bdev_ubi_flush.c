@@ -1,4 +1,3 @@
-
 #include "bdev_ubi_internal.h"
 
 #include "spdk/likely.h"
@@ -9,24 +8,33 @@
  */
 static void ubi_data_flush_completion(struct spdk_bdev_io *bdev_io, bool success,
                                       void *cb_arg);
-static void ubi_metadata_write_completion(struct spdk_bdev_io *bdev_io, bool success,
-                                          void *cb_arg);
-static void ubi_metadata_flush_completion(struct spdk_bdev_io *bdev_io, bool success,
-                                          void *cb_arg);
+static void ubi_metadata_commit_completion(void *cb_arg, bool success);
 
 /*
- * To process a flush (aka sync) request for a specified block range, the
- * data is first flushed to the base bdev. If metadata is not dirty, the
- * I/O request is marked as completed.
+ * To process a flush (aka sync) request for a specified block range, if
+ * metadata is not dirty, the data is flushed to the base bdev and the I/O
+ * request is marked as completed.
  *
- * If metadata is dirty, it's first written and subsequently flushed to
- * the base bdev. Then the I/O request is marked as completed.
+ * If metadata is dirty, a metadata commit is requested from the metadata
+ * writer (see bdev_ubi_metadata.c). A commit flushes the whole data region,
+ * then writes and flushes a stable snapshot of metadata. Then the I/O request
+ * is marked as completed.
  */
 
 void ubi_submit_flush_request(struct ubi_bdev_io *ubi_io) {
     struct ubi_bdev *ubi_bdev = ubi_io->ubi_bdev;
     if (ubi_bdev->no_sync) {
-        spdk_bdev_io_complete(spdk_bdev_io_from_ctx(ubi_io), SPDK_BDEV_IO_STATUS_SUCCESS);
+        ubi_complete_io(ubi_io, true);
+        return;
+    }
+
+    uint64_t fetched = __atomic_load_n(&ubi_bdev->stripes_fetched, __ATOMIC_ACQUIRE);
+    uint64_t flushed = __atomic_load_n(&ubi_bdev->stripes_flushed, __ATOMIC_ACQUIRE);
+    if (fetched > flushed) {
+        spdk_trace_record(TRACE_UBI_FLUSH_COMMIT, 0, 0,
+                          (uintptr_t)spdk_bdev_io_from_ctx(ubi_io), fetched, flushed);
+        ubi_request_metadata_commit(ubi_bdev, &ubi_io->commit_waiter,
+                                    ubi_metadata_commit_completion, ubi_io);
         return;
     }
 
@@ -35,94 +43,47 @@ void ubi_submit_flush_request(struct ubi_bdev_io *ubi_io) {
 
     struct ubi_base_bdev_info *base_info = &ubi_bdev->base_bdev_info;
     struct spdk_io_channel *base_ch = ubi_io->ubi_ch->base_channel;
+    ubi_io->phase_tsc = ubi_histogram_start(ubi_io->ubi_ch);
+    spdk_trace_record(TRACE_UBI_FLUSH_DATA, 0, 0,
+                      (uintptr_t)spdk_bdev_io_from_ctx(ubi_io), start_block, num_blocks);
     int ret = spdk_bdev_flush_blocks(base_info->desc, base_ch, start_block, num_blocks,
                                      ubi_data_flush_completion, ubi_io);
     if (ret) {
         UBI_ERRLOG(ubi_io->ubi_bdev,
                    "flush (start: %lu, len: %lu) failed, data flush error: %s\n",
                    start_block, num_blocks, strerror(-ret));
-        spdk_bdev_io_complete(spdk_bdev_io_from_ctx(ubi_io), SPDK_BDEV_IO_STATUS_FAILED);
+        ubi_complete_io(ubi_io, false);
     }
 }
 
 static void ubi_data_flush_completion(struct spdk_bdev_io *bdev_io, bool success,
                                       void *cb_arg) {
     struct ubi_bdev_io *ubi_io = cb_arg;
-    struct ubi_bdev *ubi_bdev = ubi_io->ubi_bdev;
 
     spdk_bdev_free_io(bdev_io);
+    ubi_histogram_tally(ubi_io->ubi_ch, SPDK_UBI_LATENCY_BASE_IO, ubi_io->phase_tsc);
 
     if (!success) {
         UBI_ERRLOG(ubi_io->ubi_bdev,
                    "flush (start: %lu, len: %lu) failed (data flush failure).\n",
                    ubi_io->block_offset, ubi_io->block_count);
+        ubi_complete_io(ubi_io, false);
         return;
     }
 
-    if (ubi_bdev->stripes_fetched == ubi_bdev->stripes_flushed) {
-        spdk_bdev_io_complete(spdk_bdev_io_from_ctx(ubi_io), SPDK_BDEV_IO_STATUS_SUCCESS);
-        return;
-    }
-
-    struct ubi_base_bdev_info *base_info = &ubi_bdev->base_bdev_info;
-    struct spdk_io_channel *base_ch = ubi_io->ubi_ch->base_channel;
-
-    uint32_t num_blocks = UBI_METADATA_SIZE / ubi_bdev->bdev.blocklen;
-    ubi_io->stripes_fetched = ubi_bdev->stripes_fetched;
-    int ret = spdk_bdev_write_blocks(base_info->desc, base_ch, &ubi_bdev->metadata, 0,
-                                     num_blocks, ubi_metadata_write_completion, ubi_io);
-    if (ret) {
-        UBI_ERRLOG(ubi_io->ubi_bdev,
-                   "flush (start: %lu, len: %lu) failed, metadata write error: %s.\n",
-                   ubi_io->block_offset, ubi_io->block_count, strerror(-ret));
-        spdk_bdev_io_complete(spdk_bdev_io_from_ctx(ubi_io), SPDK_BDEV_IO_STATUS_FAILED);
-    }
+    ubi_complete_io(ubi_io, true);
 }
 
-static void ubi_metadata_write_completion(struct spdk_bdev_io *bdev_io, bool success,
-                                          void *cb_arg) {
+static void ubi_metadata_commit_completion(void *cb_arg, bool success) {
     struct ubi_bdev_io *ubi_io = cb_arg;
-    struct ubi_bdev *ubi_bdev = ubi_io->ubi_bdev;
-    spdk_bdev_free_io(bdev_io);
 
     if (!success) {
         UBI_ERRLOG(ubi_io->ubi_bdev,
-                   "flush (start: %lu, len: %lu) failed (metadata write failure).\n",
+                   "flush (start: %lu, len: %lu) failed (metadata commit failure).\n",
                    ubi_io->block_offset, ubi_io->block_count);
-        spdk_bdev_io_complete(spdk_bdev_io_from_ctx(ubi_io), SPDK_BDEV_IO_STATUS_FAILED);
+        ubi_complete_io(ubi_io, false);
         return;
     }
 
-    struct ubi_base_bdev_info *base_info = &ubi_bdev->base_bdev_info;
-    struct spdk_io_channel *base_ch = ubi_io->ubi_ch->base_channel;
-    uint32_t num_blocks = sizeof(ubi_bdev->metadata) / ubi_bdev->bdev.blocklen;
-    int ret = spdk_bdev_flush_blocks(base_info->desc, base_ch, 0, num_blocks,
-                                     ubi_metadata_flush_completion, ubi_io);
-    if (ret) {
-        UBI_ERRLOG(ubi_io->ubi_bdev,
-                   "flush failed (start: %lu, len: %lu), metadata flush error: %s.\n",
-                   ubi_io->block_offset, ubi_io->block_count, strerror(-ret));
-        spdk_bdev_io_complete(spdk_bdev_io_from_ctx(ubi_io), SPDK_BDEV_IO_STATUS_FAILED);
-    }
-}
-
-static void ubi_metadata_flush_completion(struct spdk_bdev_io *bdev_io, bool success,
-                                          void *cb_arg) {
-    struct ubi_bdev_io *ubi_io = cb_arg;
-    struct ubi_bdev *ubi_bdev = ubi_io->ubi_bdev;
-    spdk_bdev_free_io(bdev_io);
-
-    if (!success) {
-        UBI_ERRLOG(ubi_io->ubi_bdev,
-                   "flush (start: %lu, len: %lu) failed (metadata flush failure).\n",
-                   ubi_io->block_offset, ubi_io->block_count);
-        spdk_bdev_io_complete(spdk_bdev_io_from_ctx(ubi_io), SPDK_BDEV_IO_STATUS_FAILED);
-        return;
-    }
-
-    if (ubi_io->stripes_fetched > ubi_bdev->stripes_flushed) {
-        ubi_bdev->stripes_flushed = ubi_io->stripes_fetched;
-    }
-
-    spdk_bdev_io_complete(spdk_bdev_io_from_ctx(ubi_io), SPDK_BDEV_IO_STATUS_SUCCESS);
+    ubi_complete_io(ubi_io, true);
 }
@@ -0,0 +1,262 @@
+#include "bdev_ubi_internal.h"
+
+#include "spdk/log.h"
+
+/*
+ * Latency histograms are disabled by default, and can be enabled per bdev at
+ * runtime. While enabled, each channel tallies the I/O it serves into its own
+ * histograms, so the I/O path doesn't need locks. Getting histograms of a bdev
+ * merges those of all its channels, and of its destroyed channels.
+ */
+
+struct ubi_histograms_request {
+    bool reset;
+    struct spdk_histogram_data *merged[SPDK_UBI_LATENCY_PHASES];
+
+    spdk_ubi_enable_histograms_complete enable_cb_fn;
+    spdk_ubi_get_histograms_complete get_cb_fn;
+    void *cb_arg;
+};
+
+static const char *g_latency_phase_names[SPDK_UBI_LATENCY_PHASES] = {
+    [SPDK_UBI_LATENCY_QUEUE] = "queue",
+    [SPDK_UBI_LATENCY_IMAGE_READ] = "image_read",
+    [SPDK_UBI_LATENCY_BASE_IO] = "base_io",
+    [SPDK_UBI_LATENCY_READ] = "read",
+    [SPDK_UBI_LATENCY_WRITE] = "write",
+    [SPDK_UBI_LATENCY_FLUSH] = "flush",
+    [SPDK_UBI_LATENCY_FETCH_READ] = "fetch_read",
+    [SPDK_UBI_LATENCY_FETCH_WRITE] = "fetch_write",
+};
+
+/*
+ * Static function forward declarations
+ */
+static int ubi_alloc_histograms(struct spdk_histogram_data **histograms);
+static void ubi_free_histograms(struct spdk_histogram_data **histograms);
+static void ubi_merge_histograms(struct spdk_histogram_data **dst,
+                                 struct spdk_histogram_data *const *src, bool reset);
+static void ubi_update_channel_histograms(struct spdk_io_channel_iter *i);
+static void ubi_update_histograms_done(struct spdk_io_channel_iter *i, int status);
+static void ubi_get_channel_histograms(struct spdk_io_channel_iter *i);
+static void ubi_get_histograms_done(struct spdk_io_channel_iter *i, int status);
+static void ubi_free_histograms_request(struct ubi_histograms_request *req);
+
+const char *bdev_ubi_latency_phase_name(enum spdk_ubi_latency_phase phase) {
+    return g_latency_phase_names[phase];
+}
+
+/*
+ * ubi_histogram_start returns the current ticks if histograms are enabled
+ * for the channel, and 0 otherwise, so ticks aren't read needlessly.
+ */
+uint64_t ubi_histogram_start(struct ubi_io_channel *ch) {
+    return ch->histograms[0] != NULL ? spdk_get_ticks() : 0;
+}
+
+/*
+ * ubi_histogram_tally records the time since "start_tsc" for "phase". It's
+ * skipped if histograms were enabled after the phase started.
+ */
+void ubi_histogram_tally(struct ubi_io_channel *ch, enum spdk_ubi_latency_phase phase,
+                         uint64_t start_tsc) {
+    if (ch->histograms[phase] != NULL && start_tsc != 0) {
+        spdk_histogram_data_tally(ch->histograms[phase], spdk_get_ticks() - start_tsc);
+    }
+}
+
+/*
+ * bdev_ubi_enable_histograms enables or disables latency histograms of the
+ * given bdev. Disabling them drops the collected data.
+ */
+void bdev_ubi_enable_histograms(const char *bdev_name, bool enable,
+                                spdk_ubi_enable_histograms_complete cb_fn, void *cb_arg) {
+    struct ubi_bdev *ubi_bdev = ubi_bdev_get_by_name(bdev_name);
+    if (ubi_bdev == NULL) {
+        cb_fn(cb_arg, -ENODEV);
+        return;
+    }
+
+    struct ubi_histograms_request *req = calloc(1, sizeof(*req));
+    if (req == NULL) {
+        cb_fn(cb_arg, -ENOMEM);
+        return;
+    }
+
+    req->enable_cb_fn = cb_fn;
+    req->cb_arg = cb_arg;
+
+    int rc = 0;
+    pthread_mutex_lock(&ubi_bdev->histograms_lock);
+    if (enable && ubi_bdev->closed_channel_histograms[0] == NULL) {
+        rc = ubi_alloc_histograms(ubi_bdev->closed_channel_histograms);
+    } else if (!enable) {
+        ubi_free_histograms(ubi_bdev->closed_channel_histograms);
+    }
+    pthread_mutex_unlock(&ubi_bdev->histograms_lock);
+
+    if (rc != 0) {
+        ubi_free_histograms_request(req);
+        cb_fn(cb_arg, rc);
+        return;
+    }
+
+    /*
+     * Channels check histograms_enabled rather than "enable", so they end up
+     * in the state of the last request if requests overlap.
+     */
+    ubi_bdev->histograms_enabled = enable;
+    spdk_for_each_channel(ubi_bdev, ubi_update_channel_histograms, req,
+                          ubi_update_histograms_done);
+}
+
+static void ubi_update_channel_histograms(struct spdk_io_channel_iter *i) {
+    struct spdk_io_channel *_ch = spdk_io_channel_iter_get_channel(i);
+    struct ubi_io_channel *ch = spdk_io_channel_get_ctx(_ch);
+
+    if (!ch->ubi_bdev->histograms_enabled) {
+        ubi_free_histograms(ch->histograms);
+    } else if (ch->histograms[0] == NULL && ubi_alloc_histograms(ch->histograms) != 0) {
+        spdk_for_each_channel_continue(i, -ENOMEM);
+        return;
+    }
+
+    spdk_for_each_channel_continue(i, 0);
+}
+
+static void ubi_update_histograms_done(struct spdk_io_channel_iter *i, int status) {
+    struct ubi_histograms_request *req = spdk_io_channel_iter_get_ctx(i);
+    req->enable_cb_fn(req->cb_arg, status);
+    ubi_free_histograms_request(req);
+}
+
+/*
+ * bdev_ubi_get_histograms merges latency histograms of the given bdev, and
+ * calls cb_fn with them in the calling thread. If "reset" is set, histograms
+ * are cleared once they're read.
+ */
+void bdev_ubi_get_histograms(const char *bdev_name, bool reset,
+                             spdk_ubi_get_histograms_complete cb_fn, void *cb_arg) {
+    struct ubi_bdev *ubi_bdev = ubi_bdev_get_by_name(bdev_name);
+    if (ubi_bdev == NULL) {
+        cb_fn(cb_arg, NULL, -ENODEV);
+        return;
+    }
+
+    if (!ubi_bdev->histograms_enabled) {
+        cb_fn(cb_arg, NULL, -EINVAL);
+        return;
+    }
+
+    struct ubi_histograms_request *req = calloc(1, sizeof(*req));
+    if (req == NULL || ubi_alloc_histograms(req->merged) != 0) {
+        ubi_free_histograms_request(req);
+        cb_fn(cb_arg, NULL, -ENOMEM);
+        return;
+    }
+
+    req->reset = reset;
+    req->get_cb_fn = cb_fn;
+    req->cb_arg = cb_arg;
+
+    pthread_mutex_lock(&ubi_bdev->histograms_lock);
+    if (ubi_bdev->closed_channel_histograms[0] != NULL) {
+        ubi_merge_histograms(req->merged, ubi_bdev->closed_channel_histograms, reset);
+    }
+    pthread_mutex_unlock(&ubi_bdev->histograms_lock);
+
+    spdk_for_each_channel(ubi_bdev, ubi_get_channel_histograms, req,
+                          ubi_get_histograms_done);
+}
+
+static void ubi_get_channel_histograms(struct spdk_io_channel_iter *i) {
+    struct ubi_histograms_request *req = spdk_io_channel_iter_get_ctx(i);
+    struct spdk_io_channel *_ch = spdk_io_channel_iter_get_channel(i);
+    struct ubi_io_channel *ch = spdk_io_channel_get_ctx(_ch);
+
+    if (ch->histograms[0] != NULL) {
+        ubi_merge_histograms(req->merged, ch->histograms, req->reset);
+    }
+
+    spdk_for_each_channel_continue(i, 0);
+}
+
+static void ubi_get_histograms_done(struct spdk_io_channel_iter *i, int status) {
+    struct ubi_histograms_request *req = spdk_io_channel_iter_get_ctx(i);
+    req->get_cb_fn(req->cb_arg, status == 0 ? req->merged : NULL, status);
+    ubi_free_histograms_request(req);
+}
+
+/*
+ * ubi_histograms_open_channel allocates histograms of a new channel if they
+ * are enabled for its bdev. Failing that only loses data.
+ */
+void ubi_histograms_open_channel(struct ubi_io_channel *ch) {
+    memset(ch->histograms, 0, sizeof(ch->histograms));
+    if (ch->ubi_bdev->histograms_enabled && ubi_alloc_histograms(ch->histograms) != 0) {
+        UBI_ERRLOG(ch->ubi_bdev, "could not allocate latency histograms\n");
+    }
+}
+
+/*
+ * ubi_histograms_close_channel merges histograms of a channel which is being
+ * destroyed into its bdev's, so they aren't lost.
+ */
+void ubi_histograms_close_channel(struct ubi_io_channel *ch) {
+    struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
+
+    if (ch->histograms[0] == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&ubi_bdev->histograms_lock);
+    if (ubi_bdev->closed_channel_histograms[0] != NULL) {
+        ubi_merge_histograms(ubi_bdev->closed_channel_histograms, ch->histograms,
+                             false);
+    }
+    pthread_mutex_unlock(&ubi_bdev->histograms_lock);
+
+    ubi_free_histograms(ch->histograms);
+}
+
+void ubi_free_closed_channel_histograms(struct ubi_bdev *ubi_bdev) {
+    ubi_free_histograms(ubi_bdev->closed_channel_histograms);
+}
+
+static int ubi_alloc_histograms(struct spdk_histogram_data **histograms) {
+    for (int i = 0; i < SPDK_UBI_LATENCY_PHASES; i++) {
+        histograms[i] = spdk_histogram_data_alloc_sized(UBI_HISTOGRAM_BUCKET_SHIFT);
+        if (histograms[i] == NULL) {
+            ubi_free_histograms(histograms);
+            return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+static void ubi_free_histograms(struct spdk_histogram_data **histograms) {
+    for (int i = 0; i < SPDK_UBI_LATENCY_PHASES; i++) {
+        spdk_histogram_data_free(histograms[i]);
+        histograms[i] = NULL;
+    }
+}
+
+static void ubi_merge_histograms(struct spdk_histogram_data **dst,
+                                 struct spdk_histogram_data *const *src, bool reset) {
+    for (int i = 0; i < SPDK_UBI_LATENCY_PHASES; i++) {
+        spdk_histogram_data_merge(dst[i], src[i]);
+        if (reset) {
+            spdk_histogram_data_reset(src[i]);
+        }
+    }
+}
+
+static void ubi_free_histograms_request(struct ubi_histograms_request *req) {
+    if (req == NULL) {
+        return;
+    }
+
+    ubi_free_histograms(req->merged);
+    free(req);
+}
@@ -2,21 +2,38 @@
 #include "bdev_ubi_test_control.h"
 #include "spdk/likely.h"
 #include "spdk/log.h"
+#include "spdk/util.h"
+#include <sys/eventfd.h>
 
 /*
  * Static function forward declarations
  */
 static int ubi_io_poll(void *arg);
-static int ubi_complete_image_io(struct ubi_io_channel *ch);
-static int ubi_complete_read_from_image(struct ubi_io_channel *ch,
-                                        struct ubi_bdev_io *ubi_io, int res);
+static int ubi_register_channel_poller(struct ubi_io_channel *ch);
+static void ubi_unregister_channel_poller(struct ubi_io_channel *ch);
+static int ubi_channel_interrupt(void *arg);
+static int ubi_channel_retry_poll(void *arg);
+static void ubi_set_retry_poller(struct ubi_io_channel *ch, bool active);
+static void ubi_add_channel(struct ubi_io_channel *ch);
+static void ubi_remove_channel(struct ubi_io_channel *ch);
+static void ubi_kick_bdev_channels(struct ubi_bdev *ubi_bdev);
+static bool ubi_has_active_fetches(struct ubi_io_channel *ch);
+static void ubi_free_fetch_bufs(struct ubi_io_channel *ch);
+static int ubi_init_image_ring(struct ubi_io_channel *ch);
+static int ubi_init_private_ring(struct ubi_io_channel *ch);
+static void ubi_exit_image_ring(struct ubi_io_channel *ch);
+static int ubi_open_overlays(struct ubi_io_channel *ch, int open_flags);
+static void ubi_close_overlays(struct ubi_io_channel *ch);
 static void get_buf_for_read_cb(struct spdk_io_channel *ch, struct spdk_bdev_io *bdev_io,
                                 bool success);
+static bool ubi_read_from_stripe_cache(struct ubi_bdev_io *ubi_io);
+static void ubi_read_from_image_bdev(struct ubi_bdev_io *ubi_io);
+static void ubi_image_bdev_read_cb(struct spdk_bdev_io *image_io, bool success,
+                                   void *cb_arg);
 static int ubi_submit_read_request(struct ubi_bdev_io *ubi_io);
 static int ubi_submit_write_request(struct ubi_bdev_io *ubi_io);
 static void ubi_io_completion_cb(struct spdk_bdev_io *bdev_io, bool success,
                                  void *cb_arg);
-static void ubi_complete_io(struct ubi_bdev_io *ubi_io, bool success);
 static void ubi_init_ext_io_opts(struct spdk_bdev_io *bdev_io,
                                  struct spdk_bdev_ext_io_opts *opts);
 
@@ -26,7 +43,6 @@ static void ubi_init_ext_io_opts(struct spdk_bdev_io *bdev_io,
 static bool g_fail_register_poller = false;
 static bool g_fail_create_base_ch = false;
 static bool g_fail_image_file_open = false;
-static bool g_fail_uring_queue_init = false;
 
 /*
  * ubi_create_channel_cb is called when an I/O channel needs to be created. In
@@ -39,8 +55,9 @@ int ubi_create_channel_cb(void *io_device, void *ctx_buf) {
 
     ch->ubi_bdev = ubi_bdev;
     TAILQ_INIT(&ch->io);
-    ch->poller = g_fail_register_poller ? NULL : spdk_poller_register(ubi_io_poll, ch, 0);
-    if (ch->poller == NULL) {
+    ubi_histograms_open_channel(ch);
+    if (ubi_register_channel_poller(ch) != 0) {
+        ubi_histograms_close_channel(ch);
         UBI_ERRLOG(ubi_bdev, "could not register poller\n");
         return -ENOMEM;
     }
@@ -49,7 +66,8 @@ int ubi_create_channel_cb(void *io_device, void *ctx_buf) {
                            ? NULL
                            : spdk_bdev_get_io_channel(ubi_bdev->base_bdev_info.desc);
     if (ch->base_channel == NULL) {
-        spdk_poller_unregister(&ch->poller);
+        ubi_unregister_channel_poller(ch);
+        ubi_histograms_close_channel(ch);
         UBI_ERRLOG(ubi_bdev, "could not get io channel for base bdev\n");
         return -ENOMEM;
     }
@@ -60,6 +78,28 @@ int ubi_create_channel_cb(void *io_device, void *ctx_buf) {
     for (int i = 0; i < UBI_MAX_ACTIVE_STRIPE_FETCHES; i++) {
         ch->stripe_fetches[i].active = false;
         ch->stripe_fetches[i].ubi_bdev = ubi_bdev;
+        ch->stripe_fetches[i].ch = ch;
+        ch->stripe_fetches[i].buf = NULL;
+        ch->stripe_fetches[i].zbuf = NULL;
+    }
+    ch->zstd_dctx = NULL;
+
+    ch->image_channel = NULL;
+    ch->image_ring = NULL;
+    ch->thread_ctx_ch = NULL;
+    ch->private_ring = NULL;
+    ch->image_file_fd = -1;
+    if (ubi_bdev->image_bdev_info.desc) {
+        ch->image_channel = spdk_bdev_get_io_channel(ubi_bdev->image_bdev_info.desc);
+        if (ch->image_channel == NULL) {
+            ubi_unregister_channel_poller(ch);
+            ubi_histograms_close_channel(ch);
+            spdk_put_io_channel(ch->base_channel);
+            UBI_ERRLOG(ubi_bdev, "could not get io channel for image bdev\n");
+            return -ENOMEM;
+        }
+        ubi_add_channel(ch);
+        return 0;
     }
 
     int open_flags = O_RDONLY;
@@ -68,65 +108,501 @@ int ubi_create_channel_cb(void *io_device, void *ctx_buf) {
     ch->image_file_fd =
         g_fail_image_file_open ? -1 : open(ubi_bdev->image_path, open_flags);
     if (ch->image_file_fd < 0) {
-        spdk_poller_unregister(&ch->poller);
+        ubi_unregister_channel_poller(ch);
+        ubi_histograms_close_channel(ch);
         spdk_put_io_channel(ch->base_channel);
         UBI_ERRLOG(ubi_bdev, "could not open %s: %s\n", ubi_bdev->image_path,
                    strerror(errno));
         return -EINVAL;
     }
 
-    struct io_uring_params io_uring_params;
-    memset(&io_uring_params, 0, sizeof(io_uring_params));
-    int rc = g_fail_uring_queue_init
-                 ? -1
-                 : io_uring_queue_init(UBI_URING_QUEUE_SIZE, &ch->image_file_ring, 0);
+    if (ubi_open_overlays(ch, open_flags) != 0) {
+        ubi_unregister_channel_poller(ch);
+        ubi_histograms_close_channel(ch);
+        spdk_put_io_channel(ch->base_channel);
+        close(ch->image_file_fd);
+        return -EINVAL;
+    }
+
+    int rc = ubi_init_image_ring(ch);
     if (rc != 0) {
-        spdk_poller_unregister(&ch->poller);
+        ubi_unregister_channel_poller(ch);
+        ubi_histograms_close_channel(ch);
         spdk_put_io_channel(ch->base_channel);
         close(ch->image_file_fd);
+        ubi_close_overlays(ch);
         UBI_ERRLOG(ubi_bdev, "Unable to setup io_uring: %s\n", strerror(-rc));
         return -EINVAL;
     }
 
+    ubi_add_channel(ch);
+    return 0;
+}
+
+static void ubi_add_channel(struct ubi_io_channel *ch) {
+    pthread_mutex_lock(&ch->ubi_bdev->channels_lock);
+    TAILQ_INSERT_TAIL(&ch->ubi_bdev->channels, ch, link);
+    pthread_mutex_unlock(&ch->ubi_bdev->channels_lock);
+}
+
+static void ubi_remove_channel(struct ubi_io_channel *ch) {
+    pthread_mutex_lock(&ch->ubi_bdev->channels_lock);
+    TAILQ_REMOVE(&ch->ubi_bdev->channels, ch, link);
+    pthread_mutex_unlock(&ch->ubi_bdev->channels_lock);
+}
+
+/*
+ * ubi_kick_bdev_channels kicks all channels of a bdev in interrupt mode,
+ * from any thread. efd_signaled is only used by the channel's own thread, so
+ * the eventfds are signaled directly. Channels are removed from the list
+ * before their eventfds are closed.
+ */
+static void ubi_kick_bdev_channels(struct ubi_bdev *ubi_bdev) {
+    uint64_t one = 1;
+    struct ubi_io_channel *ch;
+
+    pthread_mutex_lock(&ubi_bdev->channels_lock);
+    TAILQ_FOREACH(ch, &ubi_bdev->channels, link) {
+        if (ch->intr != NULL && write(ch->efd, &one, sizeof(one)) < 0 &&
+            errno != EAGAIN) {
+            SPDK_ERRLOG("could not signal eventfd: %s\n", strerror(errno));
+        }
+    }
+    pthread_mutex_unlock(&ubi_bdev->channels_lock);
+}
+
+/*
+ * ubi_open_overlays opens the image overlays for the channel, with the same
+ * flags as the image file.
+ */
+static int ubi_open_overlays(struct ubi_io_channel *ch, int open_flags) {
+    struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
+
+    for (uint32_t i = 0; i < ubi_bdev->overlay_count; i++) {
+        ch->overlay_fds[i] = open(ubi_bdev->overlays[i].path, open_flags);
+        if (ch->overlay_fds[i] < 0) {
+            UBI_ERRLOG(ubi_bdev, "could not open %s: %s\n", ubi_bdev->overlays[i].path,
+                       strerror(errno));
+            while (i-- > 0) {
+                close(ch->overlay_fds[i]);
+            }
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+static void ubi_close_overlays(struct ubi_io_channel *ch) {
+    for (uint32_t i = 0; i < ch->ubi_bdev->overlay_count; i++) {
+        close(ch->overlay_fds[i]);
+    }
+}
+
+/*
+ * ubi_register_channel_poller arranges for ubi_io_poll to be called for the
+ * channel. Normally it's a poller. In interrupt mode it's called when the
+ * channel's eventfd is kicked, so an idle channel doesn't use CPU.
+ */
+static int ubi_register_channel_poller(struct ubi_io_channel *ch) {
+    ch->poller = NULL;
+    ch->intr = NULL;
+    ch->retry_poller = NULL;
+    ch->retry_poller_active = false;
+    ch->efd_signaled = false;
+    ch->efd = -1;
+
+    if (g_fail_register_poller) {
+        return -ENOMEM;
+    }
+
+    if (!spdk_interrupt_mode_is_enabled()) {
+        ch->poller = spdk_poller_register(ubi_io_poll, ch, 0);
+        return ch->poller == NULL ? -ENOMEM : 0;
+    }
+
+    ch->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ch->efd < 0) {
+        return -errno;
+    }
+
+    ch->intr = SPDK_INTERRUPT_REGISTER(ch->efd, ubi_channel_interrupt, ch);
+    ch->retry_poller =
+        SPDK_POLLER_REGISTER(ubi_channel_retry_poll, ch, UBI_INTERRUPT_RETRY_US);
+    if (ch->intr == NULL || ch->retry_poller == NULL) {
+        ubi_unregister_channel_poller(ch);
+        return -ENOMEM;
+    }
+
+    spdk_poller_pause(ch->retry_poller);
+    return 0;
+}
+
+static void ubi_unregister_channel_poller(struct ubi_io_channel *ch) {
+    spdk_poller_unregister(&ch->poller);
+    spdk_poller_unregister(&ch->retry_poller);
+    spdk_interrupt_unregister(&ch->intr);
+    if (ch->efd >= 0) {
+        close(ch->efd);
+        ch->efd = -1;
+    }
+}
+
+/*
+ * ubi_kick_channel makes ubi_io_poll run soon for the channel in interrupt
+ * mode. It's called whenever the channel gets work it might be able to
+ * progress, i.e. a new request, a finished stripe fetch, or a freed read slot.
+ */
+void ubi_kick_channel(struct ubi_io_channel *ch) {
+    if (ch->intr != NULL) {
+        ubi_signal_eventfd(ch->efd, &ch->efd_signaled);
+    }
+}
+
+static int ubi_channel_interrupt(void *arg) {
+    struct ubi_io_channel *ch = arg;
+
+    /* A private ring signals the same eventfd on completions. */
+    ubi_drain_eventfd(ch->efd, &ch->efd_signaled);
+    if (ch->private_ring) {
+        ch->private_ring->efd_signaled = false;
+    }
+
+    int rc = ubi_io_poll(ch);
+
+    /*
+     * If it made progress, something it was waiting for might now be done.
+     * If it didn't, whatever it's waiting for will kick it. Delayed image
+     * reads of a private ring wake it with a timeout once they're due.
+     */
+    if (rc == SPDK_POLLER_BUSY &&
+        (!TAILQ_EMPTY(&ch->io) || !stripe_queue_empty(ch) ||
+         (ch->private_ring && ch->private_ring->pending_sqes > 0))) {
+        ubi_kick_channel(ch);
+    }
+
+    return rc;
+}
+
+/*
+ * ubi_channel_retry_poll runs in interrupt mode while the channel waits for
+ * a stripe another channel is fetching. The other channel only kicks itself
+ * when done, so this channel needs to check the stripe periodically.
+ */
+static int ubi_channel_retry_poll(void *arg) {
+    struct ubi_io_channel *ch = arg;
+    ubi_kick_channel(ch);
+    return SPDK_POLLER_IDLE;
+}
+
+static void ubi_set_retry_poller(struct ubi_io_channel *ch, bool active) {
+    if (ch->retry_poller == NULL || ch->retry_poller_active == active) {
+        return;
+    }
+
+    if (active) {
+        spdk_poller_resume(ch->retry_poller);
+    } else {
+        spdk_poller_pause(ch->retry_poller);
+    }
+    ch->retry_poller_active = active;
+}
+
+/*
+ * ubi_init_image_ring sets up the ring used for reading the image file, and
+ * registers the image file with it. Registering the file saves a file table
+ * lookup per I/O. It's an optimization only, so fall back to the plain fd if
+ * it fails.
+ */
+static int ubi_init_image_ring(struct ubi_io_channel *ch) {
+    struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
+
+    ch->thread_ctx_ch = NULL;
+    ch->private_ring = NULL;
+    ch->fetch_bufs_registered = false;
+
+    if (ubi_bdev->uring_sqpoll || ubi_bdev->uring_iopoll) {
+        int rc = ubi_init_private_ring(ch);
+        if (rc != 0) {
+            return rc;
+        }
+        ch->image_ring = ch->private_ring;
+    } else {
+        ch->thread_ctx_ch = ubi_get_thread_ctx_channel();
+        if (ch->thread_ctx_ch == NULL) {
+            return -ENOMEM;
+        }
+        struct ubi_thread_ctx *ctx = spdk_io_channel_get_ctx(ch->thread_ctx_ch);
+        ch->image_ring = &ctx->image_ring;
+    }
+
+    ch->image_file_slot = ubi_image_ring_add_file(ch->image_ring, ch->image_file_fd);
+    if (ch->image_file_slot >= 0) {
+        ch->image_file_sqe_fd = ch->image_file_slot;
+        ch->image_file_sqe_flags = IOSQE_FIXED_FILE;
+    } else {
+        ch->image_file_sqe_fd = ch->image_file_fd;
+        ch->image_file_sqe_flags = 0;
+    }
+
     return 0;
 }
 
+/*
+ * ubi_init_private_ring sets up a ring used only by this channel, with SQ
+ * polling and/or I/O polling as requested. These are optimizations only, so
+ * if the kernel refuses them we fall back to a plain ring.
+ */
+static int ubi_init_private_ring(struct ubi_io_channel *ch) {
+    struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
+    uint32_t flags = 0;
+
+    if (ubi_bdev->uring_sqpoll) {
+        flags |= IORING_SETUP_SQPOLL;
+        if (ubi_bdev->uring_sqpoll_cpu >= 0) {
+            flags |= IORING_SETUP_SQ_AFF;
+        }
+    }
+
+    /*
+     * Completions of IOPOLL rings must be reaped actively, so they never
+     * signal an eventfd and can't be used in interrupt mode.
+     */
+    if (ubi_bdev->uring_iopoll && ch->intr != NULL) {
+        SPDK_WARNLOG("[%s] uring_iopoll isn't supported in interrupt mode, "
+                     "disabling it\n",
+                     ubi_bdev->bdev.name);
+    } else if (ubi_bdev->uring_iopoll) {
+        flags |= IORING_SETUP_IOPOLL;
+    }
+
+    ch->private_ring = calloc(1, sizeof(struct ubi_image_ring));
+    if (ch->private_ring == NULL) {
+        return -ENOMEM;
+    }
+
+    int sq_thread_cpu = ubi_bdev->uring_sqpoll_cpu;
+    int rc = ubi_image_ring_init(ch->private_ring, UBI_URING_QUEUE_SIZE, flags,
+                                 sq_thread_cpu, 1);
+
+    /*
+     * The kernel accepts IOPOLL rings for any file, but fails reads of files
+     * which don't support polled I/O.
+     */
+    if (rc == 0 && (flags & IORING_SETUP_IOPOLL) &&
+        !ubi_image_ring_probe(ch->private_ring, ch->image_file_fd,
+                              ubi_bdev->alignment_bytes, ubi_bdev->alignment_bytes)) {
+        SPDK_WARNLOG("[%s] %s doesn't support polled I/O, disabling uring_iopoll\n",
+                     ubi_bdev->bdev.name, ubi_bdev->image_path);
+        ubi_image_ring_exit(ch->private_ring);
+        flags &= ~IORING_SETUP_IOPOLL;
+        rc = ubi_image_ring_init(ch->private_ring, UBI_URING_QUEUE_SIZE, flags,
+                                 sq_thread_cpu, 1);
+    }
+
+    if (rc != 0 && flags != 0) {
+        SPDK_WARNLOG("[%s] could not set up io_uring with flags 0x%x: %s, "
+                     "using default flags\n",
+                     ubi_bdev->bdev.name, flags, strerror(-rc));
+        rc = ubi_image_ring_init(ch->private_ring, UBI_URING_QUEUE_SIZE, 0, -1, 1);
+    }
+
+    if (rc == 0 && ch->intr != NULL) {
+        rc = ubi_image_ring_set_eventfd(ch->private_ring, ch->efd);
+        if (rc != 0) {
+            ubi_image_ring_exit(ch->private_ring);
+        }
+    }
+
+    if (rc != 0) {
+        free(ch->private_ring);
+        ch->private_ring = NULL;
+    }
+
+    return rc;
+}
+
+static void ubi_exit_image_ring(struct ubi_io_channel *ch) {
+    if (ch->private_ring) {
+        ubi_image_ring_exit(ch->private_ring);
+        free(ch->private_ring);
+        ch->private_ring = NULL;
+    } else {
+        ubi_image_ring_remove_file(ch->image_ring, ch->image_file_slot);
+        spdk_put_io_channel(ch->thread_ctx_ch);
+        ch->thread_ctx_ch = NULL;
+    }
+    ch->image_ring = NULL;
+}
+
 /*
  * ubi_destroy_channel_cb when an I/O channel needs to be destroyed.
  */
 void ubi_destroy_channel_cb(void *io_device, void *ctx_buf) {
     struct ubi_io_channel *ch = ctx_buf;
-    spdk_poller_unregister(&ch->poller);
 
-    if (close(ch->image_file_fd) != 0) {
-        UBI_ERRLOG(ch->ubi_bdev, "Error closing file: %s\n", strerror(errno));
+    ubi_remove_channel(ch);
+
+    if (ch->image_channel) {
+        spdk_put_io_channel(ch->image_channel);
+    } else {
+        /*
+         * The kernel must be done with the channel's reads before their
+         * buffers are freed, and before the image file is removed from the
+         * ring's file table and closed.
+         */
+        ubi_image_ring_cancel_channel(ch->image_ring, ch);
+        ubi_exit_image_ring(ch);
+        if (close(ch->image_file_fd) != 0) {
+            UBI_ERRLOG(ch->ubi_bdev, "Error closing file: %s\n", strerror(errno));
+        }
+        ubi_close_overlays(ch);
     }
 
+    /*
+     * I/O of other channels may be waiting for stripes this channel was
+     * fetching, or had queued. Fail those stripes, and kick the channels so
+     * they fail the I/O.
+     */
+    ubi_cancel_queued_stripe_fetches(ch);
+    ubi_kick_bdev_channels(ch->ubi_bdev);
+
     SPDK_NOTICELOG(
         "stats for %s: blocks read: %ld, blocks written: %ld, stripes_fetched: %ld\n",
-        ch->ubi_bdev->bdev.name, ch->blocks_read, ch->blocks_written,
-        ch->stripes_fetched);
+        ch->ubi_bdev->bdev.name, ch->stats.blocks_read, ch->stats.blocks_written,
+        ch->stats.stripe_fetches);
+    ubi_stats_close_channel(ch);
+    ubi_histograms_close_channel(ch);
 
-    io_uring_queue_exit(&ch->image_file_ring);
     spdk_put_io_channel(ch->base_channel);
+
+    /* The private ring signals efd, so it's closed after the ring exits. */
+    ubi_unregister_channel_poller(ch);
+
+    ubi_free_fetch_bufs(ch);
+    ubi_zstd_free_dctx(ch->zstd_dctx);
+}
+
+/*
+ * ubi_prep_image_sqe makes an SQE prepared with image_file_fd refer to the
+ * image file the way it's known to image_ring.
+ */
+void ubi_prep_image_sqe(struct ubi_io_channel *ch, struct io_uring_sqe *sqe) {
+    sqe->fd = ch->image_file_sqe_fd;
+    io_uring_sqe_set_flags(sqe, ch->image_file_sqe_flags);
+}
+
+/*
+ * ubi_image_bdev_read_size returns how many of the nbytes at offset of the
+ * image can be read from the image bdev. Unlike a file, a bdev can't be read
+ * past its end, which the last stripe or block may extend beyond.
+ */
+uint64_t ubi_image_bdev_read_size(struct ubi_bdev *ubi_bdev, uint64_t offset,
+                                  uint64_t nbytes) {
+    struct spdk_bdev *image_bdev = ubi_bdev->image_bdev_info.bdev;
+    uint64_t image_size =
+        (image_bdev->blockcnt - ubi_bdev->image_offset_blocks) * image_bdev->blocklen;
+    return spdk_min(nbytes, image_size - offset);
+}
+
+/*
+ * ubi_alloc_fetch_bufs allocates buffers of all stripe fetches of the
+ * channel. If the channel has a private ring, it also tries registering them
+ * as fixed buffers, so the kernel doesn't need to pin and unpin their pages
+ * for each fetch.
+ * Buffers are allocated on first fetch rather than at channel creation, since
+ * stripes can be large and many channels never fetch a stripe. Either all of
+ * them are allocated or none, so a failed allocation can be retried by a later
+ * fetch, and buffers are registered at most once.
+ */
+int ubi_alloc_fetch_bufs(struct ubi_io_channel *ch) {
+    struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
+    uint32_t nbytes = ubi_bdev->stripe_size_kb * 1024L;
+    struct iovec iovs[UBI_MAX_ACTIVE_STRIPE_FETCHES];
+
+    for (int i = 0; i < UBI_MAX_ACTIVE_STRIPE_FETCHES; i++) {
+        struct stripe_fetch *stripe_fetch = &ch->stripe_fetches[i];
+        stripe_fetch->buf = spdk_dma_malloc(nbytes, ubi_bdev->alignment_bytes, NULL);
+        if (stripe_fetch->buf == NULL) {
+            ubi_free_fetch_bufs(ch);
+            return -ENOMEM;
+        }
+
+        /* Compressed stripes are read at an aligned offset before their frames. */
+        if (ubi_bdev->zstd) {
+            uint64_t zbuf_size =
+                ubi_bdev->zstd->max_stripe_bytes + 2 * ubi_bdev->alignment_bytes;
+            stripe_fetch->zbuf =
+                spdk_dma_malloc(zbuf_size, ubi_bdev->alignment_bytes, NULL);
+            if (stripe_fetch->zbuf == NULL) {
+                ubi_free_fetch_bufs(ch);
+                return -ENOMEM;
+            }
+        }
+        iovs[i].iov_base = stripe_fetch->buf;
+        iovs[i].iov_len = nbytes;
+    }
+
+    if (ch->private_ring == NULL || ch->fetch_bufs_registered) {
+        return 0;
+    }
+
+    int rc = ubi_image_ring_register_buffers(ch->private_ring, iovs,
+                                             UBI_MAX_ACTIVE_STRIPE_FETCHES);
+    if (rc == 0) {
+        ch->fetch_bufs_registered = true;
+    } else {
+        SPDK_DEBUGLOG(bdev_ubi, "[%s] could not register stripe fetch buffers: %s\n",
+                      ubi_bdev->bdev.name, strerror(-rc));
+    }
+
+    return 0;
+}
+
+/*
+ * ubi_free_fetch_bufs frees buffers of all stripe fetches of the channel. It
+ * must only be called when none of them is in use, and the buffers aren't
+ * registered with the ring.
+ */
+static void ubi_free_fetch_bufs(struct ubi_io_channel *ch) {
+    for (int i = 0; i < UBI_MAX_ACTIVE_STRIPE_FETCHES; i++) {
+        spdk_dma_free(ch->stripe_fetches[i].buf);
+        spdk_dma_free(ch->stripe_fetches[i].zbuf);
+        ch->stripe_fetches[i].buf = NULL;
+        ch->stripe_fetches[i].zbuf = NULL;
+    }
 }
 
 /*
- * ubi_io_poll is the poller function that is called regularly by SPDK.
+ * ubi_io_poll is the poller function that is called regularly by SPDK, or in
+ * interrupt mode when the channel is kicked. It returns SPDK_POLLER_BUSY only
+ * if it made progress.
  */
 static int ubi_io_poll(void *arg) {
     struct ubi_io_channel *ch = arg;
     struct spdk_bdev_io *bdev_io;
     struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
+    bool progress = false;
+    bool waiting_for_other_ch = false;
 
     bool queues_empty = TAILQ_EMPTY(&ch->io) && stripe_queue_empty(ch);
-    int image_ios_completed = ubi_complete_image_io(ch);
 
-    if (queues_empty && image_ios_completed < 1) {
-        return SPDK_POLLER_IDLE;
+    /*
+     * Shared rings are completed and submitted by their thread's poller.
+     */
+    int image_ios_completed = 0;
+    uint32_t pending_sqes = 0;
+    if (ch->private_ring) {
+        image_ios_completed = ubi_image_ring_complete(ch->private_ring);
+        pending_sqes = ch->private_ring->pending_sqes;
     }
 
-    if (queues_empty) {
+    if (queues_empty && pending_sqes == 0) {
+        ubi_set_retry_poller(ch, false);
+        if (image_ios_completed < 1) {
+            return SPDK_POLLER_IDLE;
+        }
+
         // no items in queues to process, but might have some more fetches to
         // finish.
         return SPDK_POLLER_BUSY;
@@ -158,10 +634,13 @@ static int ubi_io_poll(void *arg) {
         stripe_fetch->stripe_idx = stripe_idx;
         stripe_fetch->active = true;
         stripe_fetch->op.type = UBI_STRIPE_FETCH;
+        __atomic_fetch_sub(&ubi_bdev->stripe_fetches_queued, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&ubi_bdev->stripe_fetches_active, 1, __ATOMIC_RELAXED);
         ubi_start_fetch_stripe(ch, stripe_fetch);
-        ch->stripes_fetched++;
+        ch->stats.stripe_fetches++;
 
         free_stripe_fetch_idx++;
+        progress = true;
     }
 
     /*
@@ -186,7 +665,9 @@ static int ubi_io_poll(void *arg) {
                  * unsuccessful. Dequeue it and mark it as failed.
                  */
                 TAILQ_REMOVE(&ch->io, bdev_io, module_link);
+                spdk_trace_record(TRACE_UBI_IO_COMPLETE, 0, 0, (uintptr_t)bdev_io, 0);
                 spdk_bdev_io_complete(bdev_io, SPDK_BDEV_IO_STATUS_FAILED);
+                progress = true;
                 continue;
             } else if (stripe_status == STRIPE_INFLIGHT) {
                 /*
@@ -194,6 +675,8 @@ static int ubi_io_poll(void *arg) {
                  * Halt the loop to ensure I/O requests are addressed in the
                  * order they were received.
                  */
+                waiting_for_other_ch = !ubi_has_active_fetches(ch) &&
+                                       stripe_queue_empty(ch);
                 break;
             } else if (stripe_status == STRIPE_NOT_FETCHED &&
                        (bdev_io->type != SPDK_BDEV_IO_TYPE_READ ||
@@ -210,6 +693,7 @@ static int ubi_io_poll(void *arg) {
 
                 TAILQ_REMOVE(&ch->io, bdev_io, module_link);
                 spdk_bdev_io_complete(bdev_io, SPDK_BDEV_IO_STATUS_FAILED);
+                progress = true;
                 continue;
             }
         }
@@ -220,8 +704,12 @@ static int ubi_io_poll(void *arg) {
          */
 
         TAILQ_REMOVE(&ch->io, bdev_io, module_link);
+        progress = true;
+        spdk_trace_record(TRACE_UBI_IO_DEQUEUE, 0, 0, (uintptr_t)bdev_io,
+                          start_block >> ubi_bdev->stripe_shift);
 
         struct ubi_bdev_io *ubi_io = (struct ubi_bdev_io *)bdev_io->driver_ctx;
+        ubi_histogram_tally(ch, SPDK_UBI_LATENCY_QUEUE, ubi_io->submit_tsc);
         ubi_io->ubi_bdev = ubi_bdev;
         ubi_io->ubi_ch = ch;
         ubi_io->block_offset = bdev_io->u.bdev.offset_blocks;
@@ -231,13 +719,13 @@ static int ubi_io_poll(void *arg) {
         switch (bdev_io->type) {
         case SPDK_BDEV_IO_TYPE_READ: {
             ch->active_reads++;
-            ch->blocks_read += ubi_io->block_count;
+            ch->stats.blocks_read += ubi_io->block_count;
             uint64_t len = bdev_io->u.bdev.num_blocks * bdev_io->bdev->blocklen;
             spdk_bdev_io_get_buf(bdev_io, get_buf_for_read_cb, len);
             break;
         }
         case SPDK_BDEV_IO_TYPE_WRITE:
-            ch->blocks_written += ubi_io->block_count;
+            ch->stats.blocks_written += ubi_io->block_count;
             ubi_submit_write_request(ubi_io);
             break;
         case SPDK_BDEV_IO_TYPE_FLUSH:
@@ -249,45 +737,23 @@ static int ubi_io_poll(void *arg) {
         }
     }
 
-    if (ch->has_reads) {
-        int ret = io_uring_submit(&ch->image_file_ring);
-        if (ret < 0) {
-            UBI_ERRLOG(ubi_bdev, "io_uring_submit failed: %d\n", ret);
-        } else {
-            ch->has_reads = 0;
-        }
+    if (ch->private_ring && ubi_image_ring_submit(ch->private_ring) > 0) {
+        progress = true;
     }
 
-    return SPDK_POLLER_BUSY;
-}
+    ubi_set_retry_poller(ch, waiting_for_other_ch);
 
-static int ubi_complete_image_io(struct ubi_io_channel *ch) {
-    struct io_uring *ring = &ch->image_file_ring;
-    struct io_uring_cqe *cqe[64];
-
-    int batch = io_uring_peek_batch_cqe(ring, cqe, 64);
-    if (batch == -EAGAIN) {
-        return 0;
-    } else if (batch < 0) {
-        UBI_ERRLOG(ch->ubi_bdev, "io_uring_peek_cqe: %s\n", strerror(-batch));
-        return -1;
-    }
+    return progress || image_ios_completed > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
 
-    int ret = 0;
-    for (int i = 0; i < batch; i++) {
-        struct ubi_io_op *op = io_uring_cqe_get_data(cqe[i]);
-        switch (op->type) {
-        case UBI_STRIPE_FETCH:
-            ret = ubi_complete_fetch_stripe(ch, (struct stripe_fetch *)op, cqe[i]->res);
-            break;
-        case UBI_BDEV_IO:
-            ret = ubi_complete_read_from_image(ch, (struct ubi_bdev_io *)op, cqe[i]->res);
-            break;
+static bool ubi_has_active_fetches(struct ubi_io_channel *ch) {
+    for (int i = 0; i < UBI_MAX_ACTIVE_STRIPE_FETCHES; i++) {
+        if (ch->stripe_fetches[i].active) {
+            return true;
         }
-        io_uring_cqe_seen(ring, cqe[i]);
     }
 
-    return ret;
+    return false;
 }
 
 /*
@@ -305,39 +771,122 @@ static void get_buf_for_read_cb(struct spdk_io_channel *ch, struct spdk_bdev_io
 
     uint64_t start_block = bdev_io->u.bdev.offset_blocks;
     uint64_t stripe = start_block >> ubi_bdev->stripe_shift;
-    enum stripe_status stripe_status = ubi_get_stripe_status(ubi_bdev, stripe);
 
-    if (stripe_status == STRIPE_FETCHED || start_block >= ubi_bdev->image_block_count) {
+    /* Stripe status is only tracked for stripes within the image. */
+    if (start_block >= ubi_bdev->image_block_count ||
+        ubi_get_stripe_status(ubi_bdev, stripe) == STRIPE_FETCHED) {
         int ret = ubi_submit_read_request(ubi_io);
 
         if (spdk_unlikely(ret != 0)) {
             ubi_complete_io(ubi_io, false);
         }
+    } else if (ubi_io->ubi_ch->image_channel) {
+        ubi_read_from_image_bdev(ubi_io);
+    } else if (ubi_read_from_stripe_cache(ubi_io)) {
+        ubi_complete_io(ubi_io, true);
     } else {
         // read from base image.
         struct ubi_io_channel *ubi_ch = ubi_io->ubi_ch;
-        struct io_uring *ring = &ubi_ch->image_file_ring;
-        struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+        uint64_t offset = start_block * ubi_bdev->bdev.blocklen;
+        if (ubi_bdev->qcow2) {
+            /*
+             * ubi_submit_request fetched the stripe instead unless the read is
+             * contiguous in the image file, or all zeros.
+             */
+            uint64_t nbytes = bdev_io->u.bdev.num_blocks * ubi_bdev->bdev.blocklen;
+            offset = ubi_qcow2_map(ubi_bdev->qcow2, offset, &nbytes);
+            if (offset == 0) {
+                spdk_iov_memset(bdev_io->u.bdev.iovs, bdev_io->u.bdev.iovcnt, 0);
+                ubi_complete_io(ubi_io, true);
+                return;
+            }
+        }
+
+        struct io_uring_sqe *sqe = ubi_image_ring_get_sqe(ubi_ch->image_ring);
         if (!sqe) {
             UBI_ERRLOG(ubi_bdev, "No available SQE in io_uring\n");
             ubi_complete_io(ubi_io, false);
             return;
         }
-        uint64_t offset = start_block * ubi_bdev->bdev.blocklen;
+        ubi_io->phase_tsc = ubi_histogram_start(ubi_ch);
         io_uring_prep_readv(sqe, ubi_ch->image_file_fd, bdev_io->u.bdev.iovs,
                             bdev_io->u.bdev.iovcnt, offset);
-        io_uring_sqe_set_data(sqe, ubi_io);
-        ubi_ch->has_reads++;
+        ubi_prep_image_sqe(ubi_ch, sqe);
+        ubi_image_sqe_set_op(sqe, &ubi_io->op);
+    }
+}
+
+/*
+ * ubi_read_from_stripe_cache serves a read of blocks which haven't been
+ * fetched yet from the stripe cache, if their stripe is there. I/Os are split
+ * at stripe boundaries, so the read is within one stripe. Returns whether it
+ * was served.
+ */
+static bool ubi_read_from_stripe_cache(struct ubi_bdev_io *ubi_io) {
+    struct spdk_bdev_io *bdev_io = spdk_bdev_io_from_ctx(ubi_io);
+    struct ubi_bdev *ubi_bdev = ubi_io->ubi_bdev;
+    uint64_t start_block = bdev_io->u.bdev.offset_blocks;
+
+    struct ubi_cache_entry *entry = ubi_stripe_cache_get(
+        ubi_bdev->cache_image_id, start_block >> ubi_bdev->stripe_shift);
+    if (entry == NULL) {
+        return false;
+    }
+
+    uint64_t block_in_stripe = start_block & (ubi_bdev->stripe_block_count - 1);
+    spdk_copy_buf_to_iovs(bdev_io->u.bdev.iovs, bdev_io->u.bdev.iovcnt,
+                          entry->buf + block_in_stripe * ubi_bdev->bdev.blocklen,
+                          bdev_io->u.bdev.num_blocks * ubi_bdev->bdev.blocklen);
+    ubi_stripe_cache_put(entry);
+    ubi_io->ubi_ch->stats.stripe_cache_hits++;
+    return true;
+}
+
+/*
+ * ubi_read_from_image_bdev reads an I/O's blocks which haven't been fetched
+ * yet from the image bdev.
+ */
+static void ubi_read_from_image_bdev(struct ubi_bdev_io *ubi_io) {
+    struct spdk_bdev_io *bdev_io = spdk_bdev_io_from_ctx(ubi_io);
+    struct ubi_io_channel *ubi_ch = ubi_io->ubi_ch;
+    struct ubi_bdev *ubi_bdev = ubi_io->ubi_bdev;
+
+    uint64_t offset = bdev_io->u.bdev.offset_blocks * ubi_bdev->bdev.blocklen;
+    uint64_t nbytes = ubi_image_bdev_read_size(
+        ubi_bdev, offset, bdev_io->u.bdev.num_blocks * ubi_bdev->bdev.blocklen);
+    uint64_t image_offset =
+        ubi_bdev->image_offset_blocks * ubi_bdev->image_bdev_info.bdev->blocklen;
+    ubi_io->phase_tsc = ubi_histogram_start(ubi_ch);
+    int ret = spdk_bdev_readv(ubi_bdev->image_bdev_info.desc, ubi_ch->image_channel,
+                              bdev_io->u.bdev.iovs, bdev_io->u.bdev.iovcnt,
+                              image_offset + offset, nbytes, ubi_image_bdev_read_cb,
+                              ubi_io);
+    if (ret != 0) {
+        UBI_ERRLOG(ubi_bdev, "could not read from image bdev: %s\n", strerror(-ret));
+        ubi_complete_io(ubi_io, false);
     }
 }
 
-static int ubi_complete_read_from_image(struct ubi_io_channel *ch,
-                                        struct ubi_bdev_io *ubi_io, int res) {
+static void ubi_image_bdev_read_cb(struct spdk_bdev_io *image_io, bool success,
+                                   void *cb_arg) {
+    struct ubi_bdev_io *ubi_io = cb_arg;
+
+    int res = success ? image_io->u.bdev.num_blocks * image_io->bdev->blocklen : -EIO;
+    spdk_bdev_free_io(image_io);
+    ubi_complete_read_from_image(ubi_io->ubi_ch, ubi_io, res);
+}
+
+int ubi_complete_read_from_image(struct ubi_io_channel *ch, struct ubi_bdev_io *ubi_io,
+                                 int res) {
+    spdk_trace_record(TRACE_UBI_IO_IMAGE_READ_DONE, 0, 0,
+                      (uintptr_t)spdk_bdev_io_from_ctx(ubi_io), (int64_t)res);
     if (res < 0) {
         ubi_complete_io(ubi_io, false);
         return -1;
     }
 
+    ch->stats.image_bytes_read += res;
+    ubi_histogram_tally(ch, SPDK_UBI_LATENCY_IMAGE_READ, ubi_io->phase_tsc);
     ubi_complete_io(ubi_io, true);
     return 1;
 }
@@ -359,6 +908,7 @@ static int ubi_submit_read_request(struct ubi_bdev_io *ubi_io) {
 
     uint64_t start_block = bdev_io->u.bdev.offset_blocks + ubi_bdev->data_offset_blocks;
     uint64_t num_blocks = bdev_io->u.bdev.num_blocks;
+    ubi_io->phase_tsc = ubi_histogram_start(ubi_io->ubi_ch);
     int ret = spdk_bdev_readv_blocks_ext(base_info->desc, base_ch, bdev_io->u.bdev.iovs,
                                          bdev_io->u.bdev.iovcnt, start_block, num_blocks,
                                          ubi_io_completion_cb, ubi_io, &io_opts);
@@ -383,6 +933,7 @@ static int ubi_submit_write_request(struct ubi_bdev_io *ubi_io) {
 
     struct ubi_base_bdev_info *base_info = &ubi_io->ubi_bdev->base_bdev_info;
     struct spdk_io_channel *base_ch = ubi_io->ubi_ch->base_channel;
+    ubi_io->phase_tsc = ubi_histogram_start(ubi_io->ubi_ch);
     int ret = spdk_bdev_writev_blocks_ext(base_info->desc, base_ch, bdev_io->u.bdev.iovs,
                                           bdev_io->u.bdev.iovcnt, start_block, num_blocks,
                                           ubi_io_completion_cb, ubi_io, &io_opts);
@@ -397,14 +948,41 @@ static void ubi_io_completion_cb(struct spdk_bdev_io *bdev_io, bool success,
     spdk_bdev_free_io(bdev_io);
 
     struct ubi_bdev_io *ubi_io = cb_arg;
+    ubi_histogram_tally(ubi_io->ubi_ch, SPDK_UBI_LATENCY_BASE_IO, ubi_io->phase_tsc);
     ubi_complete_io(ubi_io, success);
 }
 
-static void ubi_complete_io(struct ubi_bdev_io *ubi_io, bool success) {
+/*
+ * ubi_complete_io completes an I/O request which was dequeued by ubi_io_poll.
+ */
+void ubi_complete_io(struct ubi_bdev_io *ubi_io, bool success) {
     struct spdk_bdev_io *bdev_io = spdk_bdev_io_from_ctx(ubi_io);
 
-    if (bdev_io->type == SPDK_BDEV_IO_TYPE_READ)
-        ubi_io->ubi_ch->active_reads--;
+    switch (bdev_io->type) {
+    case SPDK_BDEV_IO_TYPE_READ:
+        ubi_histogram_tally(ubi_io->ubi_ch, SPDK_UBI_LATENCY_READ, ubi_io->submit_tsc);
+        break;
+    case SPDK_BDEV_IO_TYPE_WRITE:
+        ubi_histogram_tally(ubi_io->ubi_ch, SPDK_UBI_LATENCY_WRITE, ubi_io->submit_tsc);
+        break;
+    case SPDK_BDEV_IO_TYPE_FLUSH:
+        ubi_histogram_tally(ubi_io->ubi_ch, SPDK_UBI_LATENCY_FLUSH, ubi_io->submit_tsc);
+        break;
+    default:
+        break;
+    }
+
+    spdk_trace_record(TRACE_UBI_IO_COMPLETE, 0, 0, (uintptr_t)bdev_io, (uint64_t)success);
+
+    if (bdev_io->type == SPDK_BDEV_IO_TYPE_READ) {
+        struct ubi_io_channel *ch = ubi_io->ubi_ch;
+        ch->active_reads--;
+
+        /* Reads might be queued waiting for a free slot. */
+        if (!TAILQ_EMPTY(&ch->io)) {
+            ubi_kick_channel(ch);
+        }
+    }
 
     spdk_bdev_io_complete(bdev_io, success ? SPDK_BDEV_IO_STATUS_SUCCESS
                                            : SPDK_BDEV_IO_STATUS_FAILED);
@@ -428,4 +1006,3 @@ static void ubi_init_ext_io_opts(struct spdk_bdev_io *bdev_io,
 void ubi_io_channel_fail_register_poller(bool fail) { g_fail_register_poller = fail; }
 void ubi_io_channel_fail_create_base_ch(bool fail) { g_fail_create_base_ch = fail; }
 void ubi_io_channel_fail_image_file_open(bool fail) { g_fail_image_file_open = fail; }
-void ubi_io_channel_fail_uring_queue_init(bool fail) { g_fail_uring_queue_init = fail; }
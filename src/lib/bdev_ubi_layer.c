@@ -0,0 +1,173 @@
+#include "bdev_ubi_internal.h"
+
+#include "spdk/log.h"
+#include "spdk/util.h"
+
+/*
+ * An image may have overlays, which are files layered over the image file.
+ * Each range of the image is read from the topmost layer which has data for
+ * it, so an update of the image can be shipped as a small delta while the
+ * image it's based on is shared.
+ *
+ * Overlays are either qcow2 files, usually created with the image they're
+ * based on as their backing file, or sparse raw files. Unallocated clusters
+ * of qcow2 overlays, and holes of sparse raw overlays, show the layers below
+ * them. Their indexes are built once when the bdev is created.
+ */
+
+/*
+ * Holes are aligned to file system blocks, but the file may end anywhere. Its
+ * last extent is widened to this, so it can be read with O_DIRECT. The part
+ * past the end of the file reads as zeros.
+ */
+#define UBI_LAYER_EXTENT_ALIGNMENT 4096
+
+/*
+ * Static function forward declarations
+ */
+static int ubi_load_sparse_extents(const char *path, struct ubi_image_layer *layer);
+static enum ubi_range_kind ubi_layer_map(const struct ubi_image_layer *layer,
+                                         uint64_t offset, uint64_t *len,
+                                         uint64_t *host);
+
+int ubi_image_layer_load(const char *path, struct ubi_image_layer *layer) {
+    memset(layer, 0, sizeof(*layer));
+    snprintf(layer->path, sizeof(layer->path), "%s", path);
+
+    int rc = ubi_qcow2_load(path, true, &layer->qcow2);
+    if (rc != 0 || layer->qcow2 != NULL) {
+        return rc;
+    }
+
+    return ubi_load_sparse_extents(path, layer);
+}
+
+void ubi_image_layer_free(struct ubi_image_layer *layer) {
+    ubi_qcow2_free(layer->qcow2);
+    free(layer->extents);
+    layer->qcow2 = NULL;
+    layer->extents = NULL;
+}
+
+/*
+ * ubi_image_map resolves the *len bytes at offset of the image to the layer
+ * to read them from, and shortens *len to the part which is read from that
+ * layer, contiguously. Returns the index of an overlay, UBI_IMAGE_LAYER_BASE
+ * for the image file, or UBI_IMAGE_LAYER_ZERO if they read as zeros. *host is
+ * the offset to read from in the layer's file.
+ */
+int ubi_image_map(const struct ubi_bdev *ubi_bdev, uint64_t offset, uint64_t *len,
+                  uint64_t *host) {
+    /* A layer is only used as far as the layers above it have nothing. */
+    uint64_t run = *len;
+    for (int i = ubi_bdev->overlay_count - 1; i >= 0; i--) {
+        uint64_t layer_run = run;
+        enum ubi_range_kind kind =
+            ubi_layer_map(&ubi_bdev->overlays[i], offset, &layer_run, host);
+        if (kind != UBI_RANGE_ABSENT) {
+            *len = layer_run;
+            return kind == UBI_RANGE_ZERO ? UBI_IMAGE_LAYER_ZERO : i;
+        }
+        run = layer_run;
+    }
+
+    *len = run;
+    if (ubi_bdev->qcow2) {
+        *host = ubi_qcow2_map(ubi_bdev->qcow2, offset, len);
+        return *host == 0 ? UBI_IMAGE_LAYER_ZERO : UBI_IMAGE_LAYER_BASE;
+    }
+
+    *host = offset;
+    return UBI_IMAGE_LAYER_BASE;
+}
+
+static enum ubi_range_kind ubi_layer_map(const struct ubi_image_layer *layer,
+                                         uint64_t offset, uint64_t *len,
+                                         uint64_t *host) {
+    if (layer->qcow2) {
+        return ubi_qcow2_map_range(layer->qcow2, offset, len, host);
+    }
+
+    /* Find the first extent which ends after offset. */
+    uint32_t lo = 0, hi = layer->extent_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (layer->extents[mid].end <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == layer->extent_count) {
+        return UBI_RANGE_ABSENT;
+    }
+
+    const struct ubi_layer_extent *extent = &layer->extents[lo];
+    if (offset < extent->start) {
+        *len = spdk_min(*len, extent->start - offset);
+        return UBI_RANGE_ABSENT;
+    }
+
+    *len = spdk_min(*len, extent->end - offset);
+    *host = offset;
+    return UBI_RANGE_DATA;
+}
+
+/*
+ * ubi_load_sparse_extents finds the extents of a sparse raw overlay which
+ * have data. If the file system can't tell holes apart, all of the file is
+ * data.
+ */
+static int ubi_load_sparse_extents(const char *path, struct ubi_image_layer *layer) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        int rc = -errno;
+        SPDK_ERRLOG("could not open %s: %s\n", path, strerror(errno));
+        return rc;
+    }
+
+    off_t end = lseek(fd, 0, SEEK_END);
+    if (end < 0) {
+        int rc = -errno;
+        SPDK_ERRLOG("could not get size of %s: %s\n", path, strerror(errno));
+        close(fd);
+        return rc;
+    }
+
+    uint32_t capacity = 0;
+    int rc = 0;
+    off_t pos = 0;
+    while (pos < end) {
+        off_t start = lseek(fd, pos, SEEK_DATA);
+        if (start < 0) {
+            if (errno == ENXIO) {
+                break;
+            }
+            start = pos;
+        }
+
+        off_t hole = lseek(fd, start, SEEK_HOLE);
+        if (hole <= start || hole >= end) {
+            hole = SPDK_ALIGN_CEIL(end, UBI_LAYER_EXTENT_ALIGNMENT);
+        }
+
+        if (layer->extent_count == capacity) {
+            capacity = spdk_max(2 * capacity, 64);
+            void *extents = realloc(layer->extents, capacity * sizeof(*layer->extents));
+            if (extents == NULL) {
+                rc = -ENOMEM;
+                break;
+            }
+            layer->extents = extents;
+        }
+
+        layer->extents[layer->extent_count].start = start;
+        layer->extents[layer->extent_count].end = hole;
+        layer->extent_count++;
+        pos = spdk_min(hole, end);
+    }
+
+    close(fd);
+    return rc;
+}
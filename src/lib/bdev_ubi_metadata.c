@@ -0,0 +1,428 @@
+#include "bdev_ubi_internal.h"
+
+#include "spdk/likely.h"
+#include "spdk/log.h"
+
+/*
+ * Static function forward declarations
+ */
+static void ubi_queue_commit_waiter(void *arg);
+static void ubi_complete_commit_waiter(void *arg);
+static void ubi_notify_commit_waiter(struct ubi_metadata_commit_waiter *waiter,
+                                     bool success);
+static int ubi_checkpoint_poll(void *arg);
+static void ubi_start_commit(struct ubi_bdev *ubi_bdev);
+static void ubi_snapshot_dirty_pages(struct ubi_bdev *ubi_bdev);
+static void ubi_commit_data_flush_completion(struct spdk_bdev_io *bdev_io, bool success,
+                                             void *cb_arg);
+static void ubi_commit_metadata_write_completion(struct spdk_bdev_io *bdev_io,
+                                                 bool success, void *cb_arg);
+static void ubi_commit_metadata_flush_completion(struct spdk_bdev_io *bdev_io,
+                                                 bool success, void *cb_arg);
+static void ubi_finish_commit(struct ubi_bdev *ubi_bdev, bool success);
+static void ubi_advance_stripes_flushed(struct ubi_bdev *ubi_bdev,
+                                        uint64_t stripes_fetched);
+static void ubi_release_metadata_writer(struct ubi_bdev *ubi_bdev);
+
+/*
+ * The metadata writer persists stripe headers. All writer state is owned by
+ * ubi_bdev->thread, and metadata is only ever written by a "commit":
+ *   1. pages of "metadata" which are dirty are copied to metadata_snapshot,
+ *   2. the data region is flushed, so stripes recorded in the snapshot are
+ *      durable,
+ *   3. the dirty page range of the snapshot is written, and
+ *   4. the written range is flushed.
+ *
+ * metadata_snapshot is only modified in step 1, so the written buffer stays
+ * stable while channels keep fetching stripes and updating "metadata". A
+ * stripe fetched during a commit marks its page dirty again and is persisted
+ * by the next commit.
+ *
+ * Commits are started either by a flush request (see
+ * ubi_request_metadata_commit) or by the checkpoint poller. The checkpoint
+ * poller starts a commit when either checkpoint_dirty_stripes stripes have
+ * been fetched since the last persisted state, or checkpoint_interval_ms has
+ * elapsed since metadata first became dirty after the last commit started.
+ * So an idle disk doesn't commit as soon as it's written to again.
+ */
+int ubi_start_metadata_writer(struct ubi_bdev *ubi_bdev) {
+    TAILQ_INIT(&ubi_bdev->commit_waiters);
+    TAILQ_INIT(&ubi_bdev->pending_commit_waiters);
+
+    ubi_bdev->metadata_snapshot =
+        spdk_dma_zmalloc(ubi_bdev->metadata_size, ubi_bdev->alignment_bytes, NULL);
+    if (ubi_bdev->metadata_snapshot == NULL) {
+        UBI_ERRLOG(ubi_bdev, "could not allocate metadata snapshot\n");
+        return -ENOMEM;
+    }
+    memcpy(ubi_bdev->metadata_snapshot, ubi_bdev->metadata, ubi_bdev->metadata_size);
+
+    ubi_bdev->metadata_base_ch = spdk_bdev_get_io_channel(ubi_bdev->base_bdev_info.desc);
+    if (ubi_bdev->metadata_base_ch == NULL) {
+        UBI_ERRLOG(ubi_bdev, "could not get io channel for base bdev\n");
+        ubi_release_metadata_writer(ubi_bdev);
+        return -ENOMEM;
+    }
+
+    ubi_bdev->metadata_ch = spdk_bdev_get_io_channel(ubi_bdev->metadata_info->desc);
+    if (ubi_bdev->metadata_ch == NULL) {
+        UBI_ERRLOG(ubi_bdev, "could not get io channel for metadata bdev\n");
+        ubi_release_metadata_writer(ubi_bdev);
+        return -ENOMEM;
+    }
+
+    if (ubi_bdev->checkpoint_interval_ms == 0 &&
+        ubi_bdev->checkpoint_dirty_stripes == 0) {
+        return 0;
+    }
+
+    ubi_bdev->checkpoint_poller = spdk_poller_register(ubi_checkpoint_poll, ubi_bdev,
+                                                       UBI_CHECKPOINT_POLL_PERIOD_US);
+    if (ubi_bdev->checkpoint_poller == NULL) {
+        UBI_ERRLOG(ubi_bdev, "could not register checkpoint poller\n");
+        ubi_release_metadata_writer(ubi_bdev);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+/*
+ * ubi_stop_metadata_writer stops the metadata writer and releases its
+ * resources. If a commit is in progress, this waits for it to finish. "cb" (if
+ * not NULL) is called once the writer has been fully stopped.
+ */
+void ubi_stop_metadata_writer(struct ubi_bdev *ubi_bdev,
+                              ubi_metadata_writer_stopped_cb cb) {
+    spdk_poller_unregister(&ubi_bdev->checkpoint_poller);
+    ubi_bdev->metadata_writer_stopping = true;
+
+    if (ubi_bdev->commit_in_progress) {
+        ubi_bdev->metadata_writer_stopped_cb = cb;
+        return;
+    }
+
+    ubi_release_metadata_writer(ubi_bdev);
+    if (cb) {
+        cb(ubi_bdev);
+    }
+}
+
+static void ubi_release_metadata_writer(struct ubi_bdev *ubi_bdev) {
+    struct ubi_metadata_commit_waiter *waiter;
+    while ((waiter = TAILQ_FIRST(&ubi_bdev->pending_commit_waiters))) {
+        TAILQ_REMOVE(&ubi_bdev->pending_commit_waiters, waiter, link);
+        ubi_notify_commit_waiter(waiter, false);
+    }
+
+    if (ubi_bdev->metadata_base_ch) {
+        spdk_put_io_channel(ubi_bdev->metadata_base_ch);
+        ubi_bdev->metadata_base_ch = NULL;
+    }
+
+    if (ubi_bdev->metadata_ch) {
+        spdk_put_io_channel(ubi_bdev->metadata_ch);
+        ubi_bdev->metadata_ch = NULL;
+    }
+
+    spdk_dma_free(ubi_bdev->metadata_snapshot);
+    ubi_bdev->metadata_snapshot = NULL;
+}
+
+/*
+ * ubi_mark_metadata_dirty records that the metadata page containing "addr",
+ * which must point into ubi_bdev->metadata, has been modified. This can be
+ * called from any thread, after the modification has been made.
+ */
+void ubi_mark_metadata_dirty(struct ubi_bdev *ubi_bdev, const void *addr) {
+    uint64_t offset = (const uint8_t *)addr - (const uint8_t *)ubi_bdev->metadata;
+    uint64_t page = offset / UBI_METADATA_PAGE_SIZE;
+    __atomic_fetch_or(&ubi_bdev->metadata_dirty_pages[page / 64], 1ULL << (page % 64),
+                      __ATOMIC_RELEASE);
+
+    if (__atomic_load_n(&ubi_bdev->first_dirty_tsc, __ATOMIC_RELAXED) == 0) {
+        uint64_t expected = 0;
+        __atomic_compare_exchange_n(&ubi_bdev->first_dirty_tsc, &expected,
+                                    spdk_get_ticks(), false, __ATOMIC_RELAXED,
+                                    __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * ubi_request_metadata_commit asks the metadata writer to persist all stripes
+ * fetched so far. "cb" is called in the calling thread once a commit which
+ * started after this call has finished. "waiter" must stay valid until then.
+ */
+void ubi_request_metadata_commit(struct ubi_bdev *ubi_bdev,
+                                 struct ubi_metadata_commit_waiter *waiter,
+                                 ubi_metadata_commit_cb cb, void *cb_arg) {
+    waiter->ubi_bdev = ubi_bdev;
+    waiter->thread = spdk_get_thread();
+    waiter->cb = cb;
+    waiter->cb_arg = cb_arg;
+    waiter->success = false;
+
+    int ret = spdk_thread_send_msg(ubi_bdev->thread, ubi_queue_commit_waiter, waiter);
+    if (ret) {
+        UBI_ERRLOG(ubi_bdev, "could not request metadata commit: %s\n", strerror(-ret));
+        cb(cb_arg, false);
+    }
+}
+
+static void ubi_queue_commit_waiter(void *arg) {
+    struct ubi_metadata_commit_waiter *waiter = arg;
+    struct ubi_bdev *ubi_bdev = waiter->ubi_bdev;
+
+    if (ubi_bdev->metadata_writer_stopping) {
+        ubi_notify_commit_waiter(waiter, false);
+        return;
+    }
+
+    /*
+     * A commit in progress may have snapshotted metadata before the stripes
+     * this waiter cares about were fetched, so wait for the next one.
+     */
+    TAILQ_INSERT_TAIL(&ubi_bdev->pending_commit_waiters, waiter, link);
+    if (!ubi_bdev->commit_in_progress) {
+        ubi_start_commit(ubi_bdev);
+    }
+}
+
+static void ubi_notify_commit_waiter(struct ubi_metadata_commit_waiter *waiter,
+                                     bool success) {
+    waiter->success = success;
+    if (waiter->thread == spdk_get_thread()) {
+        ubi_complete_commit_waiter(waiter);
+        return;
+    }
+
+    int ret = spdk_thread_send_msg(waiter->thread, ubi_complete_commit_waiter, waiter);
+    if (ret) {
+        UBI_ERRLOG(waiter->ubi_bdev, "could not notify metadata commit waiter: %s\n",
+                   strerror(-ret));
+    }
+}
+
+static void ubi_complete_commit_waiter(void *arg) {
+    struct ubi_metadata_commit_waiter *waiter = arg;
+    waiter->cb(waiter->cb_arg, waiter->success);
+}
+
+static void ubi_advance_stripes_flushed(struct ubi_bdev *ubi_bdev,
+                                        uint64_t stripes_fetched) {
+    uint64_t flushed = __atomic_load_n(&ubi_bdev->stripes_flushed, __ATOMIC_RELAXED);
+    while (stripes_fetched > flushed &&
+           !__atomic_compare_exchange_n(&ubi_bdev->stripes_flushed, &flushed,
+                                        stripes_fetched, false, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED)) {
+    }
+}
+
+static int ubi_checkpoint_poll(void *arg) {
+    struct ubi_bdev *ubi_bdev = arg;
+
+    if (ubi_bdev->commit_in_progress) {
+        return SPDK_POLLER_IDLE;
+    }
+
+    uint64_t fetched = __atomic_load_n(&ubi_bdev->stripes_fetched, __ATOMIC_RELAXED);
+    uint64_t flushed = __atomic_load_n(&ubi_bdev->stripes_flushed, __ATOMIC_RELAXED);
+    if (fetched <= flushed) {
+        return SPDK_POLLER_IDLE;
+    }
+
+    /*
+     * Stripes whose pages were dirtied just before the last commit started,
+     * but counted after it, don't have first_dirty_tsc set. Their interval
+     * starts now.
+     */
+    uint64_t now = spdk_get_ticks();
+    uint64_t dirty_tsc = 0;
+    if (__atomic_compare_exchange_n(&ubi_bdev->first_dirty_tsc, &dirty_tsc, now, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        dirty_tsc = now;
+    }
+
+    uint64_t dirty_stripes = fetched - flushed;
+    uint64_t interval_ticks =
+        ubi_bdev->checkpoint_interval_ms * spdk_get_ticks_hz() / 1000;
+    bool threshold_reached = ubi_bdev->checkpoint_dirty_stripes != 0 &&
+                             dirty_stripes >= ubi_bdev->checkpoint_dirty_stripes;
+    bool interval_elapsed = ubi_bdev->checkpoint_interval_ms != 0 &&
+                            now - dirty_tsc >= interval_ticks;
+
+    if (!threshold_reached && !interval_elapsed) {
+        return SPDK_POLLER_IDLE;
+    }
+
+    ubi_start_commit(ubi_bdev);
+    return SPDK_POLLER_BUSY;
+}
+
+static void ubi_start_commit(struct ubi_bdev *ubi_bdev) {
+    ubi_bdev->commit_in_progress = true;
+    TAILQ_CONCAT(&ubi_bdev->commit_waiters, &ubi_bdev->pending_commit_waiters, link);
+
+    /* Pages dirtied from now on start the next checkpoint interval. */
+    __atomic_store_n(&ubi_bdev->first_dirty_tsc, 0, __ATOMIC_RELAXED);
+
+    /*
+     * Stripe headers are set and their pages marked dirty before
+     * stripes_fetched is incremented, so every stripe counted here is also
+     * marked as fetched in the snapshot.
+     */
+    ubi_bdev->commit_stripes_fetched =
+        __atomic_load_n(&ubi_bdev->stripes_fetched, __ATOMIC_ACQUIRE);
+    ubi_snapshot_dirty_pages(ubi_bdev);
+
+    struct ubi_base_bdev_info *base_info = &ubi_bdev->base_bdev_info;
+    uint64_t start_block = ubi_bdev->data_offset_blocks;
+    uint64_t num_blocks = base_info->bdev->blockcnt - ubi_bdev->data_offset_blocks;
+    int ret = spdk_bdev_flush_blocks(base_info->desc, ubi_bdev->metadata_base_ch,
+                                     start_block, num_blocks,
+                                     ubi_commit_data_flush_completion, ubi_bdev);
+    if (ret) {
+        UBI_ERRLOG(ubi_bdev, "metadata commit failed, data flush error: %s\n",
+                   strerror(-ret));
+        ubi_finish_commit(ubi_bdev, false);
+    }
+}
+
+/*
+ * ubi_snapshot_dirty_pages copies metadata pages modified since the last
+ * snapshot to metadata_snapshot, and records the range of pages that need to
+ * be written in commit_first_page and commit_end_page.
+ */
+static void ubi_snapshot_dirty_pages(struct ubi_bdev *ubi_bdev) {
+    uint8_t *src = (uint8_t *)ubi_bdev->metadata;
+    uint8_t *dst = ubi_bdev->metadata_snapshot;
+    uint32_t first_page = ubi_bdev->metadata_pages;
+    uint32_t end_page = 0;
+
+    for (uint32_t i = 0; i < spdk_divide_round_up(ubi_bdev->metadata_pages, 64); i++) {
+        uint64_t bits =
+            __atomic_exchange_n(&ubi_bdev->metadata_dirty_pages[i], 0, __ATOMIC_ACQ_REL);
+        while (bits) {
+            uint32_t page = i * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+
+            memcpy(dst + page * UBI_METADATA_PAGE_SIZE,
+                   src + page * UBI_METADATA_PAGE_SIZE, UBI_METADATA_PAGE_SIZE);
+            first_page = spdk_min(first_page, page);
+            end_page = page + 1;
+        }
+    }
+
+    ubi_bdev->commit_first_page = first_page < end_page ? first_page : 0;
+    ubi_bdev->commit_end_page = end_page;
+}
+
+static void ubi_commit_data_flush_completion(struct spdk_bdev_io *bdev_io, bool success,
+                                             void *cb_arg) {
+    struct ubi_bdev *ubi_bdev = cb_arg;
+    spdk_bdev_free_io(bdev_io);
+
+    if (!success) {
+        UBI_ERRLOG(ubi_bdev, "metadata commit failed (data flush failure).\n");
+        ubi_finish_commit(ubi_bdev, false);
+        return;
+    }
+
+    /* Nothing to write if no metadata page has changed. */
+    if (ubi_bdev->commit_first_page == ubi_bdev->commit_end_page) {
+        ubi_finish_commit(ubi_bdev, true);
+        return;
+    }
+
+    struct ubi_base_bdev_info *metadata_info = ubi_bdev->metadata_info;
+    uint32_t blocks_per_page = UBI_METADATA_PAGE_SIZE / metadata_info->bdev->blocklen;
+    uint32_t num_pages = ubi_bdev->commit_end_page - ubi_bdev->commit_first_page;
+    uint8_t *buf = ubi_bdev->metadata_snapshot +
+                   (uint64_t)ubi_bdev->commit_first_page * UBI_METADATA_PAGE_SIZE;
+    int ret = spdk_bdev_write_blocks(
+        metadata_info->desc, ubi_bdev->metadata_ch, buf,
+        ubi_bdev->commit_first_page * blocks_per_page, num_pages * blocks_per_page,
+        ubi_commit_metadata_write_completion, ubi_bdev);
+    if (ret) {
+        UBI_ERRLOG(ubi_bdev, "metadata commit failed, metadata write error: %s\n",
+                   strerror(-ret));
+        ubi_finish_commit(ubi_bdev, false);
+    }
+}
+
+static void ubi_commit_metadata_write_completion(struct spdk_bdev_io *bdev_io,
+                                                 bool success, void *cb_arg) {
+    struct ubi_bdev *ubi_bdev = cb_arg;
+    spdk_bdev_free_io(bdev_io);
+
+    if (!success) {
+        UBI_ERRLOG(ubi_bdev, "metadata commit failed (metadata write failure).\n");
+        ubi_finish_commit(ubi_bdev, false);
+        return;
+    }
+
+    struct ubi_base_bdev_info *metadata_info = ubi_bdev->metadata_info;
+    uint32_t blocks_per_page = UBI_METADATA_PAGE_SIZE / metadata_info->bdev->blocklen;
+    uint32_t num_pages = ubi_bdev->commit_end_page - ubi_bdev->commit_first_page;
+    int ret = spdk_bdev_flush_blocks(
+        metadata_info->desc, ubi_bdev->metadata_ch,
+        ubi_bdev->commit_first_page * blocks_per_page, num_pages * blocks_per_page,
+        ubi_commit_metadata_flush_completion, ubi_bdev);
+    if (ret) {
+        UBI_ERRLOG(ubi_bdev, "metadata commit failed, metadata flush error: %s\n",
+                   strerror(-ret));
+        ubi_finish_commit(ubi_bdev, false);
+    }
+}
+
+static void ubi_commit_metadata_flush_completion(struct spdk_bdev_io *bdev_io,
+                                                 bool success, void *cb_arg) {
+    struct ubi_bdev *ubi_bdev = cb_arg;
+    spdk_bdev_free_io(bdev_io);
+
+    if (!success) {
+        UBI_ERRLOG(ubi_bdev, "metadata commit failed (metadata flush failure).\n");
+    }
+
+    ubi_finish_commit(ubi_bdev, success);
+}
+
+static void ubi_finish_commit(struct ubi_bdev *ubi_bdev, bool success) {
+    if (success) {
+        ubi_advance_stripes_flushed(ubi_bdev, ubi_bdev->commit_stripes_fetched);
+    } else {
+        /*
+         * Pages of this commit may not be persisted, so retry them next time.
+         * Marking them dirty starts a new interval, so a failing base bdev is
+         * retried once per interval instead of on every poller iteration.
+         */
+        uint8_t *metadata = (uint8_t *)ubi_bdev->metadata;
+        for (uint64_t page = ubi_bdev->commit_first_page;
+             page < ubi_bdev->commit_end_page; page++) {
+            ubi_mark_metadata_dirty(ubi_bdev, metadata + page * UBI_METADATA_PAGE_SIZE);
+        }
+    }
+
+    ubi_bdev->commit_in_progress = false;
+
+    struct ubi_metadata_commit_waiter *waiter;
+    while ((waiter = TAILQ_FIRST(&ubi_bdev->commit_waiters))) {
+        TAILQ_REMOVE(&ubi_bdev->commit_waiters, waiter, link);
+        ubi_notify_commit_waiter(waiter, success);
+    }
+
+    /* Finish stopping if ubi_stop_metadata_writer() was called meanwhile. */
+    if (ubi_bdev->metadata_writer_stopping) {
+        ubi_metadata_writer_stopped_cb cb = ubi_bdev->metadata_writer_stopped_cb;
+        ubi_bdev->metadata_writer_stopped_cb = NULL;
+        ubi_release_metadata_writer(ubi_bdev);
+        if (cb) {
+            cb(ubi_bdev);
+        }
+        return;
+    }
+
+    if (!TAILQ_EMPTY(&ubi_bdev->pending_commit_waiters)) {
+        ubi_start_commit(ubi_bdev);
+    }
+}
@@ -0,0 +1,274 @@
+#include "bdev_ubi_internal.h"
+
+#include "spdk/endian.h"
+#include "spdk/log.h"
+#include "spdk/util.h"
+
+/*
+ * qcow2 images are read in place. Their L1 and L2 tables are read once when
+ * the bdev is created, into a flat index with the host offset of each guest
+ * cluster. Encryption, compressed clusters, external data files and extended
+ * L2 entries aren't supported, since they don't map guest ranges to plain
+ * host ranges. Backing files are only allowed for image overlays, whose
+ * unallocated clusters show the layers below them.
+ */
+
+#define QCOW2_MAGIC 0x514649fb /* "QFI\xfb" */
+#define QCOW2_V2_HEADER_SIZE 72
+#define QCOW2_V3_HEADER_SIZE 104
+#define QCOW2_MIN_CLUSTER_BITS 12
+#define QCOW2_MAX_CLUSTER_BITS 21
+
+#define QCOW2_INCOMPAT_DIRTY (1ULL << 0)
+
+#define QCOW2_OFFSET_MASK 0x00fffffffffffe00ULL
+#define QCOW2_L2_COMPRESSED (1ULL << 62)
+#define QCOW2_L2_ZERO (1ULL << 0)
+
+/* Index entry of clusters which read as zeros. Host offsets are aligned. */
+#define QCOW2_ZERO_CLUSTER 1
+
+/*
+ * Static function forward declarations
+ */
+static int ubi_qcow2_parse_header(const char *path, const uint8_t *header,
+                                  bool allow_backing_file, struct ubi_qcow2 *qcow2,
+                                  uint32_t *l1_size, uint64_t *l1_offset);
+static int ubi_qcow2_load_tables(const char *path, int fd, struct ubi_qcow2 *qcow2,
+                                 uint32_t l1_size, uint64_t l1_offset);
+static int ubi_qcow2_pread(const char *path, int fd, void *buf, size_t len,
+                           uint64_t offset);
+
+/*
+ * ubi_qcow2_load builds the cluster index of the image at path if it's a
+ * qcow2 image. *out is set to NULL for other images, which are read raw.
+ */
+int ubi_qcow2_load(const char *path, bool allow_backing_file, struct ubi_qcow2 **out) {
+    *out = NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        int rc = -errno;
+        SPDK_ERRLOG("could not open %s: %s\n", path, strerror(errno));
+        return rc;
+    }
+
+    uint8_t header[QCOW2_V3_HEADER_SIZE] = {0};
+    ssize_t n = pread(fd, header, sizeof(header), 0);
+    if (n < QCOW2_V2_HEADER_SIZE || from_be32(header) != QCOW2_MAGIC) {
+        close(fd);
+        return 0;
+    }
+
+    struct ubi_qcow2 *qcow2 = calloc(1, sizeof(*qcow2));
+    if (qcow2 == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+
+    uint32_t l1_size;
+    uint64_t l1_offset;
+    int rc = ubi_qcow2_parse_header(path, header, allow_backing_file, qcow2, &l1_size,
+                                    &l1_offset);
+    if (rc == 0) {
+        rc = ubi_qcow2_load_tables(path, fd, qcow2, l1_size, l1_offset);
+    }
+
+    close(fd);
+    if (rc != 0) {
+        ubi_qcow2_free(qcow2);
+        return rc;
+    }
+
+    *out = qcow2;
+    return 0;
+}
+
+void ubi_qcow2_free(struct ubi_qcow2 *qcow2) {
+    if (qcow2 == NULL) {
+        return;
+    }
+
+    free(qcow2->cluster_offsets);
+    free(qcow2);
+}
+
+/*
+ * ubi_qcow2_map translates the guest range of *len bytes at offset. It
+ * returns the host offset of its start, or 0 if it reads as zeros, and
+ * shortens *len to the part which is contiguous on the host or all zeros.
+ * Unallocated clusters and offsets past the end of the image read as zeros.
+ */
+uint64_t ubi_qcow2_map(const struct ubi_qcow2 *qcow2, uint64_t offset, uint64_t *len) {
+    uint64_t host;
+    uint64_t run = *len;
+    if (ubi_qcow2_map_range(qcow2, offset, &run, &host) == UBI_RANGE_DATA) {
+        *len = run;
+        return host;
+    }
+
+    while (run < *len) {
+        uint64_t next = *len - run;
+        if (ubi_qcow2_map_range(qcow2, offset + run, &next, &host) == UBI_RANGE_DATA) {
+            break;
+        }
+        run += next;
+    }
+
+    *len = run;
+    return 0;
+}
+
+/*
+ * ubi_qcow2_map_range is like ubi_qcow2_map, but tells unallocated ranges,
+ * which an overlay doesn't have data for, apart from zero clusters. *host is
+ * only set for UBI_RANGE_DATA.
+ */
+enum ubi_range_kind ubi_qcow2_map_range(const struct ubi_qcow2 *qcow2, uint64_t offset,
+                                        uint64_t *len, uint64_t *host) {
+    uint64_t cluster_size = 1ULL << qcow2->cluster_bits;
+    uint64_t cluster = offset >> qcow2->cluster_bits;
+    uint64_t in_cluster = offset & (cluster_size - 1);
+
+    /* Past the end of the image nothing is allocated. */
+    if (cluster >= qcow2->cluster_count) {
+        return UBI_RANGE_ABSENT;
+    }
+
+    uint64_t first = qcow2->cluster_offsets[cluster];
+    bool data = first != 0 && first != QCOW2_ZERO_CLUSTER;
+    uint64_t run = cluster_size - in_cluster;
+    while (run < *len && ++cluster < qcow2->cluster_count) {
+        uint64_t next = qcow2->cluster_offsets[cluster];
+        if (data ? next != first + (run + in_cluster) : next != first) {
+            break;
+        }
+        run += cluster_size;
+    }
+
+    if (cluster >= qcow2->cluster_count && first == 0) {
+        run = *len;
+    }
+
+    *len = spdk_min(*len, run);
+    if (!data) {
+        return first == 0 ? UBI_RANGE_ABSENT : UBI_RANGE_ZERO;
+    }
+
+    *host = first + in_cluster;
+    return UBI_RANGE_DATA;
+}
+
+static int ubi_qcow2_parse_header(const char *path, const uint8_t *header,
+                                  bool allow_backing_file, struct ubi_qcow2 *qcow2,
+                                  uint32_t *l1_size, uint64_t *l1_offset) {
+    uint32_t version = from_be32(header + 4);
+    if (version != 2 && version != 3) {
+        SPDK_ERRLOG("%s: unsupported qcow2 version %u\n", path, version);
+        return -ENOTSUP;
+    }
+
+    if (!allow_backing_file && from_be64(header + 8) != 0) {
+        SPDK_ERRLOG("%s: qcow2 images with backing files aren't supported\n", path);
+        return -ENOTSUP;
+    }
+
+    if (from_be32(header + 32) != 0) {
+        SPDK_ERRLOG("%s: encrypted qcow2 images aren't supported\n", path);
+        return -ENOTSUP;
+    }
+
+    /* A dirty image may have stale refcounts, but its tables are valid. */
+    uint64_t incompatible = version == 3 ? from_be64(header + 72) : 0;
+    if (incompatible & ~QCOW2_INCOMPAT_DIRTY) {
+        SPDK_ERRLOG("%s: unsupported qcow2 incompatible features 0x%lx\n", path,
+                    incompatible);
+        return -ENOTSUP;
+    }
+
+    /* Smaller clusters couldn't be read with O_DIRECT. */
+    qcow2->cluster_bits = from_be32(header + 20);
+    if (qcow2->cluster_bits < QCOW2_MIN_CLUSTER_BITS ||
+        qcow2->cluster_bits > QCOW2_MAX_CLUSTER_BITS) {
+        SPDK_ERRLOG("%s: unsupported qcow2 cluster size 2^%u\n", path,
+                    qcow2->cluster_bits);
+        return -ENOTSUP;
+    }
+
+    qcow2->size = from_be64(header + 24);
+    qcow2->cluster_count =
+        spdk_divide_round_up(qcow2->size, 1ULL << qcow2->cluster_bits);
+    *l1_size = from_be32(header + 36);
+    *l1_offset = from_be64(header + 40);
+
+    uint64_t l2_entries = (1ULL << qcow2->cluster_bits) / sizeof(uint64_t);
+    if (*l1_size < spdk_divide_round_up(qcow2->cluster_count, l2_entries)) {
+        SPDK_ERRLOG("%s: qcow2 L1 table is too small\n", path);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int ubi_qcow2_load_tables(const char *path, int fd, struct ubi_qcow2 *qcow2,
+                                 uint32_t l1_size, uint64_t l1_offset) {
+    uint64_t cluster_size = 1ULL << qcow2->cluster_bits;
+    uint64_t l2_entries = cluster_size / sizeof(uint64_t);
+    uint32_t l1_used = spdk_divide_round_up(qcow2->cluster_count, l2_entries);
+
+    qcow2->cluster_offsets = calloc(qcow2->cluster_count, sizeof(uint64_t));
+    uint64_t *l1 = calloc(l1_used, sizeof(uint64_t));
+    uint64_t *l2 = malloc(cluster_size);
+    int rc = -ENOMEM;
+    if (qcow2->cluster_offsets == NULL || l1 == NULL || l2 == NULL) {
+        goto out;
+    }
+
+    rc = ubi_qcow2_pread(path, fd, l1, l1_used * sizeof(uint64_t), l1_offset);
+    for (uint32_t i = 0; rc == 0 && i < l1_used; i++) {
+        uint64_t l2_offset = from_be64(&l1[i]) & QCOW2_OFFSET_MASK;
+        if (l2_offset == 0) {
+            continue;
+        }
+
+        rc = ubi_qcow2_pread(path, fd, l2, cluster_size, l2_offset);
+        uint64_t first = i * l2_entries;
+        for (uint64_t j = 0; rc == 0 && j < l2_entries; j++) {
+            if (first + j >= qcow2->cluster_count) {
+                break;
+            }
+
+            uint64_t entry = from_be64(&l2[j]);
+            if (entry & QCOW2_L2_COMPRESSED) {
+                SPDK_ERRLOG("%s: compressed qcow2 clusters aren't supported\n", path);
+                rc = -ENOTSUP;
+            } else if (entry & QCOW2_L2_ZERO) {
+                qcow2->cluster_offsets[first + j] = QCOW2_ZERO_CLUSTER;
+            } else {
+                qcow2->cluster_offsets[first + j] = entry & QCOW2_OFFSET_MASK;
+            }
+        }
+    }
+
+out:
+    free(l1);
+    free(l2);
+    return rc;
+}
+
+static int ubi_qcow2_pread(const char *path, int fd, void *buf, size_t len,
+                           uint64_t offset) {
+    ssize_t n = pread(fd, buf, len, offset);
+    if (n < 0) {
+        int rc = -errno;
+        SPDK_ERRLOG("%s: reading qcow2 tables failed: %s\n", path, strerror(errno));
+        return rc;
+    }
+
+    if ((size_t)n != len) {
+        SPDK_ERRLOG("%s: qcow2 table at %lu is truncated\n", path, offset);
+        return -EINVAL;
+    }
+
+    return 0;
+}
@@ -1,4 +1,6 @@
 #include "spdk/bdev_module.h"
+#include "spdk/env.h"
+#include "spdk/histogram_data.h"
 #include "spdk/log.h"
 #include "spdk/rpc.h"
 #include "spdk/string.h"
@@ -6,35 +8,122 @@
 
 #include "bdev_ubi.h"
 
+#define RPC_MAX_UBI_CREATE_BATCH 1024
+
+struct rpc_image_overlays {
+    size_t num_paths;
+    char *paths[SPDK_UBI_MAX_IMAGE_OVERLAYS];
+};
+
 struct rpc_construct_ubi {
     char *name;
     char *image_path;
+    char *image_bdev_name;
+    uint64_t image_offset_blocks;
+    struct rpc_image_overlays image_overlays;
     char *base_bdev_name;
+    char *metadata_bdev_name;
     uint32_t stripe_size_kb;
     bool no_sync;
     bool copy_on_read;
     bool directio;
+    uint32_t checkpoint_interval_ms;
+    uint32_t checkpoint_dirty_stripes;
+    bool uring_sqpoll;
+    int32_t uring_sqpoll_cpu;
+    bool uring_iopoll;
 };
 
 static void free_rpc_construct_ubi(struct rpc_construct_ubi *req) {
     free(req->name);
     free(req->image_path);
+    free(req->image_bdev_name);
+    for (size_t i = 0; i < req->image_overlays.num_paths; i++) {
+        free(req->image_overlays.paths[i]);
+    }
     free(req->base_bdev_name);
+    free(req->metadata_bdev_name);
+}
+
+static int decode_image_overlays(const struct spdk_json_val *val, void *out) {
+    struct rpc_image_overlays *overlays = out;
+    return spdk_json_decode_array(val, spdk_json_decode_string, overlays->paths,
+                                  SPDK_UBI_MAX_IMAGE_OVERLAYS, &overlays->num_paths,
+                                  sizeof(char *));
 }
 
 static const struct spdk_json_object_decoder rpc_construct_ubi_decoders[] = {
     {"name", offsetof(struct rpc_construct_ubi, name), spdk_json_decode_string},
     {"image_path", offsetof(struct rpc_construct_ubi, image_path),
-     spdk_json_decode_string},
+     spdk_json_decode_string, true},
+    {"image_bdev", offsetof(struct rpc_construct_ubi, image_bdev_name),
+     spdk_json_decode_string, true},
+    {"image_offset_blocks", offsetof(struct rpc_construct_ubi, image_offset_blocks),
+     spdk_json_decode_uint64, true},
+    {"image_overlays", offsetof(struct rpc_construct_ubi, image_overlays),
+     decode_image_overlays, true},
     {"base_bdev", offsetof(struct rpc_construct_ubi, base_bdev_name),
      spdk_json_decode_string},
+    {"metadata_bdev", offsetof(struct rpc_construct_ubi, metadata_bdev_name),
+     spdk_json_decode_string, true},
     {"stripe_size_kb", offsetof(struct rpc_construct_ubi, stripe_size_kb),
-     spdk_json_decode_uint32},
+     spdk_json_decode_uint32, true},
     {"no_sync", offsetof(struct rpc_construct_ubi, no_sync), spdk_json_decode_bool, true},
     {"copy_on_read", offsetof(struct rpc_construct_ubi, copy_on_read),
      spdk_json_decode_bool, true},
     {"directio", offsetof(struct rpc_construct_ubi, directio), spdk_json_decode_bool,
-     true}};
+     true},
+    {"checkpoint_interval_ms",
+     offsetof(struct rpc_construct_ubi, checkpoint_interval_ms), spdk_json_decode_uint32,
+     true},
+    {"checkpoint_dirty_stripes",
+     offsetof(struct rpc_construct_ubi, checkpoint_dirty_stripes),
+     spdk_json_decode_uint32, true},
+    {"uring_sqpoll", offsetof(struct rpc_construct_ubi, uring_sqpoll),
+     spdk_json_decode_bool, true},
+    {"uring_sqpoll_cpu", offsetof(struct rpc_construct_ubi, uring_sqpoll_cpu),
+     spdk_json_decode_int32, true},
+    {"uring_iopoll", offsetof(struct rpc_construct_ubi, uring_iopoll),
+     spdk_json_decode_bool, true}};
+
+/*
+ * decode_rpc_construct_ubi decodes parameters of a single ubi bdev, after
+ * setting defaults of optional parameters. spdk_json_decode_object will
+ * overwrite them if provided.
+ */
+static int decode_rpc_construct_ubi(const struct spdk_json_val *val, void *out) {
+    struct rpc_construct_ubi *req = out;
+    req->no_sync = false;
+    req->copy_on_read = true;
+    req->directio = true;
+    req->uring_sqpoll_cpu = -1;
+
+    return spdk_json_decode_object(val, rpc_construct_ubi_decoders,
+                                   SPDK_COUNTOF(rpc_construct_ubi_decoders), req);
+}
+
+static void rpc_construct_ubi_to_opts(const struct rpc_construct_ubi *req,
+                                      struct spdk_ubi_bdev_opts *opts) {
+    opts->name = req->name;
+    opts->image_path = req->image_path;
+    opts->image_bdev_name = req->image_bdev_name;
+    opts->image_offset_blocks = req->image_offset_blocks;
+    for (size_t i = 0; i < req->image_overlays.num_paths; i++) {
+        opts->image_overlays[i] = req->image_overlays.paths[i];
+    }
+    opts->image_overlay_count = req->image_overlays.num_paths;
+    opts->base_bdev_name = req->base_bdev_name;
+    opts->metadata_bdev_name = req->metadata_bdev_name;
+    opts->stripe_size_kb = req->stripe_size_kb;
+    opts->no_sync = req->no_sync;
+    opts->copy_on_read = req->copy_on_read;
+    opts->directio = req->directio;
+    opts->checkpoint_interval_ms = req->checkpoint_interval_ms;
+    opts->checkpoint_dirty_stripes = req->checkpoint_dirty_stripes;
+    opts->uring_sqpoll = req->uring_sqpoll;
+    opts->uring_sqpoll_cpu = req->uring_sqpoll_cpu;
+    opts->uring_iopoll = req->uring_iopoll;
+}
 
 static void bdev_ubi_create_done(void *cb_arg, struct spdk_bdev *bdev, int status) {
     struct spdk_jsonrpc_request *request = cb_arg;
@@ -58,14 +147,7 @@ static void rpc_bdev_ubi_create(struct spdk_jsonrpc_request *request,
     struct rpc_construct_ubi req = {};
     struct spdk_ubi_bdev_opts opts = {};
 
-    // set optional parameters. spdk_json_decode_object will overwrite if
-    // provided.
-    req.no_sync = false;
-    req.copy_on_read = true;
-    req.directio = true;
-
-    if (spdk_json_decode_object(params, rpc_construct_ubi_decoders,
-                                SPDK_COUNTOF(rpc_construct_ubi_decoders), &req)) {
+    if (decode_rpc_construct_ubi(params, &req)) {
         SPDK_DEBUGLOG(bdev_ubi, "spdk_json_decode_object failed\n");
         spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_INTERNAL_ERROR,
                                          "spdk_json_decode_object failed");
@@ -73,13 +155,7 @@ static void rpc_bdev_ubi_create(struct spdk_jsonrpc_request *request,
         return;
     }
 
-    opts.name = req.name;
-    opts.image_path = req.image_path;
-    opts.base_bdev_name = req.base_bdev_name;
-    opts.stripe_size_kb = req.stripe_size_kb;
-    opts.no_sync = req.no_sync;
-    opts.copy_on_read = req.copy_on_read;
-    opts.directio = req.directio;
+    rpc_construct_ubi_to_opts(&req, &opts);
 
     struct ubi_create_context *context = calloc(1, sizeof(struct ubi_create_context));
     context->done_fn = bdev_ubi_create_done;
@@ -90,6 +166,165 @@ static void rpc_bdev_ubi_create(struct spdk_jsonrpc_request *request,
 }
 SPDK_RPC_REGISTER("bdev_ubi_create", rpc_bdev_ubi_create, SPDK_RPC_RUNTIME)
 
+struct rpc_construct_ubi_batch;
+
+struct rpc_construct_ubi_batch_entry {
+    struct rpc_construct_ubi_batch *batch;
+    int status;
+
+    /* Set if decoding parameters of the entry failed. */
+    const char *error;
+};
+
+struct rpc_construct_ubi_batch {
+    struct spdk_jsonrpc_request *request;
+
+    /*
+     * Undecoded parameters of each bdev. They point into the request, so
+     * are only valid until rpc_bdev_ubi_create_batch returns.
+     */
+    const struct spdk_json_val *params[RPC_MAX_UBI_CREATE_BATCH];
+    struct rpc_construct_ubi bdevs[RPC_MAX_UBI_CREATE_BATCH];
+    struct rpc_construct_ubi_batch_entry entries[RPC_MAX_UBI_CREATE_BATCH];
+    size_t num_bdevs;
+    size_t remaining;
+};
+
+static int decode_json_val(const struct spdk_json_val *val, void *out) {
+    const struct spdk_json_val **vals = out;
+    *vals = val;
+    return 0;
+}
+
+static int decode_rpc_construct_ubi_array(const struct spdk_json_val *val, void *out) {
+    struct rpc_construct_ubi_batch *batch = out;
+    return spdk_json_decode_array(val, decode_json_val, batch->params,
+                                  RPC_MAX_UBI_CREATE_BATCH, &batch->num_bdevs,
+                                  sizeof(const struct spdk_json_val *));
+}
+
+static const struct spdk_json_object_decoder rpc_construct_ubi_batch_decoders[] = {
+    {"bdevs", 0, decode_rpc_construct_ubi_array},
+};
+
+static void free_rpc_construct_ubi_batch(struct rpc_construct_ubi_batch *batch) {
+    for (size_t i = 0; i < batch->num_bdevs; i++) {
+        free_rpc_construct_ubi(&batch->bdevs[i]);
+    }
+    free(batch);
+}
+
+static void rpc_bdev_ubi_create_batch_finish(struct rpc_construct_ubi_batch *batch) {
+    struct spdk_json_write_ctx *w = spdk_jsonrpc_begin_result(batch->request);
+    spdk_json_write_array_begin(w);
+    for (size_t i = 0; i < batch->num_bdevs; i++) {
+        struct rpc_construct_ubi_batch_entry *entry = &batch->entries[i];
+        spdk_json_write_object_begin(w);
+        if (batch->bdevs[i].name) {
+            spdk_json_write_named_string(w, "name", batch->bdevs[i].name);
+        } else {
+            spdk_json_write_named_null(w, "name");
+        }
+        spdk_json_write_named_bool(w, "success", entry->status == 0);
+        if (entry->error) {
+            spdk_json_write_named_string(w, "error", entry->error);
+        } else if (entry->status < 0) {
+            spdk_json_write_named_string(w, "error", spdk_strerror(-entry->status));
+        } else if (entry->status > 0) {
+            spdk_json_write_named_string_fmt(w, "error", "error code: %d.",
+                                             entry->status);
+        }
+        spdk_json_write_object_end(w);
+    }
+    spdk_json_write_array_end(w);
+    spdk_jsonrpc_end_result(batch->request, w);
+
+    free_rpc_construct_ubi_batch(batch);
+}
+
+static void bdev_ubi_create_batch_done(void *cb_arg, struct spdk_bdev *bdev,
+                                       int status) {
+    struct rpc_construct_ubi_batch_entry *entry = cb_arg;
+    struct rpc_construct_ubi_batch *batch = entry->batch;
+
+    entry->status = status;
+    if (--batch->remaining == 0) {
+        rpc_bdev_ubi_create_batch_finish(batch);
+    }
+}
+
+/*
+ * rpc_bdev_ubi_create_batch handles an rpc request to create many bdev_ubis.
+ * All creations are started at once, so their metadata reads are in flight
+ * concurrently. Each entry is decoded and validated on its own, so an invalid
+ * entry only fails its own creation. The response is sent once all of them
+ * are done, and reports the result of each one.
+ */
+static void rpc_bdev_ubi_create_batch(struct spdk_jsonrpc_request *request,
+                                      const struct spdk_json_val *params) {
+    struct rpc_construct_ubi_batch *batch =
+        calloc(1, sizeof(struct rpc_construct_ubi_batch));
+    if (batch == NULL) {
+        spdk_jsonrpc_send_error_response(request, -ENOMEM, spdk_strerror(ENOMEM));
+        return;
+    }
+
+    if (spdk_json_decode_object(params, rpc_construct_ubi_batch_decoders,
+                                SPDK_COUNTOF(rpc_construct_ubi_batch_decoders),
+                                batch)) {
+        SPDK_DEBUGLOG(bdev_ubi, "spdk_json_decode_object failed\n");
+        spdk_jsonrpc_send_error_response_fmt(
+            request, SPDK_JSONRPC_ERROR_INVALID_PARAMS,
+            "bdevs must be an array of at most %d objects", RPC_MAX_UBI_CREATE_BATCH);
+        free(batch);
+        return;
+    }
+
+    if (batch->num_bdevs == 0) {
+        spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_INVALID_PARAMS,
+                                         "bdevs must not be empty");
+        free(batch);
+        return;
+    }
+
+    batch->request = request;
+
+    /*
+     * Hold a reference while starting creations, so the response isn't sent
+     * if some of them complete synchronously.
+     */
+    batch->remaining = batch->num_bdevs + 1;
+    for (size_t i = 0; i < batch->num_bdevs; i++) {
+        struct rpc_construct_ubi_batch_entry *entry = &batch->entries[i];
+        entry->batch = batch;
+
+        if (decode_rpc_construct_ubi(batch->params[i], &batch->bdevs[i])) {
+            SPDK_DEBUGLOG(bdev_ubi, "decoding bdevs[%zu] failed\n", i);
+            entry->error = "spdk_json_decode_object failed";
+            bdev_ubi_create_batch_done(entry, NULL, -EINVAL);
+            continue;
+        }
+
+        struct ubi_create_context *context =
+            calloc(1, sizeof(struct ubi_create_context));
+        if (context == NULL) {
+            bdev_ubi_create_batch_done(entry, NULL, -ENOMEM);
+            continue;
+        }
+        context->done_fn = bdev_ubi_create_batch_done;
+        context->done_arg = entry;
+
+        struct spdk_ubi_bdev_opts opts = {};
+        rpc_construct_ubi_to_opts(&batch->bdevs[i], &opts);
+        bdev_ubi_create(&opts, context);
+    }
+
+    if (--batch->remaining == 0) {
+        rpc_bdev_ubi_create_batch_finish(batch);
+    }
+}
+SPDK_RPC_REGISTER("bdev_ubi_create_batch", rpc_bdev_ubi_create_batch, SPDK_RPC_RUNTIME)
+
 struct rpc_delete_ubi {
     char *name;
 };
@@ -123,3 +358,376 @@ static void rpc_bdev_ubi_delete(struct spdk_jsonrpc_request *request,
     free(req.name);
 }
 SPDK_RPC_REGISTER("bdev_ubi_delete", rpc_bdev_ubi_delete, SPDK_RPC_RUNTIME)
+
+struct rpc_get_ubi_stats {
+    char *name;
+};
+
+static const struct spdk_json_object_decoder rpc_get_ubi_stats_decoders[] = {
+    {"name", offsetof(struct rpc_get_ubi_stats, name), spdk_json_decode_string, true},
+};
+
+/*
+ * State of a bdev_ubi_get_stats request. Stats of bdevs in "names" are
+ * gathered one at a time, and written to "w" as they arrive.
+ */
+struct rpc_get_ubi_stats_ctx {
+    struct spdk_jsonrpc_request *request;
+    struct spdk_json_write_ctx *w;
+    char **names;
+    size_t num_names;
+    size_t next;
+
+    /* Was a single bdev requested by name? */
+    bool by_name;
+};
+
+static void rpc_bdev_ubi_get_stats_next(struct rpc_get_ubi_stats_ctx *ctx);
+
+static void free_rpc_get_ubi_stats_ctx(struct rpc_get_ubi_stats_ctx *ctx) {
+    for (size_t i = 0; i < ctx->num_names; i++) {
+        free(ctx->names[i]);
+    }
+    free(ctx->names);
+    free(ctx);
+}
+
+static void rpc_write_ubi_stats(struct spdk_json_write_ctx *w, const char *name,
+                                const struct spdk_ubi_bdev_stats *stats) {
+    double hydration_percent = 100.0;
+    if (stats->image_stripes > 0) {
+        hydration_percent = 100.0 * stats->stripes_fetched / stats->image_stripes;
+    }
+
+    spdk_json_write_object_begin(w);
+    spdk_json_write_named_string(w, "name", name);
+    spdk_json_write_named_uint64(w, "image_stripes", stats->image_stripes);
+    spdk_json_write_named_uint64(w, "stripes_fetched", stats->stripes_fetched);
+    spdk_json_write_named_uint64(w, "stripes_flushed", stats->stripes_flushed);
+    spdk_json_write_named_double(w, "hydration_percent", hydration_percent);
+    spdk_json_write_named_uint64(w, "blocks_read", stats->io.blocks_read);
+    spdk_json_write_named_uint64(w, "blocks_written", stats->io.blocks_written);
+    spdk_json_write_named_uint64(w, "stripe_fetches", stats->io.stripe_fetches);
+    spdk_json_write_named_uint64(w, "image_bytes_read", stats->io.image_bytes_read);
+    spdk_json_write_named_uint64(w, "fetch_bytes_written", stats->io.fetch_bytes_written);
+    spdk_json_write_named_uint64(w, "ios_blocked_on_fetch",
+                                 stats->io.ios_blocked_on_fetch);
+    spdk_json_write_named_uint64(w, "stripe_cache_hits", stats->io.stripe_cache_hits);
+    spdk_json_write_named_uint32(w, "channels", stats->channels);
+    spdk_json_write_named_uint64(w, "queued_ios", stats->queued_ios);
+    spdk_json_write_named_uint64(w, "queued_stripe_fetches",
+                                 stats->queued_stripe_fetches);
+    spdk_json_write_named_uint64(w, "active_stripe_fetches",
+                                 stats->active_stripe_fetches);
+    spdk_json_write_named_uint64(w, "active_reads", stats->active_reads);
+    spdk_json_write_object_end(w);
+}
+
+static void rpc_bdev_ubi_get_stats_cb(void *cb_arg,
+                                      const struct spdk_ubi_bdev_stats *stats,
+                                      int status) {
+    struct rpc_get_ubi_stats_ctx *ctx = cb_arg;
+    const char *name = ctx->names[ctx->next];
+
+    if (status != 0 && ctx->by_name) {
+        spdk_jsonrpc_send_error_response(ctx->request, status, spdk_strerror(-status));
+        free_rpc_get_ubi_stats_ctx(ctx);
+        return;
+    }
+
+    /* Bdevs deleted since the request started are skipped. */
+    if (status == 0) {
+        if (ctx->w == NULL) {
+            ctx->w = spdk_jsonrpc_begin_result(ctx->request);
+            spdk_json_write_array_begin(ctx->w);
+        }
+        rpc_write_ubi_stats(ctx->w, name, stats);
+    }
+
+    ctx->next++;
+    rpc_bdev_ubi_get_stats_next(ctx);
+}
+
+static void rpc_bdev_ubi_get_stats_next(struct rpc_get_ubi_stats_ctx *ctx) {
+    if (ctx->next < ctx->num_names) {
+        bdev_ubi_get_stats(ctx->names[ctx->next], rpc_bdev_ubi_get_stats_cb, ctx);
+        return;
+    }
+
+    if (ctx->w == NULL) {
+        ctx->w = spdk_jsonrpc_begin_result(ctx->request);
+        spdk_json_write_array_begin(ctx->w);
+    }
+    spdk_json_write_array_end(ctx->w);
+    spdk_jsonrpc_end_result(ctx->request, ctx->w);
+    free_rpc_get_ubi_stats_ctx(ctx);
+}
+
+/*
+ * rpc_bdev_ubi_get_stats handles an rpc request to get statistics of the
+ * given ubi bdev, or of all ubi bdevs if no name is given.
+ */
+static void rpc_bdev_ubi_get_stats(struct spdk_jsonrpc_request *request,
+                                   const struct spdk_json_val *params) {
+    struct rpc_get_ubi_stats req = {NULL};
+
+    if (params && spdk_json_decode_object(params, rpc_get_ubi_stats_decoders,
+                                          SPDK_COUNTOF(rpc_get_ubi_stats_decoders),
+                                          &req)) {
+        spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_INTERNAL_ERROR,
+                                         "spdk_json_decode_object failed");
+        free(req.name);
+        return;
+    }
+
+    struct rpc_get_ubi_stats_ctx *ctx = calloc(1, sizeof(*ctx));
+    if (ctx == NULL) {
+        spdk_jsonrpc_send_error_response(request, -ENOMEM, spdk_strerror(ENOMEM));
+        free(req.name);
+        return;
+    }
+    ctx->request = request;
+
+    /*
+     * Names are copied, since bdevs might be deleted while we wait for stats
+     * of earlier ones.
+     */
+    size_t max_names = 1;
+    if (req.name == NULL) {
+        max_names = 0;
+        for (struct spdk_bdev *bdev = spdk_bdev_first(); bdev;
+             bdev = spdk_bdev_next(bdev)) {
+            max_names++;
+        }
+    }
+
+    ctx->names = calloc(spdk_max(max_names, 1), sizeof(char *));
+    if (ctx->names == NULL) {
+        spdk_jsonrpc_send_error_response(request, -ENOMEM, spdk_strerror(ENOMEM));
+        free_rpc_get_ubi_stats_ctx(ctx);
+        free(req.name);
+        return;
+    }
+
+    if (req.name != NULL) {
+        ctx->by_name = true;
+        ctx->names[ctx->num_names++] = req.name;
+    } else {
+        for (struct spdk_bdev *bdev = spdk_bdev_first(); bdev;
+             bdev = spdk_bdev_next(bdev)) {
+            if (strcmp(spdk_bdev_get_module_name(bdev), "ubi") != 0) {
+                continue;
+            }
+            char *name = strdup(spdk_bdev_get_name(bdev));
+            if (name != NULL) {
+                ctx->names[ctx->num_names++] = name;
+            }
+        }
+    }
+
+    rpc_bdev_ubi_get_stats_next(ctx);
+}
+SPDK_RPC_REGISTER("bdev_ubi_get_stats", rpc_bdev_ubi_get_stats, SPDK_RPC_RUNTIME)
+
+struct rpc_enable_ubi_histograms {
+    char *name;
+    bool enable;
+};
+
+static const struct spdk_json_object_decoder rpc_enable_ubi_histograms_decoders[] = {
+    {"name", offsetof(struct rpc_enable_ubi_histograms, name), spdk_json_decode_string},
+    {"enable", offsetof(struct rpc_enable_ubi_histograms, enable), spdk_json_decode_bool},
+};
+
+static void rpc_bdev_ubi_enable_histograms_cb(void *cb_arg, int status) {
+    struct spdk_jsonrpc_request *request = cb_arg;
+
+    if (status == 0) {
+        spdk_jsonrpc_send_bool_response(request, true);
+    } else {
+        spdk_jsonrpc_send_error_response(request, status, spdk_strerror(-status));
+    }
+}
+
+/*
+ * rpc_bdev_ubi_enable_histograms handles an rpc request to enable or disable
+ * latency histograms of a ubi bdev.
+ */
+static void rpc_bdev_ubi_enable_histograms(struct spdk_jsonrpc_request *request,
+                                           const struct spdk_json_val *params) {
+    struct rpc_enable_ubi_histograms req = {NULL};
+
+    if (spdk_json_decode_object(params, rpc_enable_ubi_histograms_decoders,
+                                SPDK_COUNTOF(rpc_enable_ubi_histograms_decoders), &req)) {
+        spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_INTERNAL_ERROR,
+                                         "spdk_json_decode_object failed");
+        free(req.name);
+        return;
+    }
+
+    bdev_ubi_enable_histograms(req.name, req.enable, rpc_bdev_ubi_enable_histograms_cb,
+                               request);
+    free(req.name);
+}
+SPDK_RPC_REGISTER("bdev_ubi_enable_histograms", rpc_bdev_ubi_enable_histograms,
+                  SPDK_RPC_RUNTIME)
+
+struct rpc_get_ubi_histograms {
+    char *name;
+    bool reset;
+};
+
+static const struct spdk_json_object_decoder rpc_get_ubi_histograms_decoders[] = {
+    {"name", offsetof(struct rpc_get_ubi_histograms, name), spdk_json_decode_string},
+    {"reset", offsetof(struct rpc_get_ubi_histograms, reset), spdk_json_decode_bool,
+     true},
+};
+
+static const double g_rpc_histogram_percentiles[] = {50.0, 90.0, 99.0, 99.9};
+static const char *g_rpc_histogram_percentile_names[] = {"p50_us", "p90_us", "p99_us",
+                                                          "p999_us"};
+
+/*
+ * Summary of a histogram: upper bounds of buckets where each percentile
+ * falls, and of the highest non-empty bucket.
+ */
+struct rpc_histogram_summary {
+    uint64_t count;
+    uint64_t percentile_ticks[SPDK_COUNTOF(g_rpc_histogram_percentiles)];
+    uint64_t max_ticks;
+};
+
+static void rpc_summarize_histogram_bucket(void *ctx, uint64_t start, uint64_t end,
+                                           uint64_t count, uint64_t total,
+                                           uint64_t so_far) {
+    struct rpc_histogram_summary *summary = ctx;
+
+    if (count == 0) {
+        return;
+    }
+
+    summary->count = total;
+    summary->max_ticks = end;
+    for (size_t i = 0; i < SPDK_COUNTOF(g_rpc_histogram_percentiles); i++) {
+        if (summary->percentile_ticks[i] == 0 &&
+            so_far * 100.0 >= g_rpc_histogram_percentiles[i] * total) {
+            summary->percentile_ticks[i] = end;
+        }
+    }
+}
+
+static void rpc_bdev_ubi_get_histograms_cb(void *cb_arg,
+                                           struct spdk_histogram_data *const *histograms,
+                                           int status) {
+    struct spdk_jsonrpc_request *request = cb_arg;
+
+    if (status != 0) {
+        spdk_jsonrpc_send_error_response(request, status, spdk_strerror(-status));
+        return;
+    }
+
+    double ticks_per_us = spdk_get_ticks_hz() / 1000000.0;
+    struct spdk_json_write_ctx *w = spdk_jsonrpc_begin_result(request);
+    spdk_json_write_object_begin(w);
+    for (int phase = 0; phase < SPDK_UBI_LATENCY_PHASES; phase++) {
+        struct rpc_histogram_summary summary = {};
+        spdk_histogram_data_iterate(histograms[phase], rpc_summarize_histogram_bucket,
+                                    &summary);
+
+        spdk_json_write_named_object_begin(w, bdev_ubi_latency_phase_name(phase));
+        spdk_json_write_named_uint64(w, "count", summary.count);
+        for (size_t i = 0; i < SPDK_COUNTOF(g_rpc_histogram_percentiles); i++) {
+            spdk_json_write_named_double(w, g_rpc_histogram_percentile_names[i],
+                                         summary.percentile_ticks[i] / ticks_per_us);
+        }
+        spdk_json_write_named_double(w, "max_us", summary.max_ticks / ticks_per_us);
+        spdk_json_write_object_end(w);
+    }
+    spdk_json_write_object_end(w);
+    spdk_jsonrpc_end_result(request, w);
+}
+
+/*
+ * rpc_bdev_ubi_get_histograms handles an rpc request to get latency
+ * histograms of a ubi bdev, and optionally reset them.
+ */
+static void rpc_bdev_ubi_get_histograms(struct spdk_jsonrpc_request *request,
+                                        const struct spdk_json_val *params) {
+    struct rpc_get_ubi_histograms req = {NULL};
+
+    if (spdk_json_decode_object(params, rpc_get_ubi_histograms_decoders,
+                                SPDK_COUNTOF(rpc_get_ubi_histograms_decoders), &req)) {
+        spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_INTERNAL_ERROR,
+                                         "spdk_json_decode_object failed");
+        free(req.name);
+        return;
+    }
+
+    bdev_ubi_get_histograms(req.name, req.reset, rpc_bdev_ubi_get_histograms_cb,
+                            request);
+    free(req.name);
+}
+SPDK_RPC_REGISTER("bdev_ubi_get_histograms", rpc_bdev_ubi_get_histograms,
+                  SPDK_RPC_RUNTIME)
+
+static const struct spdk_json_object_decoder rpc_set_ubi_image_delay_decoders[] = {
+    {"avg_latency_us", offsetof(struct spdk_ubi_image_delay_opts, avg_latency_us),
+     spdk_json_decode_uint64, true},
+    {"p99_latency_us", offsetof(struct spdk_ubi_image_delay_opts, p99_latency_us),
+     spdk_json_decode_uint64, true},
+    {"max_mbytes_per_sec", offsetof(struct spdk_ubi_image_delay_opts, max_mbytes_per_sec),
+     spdk_json_decode_uint64, true},
+};
+
+/*
+ * rpc_bdev_ubi_set_image_delay handles an rpc request to add latency and a
+ * bandwidth cap to image reads of all ubi bdevs. Omitted parameters are 0.
+ * It's for tests and benchmarks only, and shouldn't be used in production.
+ */
+static void rpc_bdev_ubi_set_image_delay(struct spdk_jsonrpc_request *request,
+                                         const struct spdk_json_val *params) {
+    struct spdk_ubi_image_delay_opts opts = {0};
+
+    if (params != NULL &&
+        spdk_json_decode_object(params, rpc_set_ubi_image_delay_decoders,
+                                SPDK_COUNTOF(rpc_set_ubi_image_delay_decoders), &opts)) {
+        spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_INTERNAL_ERROR,
+                                         "spdk_json_decode_object failed");
+        return;
+    }
+
+    bdev_ubi_set_image_delay(&opts);
+    spdk_jsonrpc_send_bool_response(request, true);
+}
+SPDK_RPC_REGISTER("bdev_ubi_set_image_delay", rpc_bdev_ubi_set_image_delay,
+                  SPDK_RPC_RUNTIME)
+
+struct rpc_set_ubi_stripe_cache {
+    uint64_t size_mb;
+};
+
+static const struct spdk_json_object_decoder rpc_set_ubi_stripe_cache_decoders[] = {
+    {"size_mb", offsetof(struct rpc_set_ubi_stripe_cache, size_mb),
+     spdk_json_decode_uint64},
+};
+
+/*
+ * rpc_bdev_ubi_set_stripe_cache handles an rpc request to set the size of the
+ * stripe cache shared by all ubi bdevs.
+ */
+static void rpc_bdev_ubi_set_stripe_cache(struct spdk_jsonrpc_request *request,
+                                          const struct spdk_json_val *params) {
+    struct rpc_set_ubi_stripe_cache req = {0};
+
+    if (spdk_json_decode_object(params, rpc_set_ubi_stripe_cache_decoders,
+                                SPDK_COUNTOF(rpc_set_ubi_stripe_cache_decoders), &req)) {
+        spdk_jsonrpc_send_error_response(request, SPDK_JSONRPC_ERROR_INTERNAL_ERROR,
+                                         "spdk_json_decode_object failed");
+        return;
+    }
+
+    bdev_ubi_set_stripe_cache(req.size_mb);
+    spdk_jsonrpc_send_bool_response(request, true);
+}
+SPDK_RPC_REGISTER("bdev_ubi_set_stripe_cache", rpc_bdev_ubi_set_stripe_cache,
+                  SPDK_RPC_STARTUP | SPDK_RPC_RUNTIME)
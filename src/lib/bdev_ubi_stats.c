@@ -0,0 +1,122 @@
+#include "bdev_ubi_internal.h"
+
+#include "spdk/log.h"
+#include "spdk/util.h"
+
+/*
+ * Counters are kept per I/O channel, so the I/O path doesn't need atomics.
+ * bdev_ubi_get_stats visits each channel in its own thread to sum them up.
+ */
+
+struct ubi_get_stats_request {
+    struct spdk_ubi_bdev_stats stats;
+    spdk_ubi_get_stats_complete cb_fn;
+    void *cb_arg;
+};
+
+/*
+ * Static function forward declarations
+ */
+static void ubi_add_io_stats(struct spdk_ubi_io_stats *dst,
+                             const struct spdk_ubi_io_stats *src);
+static void ubi_collect_channel_stats(struct spdk_io_channel_iter *i);
+static void ubi_collect_stats_done(struct spdk_io_channel_iter *i, int status);
+
+/*
+ * bdev_ubi_get_stats gathers statistics of the given bdev, and calls cb_fn
+ * with them in the calling thread.
+ */
+void bdev_ubi_get_stats(const char *bdev_name, spdk_ubi_get_stats_complete cb_fn,
+                        void *cb_arg) {
+    struct ubi_bdev *ubi_bdev = ubi_bdev_get_by_name(bdev_name);
+    if (ubi_bdev == NULL) {
+        cb_fn(cb_arg, NULL, -ENODEV);
+        return;
+    }
+
+    struct ubi_get_stats_request *req = calloc(1, sizeof(*req));
+    if (req == NULL) {
+        cb_fn(cb_arg, NULL, -ENOMEM);
+        return;
+    }
+
+    req->cb_fn = cb_fn;
+    req->cb_arg = cb_arg;
+
+    struct spdk_ubi_bdev_stats *stats = &req->stats;
+    stats->image_stripes =
+        spdk_divide_round_up(ubi_bdev->image_block_count, ubi_bdev->stripe_block_count);
+    stats->stripes_fetched =
+        __atomic_load_n(&ubi_bdev->stripes_fetched, __ATOMIC_ACQUIRE);
+    stats->stripes_flushed =
+        __atomic_load_n(&ubi_bdev->stripes_flushed, __ATOMIC_ACQUIRE);
+    ubi_add_io_stats(&stats->io, &ubi_bdev->closed_channel_stats);
+
+    spdk_for_each_channel(ubi_bdev, ubi_collect_channel_stats, req,
+                          ubi_collect_stats_done);
+}
+
+static void ubi_collect_channel_stats(struct spdk_io_channel_iter *i) {
+    struct ubi_get_stats_request *req = spdk_io_channel_iter_get_ctx(i);
+    struct spdk_io_channel *_ch = spdk_io_channel_iter_get_channel(i);
+    struct ubi_io_channel *ch = spdk_io_channel_get_ctx(_ch);
+    struct spdk_ubi_bdev_stats *stats = &req->stats;
+
+    ubi_add_io_stats(&stats->io, &ch->stats);
+    stats->channels++;
+    stats->active_reads += ch->active_reads;
+    stats->queued_stripe_fetches +=
+        (ch->stripe_fetch_queue.tail - ch->stripe_fetch_queue.head) &
+        (UBI_FETCH_QUEUE_SIZE - 1);
+
+    for (int j = 0; j < UBI_MAX_ACTIVE_STRIPE_FETCHES; j++) {
+        if (ch->stripe_fetches[j].active) {
+            stats->active_stripe_fetches++;
+        }
+    }
+
+    struct spdk_bdev_io *bdev_io;
+    TAILQ_FOREACH(bdev_io, &ch->io, module_link) { stats->queued_ios++; }
+
+    spdk_for_each_channel_continue(i, 0);
+}
+
+static void ubi_collect_stats_done(struct spdk_io_channel_iter *i, int status) {
+    struct ubi_get_stats_request *req = spdk_io_channel_iter_get_ctx(i);
+    req->cb_fn(req->cb_arg, status == 0 ? &req->stats : NULL, status);
+    free(req);
+}
+
+/*
+ * ubi_stats_close_channel adds counters of a channel which is being destroyed
+ * to its bdev's, so they aren't lost. Channels of a bdev can be destroyed in
+ * different threads concurrently.
+ */
+void ubi_stats_close_channel(struct ubi_io_channel *ch) {
+    struct spdk_ubi_io_stats *dst = &ch->ubi_bdev->closed_channel_stats;
+    struct spdk_ubi_io_stats *src = &ch->stats;
+
+    __atomic_fetch_add(&dst->blocks_read, src->blocks_read, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dst->blocks_written, src->blocks_written, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dst->stripe_fetches, src->stripe_fetches, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dst->image_bytes_read, src->image_bytes_read, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dst->fetch_bytes_written, src->fetch_bytes_written,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dst->ios_blocked_on_fetch, src->ios_blocked_on_fetch,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&dst->stripe_cache_hits, src->stripe_cache_hits,
+                       __ATOMIC_RELAXED);
+}
+
+static void ubi_add_io_stats(struct spdk_ubi_io_stats *dst,
+                             const struct spdk_ubi_io_stats *src) {
+    dst->blocks_read += __atomic_load_n(&src->blocks_read, __ATOMIC_RELAXED);
+    dst->blocks_written += __atomic_load_n(&src->blocks_written, __ATOMIC_RELAXED);
+    dst->stripe_fetches += __atomic_load_n(&src->stripe_fetches, __ATOMIC_RELAXED);
+    dst->image_bytes_read += __atomic_load_n(&src->image_bytes_read, __ATOMIC_RELAXED);
+    dst->fetch_bytes_written +=
+        __atomic_load_n(&src->fetch_bytes_written, __ATOMIC_RELAXED);
+    dst->ios_blocked_on_fetch +=
+        __atomic_load_n(&src->ios_blocked_on_fetch, __ATOMIC_RELAXED);
+    dst->stripe_cache_hits += __atomic_load_n(&src->stripe_cache_hits, __ATOMIC_RELAXED);
+}
@@ -9,38 +9,368 @@
 static void write_stripe_io_completion(struct spdk_bdev_io *bdev_io, bool success,
                                        void *cb_arg);
 static void ubi_fail_stripe_fetch(struct stripe_fetch *stripe_fetch);
+static void ubi_start_fetch_stripe_from_bdev(struct ubi_io_channel *ch,
+                                             struct stripe_fetch *stripe_fetch);
+static void read_stripe_io_completion(struct spdk_bdev_io *bdev_io, bool success,
+                                      void *cb_arg);
+static void ubi_start_copy_stripe(struct ubi_io_channel *ch,
+                                  struct stripe_fetch *stripe_fetch);
+static void copy_stripe_io_completion(struct spdk_bdev_io *bdev_io, bool success,
+                                      void *cb_arg);
+static void ubi_finish_stripe_write(struct stripe_fetch *stripe_fetch, bool success);
+static bool ubi_fetch_in_runs(struct ubi_bdev *ubi_bdev);
+static bool ubi_image_range_is_zero(struct ubi_bdev *ubi_bdev, uint64_t offset,
+                                    uint64_t nbytes);
+static int ubi_prep_stripe_read(struct ubi_io_channel *ch,
+                                struct stripe_fetch *stripe_fetch, int layer,
+                                uint64_t offset, uint8_t *buf, uint32_t nbytes);
+static int ubi_read_next_image_run(struct ubi_io_channel *ch,
+                                   struct stripe_fetch *stripe_fetch);
+static void ubi_write_zero_stripe(struct ubi_io_channel *ch,
+                                  struct stripe_fetch *stripe_fetch);
+static int ubi_read_zstd_stripe(struct ubi_io_channel *ch,
+                                struct stripe_fetch *stripe_fetch);
+static int ubi_decompress_zstd_stripe(struct ubi_io_channel *ch,
+                                      struct stripe_fetch *stripe_fetch, int res);
+static bool ubi_fetch_from_stripe_cache(struct ubi_io_channel *ch,
+                                        struct stripe_fetch *stripe_fetch);
+static int ubi_write_fetched_stripe(struct ubi_io_channel *ch,
+                                    struct stripe_fetch *stripe_fetch);
 
 void ubi_start_fetch_stripe(struct ubi_io_channel *ch,
                             struct stripe_fetch *stripe_fetch) {
     struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
-    struct io_uring *ring = &ch->image_file_ring;
-    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
     uint32_t stripe_idx = stripe_fetch->stripe_idx;
-    uint32_t alignment = ubi_bdev->alignment_bytes;
 
     uint64_t offset = ubi_bdev->stripe_size_kb * 1024L * stripe_idx;
     uint32_t nbytes = ubi_bdev->stripe_size_kb * 1024L;
 
-    uint64_t remainder = (uint64_t)stripe_fetch->buf & (alignment - 1);
-    uint32_t alignment_offset = remainder ? (alignment - remainder) : 0;
-    stripe_fetch->buf_aligned = stripe_fetch->buf + alignment_offset;
+    if (ubi_bdev->image_copy_offload) {
+        ubi_start_copy_stripe(ch, stripe_fetch);
+        return;
+    }
+
+    if (stripe_fetch->buf == NULL && ubi_alloc_fetch_bufs(ch) != 0) {
+        UBI_ERRLOG(ubi_bdev, "fetching stripe %d failed, could not allocate buffer\n",
+                   stripe_idx);
+        ubi_fail_stripe_fetch(stripe_fetch);
+        return;
+    }
+
+    if (ch->image_channel) {
+        ubi_start_fetch_stripe_from_bdev(ch, stripe_fetch);
+        return;
+    }
+
+    int rc;
+    stripe_fetch->phase_tsc = ubi_histogram_start(ch);
+    if (ubi_fetch_from_stripe_cache(ch, stripe_fetch)) {
+        return;
+    }
+
+    if (ubi_fetch_in_runs(ubi_bdev)) {
+        /* Stripes which read as zeros in all layers aren't read at all. */
+        if (ubi_image_range_is_zero(ubi_bdev, offset, nbytes)) {
+            ubi_write_zero_stripe(ch, stripe_fetch);
+            return;
+        }
+
+        stripe_fetch->read_offset = 0;
+        stripe_fetch->read_len = 0;
+        rc = ubi_read_next_image_run(ch, stripe_fetch);
+    } else if (ubi_bdev->zstd) {
+        rc = ubi_read_zstd_stripe(ch, stripe_fetch);
+    } else {
+        rc = ubi_prep_stripe_read(ch, stripe_fetch, UBI_IMAGE_LAYER_BASE, offset,
+                                  stripe_fetch->buf, nbytes);
+    }
+
+    if (rc > 0) {
+        spdk_trace_record(TRACE_UBI_FETCH_START, 0, 0, stripe_idx,
+                          (uint64_t)(stripe_fetch - ch->stripe_fetches));
+    }
+}
+
+/*
+ * ubi_fetch_in_runs returns whether stripes are read one run at a time, each
+ * of which is contiguous in the image file or in an overlay.
+ */
+static bool ubi_fetch_in_runs(struct ubi_bdev *ubi_bdev) {
+    return ubi_bdev->qcow2 != NULL || ubi_bdev->overlay_count > 0;
+}
+
+static bool ubi_image_range_is_zero(struct ubi_bdev *ubi_bdev, uint64_t offset,
+                                    uint64_t nbytes) {
+    uint64_t pos = 0;
+    while (pos < nbytes) {
+        uint64_t len = nbytes - pos;
+        uint64_t host;
+        if (ubi_image_map(ubi_bdev, offset + pos, &len, &host) != UBI_IMAGE_LAYER_ZERO) {
+            return false;
+        }
+        pos += len;
+    }
+
+    return true;
+}
+
+/*
+ * ubi_prep_stripe_read queues a read of nbytes at offset of the image file,
+ * or of an overlay if layer is one, into buf, which is within the stripe
+ * fetch's buffer. Returns 1 if it was queued, or fails the stripe fetch and
+ * returns -1.
+ */
+static int ubi_prep_stripe_read(struct ubi_io_channel *ch,
+                                struct stripe_fetch *stripe_fetch, int layer,
+                                uint64_t offset, uint8_t *buf, uint32_t nbytes) {
+    struct io_uring_sqe *sqe = ubi_image_ring_get_sqe(ch->image_ring);
+    if (sqe == NULL) {
+        UBI_ERRLOG(ch->ubi_bdev,
+                   "fetching stripe %d failed, no available SQE in io_uring\n",
+                   stripe_fetch->stripe_idx);
+        ubi_fail_stripe_fetch(stripe_fetch);
+        return -1;
+    }
+
+    int fd = layer == UBI_IMAGE_LAYER_BASE ? ch->image_file_fd : ch->overlay_fds[layer];
+
+    /* Compressed stripes are read into zbuf, which isn't registered. */
+    if (ch->fetch_bufs_registered && ch->ubi_bdev->zstd == NULL) {
+        int buf_index = stripe_fetch - ch->stripe_fetches;
+        io_uring_prep_read_fixed(sqe, fd, buf, nbytes, offset, buf_index);
+    } else {
+        io_uring_prep_read(sqe, fd, buf, nbytes, offset);
+    }
+    if (layer == UBI_IMAGE_LAYER_BASE) {
+        ubi_prep_image_sqe(ch, sqe);
+    }
+    ubi_image_sqe_set_op(sqe, &stripe_fetch->op);
+    return 1;
+}
+
+/*
+ * ubi_read_next_image_run queues a read of the next part of a stripe which is
+ * contiguous in the image file or in an overlay, zeroing the parts before it
+ * which read as zeros. Returns 1 if a read was queued, 0 if the whole stripe
+ * has been read, or -1 if the stripe fetch failed.
+ */
+static int ubi_read_next_image_run(struct ubi_io_channel *ch,
+                                   struct stripe_fetch *stripe_fetch) {
+    struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
+    uint32_t nbytes = ubi_bdev->stripe_size_kb * 1024L;
+    uint64_t stripe_offset = (uint64_t)nbytes * stripe_fetch->stripe_idx;
+
+    while (stripe_fetch->read_offset < nbytes) {
+        uint8_t *buf = stripe_fetch->buf + stripe_fetch->read_offset;
+        uint64_t len = nbytes - stripe_fetch->read_offset;
+        uint64_t host_offset;
+        int layer = ubi_image_map(ubi_bdev, stripe_offset + stripe_fetch->read_offset,
+                                  &len, &host_offset);
+        if (layer == UBI_IMAGE_LAYER_ZERO) {
+            memset(buf, 0, len);
+            stripe_fetch->read_offset += len;
+            continue;
+        }
+
+        stripe_fetch->read_len = len;
+        return ubi_prep_stripe_read(ch, stripe_fetch, layer, host_offset, buf, len);
+    }
+
+    return 0;
+}
+
+/*
+ * ubi_read_zstd_stripe queues a read of the compressed frames of a zstd
+ * stripe into zbuf. The read is widened to alignment_bytes, so it works with
+ * directio. Returns 1 if it was queued, or -1 if the stripe fetch failed.
+ */
+static int ubi_read_zstd_stripe(struct ubi_io_channel *ch,
+                                struct stripe_fetch *stripe_fetch) {
+    struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
+    uint64_t offset, len;
+    ubi_zstd_stripe_range(ubi_bdev->zstd, stripe_fetch->stripe_idx,
+                          ubi_bdev->stripe_size_kb * 1024L, &offset, &len);
+
+    uint64_t aligned_offset = offset - offset % ubi_bdev->alignment_bytes;
+    uint64_t aligned_len = SPDK_ALIGN_CEIL(offset + len - aligned_offset,
+                                           ubi_bdev->alignment_bytes);
+    stripe_fetch->read_offset = offset - aligned_offset;
+    stripe_fetch->read_len = len;
+    return ubi_prep_stripe_read(ch, stripe_fetch, UBI_IMAGE_LAYER_BASE, aligned_offset,
+                                stripe_fetch->zbuf, aligned_len);
+}
+
+/*
+ * ubi_decompress_zstd_stripe decompresses a zstd stripe read into zbuf into
+ * the stripe fetch buffer. A read may only be short past the frames, at EOF.
+ * Returns 0 on success, or fails the stripe fetch and returns -1.
+ */
+static int ubi_decompress_zstd_stripe(struct ubi_io_channel *ch,
+                                      struct stripe_fetch *stripe_fetch, int res) {
+    struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
+    if ((uint64_t)res < (uint64_t)stripe_fetch->read_offset + stripe_fetch->read_len) {
+        UBI_ERRLOG(ubi_bdev, "fetching stripe %d failed, zstd frames are truncated\n",
+                   stripe_fetch->stripe_idx);
+        ubi_fail_stripe_fetch(stripe_fetch);
+        return -1;
+    }
+
+    int rc = ubi_zstd_decompress_stripe(
+        ubi_bdev->zstd, &ch->zstd_dctx, stripe_fetch->stripe_idx,
+        ubi_bdev->stripe_size_kb * 1024L, stripe_fetch->zbuf + stripe_fetch->read_offset,
+        stripe_fetch->buf);
+    if (rc != 0) {
+        UBI_ERRLOG(ubi_bdev, "fetching stripe %d failed, decompression error: %s\n",
+                   stripe_fetch->stripe_idx, strerror(-rc));
+        ubi_fail_stripe_fetch(stripe_fetch);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * ubi_write_zero_stripe fetches a stripe which reads as zeros by zeroing it
+ * on base bdev, without reading or transferring any data.
+ */
+static void ubi_write_zero_stripe(struct ubi_io_channel *ch,
+                                  struct stripe_fetch *stripe_fetch) {
+    struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
+    uint64_t nbytes = ubi_bdev->stripe_size_kb * 1024L;
+    uint64_t offset = nbytes * stripe_fetch->stripe_idx +
+                      (uint64_t)ubi_bdev->data_offset_blocks * ubi_bdev->bdev.blocklen;
+
+    int ret = spdk_bdev_write_zeroes(ubi_bdev->base_bdev_info.desc, ch->base_channel,
+                                     offset, nbytes, write_stripe_io_completion,
+                                     stripe_fetch);
+    if (ret != 0) {
+        UBI_ERRLOG(ubi_bdev,
+                   "fetching stripe %d failed, spdk_bdev_write_zeroes error: %s\n",
+                   stripe_fetch->stripe_idx, strerror(-ret));
+        ubi_fail_stripe_fetch(stripe_fetch);
+        return;
+    }
+
+    spdk_trace_record(TRACE_UBI_FETCH_START, 0, 0, stripe_fetch->stripe_idx,
+                      (uint64_t)(stripe_fetch - ch->stripe_fetches));
+}
+
+/*
+ * ubi_start_fetch_stripe_from_bdev reads a stripe from the image bdev. The
+ * read completes in read_stripe_io_completion, which continues the same way
+ * as a read from the image file.
+ */
+static void ubi_start_fetch_stripe_from_bdev(struct ubi_io_channel *ch,
+                                             struct stripe_fetch *stripe_fetch) {
+    struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
+    uint32_t stripe_idx = stripe_fetch->stripe_idx;
 
-    io_uring_prep_read(sqe, ch->image_file_fd, stripe_fetch->buf_aligned, nbytes, offset);
-    io_uring_sqe_set_data(sqe, stripe_fetch);
+    uint64_t offset = ubi_bdev->stripe_size_kb * 1024L * stripe_idx;
+    uint64_t nbytes =
+        ubi_image_bdev_read_size(ubi_bdev, offset, ubi_bdev->stripe_size_kb * 1024L);
+    uint64_t image_offset =
+        ubi_bdev->image_offset_blocks * ubi_bdev->image_bdev_info.bdev->blocklen;
 
-    int ret = io_uring_submit(ring);
-    if (ret < 0) {
-        UBI_ERRLOG(ubi_bdev, "fetching stripe %d failed, io_uring_submit error: %s\n",
+    stripe_fetch->phase_tsc = ubi_histogram_start(ch);
+    int ret = spdk_bdev_read(ubi_bdev->image_bdev_info.desc, ch->image_channel,
+                             stripe_fetch->buf, image_offset + offset, nbytes,
+                             read_stripe_io_completion, stripe_fetch);
+    if (ret != 0) {
+        UBI_ERRLOG(ubi_bdev, "fetching stripe %d failed, spdk_bdev_read error: %s\n",
                    stripe_idx, strerror(-ret));
         ubi_fail_stripe_fetch(stripe_fetch);
+        return;
     }
+
+    spdk_trace_record(TRACE_UBI_FETCH_START, 0, 0, stripe_idx,
+                      (uint64_t)(stripe_fetch - ch->stripe_fetches));
+}
+
+static void read_stripe_io_completion(struct spdk_bdev_io *bdev_io, bool success,
+                                      void *cb_arg) {
+    struct stripe_fetch *stripe_fetch = cb_arg;
+
+    int res = success ? bdev_io->u.bdev.num_blocks * bdev_io->bdev->blocklen : -EIO;
+    spdk_bdev_free_io(bdev_io);
+    ubi_complete_fetch_stripe(stripe_fetch->ch, stripe_fetch, res);
+}
+
+/*
+ * ubi_start_copy_stripe fetches a stripe of an image stored on base bdev by
+ * having base bdev copy it, so it doesn't pass through host memory. Only the
+ * part of the stripe within the image is copied.
+ */
+static void ubi_start_copy_stripe(struct ubi_io_channel *ch,
+                                  struct stripe_fetch *stripe_fetch) {
+    struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
+    uint32_t stripe_idx = stripe_fetch->stripe_idx;
+    uint32_t blocklen = ubi_bdev->bdev.blocklen;
+
+    uint64_t stripe_offset_blocks = (uint64_t)ubi_bdev->stripe_block_count * stripe_idx;
+    uint64_t num_blocks =
+        ubi_image_bdev_read_size(ubi_bdev, stripe_offset_blocks * blocklen,
+                                 ubi_bdev->stripe_size_kb * 1024L) /
+        blocklen;
+    uint64_t src_block = ubi_bdev->image_offset_blocks + stripe_offset_blocks;
+    uint64_t dst_block = ubi_bdev->data_offset_blocks + stripe_offset_blocks;
+
+    stripe_fetch->phase_tsc = ubi_histogram_start(ch);
+    int ret = spdk_bdev_copy_blocks(ubi_bdev->base_bdev_info.desc, ch->base_channel,
+                                    dst_block, src_block, num_blocks,
+                                    copy_stripe_io_completion, stripe_fetch);
+    if (ret != 0) {
+        UBI_ERRLOG(ubi_bdev, "fetching stripe %d failed, spdk_bdev_copy error: %s\n",
+                   stripe_idx, strerror(-ret));
+        ubi_fail_stripe_fetch(stripe_fetch);
+        return;
+    }
+
+    spdk_trace_record(TRACE_UBI_FETCH_START, 0, 0, stripe_idx,
+                      (uint64_t)(stripe_fetch - ch->stripe_fetches));
+}
+
+/*
+ * copy_stripe_io_completion is called when base bdev has copied a stripe.
+ * The copy is both the read and the write of the fetch, so it's tallied as
+ * a fetch write.
+ */
+static void copy_stripe_io_completion(struct spdk_bdev_io *bdev_io, bool success,
+                                      void *cb_arg) {
+    struct stripe_fetch *stripe_fetch = cb_arg;
+
+    if (success) {
+        stripe_fetch->ch->stats.image_bytes_read +=
+            bdev_io->u.bdev.num_blocks * bdev_io->bdev->blocklen;
+    }
+    spdk_bdev_free_io(bdev_io);
+    ubi_finish_stripe_write(stripe_fetch, success);
+}
+
+/*
+ * ubi_fetch_from_stripe_cache copies a stripe from the stripe cache, if it's
+ * there, and writes it to base bdev. Returns whether the stripe was cached.
+ */
+static bool ubi_fetch_from_stripe_cache(struct ubi_io_channel *ch,
+                                        struct stripe_fetch *stripe_fetch) {
+    struct ubi_cache_entry *entry =
+        ubi_stripe_cache_get(ch->ubi_bdev->cache_image_id, stripe_fetch->stripe_idx);
+    if (entry == NULL) {
+        return false;
+    }
+
+    memcpy(stripe_fetch->buf, entry->buf, entry->len);
+    ubi_stripe_cache_put(entry);
+    ch->stats.stripe_cache_hits++;
+    spdk_trace_record(TRACE_UBI_FETCH_START, 0, 0, stripe_fetch->stripe_idx,
+                      (uint64_t)(stripe_fetch - ch->stripe_fetches));
+    ubi_write_fetched_stripe(ch, stripe_fetch);
+    return true;
 }
 
 int ubi_complete_fetch_stripe(struct ubi_io_channel *ch,
                               struct stripe_fetch *stripe_fetch, int res) {
-    uint64_t offset = ch->ubi_bdev->stripe_size_kb * 1024L * stripe_fetch->stripe_idx;
-    uint32_t nbytes = ch->ubi_bdev->stripe_size_kb * 1024L;
-
+    spdk_trace_record(TRACE_UBI_FETCH_READ_DONE, 0, 0, stripe_fetch->stripe_idx,
+                      (int64_t)res);
     if (res < 0) {
         UBI_ERRLOG(ch->ubi_bdev,
                    "fetching stripe %d failed while checking cqe->res: %s\n",
@@ -49,16 +379,57 @@ int ubi_complete_fetch_stripe(struct ubi_io_channel *ch,
         return -1;
     }
 
-    /*
-     * Now that we have read the stripe and have it in memory, write it to the
-     * base bdev.
-     */
+    ch->stats.image_bytes_read += res;
+
+    /* Read the rest of the stripe's runs. A short read only happens at EOF. */
+    if (ubi_fetch_in_runs(ch->ubi_bdev)) {
+        uint8_t *buf = stripe_fetch->buf + stripe_fetch->read_offset;
+        if ((uint32_t)res < stripe_fetch->read_len) {
+            memset(buf + res, 0, stripe_fetch->read_len - res);
+        }
+        stripe_fetch->read_offset += stripe_fetch->read_len;
+
+        int rc = ubi_read_next_image_run(ch, stripe_fetch);
+        if (rc != 0) {
+            return rc;
+        }
+    } else if (ch->ubi_bdev->zstd == NULL) {
+        /* The last stripe of a raw image is short at EOF. Cache it zero filled. */
+        uint32_t nbytes = ch->ubi_bdev->stripe_size_kb * 1024L;
+        if ((uint32_t)res < nbytes) {
+            memset(stripe_fetch->buf + res, 0, nbytes - res);
+        }
+    }
+
+    if (ch->ubi_bdev->zstd && ubi_decompress_zstd_stripe(ch, stripe_fetch, res) != 0) {
+        return -1;
+    }
+
+    ubi_stripe_cache_insert(ch->ubi_bdev->cache_image_id, stripe_fetch->stripe_idx,
+                            stripe_fetch->buf, ch->ubi_bdev->stripe_size_kb * 1024L);
+    return ubi_write_fetched_stripe(ch, stripe_fetch);
+}
+
+/*
+ * ubi_write_fetched_stripe writes a stripe which is in the stripe fetch's
+ * buffer to base bdev. Returns 1 if the write was submitted, or fails the
+ * stripe fetch and returns -1.
+ */
+static int ubi_write_fetched_stripe(struct ubi_io_channel *ch,
+                                    struct stripe_fetch *stripe_fetch) {
     struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
     struct ubi_base_bdev_info *base_info = &ubi_bdev->base_bdev_info;
+    uint64_t offset = ubi_bdev->stripe_size_kb * 1024L * stripe_fetch->stripe_idx;
+    uint32_t nbytes = ubi_bdev->stripe_size_kb * 1024L;
 
+    ubi_histogram_tally(ch, SPDK_UBI_LATENCY_FETCH_READ, stripe_fetch->phase_tsc);
+
+    uint64_t data_offset =
+        (uint64_t)ubi_bdev->data_offset_blocks * ubi_bdev->bdev.blocklen;
+    stripe_fetch->phase_tsc = ubi_histogram_start(ch);
     int ret = spdk_bdev_write(base_info->desc, ch->base_channel,
-                              stripe_fetch->buf_aligned, offset + UBI_METADATA_SIZE,
-                              nbytes, write_stripe_io_completion, stripe_fetch);
+                              stripe_fetch->buf, offset + data_offset, nbytes,
+                              write_stripe_io_completion, stripe_fetch);
     if (ret != 0) {
         UBI_ERRLOG(ch->ubi_bdev, "fetching stripe %d failed, spdk_bdev_write error: %s\n",
                    stripe_fetch->stripe_idx, strerror(-ret));
@@ -72,20 +443,73 @@ int ubi_complete_fetch_stripe(struct ubi_io_channel *ch,
 static void write_stripe_io_completion(struct spdk_bdev_io *bdev_io, bool success,
                                        void *cb_arg) {
     spdk_bdev_free_io(bdev_io);
+    ubi_finish_stripe_write(cb_arg, success);
+}
 
-    struct stripe_fetch *stripe_fetch = cb_arg;
-    ubi_set_stripe_status(stripe_fetch->ubi_bdev, stripe_fetch->stripe_idx,
-                          STRIPE_FETCHED);
-    stripe_fetch->ubi_bdev->stripes_fetched++;
+/*
+ * ubi_finish_stripe_write marks a stripe as fetched once it has been written
+ * to base bdev, or as failed.
+ */
+static void ubi_finish_stripe_write(struct stripe_fetch *stripe_fetch, bool success) {
+    struct ubi_bdev *ubi_bdev = stripe_fetch->ubi_bdev;
+    spdk_trace_record(TRACE_UBI_FETCH_WRITE_DONE, 0, 0, stripe_fetch->stripe_idx,
+                      (uint64_t)success);
+    if (!success) {
+        UBI_ERRLOG(ubi_bdev, "fetching stripe %d failed, base bdev write error\n",
+                   stripe_fetch->stripe_idx);
+        ubi_fail_stripe_fetch(stripe_fetch);
+        return;
+    }
+
+    struct ubi_io_channel *ch = stripe_fetch->ch;
+    ch->stats.fetch_bytes_written += ubi_bdev->stripe_size_kb * 1024L;
+    ubi_histogram_tally(ch, SPDK_UBI_LATENCY_FETCH_WRITE, stripe_fetch->phase_tsc);
+    ubi_set_stripe_status(ubi_bdev, stripe_fetch->stripe_idx, STRIPE_FETCHED);
+    __atomic_fetch_add(&ubi_bdev->stripes_fetched, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_sub(&ubi_bdev->stripe_fetches_active, 1, __ATOMIC_RELAXED);
     stripe_fetch->active = false;
+    ubi_kick_channel(stripe_fetch->ch);
 }
 
 static void ubi_fail_stripe_fetch(struct stripe_fetch *stripe_fetch) {
     ubi_set_stripe_status(stripe_fetch->ubi_bdev, stripe_fetch->stripe_idx,
                           STRIPE_FAILED);
+    __atomic_fetch_sub(&stripe_fetch->ubi_bdev->stripe_fetches_active, 1,
+                       __ATOMIC_RELAXED);
+    stripe_fetch->active = false;
+    ubi_kick_channel(stripe_fetch->ch);
+}
+
+/*
+ * ubi_cancel_stripe_fetch releases a stripe fetch whose channel is being
+ * destroyed. The stripe is marked failed like any failed fetch, since I/O of
+ * other channels may be waiting for it. The destroyed channel kicks them.
+ */
+void ubi_cancel_stripe_fetch(struct stripe_fetch *stripe_fetch) {
+    UBI_ERRLOG(stripe_fetch->ubi_bdev, "fetching stripe %d canceled, channel destroyed\n",
+               stripe_fetch->stripe_idx);
+    ubi_set_stripe_status(stripe_fetch->ubi_bdev, stripe_fetch->stripe_idx,
+                          STRIPE_FAILED);
+    __atomic_fetch_sub(&stripe_fetch->ubi_bdev->stripe_fetches_active, 1,
+                       __ATOMIC_RELAXED);
     stripe_fetch->active = false;
 }
 
+/*
+ * ubi_cancel_queued_stripe_fetches marks stripes which are still queued in a
+ * channel which is being destroyed as failed, like ubi_cancel_stripe_fetch.
+ */
+void ubi_cancel_queued_stripe_fetches(struct ubi_io_channel *ch) {
+    struct ubi_bdev *ubi_bdev = ch->ubi_bdev;
+    while (!stripe_queue_empty(ch)) {
+        int stripe_idx = dequeue_stripe(ch);
+        UBI_ERRLOG(ubi_bdev, "fetching stripe %d canceled, channel destroyed\n",
+                   stripe_idx);
+        ubi_set_stripe_status(ubi_bdev, stripe_idx, STRIPE_FAILED);
+        __atomic_fetch_sub(&ubi_bdev->stripe_fetches_queued, 1, __ATOMIC_RELAXED);
+    }
+}
+
 void enqueue_stripe(struct ubi_io_channel *ch, int stripe_idx) {
     ch->stripe_fetch_queue.entries[ch->stripe_fetch_queue.tail] = stripe_idx;
     ch->stripe_fetch_queue.tail =
@@ -104,7 +528,16 @@ bool stripe_queue_empty(struct ubi_io_channel *ch) {
 }
 
 enum stripe_status ubi_get_stripe_status(struct ubi_bdev *ubi_bdev, int index) {
-    return ubi_bdev->stripe_status[index];
+    enum stripe_status status = ubi_bdev->stripe_status[index];
+
+    /*
+     * stripe_status isn't initialized from metadata when the bdev is created,
+     * so stripes fetched before that are only marked in their stripe headers.
+     */
+    if (status == STRIPE_NOT_FETCHED && ubi_bdev->stripe_headers[index][0])
+        return STRIPE_FETCHED;
+
+    return status;
 }
 
 void ubi_set_stripe_status(struct ubi_bdev *ubi_bdev, int index,
@@ -112,6 +545,7 @@ void ubi_set_stripe_status(struct ubi_bdev *ubi_bdev, int index,
     ubi_bdev->stripe_status[index] = status;
 
     if (status == STRIPE_FETCHED) {
-        ubi_bdev->metadata.stripe_headers[index][0] = 1;
+        ubi_bdev->stripe_headers[index][0] = 1;
+        ubi_mark_metadata_dirty(ubi_bdev, ubi_bdev->stripe_headers[index]);
     }
 }
@@ -0,0 +1,89 @@
+#include "bdev_ubi_internal.h"
+
+#include "spdk/util.h"
+
+/*
+ * Tracepoints of the ubi I/O lifecycle. Enable them with "-e ubi", and
+ * inspect them with the spdk_trace tool, e.g. "spdk_trace -s vhost_ubi -p <pid>".
+ * A recorded I/O shows as SUBMIT, DEQUEUE, optionally IMAGE_READ_DONE or
+ * FLUSH_* phases, then COMPLETE. A stripe fetch shows as ENQUEUE (with the
+ * I/O which triggered it), START, READ_DONE, then WRITE_DONE.
+ */
+
+static void ubi_trace(void) {
+    struct spdk_trace_tpoint_opts opts[] = {
+        {"UBI_IO_SUBMIT",
+         TRACE_UBI_IO_SUBMIT,
+         OWNER_UBI,
+         OBJECT_UBI_IO,
+         1,
+         {{"type", SPDK_TRACE_ARG_TYPE_INT, 8},
+          {"offset", SPDK_TRACE_ARG_TYPE_INT, 8},
+          {"len", SPDK_TRACE_ARG_TYPE_INT, 8},
+          {"stripe", SPDK_TRACE_ARG_TYPE_INT, 8}}},
+        {"UBI_IO_DEQUEUE",
+         TRACE_UBI_IO_DEQUEUE,
+         OWNER_UBI,
+         OBJECT_UBI_IO,
+         0,
+         {{"stripe", SPDK_TRACE_ARG_TYPE_INT, 8}}},
+        {"UBI_IO_IMAGE_READ_DONE",
+         TRACE_UBI_IO_IMAGE_READ_DONE,
+         OWNER_UBI,
+         OBJECT_UBI_IO,
+         0,
+         {{"res", SPDK_TRACE_ARG_TYPE_INT, 8}}},
+        {"UBI_IO_COMPLETE",
+         TRACE_UBI_IO_COMPLETE,
+         OWNER_UBI,
+         OBJECT_UBI_IO,
+         0,
+         {{"success", SPDK_TRACE_ARG_TYPE_INT, 8}}},
+        {"UBI_FLUSH_COMMIT",
+         TRACE_UBI_FLUSH_COMMIT,
+         OWNER_UBI,
+         OBJECT_UBI_IO,
+         0,
+         {{"fetched", SPDK_TRACE_ARG_TYPE_INT, 8},
+          {"flushed", SPDK_TRACE_ARG_TYPE_INT, 8}}},
+        {"UBI_FLUSH_DATA",
+         TRACE_UBI_FLUSH_DATA,
+         OWNER_UBI,
+         OBJECT_UBI_IO,
+         0,
+         {{"offset", SPDK_TRACE_ARG_TYPE_INT, 8}, {"len", SPDK_TRACE_ARG_TYPE_INT, 8}}},
+        {"UBI_FETCH_ENQUEUE",
+         TRACE_UBI_FETCH_ENQUEUE,
+         OWNER_UBI,
+         OBJECT_UBI_STRIPE_FETCH,
+         1,
+         {{"io", SPDK_TRACE_ARG_TYPE_PTR, 8}}},
+        {"UBI_FETCH_START",
+         TRACE_UBI_FETCH_START,
+         OWNER_UBI,
+         OBJECT_UBI_STRIPE_FETCH,
+         0,
+         {{"slot", SPDK_TRACE_ARG_TYPE_INT, 8}}},
+        {"UBI_FETCH_READ_DONE",
+         TRACE_UBI_FETCH_READ_DONE,
+         OWNER_UBI,
+         OBJECT_UBI_STRIPE_FETCH,
+         0,
+         {{"res", SPDK_TRACE_ARG_TYPE_INT, 8}}},
+        {"UBI_FETCH_WRITE_DONE",
+         TRACE_UBI_FETCH_WRITE_DONE,
+         OWNER_UBI,
+         OBJECT_UBI_STRIPE_FETCH,
+         0,
+         {{"success", SPDK_TRACE_ARG_TYPE_INT, 8}}},
+    };
+
+    spdk_trace_register_owner(OWNER_UBI, 'u');
+    spdk_trace_register_object(OBJECT_UBI_IO, 'U');
+    spdk_trace_register_object(OBJECT_UBI_STRIPE_FETCH, 'S');
+    spdk_trace_register_description_ext(opts, SPDK_COUNTOF(opts));
+
+    /* Lets spdk_trace show which I/O a stripe fetch was started for. */
+    spdk_trace_tpoint_register_relation(TRACE_UBI_FETCH_ENQUEUE, OBJECT_UBI_IO, 0);
+}
+SPDK_TRACE_REGISTER_FN(ubi_trace, "ubi", TRACE_GROUP_UBI)
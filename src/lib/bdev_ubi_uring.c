@@ -0,0 +1,701 @@
+#include "bdev_ubi_internal.h"
+#include "bdev_ubi_test_control.h"
+#include "spdk/log.h"
+#include "spdk/util.h"
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+/*
+ * Image files are read through io_urings. By default all ubi channels on a
+ * thread share one ring, so the number of rings and of pollers checking
+ * them doesn't grow with the number of bdevs. Image files are registered in
+ * the ring's file table, so I/Os don't need a file table lookup in the kernel.
+ */
+
+/*
+ * Static function forward declarations
+ */
+static int ubi_create_thread_ctx_cb(void *io_device, void *ctx_buf);
+static void ubi_destroy_thread_ctx_cb(void *io_device, void *ctx_buf);
+static int ubi_thread_ctx_poll(void *arg);
+static int ubi_thread_ctx_interrupt(void *arg);
+static int ubi_thread_ctx_register_interrupt(struct ubi_thread_ctx *ctx);
+static void ubi_image_ring_reap(struct ubi_image_ring *image_ring);
+static struct ubi_io_channel *ubi_image_op_channel(struct ubi_io_op *op);
+static void ubi_image_op_complete(struct ubi_io_op *op, int res);
+static void ubi_image_op_cancel(struct ubi_io_op *op);
+static bool ubi_image_delay_enabled(void);
+static void ubi_image_ring_delay(struct ubi_image_ring *image_ring, struct ubi_io_op *op,
+                                 int res);
+static int ubi_image_ring_release_delayed(struct ubi_image_ring *image_ring);
+static void ubi_image_ring_arm_timeout(struct ubi_image_ring *image_ring);
+static void ubi_image_ring_cancel_delayed(struct ubi_image_ring *image_ring,
+                                          struct ubi_io_channel *ch);
+
+/*
+ * Test control
+ */
+static bool g_fail_uring_queue_init = false;
+static bool g_fail_uring_register = false;
+
+/*
+ * Image delay. Settings are changed by an rpc while other threads read them,
+ * so they're accessed atomically. g_image_delay_busy_until_tsc is when image
+ * reads issued so far would be done at the bandwidth cap.
+ */
+static uint64_t g_image_delay_avg_ticks;
+static uint64_t g_image_delay_p99_ticks;
+static uint64_t g_image_delay_bytes_per_sec;
+static uint64_t g_image_delay_busy_until_tsc;
+
+/*
+ * Address of this is the io_device whose channels are ubi_thread_ctxs.
+ */
+static int g_ubi_thread_ctx_device;
+
+void ubi_uring_initialize(void) {
+    spdk_io_device_register(&g_ubi_thread_ctx_device, ubi_create_thread_ctx_cb,
+                            ubi_destroy_thread_ctx_cb, sizeof(struct ubi_thread_ctx),
+                            "ubi_thread_ctx");
+}
+
+void ubi_uring_finish(void) { spdk_io_device_unregister(&g_ubi_thread_ctx_device, NULL); }
+
+/*
+ * ubi_get_thread_ctx_channel returns a channel whose context is the
+ * ubi_thread_ctx of the current thread.
+ */
+struct spdk_io_channel *ubi_get_thread_ctx_channel(void) {
+    if (g_fail_uring_queue_init) {
+        return NULL;
+    }
+
+    return spdk_get_io_channel(&g_ubi_thread_ctx_device);
+}
+
+static int ubi_create_thread_ctx_cb(void *io_device, void *ctx_buf) {
+    struct ubi_thread_ctx *ctx = ctx_buf;
+
+    int rc = ubi_image_ring_init(&ctx->image_ring, UBI_SHARED_URING_QUEUE_SIZE, 0, -1,
+                                 UBI_SHARED_URING_MAX_FILES);
+    if (rc != 0) {
+        SPDK_ERRLOG("Unable to setup shared io_uring: %s\n", strerror(-rc));
+        return rc;
+    }
+
+    ctx->poller = NULL;
+    ctx->intr = NULL;
+    ctx->efd = -1;
+    if (spdk_interrupt_mode_is_enabled()) {
+        rc = ubi_thread_ctx_register_interrupt(ctx);
+    } else {
+        ctx->poller = spdk_poller_register(ubi_thread_ctx_poll, ctx, 0);
+        rc = ctx->poller == NULL ? -ENOMEM : 0;
+    }
+
+    if (rc != 0) {
+        SPDK_ERRLOG("could not register shared io_uring poller: %s\n", strerror(-rc));
+        ubi_image_ring_exit(&ctx->image_ring);
+        if (ctx->efd >= 0) {
+            close(ctx->efd);
+        }
+        return rc;
+    }
+
+    return 0;
+}
+
+static int ubi_thread_ctx_register_interrupt(struct ubi_thread_ctx *ctx) {
+    ctx->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ctx->efd < 0) {
+        return -errno;
+    }
+
+    int rc = ubi_image_ring_set_eventfd(&ctx->image_ring, ctx->efd);
+    if (rc != 0) {
+        return rc;
+    }
+
+    ctx->intr = SPDK_INTERRUPT_REGISTER(ctx->efd, ubi_thread_ctx_interrupt, ctx);
+    return ctx->intr == NULL ? -ENOMEM : 0;
+}
+
+static void ubi_destroy_thread_ctx_cb(void *io_device, void *ctx_buf) {
+    struct ubi_thread_ctx *ctx = ctx_buf;
+    spdk_poller_unregister(&ctx->poller);
+    spdk_interrupt_unregister(&ctx->intr);
+    ubi_image_ring_exit(&ctx->image_ring);
+    if (ctx->efd >= 0) {
+        close(ctx->efd);
+    }
+}
+
+/*
+ * ubi_thread_ctx_poll completes image I/Os of all ubi channels of the
+ * thread, and submits the ones they have prepared since the last call.
+ */
+static int ubi_thread_ctx_poll(void *arg) {
+    struct ubi_thread_ctx *ctx = arg;
+    int completed = ubi_image_ring_complete(&ctx->image_ring);
+    int submitted = ubi_image_ring_submit(&ctx->image_ring);
+    return completed > 0 || submitted > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
+
+/*
+ * ubi_thread_ctx_interrupt is ubi_thread_ctx_poll for interrupt mode, called
+ * when the ring's eventfd is signaled.
+ */
+static int ubi_thread_ctx_interrupt(void *arg) {
+    struct ubi_thread_ctx *ctx = arg;
+    struct ubi_image_ring *image_ring = &ctx->image_ring;
+
+    ubi_drain_eventfd(ctx->efd, &image_ring->efd_signaled);
+    int rc = ubi_thread_ctx_poll(ctx);
+
+    /*
+     * Completions are handled in batches, and a failed submission is
+     * retried, so we might need to run again. Delayed reads wake the ring
+     * with a timeout once they're due.
+     */
+    if (io_uring_cq_ready(&image_ring->ring) > 0 || image_ring->pending_sqes > 0) {
+        ubi_signal_eventfd(ctx->efd, &image_ring->efd_signaled);
+    }
+
+    return rc;
+}
+
+/*
+ * ubi_image_ring_init sets up an io_uring with the given setup flags, and a
+ * registered file table with "max_files" slots. Failing to register the
+ * file table isn't an error. Files just won't be registered in that case.
+ */
+int ubi_image_ring_init(struct ubi_image_ring *image_ring, uint32_t entries,
+                        uint32_t flags, int sq_thread_cpu, uint32_t max_files) {
+    memset(image_ring, 0, sizeof(*image_ring));
+    image_ring->efd = -1;
+    TAILQ_INIT(&image_ring->delayed);
+    /* xorshift needs a non-zero state. */
+    image_ring->delay_rand_state = spdk_get_ticks() | 1;
+    if (g_fail_uring_queue_init) {
+        return -EINVAL;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = flags;
+    if (flags & IORING_SETUP_SQ_AFF) {
+        params.sq_thread_cpu = sq_thread_cpu;
+    }
+
+    int rc = io_uring_queue_init_params(entries, &image_ring->ring, &params);
+    if (rc != 0) {
+        return rc;
+    }
+
+    image_ring->reap = (flags & IORING_SETUP_IOPOLL) && !(flags & IORING_SETUP_SQPOLL);
+
+    image_ring->files = malloc(max_files * sizeof(int));
+    if (image_ring->files == NULL) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < max_files; i++) {
+        image_ring->files[i] = -1;
+    }
+
+    rc = g_fail_uring_register
+             ? -ENOMEM
+             : io_uring_register_files(&image_ring->ring, image_ring->files, max_files);
+    if (rc != 0) {
+        SPDK_DEBUGLOG(bdev_ubi, "could not register io_uring file table: %s\n",
+                      strerror(-rc));
+        free(image_ring->files);
+        image_ring->files = NULL;
+        return 0;
+    }
+
+    image_ring->max_files = max_files;
+    return 0;
+}
+
+void ubi_image_ring_exit(struct ubi_image_ring *image_ring) {
+    io_uring_queue_exit(&image_ring->ring);
+    free(image_ring->files);
+    image_ring->files = NULL;
+}
+
+/*
+ * ubi_image_ring_probe synchronously reads the first "nbytes" of "fd"
+ * through the ring, and returns whether it succeeded. It must be called
+ * before any other I/O is submitted to the ring.
+ */
+bool ubi_image_ring_probe(struct ubi_image_ring *image_ring, int fd, uint32_t nbytes,
+                          uint32_t alignment) {
+    struct io_uring *ring = &image_ring->ring;
+    void *buf = spdk_dma_malloc(nbytes, alignment, NULL);
+    struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+    if (buf == NULL || sqe == NULL) {
+        spdk_dma_free(buf);
+        return false;
+    }
+
+    io_uring_prep_read(sqe, fd, buf, nbytes, 0);
+    io_uring_sqe_set_data(sqe, NULL);
+
+    struct io_uring_cqe *cqe;
+    int rc = io_uring_submit_and_wait(ring, 1);
+    if (rc >= 0) {
+        rc = io_uring_peek_cqe(ring, &cqe);
+    }
+    if (rc == 0) {
+        rc = cqe->res < 0 ? cqe->res : 0;
+        io_uring_cqe_seen(ring, cqe);
+    }
+
+    spdk_dma_free(buf);
+    return rc == 0;
+}
+
+/*
+ * ubi_image_ring_add_file registers "fd" in a free slot of the ring's file
+ * table. Returns the slot, or -1 if it couldn't be registered.
+ */
+int ubi_image_ring_add_file(struct ubi_image_ring *image_ring, int fd) {
+    if (image_ring->files == NULL) {
+        return -1;
+    }
+
+    for (uint32_t slot = 0; slot < image_ring->max_files; slot++) {
+        if (image_ring->files[slot] != -1) {
+            continue;
+        }
+
+        int rc = io_uring_register_files_update(&image_ring->ring, slot, &fd, 1);
+        if (rc != 1) {
+            SPDK_DEBUGLOG(bdev_ubi, "could not register file in io_uring: %s\n",
+                          strerror(-rc));
+            return -1;
+        }
+
+        image_ring->files[slot] = fd;
+        return slot;
+    }
+
+    return -1;
+}
+
+void ubi_image_ring_remove_file(struct ubi_image_ring *image_ring, int slot) {
+    if (slot < 0) {
+        return;
+    }
+
+    int fd = -1;
+    io_uring_register_files_update(&image_ring->ring, slot, &fd, 1);
+    image_ring->files[slot] = -1;
+}
+
+int ubi_image_ring_register_buffers(struct ubi_image_ring *image_ring,
+                                    const struct iovec *iovs, unsigned n) {
+    if (g_fail_uring_register) {
+        return -ENOMEM;
+    }
+
+    return io_uring_register_buffers(&image_ring->ring, iovs, n);
+}
+
+/*
+ * ubi_image_ring_get_sqe returns an SQE which will be submitted with the
+ * next ubi_image_ring_submit. Callers must prepare it right away. If the
+ * submission queue is full, it's submitted early to make room.
+ */
+struct io_uring_sqe *ubi_image_ring_get_sqe(struct ubi_image_ring *image_ring) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&image_ring->ring);
+    if (sqe == NULL && ubi_image_ring_submit(image_ring) > 0) {
+        sqe = io_uring_get_sqe(&image_ring->ring);
+    }
+
+    if (sqe != NULL) {
+        image_ring->pending_sqes++;
+        if (image_ring->efd >= 0) {
+            ubi_signal_eventfd(image_ring->efd, &image_ring->efd_signaled);
+        }
+    }
+
+    return sqe;
+}
+
+/*
+ * ubi_image_sqe_set_op makes "op" the user data of an SQE, and counts it as
+ * in flight for its channel until its CQE is seen.
+ */
+void ubi_image_sqe_set_op(struct io_uring_sqe *sqe, struct ubi_io_op *op) {
+    io_uring_sqe_set_data(sqe, op);
+    op->canceled = false;
+    ubi_image_op_channel(op)->image_ops_inflight++;
+}
+
+/*
+ * ubi_image_ring_submit submits all SQEs prepared since the last call with a
+ * single syscall, and returns how many were submitted. Failures of
+ * individual SQEs are reported in their CQEs. If submission itself fails or
+ * is partial, remaining SQEs stay in the submission queue and are retried on
+ * the next call.
+ */
+int ubi_image_ring_submit(struct ubi_image_ring *image_ring) {
+    if (image_ring->pending_sqes == 0) {
+        return 0;
+    }
+
+    int ret = io_uring_submit(&image_ring->ring);
+    if (ret < 0) {
+        if (ret != -EAGAIN && ret != -EBUSY && ret != -EINTR) {
+            SPDK_ERRLOG("io_uring_submit failed: %s\n", strerror(-ret));
+        }
+        return 0;
+    }
+
+    image_ring->pending_sqes -= spdk_min((uint32_t)ret, image_ring->pending_sqes);
+    if (image_ring->reap) {
+        image_ring->inflight_sqes += ret;
+    }
+
+    return ret;
+}
+
+/*
+ * ubi_image_ring_reap asks the kernel to poll for completions of an IOPOLL
+ * ring, without waiting for any. Completions of such rings are never posted
+ * to the completion queue otherwise.
+ */
+static void ubi_image_ring_reap(struct ubi_image_ring *image_ring) {
+    struct io_uring *ring = &image_ring->ring;
+    if (image_ring->inflight_sqes == 0 || io_uring_cq_ready(ring) > 0) {
+        return;
+    }
+
+    int ret = syscall(__NR_io_uring_enter, ring->ring_fd, 0, 0, IORING_ENTER_GETEVENTS,
+                      NULL, 0);
+    if (ret < 0 && errno != EAGAIN && errno != EINTR) {
+        SPDK_ERRLOG("polling io_uring failed: %s\n", strerror(errno));
+    }
+}
+
+/*
+ * ubi_image_ring_complete handles available completions, and returns how
+ * many there were. Each CQE's user data is the ubi_io_op of the I/O, which
+ * knows its channel. With image delay, completions are held back until
+ * they're due.
+ */
+int ubi_image_ring_complete(struct ubi_image_ring *image_ring) {
+    struct io_uring *ring = &image_ring->ring;
+    struct io_uring_cqe *cqe[64];
+
+    if (image_ring->reap) {
+        ubi_image_ring_reap(image_ring);
+    }
+
+    bool delay = ubi_image_delay_enabled();
+    int batch = io_uring_peek_batch_cqe(ring, cqe, 64);
+    for (int i = 0; i < batch; i++) {
+        struct ubi_io_op *op = io_uring_cqe_get_data(cqe[i]);
+        int res = cqe[i]->res;
+        io_uring_cqe_seen(ring, cqe[i]);
+
+        /* Cancel requests have no op. */
+        if (op == NULL) {
+            continue;
+        }
+
+        if ((void *)op == &image_ring->timeout_ts) {
+            image_ring->timeout_tsc = 0;
+            continue;
+        }
+
+        ubi_image_op_channel(op)->image_ops_inflight--;
+        if (op->canceled) {
+            ubi_image_op_cancel(op);
+        } else if (delay) {
+            ubi_image_ring_delay(image_ring, op, res);
+        } else {
+            ubi_image_op_complete(op, res);
+        }
+    }
+
+    if (image_ring->reap) {
+        image_ring->inflight_sqes -= spdk_min((uint32_t)batch, image_ring->inflight_sqes);
+    }
+
+    int released = 0;
+    if (!TAILQ_EMPTY(&image_ring->delayed)) {
+        released = ubi_image_ring_release_delayed(image_ring);
+        ubi_image_ring_arm_timeout(image_ring);
+    }
+
+    return batch + released;
+}
+
+/*
+ * ubi_image_ring_cancel_channel is called when "ch" is destroyed. It cancels
+ * the channel's reads which are still in the ring, and waits until the kernel
+ * is done with them, so the channel's buffers and file slot can be released.
+ * Reads of other channels which complete meanwhile are handled as usual.
+ */
+void ubi_image_ring_cancel_channel(struct ubi_image_ring *image_ring,
+                                   struct ubi_io_channel *ch) {
+    ubi_image_ring_cancel_delayed(image_ring, ch);
+    if (ch->image_ops_inflight == 0) {
+        return;
+    }
+
+    /*
+     * Reads of the channel's bdev I/Os are done by now, so only stripe
+     * fetches can be left. Reads which already started can't be canceled,
+     * so the cancel requests only save waiting for the queued ones.
+     */
+    for (int i = 0; i < UBI_MAX_ACTIVE_STRIPE_FETCHES; i++) {
+        struct stripe_fetch *stripe_fetch = &ch->stripe_fetches[i];
+        if (!stripe_fetch->active) {
+            continue;
+        }
+
+        stripe_fetch->op.canceled = true;
+        struct io_uring_sqe *sqe = ubi_image_ring_get_sqe(image_ring);
+        if (sqe != NULL) {
+            io_uring_prep_cancel(sqe, &stripe_fetch->op, 0);
+            io_uring_sqe_set_data(sqe, NULL);
+        }
+    }
+
+    while (ch->image_ops_inflight > 0) {
+        ubi_image_ring_submit(image_ring);
+
+        struct io_uring_cqe *cqe;
+        int rc = io_uring_wait_cqe(&image_ring->ring, &cqe);
+        if (rc != 0 && rc != -EINTR && rc != -EAGAIN) {
+            SPDK_ERRLOG("waiting for canceled image reads failed: %s\n", strerror(-rc));
+            return;
+        }
+
+        ubi_image_ring_complete(image_ring);
+    }
+
+    /* Reads which weren't canceled might have been delayed while waiting. */
+    ubi_image_ring_cancel_delayed(image_ring, ch);
+}
+
+/*
+ * ubi_image_ring_cancel_delayed cancels delayed completions of "ch". The
+ * kernel is already done with them.
+ */
+static void ubi_image_ring_cancel_delayed(struct ubi_image_ring *image_ring,
+                                          struct ubi_io_channel *ch) {
+    struct ubi_io_op *op, *tmp;
+    TAILQ_FOREACH_SAFE(op, &image_ring->delayed, delay_link, tmp) {
+        if (ubi_image_op_channel(op) == ch) {
+            TAILQ_REMOVE(&image_ring->delayed, op, delay_link);
+            ubi_image_op_cancel(op);
+        }
+    }
+}
+
+static struct ubi_io_channel *ubi_image_op_channel(struct ubi_io_op *op) {
+    if (op->type == UBI_STRIPE_FETCH) {
+        return ((struct stripe_fetch *)op)->ch;
+    }
+
+    return ((struct ubi_bdev_io *)op)->ubi_ch;
+}
+
+/*
+ * ubi_image_op_cancel releases an op whose channel is being destroyed,
+ * without starting anything else for it.
+ */
+static void ubi_image_op_cancel(struct ubi_io_op *op) {
+    switch (op->type) {
+    case UBI_STRIPE_FETCH:
+        ubi_cancel_stripe_fetch((struct stripe_fetch *)op);
+        break;
+    case UBI_BDEV_IO: {
+        struct ubi_bdev_io *ubi_io = (struct ubi_bdev_io *)op;
+        ubi_complete_read_from_image(ubi_io->ubi_ch, ubi_io, -ECANCELED);
+        break;
+    }
+    }
+}
+
+static void ubi_image_op_complete(struct ubi_io_op *op, int res) {
+    switch (op->type) {
+    case UBI_STRIPE_FETCH: {
+        struct stripe_fetch *stripe_fetch = (struct stripe_fetch *)op;
+        ubi_complete_fetch_stripe(stripe_fetch->ch, stripe_fetch, res);
+        break;
+    }
+    case UBI_BDEV_IO: {
+        struct ubi_bdev_io *ubi_io = (struct ubi_bdev_io *)op;
+        ubi_complete_read_from_image(ubi_io->ubi_ch, ubi_io, res);
+        break;
+    }
+    }
+}
+
+/*
+ * bdev_ubi_set_image_delay sets latency and bandwidth cap of image reads
+ * completing from now on. Only tests and benchmarks use it.
+ */
+void bdev_ubi_set_image_delay(const struct spdk_ubi_image_delay_opts *opts) {
+    uint64_t ticks_per_us = spdk_get_ticks_hz() / 1000000;
+    __atomic_store_n(&g_image_delay_avg_ticks, opts->avg_latency_us * ticks_per_us,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&g_image_delay_p99_ticks, opts->p99_latency_us * ticks_per_us,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&g_image_delay_bytes_per_sec, opts->max_mbytes_per_sec * 1024 * 1024,
+                     __ATOMIC_RELAXED);
+}
+
+static bool ubi_image_delay_enabled(void) {
+    return __atomic_load_n(&g_image_delay_avg_ticks, __ATOMIC_RELAXED) != 0 ||
+           __atomic_load_n(&g_image_delay_p99_ticks, __ATOMIC_RELAXED) != 0 ||
+           __atomic_load_n(&g_image_delay_bytes_per_sec, __ATOMIC_RELAXED) != 0;
+}
+
+/*
+ * ubi_image_ring_delay holds back completion of an image read until its
+ * latency has passed, and the bandwidth cap allows it.
+ */
+static void ubi_image_ring_delay(struct ubi_image_ring *image_ring, struct ubi_io_op *op,
+                                 int res) {
+    uint64_t now = spdk_get_ticks();
+    uint64_t latency = __atomic_load_n(&g_image_delay_avg_ticks, __ATOMIC_RELAXED);
+    uint64_t p99_latency = __atomic_load_n(&g_image_delay_p99_ticks, __ATOMIC_RELAXED);
+    uint64_t bytes_per_sec =
+        __atomic_load_n(&g_image_delay_bytes_per_sec, __ATOMIC_RELAXED);
+
+    if (p99_latency != 0 &&
+        spdk_rand_xorshift64(&image_ring->delay_rand_state) % 100 == 0) {
+        latency = p99_latency;
+    }
+
+    op->res = res;
+    op->complete_tsc = now + latency;
+
+    if (bytes_per_sec != 0 && res > 0) {
+        uint64_t transfer_ticks = (uint64_t)res * spdk_get_ticks_hz() / bytes_per_sec;
+        uint64_t busy_until =
+            __atomic_load_n(&g_image_delay_busy_until_tsc, __ATOMIC_RELAXED);
+        uint64_t done;
+        do {
+            done = spdk_max(busy_until, now) + transfer_ticks;
+        } while (!__atomic_compare_exchange_n(&g_image_delay_busy_until_tsc, &busy_until,
+                                              done, false, __ATOMIC_RELAXED,
+                                              __ATOMIC_RELAXED));
+        op->complete_tsc = spdk_max(op->complete_tsc, done);
+    }
+
+    struct ubi_io_op *prev = TAILQ_LAST(&image_ring->delayed, ubi_io_op_list);
+    while (prev != NULL && prev->complete_tsc > op->complete_tsc) {
+        prev = TAILQ_PREV(prev, ubi_io_op_list, delay_link);
+    }
+
+    if (prev == NULL) {
+        TAILQ_INSERT_HEAD(&image_ring->delayed, op, delay_link);
+    } else {
+        TAILQ_INSERT_AFTER(&image_ring->delayed, prev, op, delay_link);
+    }
+}
+
+static int ubi_image_ring_release_delayed(struct ubi_image_ring *image_ring) {
+    uint64_t now = spdk_get_ticks();
+    int released = 0;
+
+    struct ubi_io_op *op;
+    while ((op = TAILQ_FIRST(&image_ring->delayed)) != NULL && op->complete_tsc <= now) {
+        TAILQ_REMOVE(&image_ring->delayed, op, delay_link);
+        ubi_image_op_complete(op, op->res);
+        released++;
+    }
+
+    return released;
+}
+
+/*
+ * ubi_image_ring_arm_timeout makes the ring wake up through its eventfd when
+ * the earliest delayed read is due, unless a timeout which fires before then
+ * is already armed. Polled rings check the delayed reads on every poll, so
+ * they don't need one.
+ */
+static void ubi_image_ring_arm_timeout(struct ubi_image_ring *image_ring) {
+    struct ubi_io_op *first = TAILQ_FIRST(&image_ring->delayed);
+    if (image_ring->efd < 0 || first == NULL) {
+        return;
+    }
+
+    if (image_ring->timeout_tsc != 0 && image_ring->timeout_tsc <= first->complete_tsc) {
+        return;
+    }
+
+    /* If the SQ is full, pending SQEs make the ring run again and retry this. */
+    struct io_uring_sqe *sqe = ubi_image_ring_get_sqe(image_ring);
+    if (sqe == NULL) {
+        return;
+    }
+
+    uint64_t hz = spdk_get_ticks_hz();
+    uint64_t now = spdk_get_ticks();
+    uint64_t ticks = first->complete_tsc > now ? first->complete_tsc - now : 0;
+    uint64_t ns = ticks / hz * SPDK_SEC_TO_NSEC +
+                  spdk_divide_round_up(ticks % hz * SPDK_SEC_TO_NSEC, hz);
+    image_ring->timeout_ts.tv_sec = ns / SPDK_SEC_TO_NSEC;
+    image_ring->timeout_ts.tv_nsec = ns % SPDK_SEC_TO_NSEC;
+    io_uring_prep_timeout(sqe, &image_ring->timeout_ts, 0, 0);
+    io_uring_sqe_set_data(sqe, &image_ring->timeout_ts);
+    image_ring->timeout_tsc = first->complete_tsc;
+}
+
+/*
+ * ubi_image_ring_set_eventfd makes the kernel signal "efd" on completions of
+ * the ring. IOPOLL rings never signal it, so they can't be used with it.
+ */
+int ubi_image_ring_set_eventfd(struct ubi_image_ring *image_ring, int efd) {
+    int rc = io_uring_register_eventfd(&image_ring->ring, efd);
+    if (rc != 0) {
+        return rc;
+    }
+
+    image_ring->efd = efd;
+    return 0;
+}
+
+/*
+ * ubi_signal_eventfd signals "efd" unless it's already been signaled since
+ * it was last drained, which "signaled" tracks, to save syscalls.
+ */
+void ubi_signal_eventfd(int efd, bool *signaled) {
+    if (*signaled) {
+        return;
+    }
+
+    uint64_t one = 1;
+    *signaled = true;
+    if (write(efd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        SPDK_ERRLOG("could not signal eventfd: %s\n", strerror(errno));
+        *signaled = false;
+    }
+}
+
+/*
+ * ubi_drain_eventfd resets "efd" before the work it signals is done, so
+ * signals during that work aren't lost.
+ */
+void ubi_drain_eventfd(int efd, bool *signaled) {
+    uint64_t count;
+    *signaled = false;
+    if (read(efd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        SPDK_ERRLOG("could not read eventfd: %s\n", strerror(errno));
+    }
+}
+
+/*
+ * Test control
+ */
+void ubi_uring_fail_queue_init(bool fail) { g_fail_uring_queue_init = fail; }
+void ubi_uring_fail_register(bool fail) { g_fail_uring_register = fail; }
@@ -0,0 +1,233 @@
+#include "bdev_ubi_internal.h"
+
+#include "spdk/endian.h"
+#include "spdk/log.h"
+#include "spdk/util.h"
+
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+/*
+ * Images in the zstd seekable format are a sequence of independent zstd
+ * frames followed by a seek table, which is a skippable frame with the
+ * compressed and decompressed size of each frame. The seek table is read once
+ * when the bdev is created, into the offset of each frame in the file.
+ *
+ * Every frame but the last must have the same decompressed size, and stripe
+ * size must be a multiple of it, so a stripe is fetched with one read of its
+ * frames, which are then decompressed into the stripe fetch buffer.
+ * Decompression needs bdev_ubi to be built with WITH_ZSTD=true.
+ */
+
+#define ZSTD_SEEKABLE_MAGIC 0x8F92EAB1
+#define ZSTD_SKIPPABLE_MAGIC 0x184D2A5E
+#define ZSTD_SEEKABLE_FOOTER_SIZE 9
+#define ZSTD_SKIPPABLE_HEADER_SIZE 8
+#define ZSTD_SEEKABLE_CHECKSUM_FLAG 0x80
+#define ZSTD_SEEKABLE_RESERVED_BITS 0x7c
+
+/*
+ * Static function forward declarations
+ */
+static int ubi_zstd_load_seek_table(const char *path, int fd, uint64_t table_offset,
+                                    uint32_t entry_size, struct ubi_zstd *zstd);
+
+/*
+ * ubi_zstd_load builds the frame index of the image at path if it's in the
+ * zstd seekable format. *out is set to NULL for other images.
+ */
+int ubi_zstd_load(const char *path, struct ubi_zstd **out) {
+    *out = NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        int rc = -errno;
+        SPDK_ERRLOG("could not open %s: %s\n", path, strerror(errno));
+        return rc;
+    }
+
+    struct stat st;
+    uint8_t footer[ZSTD_SEEKABLE_FOOTER_SIZE];
+    if (fstat(fd, &st) < 0 || st.st_size < ZSTD_SEEKABLE_FOOTER_SIZE ||
+        pread(fd, footer, sizeof(footer), st.st_size - sizeof(footer)) !=
+            sizeof(footer) ||
+        from_le32(footer + 5) != ZSTD_SEEKABLE_MAGIC) {
+        close(fd);
+        return 0;
+    }
+
+#ifndef WITH_ZSTD
+    SPDK_ERRLOG("%s is a zstd image, but bdev_ubi was built without WITH_ZSTD\n", path);
+    close(fd);
+    return -ENOTSUP;
+#endif
+
+    uint32_t frame_count = from_le32(footer);
+    uint8_t descriptor = footer[4];
+    uint32_t entry_size = descriptor & ZSTD_SEEKABLE_CHECKSUM_FLAG ? 12 : 8;
+    uint64_t table_size = ZSTD_SKIPPABLE_HEADER_SIZE +
+                          (uint64_t)frame_count * entry_size + ZSTD_SEEKABLE_FOOTER_SIZE;
+    if ((descriptor & ZSTD_SEEKABLE_RESERVED_BITS) || frame_count == 0 ||
+        table_size > (uint64_t)st.st_size) {
+        SPDK_ERRLOG("%s: invalid zstd seek table\n", path);
+        close(fd);
+        return -EINVAL;
+    }
+
+    struct ubi_zstd *zstd = calloc(1, sizeof(*zstd));
+    if (zstd == NULL) {
+        close(fd);
+        return -ENOMEM;
+    }
+
+    zstd->frame_count = frame_count;
+    int rc = ubi_zstd_load_seek_table(path, fd, st.st_size - table_size, entry_size,
+                                      zstd);
+    close(fd);
+    if (rc != 0) {
+        ubi_zstd_free(zstd);
+        return rc;
+    }
+
+    *out = zstd;
+    return 0;
+}
+
+void ubi_zstd_free(struct ubi_zstd *zstd) {
+    if (zstd == NULL) {
+        return;
+    }
+
+    free(zstd->frame_offsets);
+    free(zstd);
+}
+
+/*
+ * ubi_zstd_set_stripe_size sets the size of the compression buffer stripe
+ * fetches need, i.e. the compressed size of the largest stripe.
+ */
+void ubi_zstd_set_stripe_size(struct ubi_zstd *zstd, uint32_t stripe_size) {
+    uint32_t frames_per_stripe = stripe_size / zstd->frame_size;
+
+    zstd->max_stripe_bytes = 0;
+    for (uint32_t first = 0; first < zstd->frame_count; first += frames_per_stripe) {
+        uint32_t end = spdk_min(first + frames_per_stripe, zstd->frame_count);
+        uint64_t len = zstd->frame_offsets[end] - zstd->frame_offsets[first];
+        zstd->max_stripe_bytes = spdk_max(zstd->max_stripe_bytes, len);
+    }
+}
+
+/*
+ * ubi_zstd_stripe_range returns the range of the image file where the frames
+ * of a stripe are stored.
+ */
+void ubi_zstd_stripe_range(const struct ubi_zstd *zstd, uint32_t stripe_idx,
+                           uint32_t stripe_size, uint64_t *offset, uint64_t *len) {
+    uint32_t frames_per_stripe = stripe_size / zstd->frame_size;
+    uint64_t first = spdk_min((uint64_t)stripe_idx * frames_per_stripe,
+                              (uint64_t)zstd->frame_count);
+    uint64_t end = spdk_min(first + frames_per_stripe, (uint64_t)zstd->frame_count);
+
+    *offset = zstd->frame_offsets[first];
+    *len = zstd->frame_offsets[end] - zstd->frame_offsets[first];
+}
+
+/*
+ * ubi_zstd_decompress_stripe decompresses the frames of a stripe from src,
+ * which holds the range given by ubi_zstd_stripe_range, into dst. The part of
+ * the stripe past the end of the image is zeroed. *dctx is the decompression
+ * context of the caller, which is created on first use.
+ */
+int ubi_zstd_decompress_stripe(const struct ubi_zstd *zstd, void **dctx,
+                               uint32_t stripe_idx, uint32_t stripe_size,
+                               const uint8_t *src, uint8_t *dst) {
+#ifdef WITH_ZSTD
+    if (*dctx == NULL) {
+        *dctx = ZSTD_createDCtx();
+        if (*dctx == NULL) {
+            return -ENOMEM;
+        }
+    }
+
+    uint32_t frames_per_stripe = stripe_size / zstd->frame_size;
+    uint64_t first = (uint64_t)stripe_idx * frames_per_stripe;
+    uint64_t end = spdk_min(first + frames_per_stripe, (uint64_t)zstd->frame_count);
+    uint32_t dst_offset = 0;
+    for (uint64_t i = first; i < end; i++) {
+        const uint8_t *frame =
+            src + (zstd->frame_offsets[i] - zstd->frame_offsets[first]);
+        size_t frame_len = zstd->frame_offsets[i + 1] - zstd->frame_offsets[i];
+        size_t expected = spdk_min((i + 1) * zstd->frame_size, zstd->size) -
+                          i * zstd->frame_size;
+        size_t n = ZSTD_decompressDCtx(*dctx, dst + dst_offset, expected, frame,
+                                       frame_len);
+        if (ZSTD_isError(n) || n != expected) {
+            SPDK_ERRLOG("decompressing zstd frame %lu failed: %s\n", i,
+                        ZSTD_isError(n) ? ZSTD_getErrorName(n) : "short frame");
+            return -EIO;
+        }
+        dst_offset += n;
+    }
+
+    memset(dst + dst_offset, 0, stripe_size - dst_offset);
+    return 0;
+#else
+    return -ENOTSUP;
+#endif
+}
+
+void ubi_zstd_free_dctx(void *dctx) {
+#ifdef WITH_ZSTD
+    ZSTD_freeDCtx(dctx);
+#endif
+}
+
+static int ubi_zstd_load_seek_table(const char *path, int fd, uint64_t table_offset,
+                                    uint32_t entry_size, struct ubi_zstd *zstd) {
+    uint64_t entries_size = (uint64_t)zstd->frame_count * entry_size;
+    uint8_t *table = malloc(ZSTD_SKIPPABLE_HEADER_SIZE + entries_size);
+    zstd->frame_offsets = calloc(zstd->frame_count + 1ULL, sizeof(uint64_t));
+    if (table == NULL || zstd->frame_offsets == NULL) {
+        free(table);
+        return -ENOMEM;
+    }
+
+    int rc = -EINVAL;
+    ssize_t n = pread(fd, table, ZSTD_SKIPPABLE_HEADER_SIZE + entries_size, table_offset);
+    if (n != (ssize_t)(ZSTD_SKIPPABLE_HEADER_SIZE + entries_size) ||
+        from_le32(table) != ZSTD_SKIPPABLE_MAGIC ||
+        from_le32(table + 4) != entries_size + ZSTD_SEEKABLE_FOOTER_SIZE) {
+        SPDK_ERRLOG("%s: invalid zstd seek table\n", path);
+        goto out;
+    }
+
+    const uint8_t *entries = table + ZSTD_SKIPPABLE_HEADER_SIZE;
+    zstd->frame_size = from_le32(entries + 4);
+    for (uint32_t i = 0; i < zstd->frame_count; i++) {
+        const uint8_t *entry = entries + (uint64_t)i * entry_size;
+        uint32_t decompressed_size = from_le32(entry + 4);
+        bool last = i + 1 == zstd->frame_count;
+        if (decompressed_size == 0 || decompressed_size > zstd->frame_size ||
+            (!last && decompressed_size != zstd->frame_size)) {
+            SPDK_ERRLOG("%s: zstd frames must have the same decompressed size, "
+                        "except the last one\n",
+                        path);
+            goto out;
+        }
+
+        zstd->frame_offsets[i + 1] = zstd->frame_offsets[i] + from_le32(entry);
+        zstd->size += decompressed_size;
+    }
+
+    if (zstd->frame_offsets[zstd->frame_count] != table_offset) {
+        SPDK_ERRLOG("%s: zstd seek table doesn't match the frames\n", path);
+        goto out;
+    }
+
+    rc = 0;
+
+out:
+    free(table);
+    return rc;
+}
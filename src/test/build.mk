@@ -2,9 +2,12 @@
 TEST_DIR := $(SRC_DIR)/test
 TEST_BIN_DIR = $(BIN_DIR)/test
 DATA_TARGETS = $(TEST_BIN_DIR)/test_image.raw $(TEST_BIN_DIR)/test_disk.raw $(TEST_BIN_DIR)/invalid_disk.raw $(TEST_BIN_DIR)/too_small_disk.raw
-TEST_TARGETS = $(TEST_BIN_DIR)/test_ubi $(TEST_BIN_DIR)/memcheck_ubi $(DATA_TARGETS)
+TEST_TARGETS = $(TEST_BIN_DIR)/test_ubi $(TEST_BIN_DIR)/memcheck_ubi $(TEST_BIN_DIR)/replay_ubi \
+	$(DATA_TARGETS)
 
-TEST_BDEVS := --bdev ubi0 --bdev ubi_nosync --bdev ubi_directio --bdev ubi_copy_on_read
+TEST_BDEVS := --bdev ubi0 --bdev ubi_nosync --bdev ubi_directio --bdev ubi_copy_on_read \
+	--bdev ubi_metadata_bdev --bdev ubi_large_stripes --bdev ubi_uring_polling \
+	--bdev ubi_image_bdev
 
 $(TEST_BIN_DIR)/test_image.raw:
 	$(info Building $@ ...)
@@ -30,21 +33,36 @@ $(TEST_BIN_DIR)/too_small_disk.raw:
 $(TEST_BIN_DIR)/memcheck_ubi: $(TEST_DIR)/memcheck_ubi/*.c $(LIB_OBJS)
 	$(info Building $@ ...)
 	@mkdir -p $(@D)
-	@$(CC) $(CFLAGS) $? -o $@ $(LDFLAGS)
+	@$(CC) $(CFLAGS) $^ -o $@ $(LDFLAGS)
+
+$(TEST_BIN_DIR)/replay_ubi: $(TEST_DIR)/replay_ubi/*.c $(LIB_OBJS)
+	$(info Building $@ ...)
+	@mkdir -p $(@D)
+	@$(CC) $(CFLAGS) $^ -o $@ $(LDFLAGS)
 
 $(TEST_BIN_DIR)/test_ubi: $(TEST_DIR)/test_ubi/*.c $(TEST_DIR)/test_ubi/tests/*.c $(LIB_OBJS)
 	$(info Building $@ ...)
 	@mkdir -p $(@D)
-	@$(CC) $(CFLAGS) -I$(TEST_DIR)/test_ubi $? -o $@ $(LDFLAGS)
+	@$(CC) $(CFLAGS) -I$(TEST_DIR)/test_ubi $^ -o $@ $(LDFLAGS)
 
 check: $(TEST_BIN_DIR)/test_ubi $(DATA_TARGETS)
 	sudo $(TEST_BIN_DIR)/test_ubi --cpumask [0,1,2] --json $(TEST_DIR)/test_conf.json \
 		--json-ignore-init-errors $(TEST_BDEVS)
+	sudo $(TEST_BIN_DIR)/test_ubi --cpumask [0,1,2] --interrupt-mode \
+		--json $(TEST_DIR)/test_conf.json --json-ignore-init-errors --bdev ubi0
 
 valgrind: $(TEST_BIN_DIR)/memcheck_ubi $(DATA_TARGETS)
 	sudo valgrind $(TEST_BIN_DIR)/memcheck_ubi --cpumask [0] \
 		--json-ignore-init-errors --json $(TEST_DIR)/test_conf.json $(TEST_BDEVS)
 
+# Trace to replay, and extra arguments for replay_ubi, e.g. REPLAY_ARGS=--asap.
+REPLAY_TRACE ?= $(TEST_DIR)/replay_ubi/boot.trace
+REPLAY_ARGS ?=
+
+replay: $(TEST_BIN_DIR)/replay_ubi $(DATA_TARGETS)
+	sudo $(TEST_BIN_DIR)/replay_ubi --cpumask [0] --json $(TEST_DIR)/test_conf.json \
+		--json-ignore-init-errors --bdev ubi0 --trace $(REPLAY_TRACE) $(REPLAY_ARGS)
+
 coverage:
 	lcov --capture --directory . --exclude=`pwd`/$(TEST_DIR)/'*.c' --no-external --output-file coverage.info > /dev/null
 	genhtml coverage.info --output-directory coverage_report
@@ -0,0 +1,635 @@
+#include "spdk/stdinc.h"
+
+#include "spdk/bdev.h"
+#include "spdk/env.h"
+#include "spdk/event.h"
+#include "spdk/histogram_data.h"
+#include "spdk/json.h"
+#include "spdk/string.h"
+#include "spdk/thread.h"
+#include "spdk/util.h"
+
+#include "bdev_ubi.h"
+
+/*
+ * replay_ubi replays a block I/O trace, e.g. one captured while a VM boots,
+ * against a bdev, and reports how long it took to complete. Each line of a
+ * trace is:
+ *
+ *     <delay_us> <R|W|F> <offset> <length>
+ *
+ * where delay_us is the time since the previous request was issued, and
+ * offset and length are in bytes. A flush of length 0 covers the rest of the
+ * bdev. Empty lines and lines starting with '#' are skipped. Requests are
+ * issued at their recorded time, or as fast as possible with --asap. Either
+ * way, at most --queue-depth requests are outstanding.
+ *
+ * For ubi bdevs, latency histograms are enabled during the replay, and the
+ * report also has per-phase latencies and how much was fetched from the image.
+ */
+
+#define DEFAULT_BDEV_NAME "ubi0"
+#define DEFAULT_QUEUE_DEPTH 128
+#define TRACE_BUF_ALIGN 4096
+
+enum replay_cmdline_opts {
+    REPLAY_OPTION_BDEV = 0x1000,
+    REPLAY_OPTION_TRACE,
+    REPLAY_OPTION_ASAP,
+    REPLAY_OPTION_QUEUE_DEPTH,
+};
+
+static struct option g_cmdline_opts[] = {
+    {.name = "bdev", .has_arg = 1, .flag = NULL, .val = REPLAY_OPTION_BDEV},
+    {.name = "trace", .has_arg = 1, .flag = NULL, .val = REPLAY_OPTION_TRACE},
+    {.name = "asap", .has_arg = 0, .flag = NULL, .val = REPLAY_OPTION_ASAP},
+    {.name = "queue-depth", .has_arg = 1, .flag = NULL, .val = REPLAY_OPTION_QUEUE_DEPTH},
+    {.name = NULL}};
+
+struct {
+    char *bdev_name;
+    char *trace_path;
+    bool asap;
+    uint32_t queue_depth;
+} g_opts = {.queue_depth = DEFAULT_QUEUE_DEPTH};
+
+enum replay_op_type {
+    REPLAY_OP_READ,
+    REPLAY_OP_WRITE,
+    REPLAY_OP_FLUSH,
+};
+
+struct replay_op {
+    enum replay_op_type type;
+    uint64_t offset;
+    uint64_t length;
+
+    /* Time since the first request, when this request was issued. */
+    uint64_t issue_at_us;
+};
+
+struct {
+    struct replay_op *ops;
+    size_t n_ops;
+    uint64_t max_length;
+} g_trace;
+
+struct {
+    struct spdk_bdev_desc *bdev_desc;
+    struct spdk_io_channel *ch;
+    struct spdk_poller *poller;
+    void *buf;
+    bool is_ubi;
+    int rc;
+
+    size_t next_op;
+    size_t n_completed;
+    uint32_t n_outstanding;
+
+    uint64_t start_tsc;
+    uint64_t end_tsc;
+    uint64_t max_lag_tsc;
+    uint64_t ops[REPLAY_OP_FLUSH + 1];
+    uint64_t bytes_read;
+    uint64_t bytes_written;
+
+    struct spdk_ubi_bdev_stats stats_before;
+    struct spdk_ubi_bdev_stats stats_after;
+} g_replay;
+
+static void begin_replay(void);
+static void finish_replay(void);
+static void stop_replay(int rc);
+
+static void replay_event_cb(enum spdk_bdev_event_type type, struct spdk_bdev *bdev,
+                            void *event_ctx) {
+    SPDK_NOTICELOG("Unsupported bdev event: type %d\n", type);
+}
+
+/*
+ * Report
+ */
+static const double g_percentiles[] = {50.0, 90.0, 99.0, 99.9};
+static const char *g_percentile_names[] = {"p50_us", "p90_us", "p99_us", "p999_us"};
+
+struct histogram_summary {
+    uint64_t count;
+    uint64_t max_ticks;
+    uint64_t percentile_ticks[SPDK_COUNTOF(g_percentiles)];
+};
+
+static void summarize_bucket(void *ctx, uint64_t start, uint64_t end, uint64_t count,
+                             uint64_t total, uint64_t so_far) {
+    struct histogram_summary *summary = ctx;
+    if (count == 0) {
+        return;
+    }
+
+    summary->count = total;
+    summary->max_ticks = end;
+    for (size_t i = 0; i < SPDK_COUNTOF(g_percentiles); i++) {
+        if (summary->percentile_ticks[i] == 0 &&
+            so_far * 100.0 >= g_percentiles[i] * total) {
+            summary->percentile_ticks[i] = end;
+        }
+    }
+}
+
+static int write_stdout(void *cb_ctx, const void *data, size_t size) {
+    return fwrite(data, 1, size, stdout) == size ? 0 : -1;
+}
+
+static void write_report(struct spdk_histogram_data *const *histograms) {
+    double ticks_per_ms = spdk_get_ticks_hz() / 1000.0;
+    struct spdk_json_write_ctx *w =
+        spdk_json_write_begin(write_stdout, NULL, SPDK_JSON_WRITE_FLAG_FORMATTED);
+    if (w == NULL) {
+        SPDK_ERRLOG("Could not write report.\n");
+        return;
+    }
+
+    spdk_json_write_object_begin(w);
+    spdk_json_write_named_string(w, "trace", g_opts.trace_path);
+    spdk_json_write_named_string(w, "bdev", g_opts.bdev_name);
+    spdk_json_write_named_string(w, "mode", g_opts.asap ? "asap" : "timed");
+    spdk_json_write_named_uint32(w, "queue_depth", g_opts.queue_depth);
+    spdk_json_write_named_uint64(w, "ops", g_trace.n_ops);
+    spdk_json_write_named_uint64(w, "reads", g_replay.ops[REPLAY_OP_READ]);
+    spdk_json_write_named_uint64(w, "writes", g_replay.ops[REPLAY_OP_WRITE]);
+    spdk_json_write_named_uint64(w, "flushes", g_replay.ops[REPLAY_OP_FLUSH]);
+    spdk_json_write_named_uint64(w, "bytes_read", g_replay.bytes_read);
+    spdk_json_write_named_uint64(w, "bytes_written", g_replay.bytes_written);
+    spdk_json_write_named_double(
+        w, "trace_duration_ms",
+        g_trace.n_ops > 0 ? g_trace.ops[g_trace.n_ops - 1].issue_at_us / 1000.0 : 0);
+    spdk_json_write_named_double(w, "time_to_complete_ms",
+                                 (g_replay.end_tsc - g_replay.start_tsc) / ticks_per_ms);
+    if (!g_opts.asap) {
+        /* How much later than recorded requests were issued at worst. */
+        spdk_json_write_named_double(w, "max_issue_lag_ms",
+                                     g_replay.max_lag_tsc / ticks_per_ms);
+    }
+
+    if (g_replay.is_ubi) {
+        struct spdk_ubi_bdev_stats *before = &g_replay.stats_before;
+        struct spdk_ubi_bdev_stats *after = &g_replay.stats_after;
+
+        spdk_json_write_named_object_begin(w, "image");
+        spdk_json_write_named_uint64(w, "bytes_read",
+                                     after->io.image_bytes_read -
+                                         before->io.image_bytes_read);
+        spdk_json_write_named_uint64(w, "stripe_fetches",
+                                     after->io.stripe_fetches -
+                                         before->io.stripe_fetches);
+        spdk_json_write_named_uint64(w, "stripes_fetched",
+                                     after->stripes_fetched - before->stripes_fetched);
+        spdk_json_write_named_uint64(w, "ios_blocked_on_fetch",
+                                     after->io.ios_blocked_on_fetch -
+                                         before->io.ios_blocked_on_fetch);
+        spdk_json_write_named_uint64(w, "stripe_cache_hits",
+                                     after->io.stripe_cache_hits -
+                                         before->io.stripe_cache_hits);
+        spdk_json_write_named_uint64(w, "image_stripes", after->image_stripes);
+        spdk_json_write_named_uint64(w, "stripes_fetched_total", after->stripes_fetched);
+        spdk_json_write_object_end(w);
+    }
+
+    if (histograms != NULL) {
+        double ticks_per_us = ticks_per_ms / 1000.0;
+        spdk_json_write_named_object_begin(w, "latency");
+        for (int phase = 0; phase < SPDK_UBI_LATENCY_PHASES; phase++) {
+            struct histogram_summary summary = {};
+            spdk_histogram_data_iterate(histograms[phase], summarize_bucket, &summary);
+
+            spdk_json_write_named_object_begin(w, bdev_ubi_latency_phase_name(phase));
+            spdk_json_write_named_uint64(w, "count", summary.count);
+            for (size_t i = 0; i < SPDK_COUNTOF(g_percentiles); i++) {
+                spdk_json_write_named_double(w, g_percentile_names[i],
+                                             summary.percentile_ticks[i] / ticks_per_us);
+            }
+            spdk_json_write_named_double(w, "max_us", summary.max_ticks / ticks_per_us);
+            spdk_json_write_object_end(w);
+        }
+        spdk_json_write_object_end(w);
+    }
+
+    spdk_json_write_object_end(w);
+    spdk_json_write_end(w);
+    printf("\n");
+}
+
+/*
+ * Replay
+ */
+static void io_completion_cb(struct spdk_bdev_io *bdev_io, bool success, void *arg) {
+    struct replay_op *op = arg;
+
+    spdk_bdev_free_io(bdev_io);
+    g_replay.n_outstanding--;
+    g_replay.n_completed++;
+
+    if (!success) {
+        SPDK_ERRLOG("Request %zu of the trace failed.\n", (size_t)(op - g_trace.ops));
+        g_replay.rc = -EIO;
+    }
+
+    if (g_replay.n_outstanding > 0) {
+        return;
+    }
+
+    if (g_replay.rc != 0 || g_replay.n_completed == g_trace.n_ops) {
+        g_replay.end_tsc = spdk_get_ticks();
+        finish_replay();
+    }
+}
+
+static int submit_op(struct replay_op *op) {
+    struct spdk_bdev_desc *desc = g_replay.bdev_desc;
+    struct spdk_io_channel *ch = g_replay.ch;
+
+    switch (op->type) {
+    case REPLAY_OP_READ:
+        return spdk_bdev_read(desc, ch, g_replay.buf, op->offset, op->length,
+                              io_completion_cb, op);
+    case REPLAY_OP_WRITE:
+        return spdk_bdev_write(desc, ch, g_replay.buf, op->offset, op->length,
+                               io_completion_cb, op);
+    case REPLAY_OP_FLUSH:
+        return spdk_bdev_flush(desc, ch, op->offset, op->length, io_completion_cb, op);
+    }
+
+    return -EINVAL;
+}
+
+static int replay_poll(void *arg) {
+    uint64_t now = spdk_get_ticks();
+    double ticks_per_us = spdk_get_ticks_hz() / 1000000.0;
+    int submitted = 0;
+
+    while (g_replay.rc == 0 && g_replay.next_op < g_trace.n_ops &&
+           g_replay.n_outstanding < g_opts.queue_depth) {
+        struct replay_op *op = &g_trace.ops[g_replay.next_op];
+
+        if (!g_opts.asap) {
+            uint64_t issue_tsc =
+                g_replay.start_tsc + (uint64_t)(op->issue_at_us * ticks_per_us);
+            if (now < issue_tsc) {
+                break;
+            }
+            g_replay.max_lag_tsc = spdk_max(g_replay.max_lag_tsc, now - issue_tsc);
+        }
+
+        int rc = submit_op(op);
+        if (rc == -ENOMEM) {
+            /* Out of bdev_io, retry once some complete. */
+            break;
+        } else if (rc != 0) {
+            SPDK_ERRLOG("Could not submit request %zu of the trace: %s\n",
+                        g_replay.next_op, spdk_strerror(-rc));
+            g_replay.rc = rc;
+            break;
+        }
+
+        g_replay.ops[op->type]++;
+        if (op->type == REPLAY_OP_READ) {
+            g_replay.bytes_read += op->length;
+        } else if (op->type == REPLAY_OP_WRITE) {
+            g_replay.bytes_written += op->length;
+        }
+
+        g_replay.next_op++;
+        g_replay.n_outstanding++;
+        submitted++;
+    }
+
+    if (g_replay.rc != 0 && g_replay.n_outstanding == 0) {
+        g_replay.end_tsc = spdk_get_ticks();
+        finish_replay();
+    }
+
+    return submitted > 0 ? SPDK_POLLER_BUSY : SPDK_POLLER_IDLE;
+}
+
+static void begin_replay(void) {
+    SPDK_NOTICELOG("Replaying %zu requests of %s against %s.\n", g_trace.n_ops,
+                   g_opts.trace_path, g_opts.bdev_name);
+
+    g_replay.start_tsc = spdk_get_ticks();
+    if (g_trace.n_ops == 0) {
+        g_replay.end_tsc = g_replay.start_tsc;
+        finish_replay();
+        return;
+    }
+
+    g_replay.poller = SPDK_POLLER_REGISTER(replay_poll, NULL, 0);
+    if (g_replay.poller == NULL) {
+        SPDK_ERRLOG("Could not register poller.\n");
+        stop_replay(-ENOMEM);
+    }
+}
+
+/*
+ * Steps of a ubi bdev replay: take stats, reset histograms by disabling and
+ * enabling them, replay, take stats and histograms again, report, and disable
+ * histograms.
+ */
+static void enable_histograms_done(void *cb_arg, int status) {
+    if (status != 0) {
+        SPDK_ERRLOG("Could not enable histograms: %s\n", spdk_strerror(-status));
+        stop_replay(status);
+        return;
+    }
+
+    begin_replay();
+}
+
+/*
+ * disable_histograms_done is called with cb_arg set to true before the replay,
+ * and to false after it.
+ */
+static void disable_histograms_done(void *cb_arg, int status) {
+    bool before_replay = (bool)cb_arg;
+    if (before_replay) {
+        bdev_ubi_enable_histograms(g_opts.bdev_name, true, enable_histograms_done, NULL);
+    } else {
+        stop_replay(g_replay.rc);
+    }
+}
+
+static void get_histograms_done(void *cb_arg,
+                                struct spdk_histogram_data *const *histograms,
+                                int status) {
+    if (status != 0) {
+        SPDK_ERRLOG("Could not get histograms: %s\n", spdk_strerror(-status));
+        histograms = NULL;
+    }
+
+    write_report(histograms);
+    bdev_ubi_enable_histograms(g_opts.bdev_name, false, disable_histograms_done,
+                               (void *)false);
+}
+
+static void get_stats_after_done(void *cb_arg, const struct spdk_ubi_bdev_stats *stats,
+                                 int status) {
+    if (status != 0) {
+        SPDK_ERRLOG("Could not get stats: %s\n", spdk_strerror(-status));
+        stop_replay(status);
+        return;
+    }
+
+    g_replay.stats_after = *stats;
+    bdev_ubi_get_histograms(g_opts.bdev_name, false, get_histograms_done, NULL);
+}
+
+static void finish_replay(void) {
+    spdk_poller_unregister(&g_replay.poller);
+
+    if (!g_replay.is_ubi) {
+        write_report(NULL);
+        stop_replay(g_replay.rc);
+        return;
+    }
+
+    bdev_ubi_get_stats(g_opts.bdev_name, get_stats_after_done, NULL);
+}
+
+static void get_stats_before_done(void *cb_arg, const struct spdk_ubi_bdev_stats *stats,
+                                  int status) {
+    if (status != 0) {
+        SPDK_ERRLOG("Could not get stats: %s\n", spdk_strerror(-status));
+        stop_replay(status);
+        return;
+    }
+
+    g_replay.stats_before = *stats;
+    bdev_ubi_enable_histograms(g_opts.bdev_name, false, disable_histograms_done,
+                               (void *)true);
+}
+
+static void stop_replay(int rc) {
+    if (g_replay.ch) {
+        spdk_put_io_channel(g_replay.ch);
+    }
+    if (g_replay.bdev_desc) {
+        spdk_bdev_close(g_replay.bdev_desc);
+    }
+    spdk_dma_free(g_replay.buf);
+
+    if (rc != 0) {
+        SPDK_ERRLOG("Replay failed.\n");
+    }
+    spdk_app_stop(rc);
+}
+
+static bool validate_trace(struct spdk_bdev *bdev) {
+    uint32_t block_size = spdk_bdev_get_block_size(bdev);
+    uint64_t size = spdk_bdev_get_num_blocks(bdev) * block_size;
+
+    for (size_t i = 0; i < g_trace.n_ops; i++) {
+        struct replay_op *op = &g_trace.ops[i];
+        if (op->type == REPLAY_OP_FLUSH && op->length == 0 && op->offset < size) {
+            op->length = size - op->offset;
+        }
+
+        if (op->offset % block_size != 0 || op->length % block_size != 0 ||
+            op->offset + op->length > size || op->length == 0) {
+            SPDK_ERRLOG("Request %zu of the trace doesn't fit %s, whose block size "
+                        "is %u and size is %" PRIu64 ".\n",
+                        i, spdk_bdev_get_name(bdev), block_size, size);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void start_replay(void *arg) {
+    int rc = spdk_bdev_open_ext(g_opts.bdev_name, true, replay_event_cb, NULL,
+                                &g_replay.bdev_desc);
+    if (rc < 0) {
+        SPDK_ERRLOG("Could not open bdev %s: %s\n", g_opts.bdev_name, spdk_strerror(-rc));
+        stop_replay(rc);
+        return;
+    }
+
+    struct spdk_bdev *bdev = spdk_bdev_desc_get_bdev(g_replay.bdev_desc);
+    if (!validate_trace(bdev)) {
+        stop_replay(-EINVAL);
+        return;
+    }
+
+    g_replay.ch = spdk_bdev_get_io_channel(g_replay.bdev_desc);
+    g_replay.buf = spdk_dma_zmalloc(spdk_max(g_trace.max_length, TRACE_BUF_ALIGN),
+                                    TRACE_BUF_ALIGN, NULL);
+    if (g_replay.ch == NULL || g_replay.buf == NULL) {
+        SPDK_ERRLOG("Could not allocate resources: %s\n", spdk_strerror(ENOMEM));
+        stop_replay(-ENOMEM);
+        return;
+    }
+
+    g_replay.is_ubi = strcmp(spdk_bdev_get_module_name(bdev), "ubi") == 0;
+    if (!g_replay.is_ubi) {
+        begin_replay();
+        return;
+    }
+
+    bdev_ubi_get_stats(g_opts.bdev_name, get_stats_before_done, NULL);
+}
+
+/*
+ * Trace parsing
+ */
+static int append_op(const struct replay_op *op, size_t *capacity) {
+    if (g_trace.n_ops == *capacity) {
+        size_t new_capacity = spdk_max(*capacity * 2, 1024);
+        struct replay_op *ops = realloc(g_trace.ops, new_capacity * sizeof(*ops));
+        if (ops == NULL) {
+            return -ENOMEM;
+        }
+
+        g_trace.ops = ops;
+        *capacity = new_capacity;
+    }
+
+    g_trace.ops[g_trace.n_ops++] = *op;
+    g_trace.max_length = spdk_max(g_trace.max_length, op->length);
+    return 0;
+}
+
+static int load_trace(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        int rc = -errno;
+        fprintf(stderr, "Could not open trace %s: %s\n", path, spdk_strerror(-rc));
+        return rc;
+    }
+
+    char *line = NULL;
+    size_t line_len = 0, capacity = 0, line_no = 0;
+    double issue_at_us = 0;
+    int rc = 0;
+
+    while (getline(&line, &line_len, f) != -1) {
+        line_no++;
+
+        char *start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || *start == '\0') {
+            continue;
+        }
+
+        double delay_us;
+        char type;
+        struct replay_op op = {};
+        if (sscanf(start, "%lf %c %" SCNu64 " %" SCNu64, &delay_us, &type, &op.offset,
+                   &op.length) != 4 ||
+            delay_us < 0) {
+            fprintf(stderr, "%s:%zu: invalid request\n", path, line_no);
+            rc = -EINVAL;
+            break;
+        }
+
+        switch (type) {
+        case 'R':
+            op.type = REPLAY_OP_READ;
+            break;
+        case 'W':
+            op.type = REPLAY_OP_WRITE;
+            break;
+        case 'F':
+            op.type = REPLAY_OP_FLUSH;
+            break;
+        default:
+            fprintf(stderr, "%s:%zu: unknown request type %c\n", path, line_no, type);
+            rc = -EINVAL;
+            break;
+        }
+
+        if (rc != 0) {
+            break;
+        }
+
+        issue_at_us += delay_us;
+        op.issue_at_us = (uint64_t)issue_at_us;
+        rc = append_op(&op, &capacity);
+        if (rc != 0) {
+            fprintf(stderr, "Could not load trace: %s\n", spdk_strerror(-rc));
+            break;
+        }
+    }
+
+    free(line);
+    fclose(f);
+    return rc;
+}
+
+static void usage(void) {
+    printf(" --bdev <name>           Block device to replay against. Default: %s.\n",
+           DEFAULT_BDEV_NAME);
+    printf(" --trace <path>          Trace to replay.\n");
+    printf(" --asap                  Ignore recorded timing, issue requests as fast as "
+           "possible.\n");
+    printf(" --queue-depth <n>       Maximum outstanding requests. Default: %d.\n",
+           DEFAULT_QUEUE_DEPTH);
+}
+
+static int parse_arg(int argc, char *argv) {
+    switch (argc) {
+    case REPLAY_OPTION_BDEV:
+        free(g_opts.bdev_name);
+        g_opts.bdev_name = strdup(argv);
+        break;
+    case REPLAY_OPTION_TRACE:
+        free(g_opts.trace_path);
+        g_opts.trace_path = strdup(argv);
+        break;
+    case REPLAY_OPTION_ASAP:
+        g_opts.asap = true;
+        break;
+    case REPLAY_OPTION_QUEUE_DEPTH: {
+        long queue_depth = spdk_strtol(argv, 10);
+        if (queue_depth <= 0) {
+            fprintf(stderr, "Invalid queue depth: %s\n", argv);
+            return -EINVAL;
+        }
+        g_opts.queue_depth = queue_depth;
+        break;
+    }
+    default:
+        return -EINVAL;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int rc;
+    struct spdk_app_opts opts = {};
+    spdk_app_opts_init(&opts, sizeof(opts));
+    opts.name = "replay_ubi";
+    opts.reactor_mask = "0x1";
+
+    rc = spdk_app_parse_args(argc, argv, &opts, NULL, g_cmdline_opts, parse_arg, usage);
+    if (rc != SPDK_APP_PARSE_ARGS_SUCCESS) {
+        exit(rc);
+    }
+
+    if (g_opts.trace_path == NULL) {
+        fprintf(stderr, "--trace is required.\n");
+        exit(-1);
+    }
+
+    if (g_opts.bdev_name == NULL) {
+        g_opts.bdev_name = strdup(DEFAULT_BDEV_NAME);
+    }
+
+    rc = load_trace(g_opts.trace_path);
+    if (rc == 0) {
+        rc = spdk_app_start(&opts, start_replay, NULL);
+        spdk_app_fini();
+    }
+
+    free(g_trace.ops);
+    free(g_opts.bdev_name);
+    free(g_opts.trace_path);
+
+    return rc;
+}
@@ -21,6 +21,9 @@
 #define TEST_IMAGE_PATH "bin/test/test_image.raw"
 #define TEST_BASE_WITH_INVALID_MAGIC "base_with_invalid_magic"
 #define TEST_TOO_SMALL_BASE "too_small_base"
+#define TEST_LARGE_NULL_IMAGE "large_null_image"
+#define TEST_LARGE_NULL_BASE "large_null_base"
+#define TEST_ONE_PAGE_METADATA "one_page_metadata"
 
 struct bdev_desc_ch_pair {
     struct spdk_bdev_desc *desc;
@@ -82,9 +85,11 @@ extern void run_ut_thread(void *arg);
  */
 extern bool verify_create(const char *base_bdev, const char *image_path,
                           const char *bdev_name);
+extern bool verify_create_opts(const struct spdk_ubi_bdev_opts *opts);
 extern bool verify_delete(const char *bdev_name);
 extern bool open_bdev_and_ch(const char *bdev_name, struct bdev_desc_ch_pair *bdev);
 extern bool close_bdev_and_ch(struct bdev_desc_ch_pair *bdev);
+extern bool read_image_block(uint64_t block, uint32_t blocklen, char *buf);
 
 /*
  * tests
@@ -92,7 +97,22 @@ extern bool close_bdev_and_ch(struct bdev_desc_ch_pair *bdev);
 extern void test_bdev_io(const char *bdev_name, int *n_tests, int *n_failures);
 extern bool test_bdev_recreate(void);
 extern bool test_bdev_create_errors(void);
+extern bool test_rpc_create_batch(void);
 extern bool test_write_config(void);
 extern bool test_io_channel_create_errors(void);
+extern bool test_checkpoint(void);
+extern bool test_checkpoint_interval(void);
+extern bool test_flush_commit(void);
+extern bool test_stats(void);
+extern bool test_histograms(void);
+extern bool test_image_delay(void);
+extern bool test_interrupt_mode(void);
+extern bool test_image_bdev(void);
+extern bool test_image_on_base(void);
+extern bool test_qcow2(void);
+extern bool test_zstd(void);
+extern bool test_overlay(void);
+extern bool test_stripe_cache(void);
+extern bool test_channel_destroy(void);
 
 #endif
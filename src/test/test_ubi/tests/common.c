@@ -3,18 +3,25 @@
 #include "test_ubi.h"
 
 bool verify_create(const char *base_bdev, const char *image_path, const char *bdev_name) {
+    struct spdk_ubi_bdev_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    opts.base_bdev_name = base_bdev;
+    opts.image_path = image_path;
+    opts.stripe_size_kb = 1024;
+    opts.name = (char *)bdev_name;
+    return verify_create_opts(&opts);
+}
+
+bool verify_create_opts(const struct spdk_ubi_bdev_opts *opts) {
     struct ubi_create_request create_req;
     memset(&create_req, 0, sizeof(create_req));
-    create_req.opts.base_bdev_name = base_bdev;
-    create_req.opts.image_path = image_path;
-    create_req.opts.stripe_size_kb = 1024;
-    create_req.opts.name = (char *)bdev_name;
+    create_req.opts = *opts;
 
     execute_app_function(init_thread_create_bdev_ubi, &create_req);
     if (!create_req.success) {
         SPDK_WARNLOG(
             "create_bdev_ubi failed for base_bdev: %s, image_path: %s, bdev_name: %s\n",
-            base_bdev, image_path, bdev_name);
+            opts->base_bdev_name, opts->image_path, opts->name);
         return false;
     }
 
@@ -64,3 +71,20 @@ bool close_bdev_and_ch(struct bdev_desc_ch_pair *bdev) {
     }
     return true;
 }
+
+/*
+ * read_image_block reads a block of the test image file, to compare with what
+ * a ubi bdev reads.
+ */
+bool read_image_block(uint64_t block, uint32_t blocklen, char *buf) {
+    FILE *f = fopen(TEST_IMAGE_PATH, "r");
+    if (f == NULL) {
+        SPDK_ERRLOG("Could not open %s: %s\n", TEST_IMAGE_PATH, strerror(errno));
+        return false;
+    }
+
+    bool success = fseek(f, block * blocklen, SEEK_SET) == 0 &&
+                   fread(buf, 1, blocklen, f) == blocklen;
+    fclose(f);
+    return success;
+}
@@ -109,6 +109,42 @@ bool test_bdev_create_errors(void) {
         return false;
     }
 
+    // Case where metadata bdev doesn't exist
+    create_req.opts.metadata_bdev_name = "non_existent_metadata_bdev";
+    execute_app_function(init_thread_create_bdev_ubi, &create_req);
+    create_req.opts.metadata_bdev_name = NULL;
+    if (create_req.success) {
+        SPDK_WARNLOG("create_bdev_ubi succeeded with non-existent metadata bdev\n");
+        return false;
+    }
+
+    // Case where metadata bdev is the same as base bdev
+    create_req.opts.metadata_bdev_name = base_bdev;
+    execute_app_function(init_thread_create_bdev_ubi, &create_req);
+    create_req.opts.metadata_bdev_name = NULL;
+    if (create_req.success) {
+        SPDK_WARNLOG("create_bdev_ubi succeeded with base bdev as metadata bdev\n");
+        return false;
+    }
+
+    // Case where a new disk has more stripes than a separate metadata bdev
+    // holds. A 256MB image with 64KB stripes needs 3 metadata pages.
+    create_req.opts.base_bdev_name = TEST_LARGE_NULL_BASE;
+    create_req.opts.image_path = NULL;
+    create_req.opts.image_bdev_name = TEST_LARGE_NULL_IMAGE;
+    create_req.opts.metadata_bdev_name = TEST_ONE_PAGE_METADATA;
+    create_req.opts.stripe_size_kb = 64;
+    execute_app_function(init_thread_create_bdev_ubi, &create_req);
+    create_req.opts.base_bdev_name = base_bdev;
+    create_req.opts.image_path = image_path;
+    create_req.opts.image_bdev_name = NULL;
+    create_req.opts.metadata_bdev_name = NULL;
+    create_req.opts.stripe_size_kb = 1024;
+    if (create_req.success) {
+        SPDK_WARNLOG("create_bdev_ubi succeeded with too small metadata bdev\n");
+        return false;
+    }
+
     // Finally check again if we can create and delete. This is to check
     // (to some degree) that the previous failure handling cases did
     // proper cleanup.
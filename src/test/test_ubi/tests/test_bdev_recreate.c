@@ -23,5 +23,38 @@ bool test_bdev_recreate(void) {
             return false;
         }
     }
+
+    // Stripe size should be read from metadata when not given
+    struct ubi_create_request create_req;
+    memset(&create_req, 0, sizeof(create_req));
+    create_req.opts.base_bdev_name = TEST_FREE_BASE_BDEV;
+    create_req.opts.image_path = image_path;
+    create_req.opts.stripe_size_kb = 0;
+    create_req.opts.name = (char *)bdev_name;
+    execute_app_function(init_thread_create_bdev_ubi, &create_req);
+    if (!create_req.success || !verify_delete(bdev_name)) {
+        SPDK_WARNLOG("Failed to recreate bdev UBI without stripe size: %s\n", bdev_name);
+        return false;
+    }
+
+    // Stripe size mismatching metadata should fail
+    create_req.opts.stripe_size_kb = 512;
+    execute_app_function(init_thread_create_bdev_ubi, &create_req);
+    if (create_req.success) {
+        SPDK_WARNLOG("Recreated bdev UBI with mismatching stripe size: %s\n", bdev_name);
+        verify_delete(bdev_name);
+        return false;
+    }
+
+    // Stripe size should be picked automatically for a new disk
+    create_req.opts.base_bdev_name = "free_base_bdev_3";
+    create_req.opts.stripe_size_kb = 0;
+    execute_app_function(init_thread_create_bdev_ubi, &create_req);
+    if (!create_req.success || !verify_delete(bdev_name)) {
+        SPDK_WARNLOG("Failed to create bdev UBI with automatic stripe size: %s\n",
+                     bdev_name);
+        return false;
+    }
+
     return true;
 }
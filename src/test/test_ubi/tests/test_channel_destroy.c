@@ -0,0 +1,146 @@
+#include "bdev_ubi_internal.h"
+#include "test_ubi.h"
+
+#define TEST_CHANNEL_DESTROY_BASE_BDEV "free_base_bdev_14"
+#define TEST_IMAGE_DELAY_US 1000000
+#define TEST_WAIT_MS 1000
+
+/*
+ * One more stripe than a channel fetches at once, so the last one stays in
+ * the fetch queue while the others are being fetched.
+ */
+#define TEST_FIRST_STRIPE 10
+#define TEST_STRIPES (UBI_MAX_ACTIVE_STRIPE_FETCHES + 1)
+
+struct channel_destroy_ctx {
+    struct ubi_bdev *ubi_bdev;
+    struct spdk_thread *app_thread;
+
+    /* Channel of the ubi bdev on the app thread, which fetches the stripes. */
+    struct spdk_io_channel *fetching_ch;
+
+    /* Write on the io thread, which waits for a stripe of fetching_ch. */
+    struct ubi_io_request req;
+};
+
+/*
+ * start_fetches gets a channel of the ubi bdev on the app thread, and queues
+ * fetches of the test stripes in it, the way ubi_submit_request does.
+ */
+static void start_fetches(void *arg) {
+    struct channel_destroy_ctx *ctx = arg;
+    ctx->app_thread = spdk_get_thread();
+    ctx->fetching_ch = spdk_get_io_channel(ctx->ubi_bdev);
+    if (ctx->fetching_ch != NULL) {
+        struct ubi_io_channel *ch = spdk_io_channel_get_ctx(ctx->fetching_ch);
+        for (int i = 0; i < TEST_STRIPES; i++) {
+            enqueue_stripe(ch, TEST_FIRST_STRIPE + i);
+            ubi_set_stripe_status(ctx->ubi_bdev, TEST_FIRST_STRIPE + i, STRIPE_INFLIGHT);
+            __atomic_fetch_add(&ctx->ubi_bdev->stripe_fetches_queued, 1,
+                               __ATOMIC_RELAXED);
+        }
+        ubi_kick_channel(ch);
+    }
+
+    wake_ut_thread();
+}
+
+static void put_fetching_channel(void *arg) {
+    struct channel_destroy_ctx *ctx = arg;
+    spdk_put_io_channel(ctx->fetching_ch);
+}
+
+/*
+ * write_and_destroy submits the write on the io thread, where it waits for
+ * the stripe queued in fetching_ch, and then destroys fetching_ch. The write's
+ * completion wakes the ut thread.
+ */
+static void write_and_destroy(void *arg) {
+    struct channel_destroy_ctx *ctx = arg;
+    io_thread_write(&ctx->req);
+    spdk_thread_send_msg(ctx->app_thread, put_fetching_channel, ctx);
+}
+
+static bool do_test_channel_destroy(struct channel_destroy_ctx *ctx) {
+    struct ubi_bdev *ubi_bdev = ctx->ubi_bdev;
+
+    execute_app_function(start_fetches, ctx);
+    if (ctx->fetching_ch == NULL) {
+        SPDK_WARNLOG("could not get a channel of the ubi bdev\n");
+        return false;
+    }
+
+    /* Image reads are delayed, so the fetches stay active until canceled. */
+    uint64_t active = 0;
+    for (int ms = 0; ms < TEST_WAIT_MS && active < UBI_MAX_ACTIVE_STRIPE_FETCHES; ms++) {
+        usleep(1000);
+        active = __atomic_load_n(&ubi_bdev->stripe_fetches_active, __ATOMIC_RELAXED);
+    }
+
+    /*
+     * The write waits for the queued stripe. Destroying the channel fails
+     * all of its stripes, and the write with them, instead of leaving the
+     * write waiting.
+     */
+    ctx->req.block_idx = (TEST_FIRST_STRIPE + TEST_STRIPES - 1) * 2048;
+    execute_spdk_function(write_and_destroy, ctx);
+    if (ctx->req.success) {
+        SPDK_WARNLOG("write to a stripe of a destroyed channel succeeded\n");
+        return false;
+    }
+
+    for (int i = 0; i < TEST_STRIPES; i++) {
+        int stripe = TEST_FIRST_STRIPE + i;
+        enum stripe_status status = ubi_get_stripe_status(ubi_bdev, stripe);
+        if (status != STRIPE_FAILED) {
+            SPDK_WARNLOG("stripe %d of a destroyed channel has status %d\n", stripe,
+                         status);
+            return false;
+        }
+    }
+
+    if (ubi_bdev->stripe_fetches_queued != 0 || ubi_bdev->stripe_fetches_active != 0) {
+        SPDK_WARNLOG("stripe fetches left. queued: %lu, active: %lu\n",
+                     ubi_bdev->stripe_fetches_queued, ubi_bdev->stripe_fetches_active);
+        return false;
+    }
+
+    return true;
+}
+
+bool test_channel_destroy(void) {
+    const char *bdev_name = "test_channel_destroy_ubi0";
+    if (!verify_create(TEST_CHANNEL_DESTROY_BASE_BDEV, TEST_IMAGE_PATH, bdev_name)) {
+        return false;
+    }
+
+    struct channel_destroy_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.ubi_bdev = spdk_bdev_get_by_name(bdev_name)->ctxt;
+
+    bool success = false;
+    struct bdev_desc_ch_pair desc_ch_pair = {0};
+    if (!open_bdev_and_ch(bdev_name, &desc_ch_pair)) {
+        SPDK_WARNLOG("Failed to open bdev UBI: %s\n", bdev_name);
+    } else {
+        struct spdk_ubi_image_delay_opts opts = {
+            .avg_latency_us = TEST_IMAGE_DELAY_US,
+            .p99_latency_us = TEST_IMAGE_DELAY_US,
+        };
+        bdev_ubi_set_image_delay(&opts);
+
+        ctx.req.bdev = &desc_ch_pair;
+        success = do_test_channel_destroy(&ctx);
+
+        memset(&opts, 0, sizeof(opts));
+        bdev_ubi_set_image_delay(&opts);
+        close_bdev_and_ch(&desc_ch_pair);
+    }
+
+    if (!verify_delete(bdev_name)) {
+        SPDK_WARNLOG("Failed to delete bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    return success;
+}
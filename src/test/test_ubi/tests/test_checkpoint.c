@@ -0,0 +1,262 @@
+#include "bdev_ubi_internal.h"
+#include "test_ubi.h"
+
+#define CHECKPOINT_WAIT_US 10000
+#define CHECKPOINT_MAX_WAITS 500
+
+/* Fresh base bdevs, so every image stripe is fetched by the test. */
+#define TEST_CHECKPOINT_BASE_BDEV "free_base_bdev_12"
+#define TEST_CHECKPOINT_INTERVAL_BASE_BDEV "free_base_bdev_13"
+#define TEST_CHECKPOINT_INTERVAL_MS 500
+
+struct get_ubi_bdev_request {
+    const char *name;
+    struct ubi_bdev *ubi_bdev;
+};
+
+static void get_ubi_bdev(void *arg) {
+    struct get_ubi_bdev_request *req = arg;
+    struct spdk_bdev *bdev = spdk_bdev_get_by_name(req->name);
+    req->ubi_bdev = bdev ? bdev->ctxt : NULL;
+
+    wake_ut_thread();
+}
+
+static struct ubi_bdev *create_test_bdev(const char *bdev_name, const char *base_bdev,
+                                         bool no_sync, uint32_t checkpoint_dirty_stripes,
+                                         uint32_t checkpoint_interval_ms) {
+    struct spdk_ubi_bdev_opts opts = {
+        .name = bdev_name,
+        .base_bdev_name = base_bdev,
+        .image_path = TEST_IMAGE_PATH,
+        .stripe_size_kb = 1024,
+        .no_sync = no_sync,
+        .checkpoint_dirty_stripes = checkpoint_dirty_stripes,
+        .checkpoint_interval_ms = checkpoint_interval_ms,
+    };
+    if (!verify_create_opts(&opts)) {
+        return NULL;
+    }
+
+    struct get_ubi_bdev_request get_req = {.name = bdev_name};
+    execute_app_function(get_ubi_bdev, &get_req);
+    return get_req.ubi_bdev;
+}
+
+/*
+ * Writes the first block of every image stripe, so stripes get fetched.
+ */
+static bool write_image_stripes(struct ubi_bdev *ubi_bdev,
+                                struct bdev_desc_ch_pair *desc_ch_pair) {
+    uint64_t n_image_stripes =
+        spdk_divide_round_up(ubi_bdev->image_block_count, ubi_bdev->stripe_block_count);
+
+    struct ubi_io_request req;
+    memset(&req, 0, sizeof(req));
+    req.bdev = desc_ch_pair;
+    for (uint64_t i = 0; i < n_image_stripes; i++) {
+        req.block_idx = i * ubi_bdev->stripe_block_count;
+        execute_spdk_function(io_thread_write, &req);
+        if (!req.success) {
+            SPDK_WARNLOG("Write to block %lu failed\n", req.block_idx);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * wait_for_checkpoint waits until all fetched stripes were persisted by the
+ * checkpointer. No flush requests are sent, so nothing else persists them.
+ */
+static bool wait_for_checkpoint(struct ubi_bdev *ubi_bdev) {
+    for (int i = 0; i < CHECKPOINT_MAX_WAITS; i++) {
+        uint64_t fetched = __atomic_load_n(&ubi_bdev->stripes_fetched, __ATOMIC_ACQUIRE);
+        uint64_t flushed = __atomic_load_n(&ubi_bdev->stripes_flushed, __ATOMIC_ACQUIRE);
+        if (fetched == flushed) {
+            return true;
+        }
+        usleep(CHECKPOINT_WAIT_US);
+    }
+
+    SPDK_WARNLOG("Checkpoint didn't happen. stripes_fetched: %lu, stripes_flushed: %lu\n",
+                 ubi_bdev->stripes_fetched, ubi_bdev->stripes_flushed);
+    return false;
+}
+
+static bool do_test_checkpoint(struct ubi_bdev *ubi_bdev, const char *bdev_name) {
+    struct bdev_desc_ch_pair desc_ch_pair = {0};
+    if (!open_bdev_and_ch(bdev_name, &desc_ch_pair)) {
+        SPDK_WARNLOG("Failed to open bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    if (ubi_bdev->stripes_fetched != 0) {
+        SPDK_WARNLOG("base bdev isn't fresh, stripes_fetched: %lu\n",
+                     ubi_bdev->stripes_fetched);
+        close_bdev_and_ch(&desc_ch_pair);
+        return false;
+    }
+
+    bool success = write_image_stripes(ubi_bdev, &desc_ch_pair);
+    close_bdev_and_ch(&desc_ch_pair);
+    return success && wait_for_checkpoint(ubi_bdev);
+}
+
+static bool do_test_flush_commit(struct ubi_bdev *ubi_bdev, const char *bdev_name) {
+    struct bdev_desc_ch_pair desc_ch_pair = {0};
+    if (!open_bdev_and_ch(bdev_name, &desc_ch_pair)) {
+        SPDK_WARNLOG("Failed to open bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    bool success = write_image_stripes(ubi_bdev, &desc_ch_pair);
+
+    // A flush should persist metadata for every stripe fetched before it.
+    struct ubi_io_request req;
+    memset(&req, 0, sizeof(req));
+    req.bdev = &desc_ch_pair;
+    if (success) {
+        uint64_t fetched = __atomic_load_n(&ubi_bdev->stripes_fetched, __ATOMIC_ACQUIRE);
+        execute_spdk_function(io_thread_flush, &req);
+        uint64_t flushed = __atomic_load_n(&ubi_bdev->stripes_flushed, __ATOMIC_ACQUIRE);
+        if (!req.success || flushed < fetched) {
+            SPDK_WARNLOG("Flush failed. success: %d, stripes_fetched: %lu, "
+                         "stripes_flushed: %lu\n",
+                         req.success, fetched, flushed);
+            success = false;
+        }
+    }
+
+    close_bdev_and_ch(&desc_ch_pair);
+    return success;
+}
+
+/*
+ * check_persisted_stripes recreates a bdev, and checks that all image stripes
+ * are marked as fetched in the metadata it reads from base bdev.
+ */
+static bool check_persisted_stripes(const char *bdev_name, const char *base_bdev) {
+    struct ubi_bdev *ubi_bdev = create_test_bdev(bdev_name, base_bdev, true, 0, 0);
+    if (ubi_bdev == NULL) {
+        return false;
+    }
+
+    uint64_t n_image_stripes =
+        spdk_divide_round_up(ubi_bdev->image_block_count, ubi_bdev->stripe_block_count);
+    bool success = ubi_bdev->stripes_fetched == n_image_stripes;
+    if (!success) {
+        SPDK_WARNLOG("stripes_fetched after recreate: %lu, expected: %lu\n",
+                     ubi_bdev->stripes_fetched, n_image_stripes);
+    }
+
+    if (!verify_delete(bdev_name)) {
+        SPDK_WARNLOG("Failed to delete bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    return success;
+}
+
+bool test_checkpoint(void) {
+    const char *bdev_name = "test_checkpoint_ubi0";
+
+    struct ubi_bdev *ubi_bdev =
+        create_test_bdev(bdev_name, TEST_CHECKPOINT_BASE_BDEV, true, 1, 0);
+    bool success = ubi_bdev != NULL && do_test_checkpoint(ubi_bdev, bdev_name);
+
+    if (!verify_delete(bdev_name)) {
+        SPDK_WARNLOG("Failed to delete bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    // Metadata isn't written on delete, so these were written by checkpoints.
+    return success && check_persisted_stripes(bdev_name, TEST_CHECKPOINT_BASE_BDEV);
+}
+
+static bool do_test_checkpoint_interval(struct ubi_bdev *ubi_bdev,
+                                        const char *bdev_name) {
+    struct bdev_desc_ch_pair desc_ch_pair = {0};
+    if (!open_bdev_and_ch(bdev_name, &desc_ch_pair)) {
+        SPDK_WARNLOG("Failed to open bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    // Stay idle for longer than the interval before the first write.
+    usleep((TEST_CHECKPOINT_INTERVAL_MS + 100) * 1000);
+
+    struct ubi_io_request req;
+    memset(&req, 0, sizeof(req));
+    req.bdev = &desc_ch_pair;
+    execute_spdk_function(io_thread_write, &req);
+    close_bdev_and_ch(&desc_ch_pair);
+    if (!req.success) {
+        SPDK_WARNLOG("Write to block 0 failed\n");
+        return false;
+    }
+
+    // The interval starts with the write, so it isn't persisted right away.
+    usleep(TEST_CHECKPOINT_INTERVAL_MS * 1000 / 5);
+    if (__atomic_load_n(&ubi_bdev->stripes_flushed, __ATOMIC_ACQUIRE) != 0) {
+        SPDK_WARNLOG("Checkpoint happened before the interval elapsed\n");
+        return false;
+    }
+
+    return wait_for_checkpoint(ubi_bdev);
+}
+
+bool test_checkpoint_interval(void) {
+    const char *bdev_name = "test_checkpoint_interval_ubi0";
+
+    struct ubi_bdev *ubi_bdev =
+        create_test_bdev(bdev_name, TEST_CHECKPOINT_INTERVAL_BASE_BDEV, true, 0,
+                         TEST_CHECKPOINT_INTERVAL_MS);
+    bool success = ubi_bdev != NULL && do_test_checkpoint_interval(ubi_bdev, bdev_name);
+
+    if (!verify_delete(bdev_name)) {
+        SPDK_WARNLOG("Failed to delete bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    return success;
+}
+
+bool test_flush_commit(void) {
+    const char *bdev_name = "test_flush_commit_ubi0";
+
+    struct ubi_bdev *ubi_bdev =
+        create_test_bdev(bdev_name, TEST_FREE_BASE_BDEV, false, 0, 0);
+    bool success = ubi_bdev != NULL && do_test_flush_commit(ubi_bdev, bdev_name);
+
+    if (!verify_delete(bdev_name)) {
+        SPDK_WARNLOG("Failed to delete bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    if (!success) {
+        return false;
+    }
+
+    // All image stripes were committed, so they should be counted as fetched
+    // when the bdev is created again.
+    ubi_bdev = create_test_bdev(bdev_name, TEST_FREE_BASE_BDEV, false, 0, 0);
+    if (ubi_bdev != NULL) {
+        uint64_t n_image_stripes = spdk_divide_round_up(ubi_bdev->image_block_count,
+                                                        ubi_bdev->stripe_block_count);
+        if (ubi_bdev->stripes_fetched != n_image_stripes) {
+            SPDK_WARNLOG("stripes_fetched after recreate: %lu, expected: %lu\n",
+                         ubi_bdev->stripes_fetched, n_image_stripes);
+            success = false;
+        }
+    } else {
+        success = false;
+    }
+
+    if (!verify_delete(bdev_name)) {
+        SPDK_WARNLOG("Failed to delete bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    return success;
+}
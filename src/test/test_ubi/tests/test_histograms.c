@@ -0,0 +1,133 @@
+#include "spdk/histogram_data.h"
+#include "test_ubi.h"
+
+struct histograms_request {
+    const char *name;
+    bool enable;
+    bool reset;
+
+    int status;
+    uint64_t counts[SPDK_UBI_LATENCY_PHASES];
+};
+
+static void enable_histograms_done(void *cb_arg, int status) {
+    struct histograms_request *req = cb_arg;
+    req->status = status;
+    wake_ut_thread();
+}
+
+static void enable_histograms(void *arg) {
+    struct histograms_request *req = arg;
+    bdev_ubi_enable_histograms(req->name, req->enable, enable_histograms_done, req);
+}
+
+static void count_bucket(void *ctx, uint64_t start, uint64_t end, uint64_t count,
+                         uint64_t total, uint64_t so_far) {
+    uint64_t *total_count = ctx;
+    *total_count = total;
+}
+
+static void get_histograms_done(void *cb_arg,
+                                struct spdk_histogram_data *const *histograms,
+                                int status) {
+    struct histograms_request *req = cb_arg;
+    req->status = status;
+    for (int i = 0; status == 0 && i < SPDK_UBI_LATENCY_PHASES; i++) {
+        req->counts[i] = 0;
+        spdk_histogram_data_iterate(histograms[i], count_bucket, &req->counts[i]);
+    }
+    wake_ut_thread();
+}
+
+static void get_histograms(void *arg) {
+    struct histograms_request *req = arg;
+    bdev_ubi_get_histograms(req->name, req->reset, get_histograms_done, req);
+}
+
+static bool do_io(const char *bdev_name) {
+    struct bdev_desc_ch_pair desc_ch_pair = {0};
+    if (!open_bdev_and_ch(bdev_name, &desc_ch_pair)) {
+        SPDK_WARNLOG("Failed to open bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    struct ubi_io_request req;
+    memset(&req, 0, sizeof(req));
+    req.bdev = &desc_ch_pair;
+    execute_spdk_function(io_thread_write, &req);
+    bool success = req.success;
+    execute_spdk_function(io_thread_read, &req);
+    success = success && req.success;
+    execute_spdk_function(io_thread_flush, &req);
+    success = success && req.success;
+
+    close_bdev_and_ch(&desc_ch_pair);
+    if (!success) {
+        SPDK_WARNLOG("I/O to %s failed\n", bdev_name);
+    }
+
+    return success;
+}
+
+static bool do_test_histograms(const char *bdev_name) {
+    struct histograms_request req = {.name = bdev_name};
+
+    // Histograms are disabled by default.
+    execute_app_function(get_histograms, &req);
+    if (req.status != -EINVAL) {
+        SPDK_WARNLOG("get histograms while disabled returned %d\n", req.status);
+        return false;
+    }
+
+    req.enable = true;
+    execute_app_function(enable_histograms, &req);
+    if (req.status != 0 || !do_io(bdev_name)) {
+        SPDK_WARNLOG("enable histograms returned %d\n", req.status);
+        return false;
+    }
+
+    // The channel was closed, so this also checks its histograms were kept.
+    req.reset = true;
+    execute_app_function(get_histograms, &req);
+    uint64_t *counts = req.counts;
+    if (req.status != 0 || counts[SPDK_UBI_LATENCY_QUEUE] != 3 ||
+        counts[SPDK_UBI_LATENCY_READ] != 1 || counts[SPDK_UBI_LATENCY_WRITE] != 1 ||
+        counts[SPDK_UBI_LATENCY_FLUSH] != 1 ||
+        counts[SPDK_UBI_LATENCY_BASE_IO] < 2) {
+        SPDK_WARNLOG("unexpected histograms. status: %d, queue: %lu, read: %lu, "
+                     "write: %lu, flush: %lu, base_io: %lu\n",
+                     req.status, counts[SPDK_UBI_LATENCY_QUEUE],
+                     counts[SPDK_UBI_LATENCY_READ], counts[SPDK_UBI_LATENCY_WRITE],
+                     counts[SPDK_UBI_LATENCY_FLUSH], counts[SPDK_UBI_LATENCY_BASE_IO]);
+        return false;
+    }
+
+    req.reset = false;
+    execute_app_function(get_histograms, &req);
+    for (int i = 0; i < SPDK_UBI_LATENCY_PHASES; i++) {
+        if (req.status != 0 || req.counts[i] != 0) {
+            SPDK_WARNLOG("%s histogram wasn't reset\n", bdev_ubi_latency_phase_name(i));
+            return false;
+        }
+    }
+
+    req.enable = false;
+    execute_app_function(enable_histograms, &req);
+    return req.status == 0;
+}
+
+bool test_histograms(void) {
+    const char *bdev_name = "test_histograms_ubi0";
+    if (!verify_create(TEST_FREE_BASE_BDEV, TEST_IMAGE_PATH, bdev_name)) {
+        return false;
+    }
+
+    bool success = do_test_histograms(bdev_name);
+
+    if (!verify_delete(bdev_name)) {
+        SPDK_WARNLOG("Failed to delete bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    return success;
+}
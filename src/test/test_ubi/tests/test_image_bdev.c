@@ -0,0 +1,89 @@
+#include "test_ubi.h"
+
+/* ubi_image_bdev in test_conf.json already reads this image bdev. */
+#define TEST_IMAGE_BDEV "image_aio0"
+#define TEST_IMAGE_BDEV_BASE_BDEV "free_base_bdev_5"
+#define TEST_IMAGE_BDEV_BLOCK 12345
+
+static bool create_with_image(const char *image_path, const char *image_bdev,
+                              const char *bdev_name) {
+    struct spdk_ubi_bdev_opts opts = {
+        .name = bdev_name,
+        .base_bdev_name = TEST_IMAGE_BDEV_BASE_BDEV,
+        .image_path = image_path,
+        .image_bdev_name = image_bdev,
+        .stripe_size_kb = 1024,
+    };
+    return verify_create_opts(&opts);
+}
+
+static bool do_test_image_bdev(const char *bdev_name) {
+    struct bdev_desc_ch_pair desc_ch_pair = {0};
+    if (!open_bdev_and_ch(bdev_name, &desc_ch_pair)) {
+        SPDK_WARNLOG("Failed to open bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    uint32_t blocklen = spdk_bdev_desc_get_bdev(desc_ch_pair.desc)->blocklen;
+
+    /*
+     * The first read is served from the image. Writing the next block fetches
+     * the stripe, so the second read is served from the base bdev.
+     */
+    struct ubi_io_request req;
+    memset(&req, 0, sizeof(req));
+    req.bdev = &desc_ch_pair;
+    char image_buf[MAX_BLOCK_SIZE];
+    bool success = read_image_block(TEST_IMAGE_BDEV_BLOCK, blocklen, image_buf);
+    for (int i = 0; success && i < 2; i++) {
+        if (i == 1) {
+            req.block_idx = TEST_IMAGE_BDEV_BLOCK + 1;
+            execute_spdk_function(io_thread_write, &req);
+            success = req.success;
+        }
+        req.block_idx = TEST_IMAGE_BDEV_BLOCK;
+        execute_spdk_function(io_thread_read, &req);
+        success = success && req.success && memcmp(req.buf, image_buf, blocklen) == 0;
+    }
+
+    close_bdev_and_ch(&desc_ch_pair);
+    if (!success) {
+        SPDK_WARNLOG("block read through image bdev doesn't match the image\n");
+    }
+
+    return success;
+}
+
+bool test_image_bdev(void) {
+    const char *bdev_name = "test_image_bdev_ubi0";
+
+    if (create_with_image(NULL, NULL, bdev_name)) {
+        SPDK_WARNLOG("create_bdev_ubi succeeded without an image\n");
+        return false;
+    }
+
+    if (create_with_image(TEST_IMAGE_PATH, TEST_IMAGE_BDEV, bdev_name)) {
+        SPDK_WARNLOG("create_bdev_ubi succeeded with both image path and bdev\n");
+        return false;
+    }
+
+    if (create_with_image(NULL, "non_existent_image_bdev", bdev_name)) {
+        SPDK_WARNLOG("create_bdev_ubi succeeded with non-existent image bdev\n");
+        return false;
+    }
+
+    // The image bdev is claimed for reading only, so it can be shared.
+    if (!create_with_image(NULL, TEST_IMAGE_BDEV, bdev_name)) {
+        SPDK_WARNLOG("create_bdev_ubi failed with shared image bdev\n");
+        return false;
+    }
+
+    bool success = do_test_image_bdev(bdev_name);
+
+    if (!verify_delete(bdev_name)) {
+        SPDK_WARNLOG("Failed to delete bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    return success;
+}
@@ -0,0 +1,57 @@
+#include "spdk/env.h"
+
+#include "test_ubi.h"
+
+#define TEST_IMAGE_DELAY_BASE_BDEV "free_base_bdev_15"
+#define TEST_IMAGE_DELAY_US 50000
+#define TEST_UNFETCHED_BLOCK (30 * 2048)
+
+static bool do_test_image_delay(const char *bdev_name) {
+    struct bdev_desc_ch_pair desc_ch_pair = {0};
+    if (!open_bdev_and_ch(bdev_name, &desc_ch_pair)) {
+        SPDK_WARNLOG("Failed to open bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    struct spdk_ubi_image_delay_opts opts = {
+        .avg_latency_us = TEST_IMAGE_DELAY_US,
+        .p99_latency_us = TEST_IMAGE_DELAY_US,
+    };
+    bdev_ubi_set_image_delay(&opts);
+
+    struct ubi_io_request req;
+    memset(&req, 0, sizeof(req));
+    req.bdev = &desc_ch_pair;
+    req.block_idx = TEST_UNFETCHED_BLOCK;
+    uint64_t start_tsc = spdk_get_ticks();
+    execute_spdk_function(io_thread_read, &req);
+    uint64_t elapsed_us = (spdk_get_ticks() - start_tsc) * 1000000 / spdk_get_ticks_hz();
+
+    memset(&opts, 0, sizeof(opts));
+    bdev_ubi_set_image_delay(&opts);
+    close_bdev_and_ch(&desc_ch_pair);
+
+    if (!req.success || elapsed_us < TEST_IMAGE_DELAY_US) {
+        SPDK_WARNLOG("delayed image read. success: %d, took: %luus, expected: %dus\n",
+                     req.success, elapsed_us, TEST_IMAGE_DELAY_US);
+        return false;
+    }
+
+    return true;
+}
+
+bool test_image_delay(void) {
+    const char *bdev_name = "test_image_delay_ubi0";
+    if (!verify_create(TEST_IMAGE_DELAY_BASE_BDEV, TEST_IMAGE_PATH, bdev_name)) {
+        return false;
+    }
+
+    bool success = do_test_image_delay(bdev_name);
+
+    if (!verify_delete(bdev_name)) {
+        SPDK_WARNLOG("Failed to delete bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    return success;
+}
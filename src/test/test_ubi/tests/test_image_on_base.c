@@ -0,0 +1,108 @@
+#include "test_ubi.h"
+
+#define TEST_IMAGE_ON_BASE_BDEV "free_base_bdev_6"
+
+/* The image is the last 84800 blocks of base bdev, i.e. 42 stripes. */
+#define TEST_IMAGE_OFFSET_BLOCKS 120000
+#define TEST_IMAGE_ON_BASE_BLOCK (3 * 2048 + 7)
+
+static void fill_pattern(char *buf, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        buf[i] = (char)(i * 7 + 1);
+    }
+}
+
+/*
+ * write_image_block stores a block of the image on base bdev before a ubi
+ * bdev claims it.
+ */
+static bool write_image_block(uint64_t block) {
+    struct bdev_desc_ch_pair desc_ch_pair = {0};
+    if (!open_bdev_and_ch(TEST_IMAGE_ON_BASE_BDEV, &desc_ch_pair)) {
+        SPDK_WARNLOG("Failed to open bdev: %s\n", TEST_IMAGE_ON_BASE_BDEV);
+        return false;
+    }
+
+    uint32_t blocklen = spdk_bdev_desc_get_bdev(desc_ch_pair.desc)->blocklen;
+    struct ubi_io_request req;
+    memset(&req, 0, sizeof(req));
+    req.bdev = &desc_ch_pair;
+    req.block_idx = TEST_IMAGE_OFFSET_BLOCKS + block;
+    fill_pattern(req.buf, blocklen);
+    execute_spdk_function(io_thread_write, &req);
+
+    close_bdev_and_ch(&desc_ch_pair);
+    return req.success;
+}
+
+static bool do_test_image_on_base(const char *bdev_name) {
+    struct bdev_desc_ch_pair desc_ch_pair = {0};
+    if (!open_bdev_and_ch(bdev_name, &desc_ch_pair)) {
+        SPDK_WARNLOG("Failed to open bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    struct spdk_bdev *bdev = spdk_bdev_desc_get_bdev(desc_ch_pair.desc);
+    uint32_t blocklen = bdev->blocklen;
+    bool success = bdev->blockcnt < TEST_IMAGE_OFFSET_BLOCKS;
+    if (!success) {
+        SPDK_WARNLOG("ubi bdev overlaps the image, blockcnt: %lu\n", bdev->blockcnt);
+    }
+
+    /*
+     * The first read is served from the image. Writing the next block fetches
+     * the stripe, by a copy if base bdev supports it, so the second read is
+     * served from the data area.
+     */
+    struct ubi_io_request req;
+    memset(&req, 0, sizeof(req));
+    req.bdev = &desc_ch_pair;
+    char image_buf[MAX_BLOCK_SIZE];
+    fill_pattern(image_buf, blocklen);
+    for (int i = 0; success && i < 2; i++) {
+        if (i == 1) {
+            req.block_idx = TEST_IMAGE_ON_BASE_BLOCK + 1;
+            execute_spdk_function(io_thread_write, &req);
+            success = req.success;
+        }
+        req.block_idx = TEST_IMAGE_ON_BASE_BLOCK;
+        execute_spdk_function(io_thread_read, &req);
+        success = success && req.success && memcmp(req.buf, image_buf, blocklen) == 0;
+    }
+
+    close_bdev_and_ch(&desc_ch_pair);
+    if (!success) {
+        SPDK_WARNLOG("block read from image on base bdev doesn't match the image\n");
+    }
+
+    return success;
+}
+
+bool test_image_on_base(void) {
+    const char *bdev_name = "test_image_on_base_ubi0";
+
+    if (!write_image_block(TEST_IMAGE_ON_BASE_BLOCK)) {
+        SPDK_WARNLOG("could not write the image to base bdev\n");
+        return false;
+    }
+
+    struct spdk_ubi_bdev_opts opts = {
+        .name = bdev_name,
+        .base_bdev_name = TEST_IMAGE_ON_BASE_BDEV,
+        .image_bdev_name = TEST_IMAGE_ON_BASE_BDEV,
+        .image_offset_blocks = TEST_IMAGE_OFFSET_BLOCKS,
+        .stripe_size_kb = 1024,
+    };
+    if (!verify_create_opts(&opts)) {
+        return false;
+    }
+
+    bool success = do_test_image_on_base(bdev_name);
+
+    if (!verify_delete(bdev_name)) {
+        SPDK_WARNLOG("Failed to delete bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    return success;
+}
@@ -0,0 +1,94 @@
+#include "spdk/env.h"
+
+#include "test_ubi.h"
+
+#define TEST_INTERRUPT_MODE_BASE_BDEV "free_base_bdev_16"
+#define TEST_IMAGE_DELAY_US 100000
+#define TEST_UNFETCHED_BLOCK (30 * 2048)
+
+static uint64_t process_cpu_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * A delayed image read completes through the ring's eventfd once it's due.
+ * While it's delayed, reactors sleep rather than poll for it, so the app
+ * uses a small fraction of the delay in CPU time.
+ */
+static bool test_delayed_read(struct bdev_desc_ch_pair *desc_ch_pair) {
+    struct spdk_ubi_image_delay_opts opts = {
+        .avg_latency_us = TEST_IMAGE_DELAY_US,
+        .p99_latency_us = TEST_IMAGE_DELAY_US,
+    };
+    bdev_ubi_set_image_delay(&opts);
+
+    struct ubi_io_request req;
+    memset(&req, 0, sizeof(req));
+    req.bdev = desc_ch_pair;
+    req.block_idx = TEST_UNFETCHED_BLOCK;
+    uint64_t start_tsc = spdk_get_ticks();
+    uint64_t start_cpu_us = process_cpu_us();
+    execute_spdk_function(io_thread_read, &req);
+    uint64_t cpu_us = process_cpu_us() - start_cpu_us;
+    uint64_t elapsed_us = (spdk_get_ticks() - start_tsc) * 1000000 / spdk_get_ticks_hz();
+
+    memset(&opts, 0, sizeof(opts));
+    bdev_ubi_set_image_delay(&opts);
+
+    if (!req.success || elapsed_us < TEST_IMAGE_DELAY_US ||
+        cpu_us > TEST_IMAGE_DELAY_US / 2) {
+        SPDK_WARNLOG("delayed image read. success: %d, took: %luus, cpu: %luus\n",
+                     req.success, elapsed_us, cpu_us);
+        return false;
+    }
+
+    return true;
+}
+
+/* A write fetches its stripe through the ring, and is read back. */
+static bool test_fetch_and_read(struct bdev_desc_ch_pair *desc_ch_pair) {
+    struct ubi_io_request req;
+    memset(&req, 0, sizeof(req));
+    req.bdev = desc_ch_pair;
+    req.block_idx = TEST_UNFETCHED_BLOCK + 1;
+    memset(req.buf, 0xa5, MAX_BLOCK_SIZE);
+    execute_spdk_function(io_thread_write, &req);
+    if (!req.success) {
+        SPDK_WARNLOG("write of an unfetched stripe failed\n");
+        return false;
+    }
+
+    memset(req.buf, 0, MAX_BLOCK_SIZE);
+    execute_spdk_function(io_thread_read, &req);
+    if (!req.success || req.buf[0] != (char)0xa5) {
+        SPDK_WARNLOG("reading back a written block failed\n");
+        return false;
+    }
+
+    return true;
+}
+
+bool test_interrupt_mode(void) {
+    const char *bdev_name = "test_interrupt_mode_ubi0";
+    if (!verify_create(TEST_INTERRUPT_MODE_BASE_BDEV, TEST_IMAGE_PATH, bdev_name)) {
+        return false;
+    }
+
+    bool success = false;
+    struct bdev_desc_ch_pair desc_ch_pair = {0};
+    if (!open_bdev_and_ch(bdev_name, &desc_ch_pair)) {
+        SPDK_WARNLOG("Failed to open bdev UBI: %s\n", bdev_name);
+    } else {
+        success = test_delayed_read(&desc_ch_pair) && test_fetch_and_read(&desc_ch_pair);
+        close_bdev_and_ch(&desc_ch_pair);
+    }
+
+    if (!verify_delete(bdev_name)) {
+        SPDK_WARNLOG("Failed to delete bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    return success;
+}
@@ -87,18 +87,31 @@ static bool do_test_io_channel_create_errors(const char *bdev_name) {
     {
         bool success = true;
         struct bdev_desc_ch_pair desc_ch_pair = {0};
-        ubi_io_channel_fail_uring_queue_init(true);
+        ubi_uring_fail_queue_init(true);
         if (open_bdev_and_ch(bdev_name, &desc_ch_pair)) {
             SPDK_WARNLOG(
                 "open_bdev_and_ch succeeded when initializing io_uring failed\n");
             success = false;
         }
-        ubi_io_channel_fail_uring_queue_init(false);
+        ubi_uring_fail_queue_init(false);
         close_bdev_and_ch(&desc_ch_pair);
         if (!success) {
             return false;
         }
     }
 
+    // Registering image file and buffers with io_uring is optional
+    {
+        int n_io_tests = 0, n_io_failures = 0;
+        ubi_uring_fail_register(true);
+        test_bdev_io(bdev_name, &n_io_tests, &n_io_failures);
+        ubi_uring_fail_register(false);
+        if (n_io_failures > 0) {
+            SPDK_WARNLOG("Failed %d I/O tests when io_uring registration failed\n",
+                         n_io_failures);
+            return false;
+        }
+    }
+
     return true;
 }
@@ -0,0 +1,112 @@
+#include "test_ubi.h"
+
+#define TEST_OVERLAY_BASE_BDEV "free_base_bdev_9"
+#define TEST_OVERLAY_PATH "bin/test/test_overlay.raw"
+
+/* The overlay is sparse, with data only in the 4KB at this block. */
+#define TEST_OVERLAY_BLOCK (2 * 2048 + 8)
+#define TEST_OVERLAY_DATA_SIZE 4096
+
+static void fill_pattern(char *buf, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++) {
+        buf[i] = (char)(i * 13 + 5);
+    }
+}
+
+static bool write_overlay(uint32_t blocklen) {
+    char data[TEST_OVERLAY_DATA_SIZE];
+    fill_pattern(data, sizeof(data));
+
+    FILE *f = fopen(TEST_OVERLAY_PATH, "w");
+    if (f == NULL) {
+        SPDK_ERRLOG("Could not open %s: %s\n", TEST_OVERLAY_PATH, strerror(errno));
+        return false;
+    }
+
+    bool success = fseek(f, (long)TEST_OVERLAY_BLOCK * blocklen, SEEK_SET) == 0 &&
+                   fwrite(data, 1, sizeof(data), f) == sizeof(data);
+    return fclose(f) == 0 && success;
+}
+
+static bool read_expected_block(uint64_t block, uint32_t blocklen, char *buf) {
+    uint64_t overlay_blocks = TEST_OVERLAY_DATA_SIZE / blocklen;
+    if (block >= TEST_OVERLAY_BLOCK && block < TEST_OVERLAY_BLOCK + overlay_blocks) {
+        char data[TEST_OVERLAY_DATA_SIZE];
+        fill_pattern(data, sizeof(data));
+        memcpy(buf, data + (block - TEST_OVERLAY_BLOCK) * blocklen, blocklen);
+        return true;
+    }
+
+    return read_image_block(block, blocklen, buf);
+}
+
+static bool do_test_overlay(const char *bdev_name) {
+    struct bdev_desc_ch_pair desc_ch_pair = {0};
+    if (!open_bdev_and_ch(bdev_name, &desc_ch_pair)) {
+        SPDK_WARNLOG("Failed to open bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    uint32_t blocklen = spdk_bdev_desc_get_bdev(desc_ch_pair.desc)->blocklen;
+
+    /*
+     * The first block comes from the overlay, and the others from the image
+     * below it, both in the stripe which has overlay data and in another.
+     */
+    uint64_t blocks[] = {TEST_OVERLAY_BLOCK, TEST_OVERLAY_BLOCK + 100, 5 * 2048 + 3};
+
+    struct ubi_io_request req;
+    memset(&req, 0, sizeof(req));
+    req.bdev = &desc_ch_pair;
+    char expected[MAX_BLOCK_SIZE];
+    bool success = true;
+    for (size_t i = 0; success && i < SPDK_COUNTOF(blocks); i++) {
+        req.block_idx = blocks[i];
+        execute_spdk_function(io_thread_read, &req);
+        success = req.success && read_expected_block(blocks[i], blocklen, expected) &&
+                  memcmp(req.buf, expected, blocklen) == 0;
+        if (!success) {
+            SPDK_WARNLOG("unexpected data in block %lu of layered image\n", blocks[i]);
+        }
+    }
+
+    close_bdev_and_ch(&desc_ch_pair);
+    return success;
+}
+
+bool test_overlay(void) {
+    const char *bdev_name = "test_overlay_ubi0";
+
+    if (!write_overlay(512)) {
+        SPDK_WARNLOG("could not write %s\n", TEST_OVERLAY_PATH);
+        return false;
+    }
+
+    struct spdk_ubi_bdev_opts opts = {
+        .name = bdev_name,
+        .base_bdev_name = TEST_OVERLAY_BASE_BDEV,
+        .image_bdev_name = "image_aio0",
+        .image_overlays = {TEST_OVERLAY_PATH},
+        .image_overlay_count = 1,
+        .stripe_size_kb = 1024,
+    };
+    if (verify_create_opts(&opts)) {
+        SPDK_WARNLOG("create_bdev_ubi succeeded with overlays over an image bdev\n");
+        return false;
+    }
+
+    opts.image_bdev_name = NULL;
+    opts.image_path = TEST_IMAGE_PATH;
+    if (!verify_create_opts(&opts)) {
+        return false;
+    }
+
+    bool success = do_test_overlay(bdev_name);
+
+    if (!verify_delete(bdev_name)) {
+        SPDK_WARNLOG("Failed to delete bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    return success;
+}
@@ -0,0 +1,179 @@
+#include "spdk/endian.h"
+
+#include "test_ubi.h"
+
+#define TEST_QCOW2_BASE_BDEV "free_base_bdev_7"
+#define TEST_QCOW2_IMAGE_PATH "bin/test/test_image.qcow2"
+
+/*
+ * The qcow2 image has the first 8MB of TEST_IMAGE_PATH followed by zeros,
+ * which are left unallocated.
+ */
+#define TEST_QCOW2_CLUSTER_BITS 16
+#define TEST_QCOW2_CLUSTER_SIZE (1ULL << TEST_QCOW2_CLUSTER_BITS)
+#define TEST_QCOW2_DATA_SIZE (8 * 1024 * 1024)
+#define TEST_QCOW2_IMAGE_SIZE (40 * 1024 * 1024)
+
+/* Metadata clusters at the start of the file. Data clusters follow them. */
+#define TEST_QCOW2_L1_CLUSTER 1
+#define TEST_QCOW2_L2_CLUSTER 2
+#define TEST_QCOW2_REFCOUNT_TABLE_CLUSTER 3
+#define TEST_QCOW2_REFCOUNT_BLOCK_CLUSTER 4
+#define TEST_QCOW2_METADATA_CLUSTERS 5
+
+#define QCOW2_MAGIC 0x514649fb
+#define QCOW2_V3_HEADER_SIZE 104
+#define QCOW2_COPIED (1ULL << 63)
+
+struct qcow2_read_check {
+    uint64_t block;
+    /* Block to write first, so the stripe is fetched, or 0. */
+    uint64_t write_block;
+};
+
+static uint64_t qcow2_cluster_offset(uint64_t cluster) {
+    return cluster * TEST_QCOW2_CLUSTER_SIZE;
+}
+
+/*
+ * write_qcow2_image writes the test image in the qcow2 v3 format, with one L1
+ * entry, one L2 table and one refcount block, which cover all of it. Data
+ * clusters are in guest order after the metadata clusters.
+ */
+static bool write_qcow2_image(void) {
+    uint64_t data_clusters = TEST_QCOW2_DATA_SIZE / TEST_QCOW2_CLUSTER_SIZE;
+    uint64_t file_clusters = TEST_QCOW2_METADATA_CLUSTERS + data_clusters;
+    uint8_t *metadata = calloc(TEST_QCOW2_METADATA_CLUSTERS, TEST_QCOW2_CLUSTER_SIZE);
+    char *buf = malloc(TEST_QCOW2_CLUSTER_SIZE);
+    FILE *raw = fopen(TEST_IMAGE_PATH, "r");
+    FILE *f = fopen(TEST_QCOW2_IMAGE_PATH, "w");
+    bool success = metadata && buf && raw && f;
+
+    if (success) {
+        uint8_t *header = metadata;
+        to_be32(header, QCOW2_MAGIC);
+        to_be32(header + 4, 3);
+        to_be32(header + 20, TEST_QCOW2_CLUSTER_BITS);
+        to_be64(header + 24, TEST_QCOW2_IMAGE_SIZE);
+        to_be32(header + 36, 1);
+        to_be64(header + 40, qcow2_cluster_offset(TEST_QCOW2_L1_CLUSTER));
+        to_be64(header + 48, qcow2_cluster_offset(TEST_QCOW2_REFCOUNT_TABLE_CLUSTER));
+        to_be32(header + 56, 1);
+        /* 16 bit refcounts. */
+        to_be32(header + 96, 4);
+        to_be32(header + 100, QCOW2_V3_HEADER_SIZE);
+
+        uint8_t *l1 = metadata + qcow2_cluster_offset(TEST_QCOW2_L1_CLUSTER);
+        to_be64(l1, qcow2_cluster_offset(TEST_QCOW2_L2_CLUSTER) | QCOW2_COPIED);
+        uint8_t *l2 = metadata + qcow2_cluster_offset(TEST_QCOW2_L2_CLUSTER);
+        for (uint64_t i = 0; i < data_clusters; i++) {
+            uint64_t host_cluster = TEST_QCOW2_METADATA_CLUSTERS + i;
+            to_be64(l2 + i * 8, qcow2_cluster_offset(host_cluster) | QCOW2_COPIED);
+        }
+
+        uint8_t *refcount_table =
+            metadata + qcow2_cluster_offset(TEST_QCOW2_REFCOUNT_TABLE_CLUSTER);
+        to_be64(refcount_table, qcow2_cluster_offset(TEST_QCOW2_REFCOUNT_BLOCK_CLUSTER));
+        uint8_t *refcount_block =
+            metadata + qcow2_cluster_offset(TEST_QCOW2_REFCOUNT_BLOCK_CLUSTER);
+        for (uint64_t i = 0; i < file_clusters; i++) {
+            to_be16(refcount_block + i * 2, 1);
+        }
+
+        success = fwrite(metadata, TEST_QCOW2_CLUSTER_SIZE, TEST_QCOW2_METADATA_CLUSTERS,
+                         f) == TEST_QCOW2_METADATA_CLUSTERS;
+    }
+
+    for (uint64_t i = 0; success && i < data_clusters; i++) {
+        size_t n = fread(buf, 1, TEST_QCOW2_CLUSTER_SIZE, raw);
+        success = n == TEST_QCOW2_CLUSTER_SIZE && fwrite(buf, 1, n, f) == n;
+    }
+
+    if (f && fclose(f) != 0) {
+        success = false;
+    }
+    if (raw) {
+        fclose(raw);
+    }
+    free(buf);
+    free(metadata);
+    return success;
+}
+
+static bool read_expected_block(uint64_t block, uint32_t blocklen, char *buf) {
+    if (block * blocklen >= TEST_QCOW2_DATA_SIZE) {
+        memset(buf, 0, blocklen);
+        return true;
+    }
+
+    return read_image_block(block, blocklen, buf);
+}
+
+static bool do_test_qcow2(const char *bdev_name) {
+    struct bdev_desc_ch_pair desc_ch_pair = {0};
+    if (!open_bdev_and_ch(bdev_name, &desc_ch_pair)) {
+        SPDK_WARNLOG("Failed to open bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    uint32_t blocklen = spdk_bdev_desc_get_bdev(desc_ch_pair.desc)->blocklen;
+
+    /*
+     * Reads of unfetched stripes are translated to the qcow2 file, then
+     * stripes with data and a stripe of zeros are fetched.
+     */
+    struct qcow2_read_check checks[] = {
+        {.block = 100},
+        {.block = 20 * 2048 + 5},
+        {.block = 3 * 2048 + 10, .write_block = 3 * 2048 + 11},
+        {.block = 25 * 2048 + 10, .write_block = 25 * 2048 + 11},
+    };
+
+    struct ubi_io_request req;
+    memset(&req, 0, sizeof(req));
+    req.bdev = &desc_ch_pair;
+    char expected[MAX_BLOCK_SIZE];
+    bool success = true;
+    for (size_t i = 0; success && i < SPDK_COUNTOF(checks); i++) {
+        if (checks[i].write_block != 0) {
+            req.block_idx = checks[i].write_block;
+            execute_spdk_function(io_thread_write, &req);
+            success = req.success;
+        }
+
+        req.block_idx = checks[i].block;
+        execute_spdk_function(io_thread_read, &req);
+        success = success && req.success &&
+                  read_expected_block(checks[i].block, blocklen, expected) &&
+                  memcmp(req.buf, expected, blocklen) == 0;
+        if (!success) {
+            SPDK_WARNLOG("unexpected data in block %lu of qcow2 image\n",
+                         checks[i].block);
+        }
+    }
+
+    close_bdev_and_ch(&desc_ch_pair);
+    return success;
+}
+
+bool test_qcow2(void) {
+    const char *bdev_name = "test_qcow2_ubi0";
+
+    if (!write_qcow2_image()) {
+        SPDK_WARNLOG("could not write %s\n", TEST_QCOW2_IMAGE_PATH);
+        return false;
+    }
+
+    if (!verify_create(TEST_QCOW2_BASE_BDEV, TEST_QCOW2_IMAGE_PATH, bdev_name)) {
+        return false;
+    }
+
+    bool success = do_test_qcow2(bdev_name);
+
+    if (!verify_delete(bdev_name)) {
+        SPDK_WARNLOG("Failed to delete bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    return success;
+}
@@ -0,0 +1,155 @@
+#include "spdk/jsonrpc.h"
+#include "spdk/rpc.h"
+
+#include "test_ubi.h"
+
+#define TEST_RPC_MAX_BATCH 1024
+#define TEST_RPC_TIMEOUT_MS 10000
+
+/*
+ * Builds a bdev_ubi_create_batch request with "n" entries. The first one is
+ * valid, the second fails creation, the third isn't an object, and the rest
+ * miss required parameters.
+ */
+static struct spdk_jsonrpc_client_request *create_batch_request(size_t n) {
+    struct spdk_jsonrpc_client_request *req = spdk_jsonrpc_client_create_request();
+    if (req == NULL) {
+        return NULL;
+    }
+
+    struct spdk_json_write_ctx *w =
+        spdk_jsonrpc_begin_request(req, 1, "bdev_ubi_create_batch");
+    spdk_json_write_named_object_begin(w, "params");
+    spdk_json_write_named_array_begin(w, "bdevs");
+    for (size_t i = 0; i < n; i++) {
+        if (i == 2) {
+            spdk_json_write_int32(w, 7);
+            continue;
+        }
+
+        spdk_json_write_object_begin(w);
+        spdk_json_write_named_string_fmt(w, "name", "test_rpc_create_batch_ubi%zu", i);
+        if (i == 0) {
+            spdk_json_write_named_string(w, "base_bdev", TEST_FREE_BASE_BDEV);
+        } else if (i == 1) {
+            spdk_json_write_named_string(w, "base_bdev", "non_existent_base_bdev");
+        }
+        if (i < 2) {
+            spdk_json_write_named_string(w, "image_path", TEST_IMAGE_PATH);
+            spdk_json_write_named_uint32(w, "stripe_size_kb", 1024);
+        }
+        spdk_json_write_object_end(w);
+    }
+    spdk_json_write_array_end(w);
+    spdk_json_write_object_end(w);
+    spdk_jsonrpc_end_request(req, w);
+    return req;
+}
+
+static struct spdk_jsonrpc_client_response *
+send_batch_request(struct spdk_jsonrpc_client *client, size_t n) {
+    struct spdk_jsonrpc_client_request *req = create_batch_request(n);
+    if (req == NULL) {
+        SPDK_WARNLOG("Failed to create bdev_ubi_create_batch request\n");
+        return NULL;
+    }
+
+    /* The client frees the request once it's sent. */
+    if (spdk_jsonrpc_client_send_request(client, req) != 0) {
+        SPDK_WARNLOG("Failed to send bdev_ubi_create_batch request\n");
+        spdk_jsonrpc_client_free_request(req);
+        return NULL;
+    }
+
+    int rc = 0;
+    for (int ms = 0; ms < TEST_RPC_TIMEOUT_MS && rc == 0; ms++) {
+        rc = spdk_jsonrpc_client_poll(client, 1);
+    }
+    if (rc <= 0) {
+        SPDK_WARNLOG("No response to bdev_ubi_create_batch: %d\n", rc);
+        return NULL;
+    }
+
+    return spdk_jsonrpc_client_get_response(client);
+}
+
+static bool check_batch_entry(struct spdk_json_val *entry, size_t i) {
+    struct spdk_json_val *success_val, *error_val;
+    bool success = false;
+    if (spdk_json_find(entry, "success", NULL, &success_val, SPDK_JSON_VAL_ANY) ||
+        spdk_json_decode_bool(success_val, &success)) {
+        SPDK_WARNLOG("bdevs[%zu] has no success in response\n", i);
+        return false;
+    }
+
+    bool has_error = spdk_json_find_string(entry, "error", NULL, &error_val) == 0;
+    if (success != (i == 0) || has_error == success) {
+        SPDK_WARNLOG("unexpected result for bdevs[%zu], success: %d, has error: %d\n",
+                     i, success, has_error);
+        return false;
+    }
+
+    return true;
+}
+
+static bool do_test_rpc_create_batch(struct spdk_jsonrpc_client *client) {
+    /* A batch over the limit is rejected as a whole. */
+    struct spdk_jsonrpc_client_response *resp =
+        send_batch_request(client, TEST_RPC_MAX_BATCH + 1);
+    if (resp == NULL || resp->error == NULL) {
+        SPDK_WARNLOG("bdev_ubi_create_batch accepted more than %d bdevs\n",
+                     TEST_RPC_MAX_BATCH);
+        spdk_jsonrpc_client_free_response(resp);
+        return false;
+    }
+    spdk_jsonrpc_client_free_response(resp);
+
+    /* A batch at the limit reports the result of each entry. */
+    resp = send_batch_request(client, TEST_RPC_MAX_BATCH);
+    if (resp == NULL || resp->result == NULL ||
+        resp->result->type != SPDK_JSON_VAL_ARRAY_BEGIN) {
+        SPDK_WARNLOG("bdev_ubi_create_batch failed for %d bdevs\n", TEST_RPC_MAX_BATCH);
+        spdk_jsonrpc_client_free_response(resp);
+        return false;
+    }
+
+    bool success = true;
+    size_t n_entries = 0;
+    struct spdk_json_val *entry = spdk_json_array_first(resp->result);
+    for (; entry != NULL && success; entry = spdk_json_next(entry), n_entries++) {
+        success = check_batch_entry(entry, n_entries);
+    }
+    spdk_jsonrpc_client_free_response(resp);
+
+    if (success && n_entries != TEST_RPC_MAX_BATCH) {
+        SPDK_WARNLOG("bdev_ubi_create_batch returned %zu results, expected %d\n",
+                     n_entries, TEST_RPC_MAX_BATCH);
+        success = false;
+    }
+
+    if (spdk_bdev_get_by_name("test_rpc_create_batch_ubi0") == NULL) {
+        SPDK_WARNLOG("valid entry of the batch wasn't created\n");
+        return false;
+    }
+
+    return success;
+}
+
+bool test_rpc_create_batch(void) {
+    struct spdk_jsonrpc_client *client =
+        spdk_jsonrpc_client_connect(SPDK_DEFAULT_RPC_ADDR, AF_UNIX);
+    if (client == NULL) {
+        SPDK_WARNLOG("Could not connect to %s\n", SPDK_DEFAULT_RPC_ADDR);
+        return false;
+    }
+
+    bool success = do_test_rpc_create_batch(client);
+    spdk_jsonrpc_client_close(client);
+
+    if (spdk_bdev_get_by_name("test_rpc_create_batch_ubi0") != NULL &&
+        !verify_delete("test_rpc_create_batch_ubi0")) {
+        return false;
+    }
+
+    return success;
+}
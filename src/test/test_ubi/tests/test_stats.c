@@ -0,0 +1,107 @@
+#include "test_ubi.h"
+
+#define TEST_STATS_BASE_BDEV "free_base_bdev_4"
+
+struct get_stats_request {
+    const char *name;
+    struct spdk_ubi_bdev_stats stats;
+    int status;
+};
+
+static void get_stats_done(void *cb_arg, const struct spdk_ubi_bdev_stats *stats,
+                           int status) {
+    struct get_stats_request *req = cb_arg;
+    req->status = status;
+    if (status == 0) {
+        req->stats = *stats;
+    }
+
+    wake_ut_thread();
+}
+
+static void get_stats(void *arg) {
+    struct get_stats_request *req = arg;
+    bdev_ubi_get_stats(req->name, get_stats_done, req);
+}
+
+static bool check_stats(const char *bdev_name, uint32_t expected_channels) {
+    struct get_stats_request req = {.name = bdev_name};
+    execute_app_function(get_stats, &req);
+    if (req.status != 0) {
+        SPDK_WARNLOG("bdev_ubi_get_stats failed: %s\n", spdk_strerror(-req.status));
+        return false;
+    }
+
+    /* A write to the first block fetched the first stripe, which is 1MB. */
+    struct spdk_ubi_bdev_stats *stats = &req.stats;
+    uint64_t stripe_bytes = 1024 * 1024;
+    if (stats->image_stripes != 40 || stats->stripes_fetched != 1 ||
+        stats->io.blocks_written != 1 || stats->io.stripe_fetches != 1 ||
+        stats->io.fetch_bytes_written != stripe_bytes ||
+        stats->io.image_bytes_read != stripe_bytes ||
+        stats->io.ios_blocked_on_fetch != 1 || stats->channels != expected_channels ||
+        stats->queued_ios != 0 || stats->active_stripe_fetches != 0) {
+        SPDK_WARNLOG("unexpected stats. image_stripes: %lu, stripes_fetched: %lu, "
+                     "blocks_written: %lu, stripe_fetches: %lu, "
+                     "fetch_bytes_written: %lu, image_bytes_read: %lu, "
+                     "ios_blocked_on_fetch: %lu, channels: %u\n",
+                     stats->image_stripes, stats->stripes_fetched,
+                     stats->io.blocks_written, stats->io.stripe_fetches,
+                     stats->io.fetch_bytes_written, stats->io.image_bytes_read,
+                     stats->io.ios_blocked_on_fetch, stats->channels);
+        return false;
+    }
+
+    return true;
+}
+
+static bool do_test_stats(const char *bdev_name) {
+    struct bdev_desc_ch_pair desc_ch_pair = {0};
+    if (!open_bdev_and_ch(bdev_name, &desc_ch_pair)) {
+        SPDK_WARNLOG("Failed to open bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    struct ubi_io_request req;
+    memset(&req, 0, sizeof(req));
+    req.bdev = &desc_ch_pair;
+    req.block_idx = 0;
+    execute_spdk_function(io_thread_write, &req);
+
+    bool success = req.success && check_stats(bdev_name, 1);
+    close_bdev_and_ch(&desc_ch_pair);
+
+    // Counters of closed channels should be kept.
+    return success && check_stats(bdev_name, 0);
+}
+
+bool test_stats(void) {
+    const char *bdev_name = "test_stats_ubi0";
+    struct spdk_ubi_bdev_opts opts = {
+        .name = bdev_name,
+        .base_bdev_name = TEST_STATS_BASE_BDEV,
+        .image_path = TEST_IMAGE_PATH,
+        .stripe_size_kb = 1024,
+        .no_sync = true,
+    };
+    if (!verify_create_opts(&opts)) {
+        return false;
+    }
+
+    bool success = do_test_stats(bdev_name);
+
+    if (!verify_delete(bdev_name)) {
+        SPDK_WARNLOG("Failed to delete bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    // Stats of a deleted bdev shouldn't be found.
+    struct get_stats_request req = {.name = bdev_name};
+    execute_app_function(get_stats, &req);
+    if (req.status != -ENODEV) {
+        SPDK_WARNLOG("bdev_ubi_get_stats of deleted bdev returned %d\n", req.status);
+        return false;
+    }
+
+    return success;
+}
@@ -0,0 +1,125 @@
+#include "test_ubi.h"
+
+#define TEST_STRIPE_CACHE_FIRST_BASE_BDEV "free_base_bdev_10"
+#define TEST_STRIPE_CACHE_SECOND_BASE_BDEV "free_base_bdev_11"
+#define TEST_STRIPE_CACHE_SIZE_MB 16
+
+/* Block size of the base bdevs. */
+#define TEST_BLOCKLEN 512
+
+/* The first bdev fetches this stripe, and the second finds it cached. */
+#define TEST_CACHED_STRIPE 3
+
+struct get_stats_request {
+    const char *name;
+    struct spdk_ubi_bdev_stats stats;
+    int status;
+};
+
+static void get_stats_done(void *cb_arg, const struct spdk_ubi_bdev_stats *stats,
+                           int status) {
+    struct get_stats_request *req = cb_arg;
+    req->status = status;
+    if (status == 0) {
+        req->stats = *stats;
+    }
+
+    wake_ut_thread();
+}
+
+static void get_stats(void *arg) {
+    struct get_stats_request *req = arg;
+    bdev_ubi_get_stats(req->name, get_stats_done, req);
+}
+
+static bool do_io(const char *bdev_name, uint64_t block, bool write, char *buf) {
+    struct bdev_desc_ch_pair desc_ch_pair = {0};
+    if (!open_bdev_and_ch(bdev_name, &desc_ch_pair)) {
+        SPDK_WARNLOG("Failed to open bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    struct ubi_io_request req;
+    memset(&req, 0, sizeof(req));
+    req.bdev = &desc_ch_pair;
+    req.block_idx = block;
+    execute_spdk_function(write ? io_thread_write : io_thread_read, &req);
+    if (buf != NULL) {
+        memcpy(buf, req.buf, MAX_BLOCK_SIZE);
+    }
+
+    close_bdev_and_ch(&desc_ch_pair);
+    return req.success;
+}
+
+static bool do_test_stripe_cache(const char *first, const char *second) {
+    uint64_t stripe_block = TEST_CACHED_STRIPE * 2048;
+
+    /* Fetching the stripe in the first bdev caches it. */
+    if (!do_io(first, stripe_block + 1, true, NULL)) {
+        SPDK_WARNLOG("write to %s failed\n", first);
+        return false;
+    }
+
+    /*
+     * A read of the unfetched stripe in the second bdev, and then its fetch,
+     * are served by the cache without reading the image.
+     */
+    char buf[MAX_BLOCK_SIZE];
+    char expected[MAX_BLOCK_SIZE];
+    if (!do_io(second, stripe_block + 5, false, buf) ||
+        !read_image_block(stripe_block + 5, TEST_BLOCKLEN, expected) ||
+        memcmp(buf, expected, TEST_BLOCKLEN) != 0) {
+        SPDK_WARNLOG("unexpected data read from the stripe cache\n");
+        return false;
+    }
+
+    if (!do_io(second, stripe_block + 7, true, NULL) ||
+        !do_io(second, stripe_block + 9, false, buf) ||
+        !read_image_block(stripe_block + 9, TEST_BLOCKLEN, expected) ||
+        memcmp(buf, expected, TEST_BLOCKLEN) != 0) {
+        SPDK_WARNLOG("unexpected data in stripe fetched from the stripe cache\n");
+        return false;
+    }
+
+    struct get_stats_request req = {.name = second};
+    execute_app_function(get_stats, &req);
+    struct spdk_ubi_bdev_stats *stats = &req.stats;
+    if (req.status != 0 || stats->stripes_fetched != 1 ||
+        stats->io.stripe_cache_hits != 2 || stats->io.image_bytes_read != 0) {
+        SPDK_WARNLOG("unexpected stats. status: %d, stripes_fetched: %lu, "
+                     "stripe_cache_hits: %lu, image_bytes_read: %lu\n",
+                     req.status, stats->stripes_fetched, stats->io.stripe_cache_hits,
+                     stats->io.image_bytes_read);
+        return false;
+    }
+
+    return true;
+}
+
+bool test_stripe_cache(void) {
+    const char *first = "test_stripe_cache_ubi0";
+    const char *second = "test_stripe_cache_ubi1";
+
+    bdev_ubi_set_stripe_cache(TEST_STRIPE_CACHE_SIZE_MB);
+    if (!verify_create(TEST_STRIPE_CACHE_FIRST_BASE_BDEV, TEST_IMAGE_PATH, first)) {
+        bdev_ubi_set_stripe_cache(0);
+        return false;
+    }
+
+    if (!verify_create(TEST_STRIPE_CACHE_SECOND_BASE_BDEV, TEST_IMAGE_PATH, second)) {
+        verify_delete(first);
+        bdev_ubi_set_stripe_cache(0);
+        return false;
+    }
+
+    bool success = do_test_stripe_cache(first, second);
+    bdev_ubi_set_stripe_cache(0);
+
+    if (!verify_delete(first) || !verify_delete(second)) {
+        SPDK_WARNLOG("Failed to delete stripe cache bdevs\n");
+        return false;
+    }
+
+    return success;
+}
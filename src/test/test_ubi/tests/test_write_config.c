@@ -12,10 +12,28 @@ const char *expected_output = "{"
                               "\"stripe_size_kb\":1024,"
                               "\"copy_on_read\":false,"
                               "\"directio\":false,"
-                              "\"no_sync\":false"
+                              "\"no_sync\":false,"
+                              "\"checkpoint_interval_ms\":0,"
+                              "\"checkpoint_dirty_stripes\":0,"
+                              "\"uring_sqpoll\":false,"
+                              "\"uring_iopoll\":false"
                               "}"
                               "}";
 
+/*
+ * Hydration progress depends on earlier tests using the same base bdev, so
+ * only check parts of dump_info_json output which don't.
+ */
+static const char *expected_info[] = {
+    "\"ubi\":{\"base_bdev\":\"free_base_bdev\",",
+    "\"image_size\":41943040,\"image_copy_offload\":false,"
+    "\"stripe_size_kb\":1024,\"image_stripes\":40,",
+    "\"stripe_fetches_queued\":0,\"stripe_fetches_active\":0}",
+    "\"copy_on_read\":false,\"directio\":false,\"no_sync\":false,",
+    "\"metadata\":{\"version\":\"0.2\",\"bdev\":\"free_base_bdev\","
+    "\"on_base_bdev\":true,\"offset\":0,",
+};
+
 static int write_cb(void *cb_ctx, const void *data, size_t size) {
     if (output_len + size > sizeof(output)) {
         return -1;
@@ -35,6 +53,18 @@ static void call_write_config_json(void *name) {
     wake_ut_thread();
 }
 
+static void call_dump_info_json(void *name) {
+    struct spdk_json_write_ctx *w = spdk_json_write_begin(write_cb, NULL, 0);
+    struct spdk_bdev *bdev = spdk_bdev_get_by_name(name);
+    spdk_json_write_object_begin(w);
+    ubi_dump_info_json(bdev->ctxt, w);
+    spdk_json_write_object_end(w);
+    spdk_json_write_end(w);
+    output[output_len] = '\0';
+
+    wake_ut_thread();
+}
+
 bool test_write_config(void) {
     const char *bdev_name = "test_bdev_write_config_ubi0";
     const char *base_bdev = TEST_FREE_BASE_BDEV;
@@ -60,6 +90,16 @@ bool test_write_config(void) {
         success = false;
     }
 
+    output_len = 0;
+    execute_app_function(call_dump_info_json, (void *)bdev_name);
+    for (size_t i = 0; i < SPDK_COUNTOF(expected_info); i++) {
+        if (strstr(output, expected_info[i]) == NULL) {
+            SPDK_WARNLOG("dump_info_json output: %s\n", output);
+            SPDK_WARNLOG("expected to contain: %s\n", expected_info[i]);
+            success = false;
+        }
+    }
+
     struct ubi_delete_request delete_req;
     memset(&delete_req, 0, sizeof(delete_req));
     delete_req.name = (char *)bdev_name;
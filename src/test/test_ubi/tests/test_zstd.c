@@ -0,0 +1,157 @@
+#include "test_ubi.h"
+
+#ifdef WITH_ZSTD
+#include <zstd.h>
+
+#define TEST_ZSTD_BASE_BDEV "free_base_bdev_8"
+#define TEST_ZSTD_IMAGE_PATH "bin/test/test_image.zst"
+
+/*
+ * The zstd image has the first 8MB of TEST_IMAGE_PATH followed by zeros, in
+ * 256KB frames. The last frame is shorter.
+ */
+#define TEST_ZSTD_FRAME_SIZE (256 * 1024)
+#define TEST_ZSTD_DATA_SIZE (8 * 1024 * 1024)
+#define TEST_ZSTD_IMAGE_SIZE (40 * 1024 * 1024 - 64 * 1024)
+
+#define ZSTD_SKIPPABLE_MAGIC 0x184D2A5E
+#define ZSTD_SEEKABLE_MAGIC 0x8F92EAB1
+
+static bool write_le32(FILE *f, uint32_t value) {
+    uint8_t bytes[4] = {value, value >> 8, value >> 16, value >> 24};
+    return fwrite(bytes, 1, sizeof(bytes), f) == sizeof(bytes);
+}
+
+/*
+ * write_zstd_image writes the test image in the zstd seekable format: one
+ * frame per TEST_ZSTD_FRAME_SIZE bytes, followed by the seek table.
+ */
+static bool write_zstd_image(void) {
+    uint32_t frame_count =
+        spdk_divide_round_up(TEST_ZSTD_IMAGE_SIZE, TEST_ZSTD_FRAME_SIZE);
+    uint32_t *compressed_sizes = calloc(frame_count, sizeof(uint32_t));
+    size_t dst_capacity = ZSTD_compressBound(TEST_ZSTD_FRAME_SIZE);
+    char *src = calloc(1, TEST_ZSTD_FRAME_SIZE);
+    char *dst = malloc(dst_capacity);
+    FILE *raw = fopen(TEST_IMAGE_PATH, "r");
+    FILE *f = fopen(TEST_ZSTD_IMAGE_PATH, "w");
+    bool success = compressed_sizes && src && dst && raw && f;
+
+    for (uint32_t i = 0; success && i < frame_count; i++) {
+        uint64_t offset = (uint64_t)i * TEST_ZSTD_FRAME_SIZE;
+        size_t len = spdk_min(TEST_ZSTD_FRAME_SIZE, TEST_ZSTD_IMAGE_SIZE - offset);
+        if (offset < TEST_ZSTD_DATA_SIZE) {
+            success = fread(src, 1, len, raw) == len;
+        } else {
+            memset(src, 0, len);
+        }
+
+        size_t n = ZSTD_compress(dst, dst_capacity, src, len, 3);
+        success = success && !ZSTD_isError(n) && fwrite(dst, 1, n, f) == n;
+        compressed_sizes[i] = n;
+    }
+
+    success = success && write_le32(f, ZSTD_SKIPPABLE_MAGIC) &&
+              write_le32(f, frame_count * 8 + 9);
+    for (uint32_t i = 0; success && i < frame_count; i++) {
+        uint64_t offset = (uint64_t)i * TEST_ZSTD_FRAME_SIZE;
+        success = write_le32(f, compressed_sizes[i]) &&
+                  write_le32(f, spdk_min(TEST_ZSTD_FRAME_SIZE,
+                                         TEST_ZSTD_IMAGE_SIZE - offset));
+    }
+    success = success && write_le32(f, frame_count) && fputc(0, f) != EOF &&
+              write_le32(f, ZSTD_SEEKABLE_MAGIC);
+
+    if (f && fclose(f) != 0) {
+        success = false;
+    }
+    if (raw) {
+        fclose(raw);
+    }
+    free(dst);
+    free(src);
+    free(compressed_sizes);
+    return success;
+}
+
+static bool read_expected_block(uint64_t block, uint32_t blocklen, char *buf) {
+    if (block * blocklen >= TEST_ZSTD_DATA_SIZE) {
+        memset(buf, 0, blocklen);
+        return true;
+    }
+
+    return read_image_block(block, blocklen, buf);
+}
+
+static bool do_test_zstd(const char *bdev_name) {
+    struct bdev_desc_ch_pair desc_ch_pair = {0};
+    if (!open_bdev_and_ch(bdev_name, &desc_ch_pair)) {
+        SPDK_WARNLOG("Failed to open bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    uint32_t blocklen = spdk_bdev_desc_get_bdev(desc_ch_pair.desc)->blocklen;
+    uint64_t last_block = TEST_ZSTD_IMAGE_SIZE / blocklen - 1;
+
+    /* Each read fetches and decompresses its stripe first. */
+    uint64_t blocks[] = {100, 7 * 2048 + 2047, 20 * 2048 + 5, last_block};
+
+    struct ubi_io_request req;
+    memset(&req, 0, sizeof(req));
+    req.bdev = &desc_ch_pair;
+    char expected[MAX_BLOCK_SIZE];
+    bool success = true;
+    for (size_t i = 0; success && i < SPDK_COUNTOF(blocks); i++) {
+        req.block_idx = blocks[i];
+        execute_spdk_function(io_thread_read, &req);
+        success = req.success && read_expected_block(blocks[i], blocklen, expected) &&
+                  memcmp(req.buf, expected, blocklen) == 0;
+        if (!success) {
+            SPDK_WARNLOG("unexpected data in block %lu of zstd image\n", blocks[i]);
+        }
+    }
+
+    close_bdev_and_ch(&desc_ch_pair);
+    return success;
+}
+
+bool test_zstd(void) {
+    const char *bdev_name = "test_zstd_ubi0";
+
+    if (!write_zstd_image()) {
+        SPDK_WARNLOG("could not write %s\n", TEST_ZSTD_IMAGE_PATH);
+        return false;
+    }
+
+    struct spdk_ubi_bdev_opts opts = {
+        .name = bdev_name,
+        .base_bdev_name = TEST_ZSTD_BASE_BDEV,
+        .image_path = TEST_ZSTD_IMAGE_PATH,
+        .stripe_size_kb = 128,
+    };
+    if (verify_create_opts(&opts)) {
+        SPDK_WARNLOG("create_bdev_ubi succeeded with stripes smaller than frames\n");
+        verify_delete(bdev_name);
+        return false;
+    }
+
+    opts.stripe_size_kb = 1024;
+    if (!verify_create_opts(&opts)) {
+        return false;
+    }
+
+    bool success = do_test_zstd(bdev_name);
+
+    if (!verify_delete(bdev_name)) {
+        SPDK_WARNLOG("Failed to delete bdev UBI: %s\n", bdev_name);
+        return false;
+    }
+
+    return success;
+}
+#else
+bool test_zstd(void) {
+    SPDK_NOTICELOG("skipping test_zstd, bdev_ubi was built without WITH_ZSTD\n");
+    return true;
+}
+#endif
@@ -25,6 +25,15 @@ void wake_ut_thread(void) {
     pthread_mutex_unlock(&g_test_mutex);
 }
 
+static void finish_ut_thread(struct test_opts *opts, int n_tests, int n_failures) {
+    SPDK_NOTICELOG("Tests run: %u, failures: %u\n", n_tests, n_failures);
+
+    execute_spdk_function(exit_io_thread, NULL);
+    spdk_thread_send_msg(opts->init_thread, stop_init_thread,
+                         n_failures ? (void *)0x1 : NULL);
+    spdk_thread_exit(spdk_get_thread());
+}
+
 void run_ut_thread(void *arg) {
     struct test_opts *opts = arg;
     g_io_thread = opts->io_thread;
@@ -39,6 +48,21 @@ void run_ut_thread(void *arg) {
         test_bdev_io(opts->bdev_names[i], &n_tests, &n_failures);
     }
 
+    /*
+     * Interrupt mode only changes how channels and rings are woken up, so
+     * only tests of that run in it.
+     */
+    if (spdk_interrupt_mode_is_enabled()) {
+        n_tests++;
+        if (!test_interrupt_mode()) {
+            SPDK_WARNLOG("test_interrupt_mode failed\n");
+            n_failures++;
+        }
+
+        finish_ut_thread(opts, n_tests, n_failures);
+        return;
+    }
+
     n_tests++;
     if (!test_bdev_recreate()) {
         SPDK_WARNLOG("test_bdev_recreate failed\n");
@@ -51,6 +75,12 @@ void run_ut_thread(void *arg) {
         n_failures++;
     }
 
+    n_tests++;
+    if (!test_rpc_create_batch()) {
+        SPDK_WARNLOG("test_rpc_create_batch failed\n");
+        n_failures++;
+    }
+
     n_tests++;
     if (!test_write_config()) {
         SPDK_WARNLOG("test_write_config failed\n");
@@ -63,10 +93,83 @@ void run_ut_thread(void *arg) {
         n_failures++;
     }
 
-    SPDK_NOTICELOG("Tests run: %u, failures: %u\n", n_tests, n_failures);
+    n_tests++;
+    if (!test_checkpoint()) {
+        SPDK_WARNLOG("test_checkpoint failed\n");
+        n_failures++;
+    }
 
-    execute_spdk_function(exit_io_thread, NULL);
-    spdk_thread_send_msg(opts->init_thread, stop_init_thread,
-                         n_failures ? (void *)0x1 : NULL);
-    spdk_thread_exit(spdk_get_thread());
+    n_tests++;
+    if (!test_checkpoint_interval()) {
+        SPDK_WARNLOG("test_checkpoint_interval failed\n");
+        n_failures++;
+    }
+
+    n_tests++;
+    if (!test_flush_commit()) {
+        SPDK_WARNLOG("test_flush_commit failed\n");
+        n_failures++;
+    }
+
+    n_tests++;
+    if (!test_stats()) {
+        SPDK_WARNLOG("test_stats failed\n");
+        n_failures++;
+    }
+
+    n_tests++;
+    if (!test_histograms()) {
+        SPDK_WARNLOG("test_histograms failed\n");
+        n_failures++;
+    }
+
+    n_tests++;
+    if (!test_image_delay()) {
+        SPDK_WARNLOG("test_image_delay failed\n");
+        n_failures++;
+    }
+
+    n_tests++;
+    if (!test_image_bdev()) {
+        SPDK_WARNLOG("test_image_bdev failed\n");
+        n_failures++;
+    }
+
+    n_tests++;
+    if (!test_image_on_base()) {
+        SPDK_WARNLOG("test_image_on_base failed\n");
+        n_failures++;
+    }
+
+    n_tests++;
+    if (!test_qcow2()) {
+        SPDK_WARNLOG("test_qcow2 failed\n");
+        n_failures++;
+    }
+
+    n_tests++;
+    if (!test_zstd()) {
+        SPDK_WARNLOG("test_zstd failed\n");
+        n_failures++;
+    }
+
+    n_tests++;
+    if (!test_overlay()) {
+        SPDK_WARNLOG("test_overlay failed\n");
+        n_failures++;
+    }
+
+    n_tests++;
+    if (!test_stripe_cache()) {
+        SPDK_WARNLOG("test_stripe_cache failed\n");
+        n_failures++;
+    }
+
+    n_tests++;
+    if (!test_channel_destroy()) {
+        SPDK_WARNLOG("test_channel_destroy failed\n");
+        n_failures++;
+    }
+
+    finish_ut_thread(opts, n_tests, n_failures);
 }